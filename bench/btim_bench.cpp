@@ -0,0 +1,490 @@
+/*
+ * Latency and allocations of the native API, against simulated controllers.
+ *
+ * Usage: btim_bench [--iterations N] [--devices N] [--command-us N]
+ *                   [--reset-us N] [--up-us N] [--ioctl-us N] [--histogram]
+ *                   [--advertisers N] [--advertising-us N] [--scan-ms N]
+ *                   [--connections N] [--credits N]
+ *
+ * Adapters cycle through the manufacturers btim knows (0, 10, 13, 15, 18,
+ * 48, 57), so that every vendor path of spoof_mac is measured. Neither
+ * Bluetooth hardware nor privileges are needed. Every adapter has
+ * --connections ACL links, whose link quality is read by connections(quality).
+ * Controllers accept --credits commands at once.
+ * exporter_render is a scrape of an exporter sampling every 100 ms.
+ * pick_adapter alternates two filters, loads being read every 100 ms.
+ *
+ * The LE scan is then measured for --scan-ms on every adapter, each one
+ * receiving a report from one of --advertisers each --advertising-us.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <new>
+#include <vector>
+
+#include <bluetooth/bluetooth.h>
+#include <bluetooth/hci.h>
+
+#include "../hci_caps.hpp"
+#include "../hci_conn.hpp"
+#include "../hci_core.hpp"
+#include "../hci_executor.hpp"
+#include "../hci_exporter.hpp"
+#include "../hci_picker.hpp"
+#include "../hci_scan.hpp"
+#include "../hci_sim.hpp"
+
+#define LATENCY_BUCKETS 32
+#define WAIT_TIMEOUT_MS 5000
+
+/*
+ * Allocations made by btim: malloc and friends are wrapped at link time
+ * (--wrap), operator new is replaced.
+ */
+static std::atomic<uint64_t> allocations;
+
+extern "C" void *__real_malloc(size_t size);
+extern "C" void *__real_calloc(size_t count, size_t size);
+extern "C" void *__real_realloc(void *pointer, size_t size);
+
+extern "C" void *__wrap_malloc(size_t size)
+{
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    return __real_malloc(size);
+}
+
+extern "C" void *__wrap_calloc(size_t count, size_t size)
+{
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    return __real_calloc(count, size);
+}
+
+extern "C" void *__wrap_realloc(void *pointer, size_t size)
+{
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    return __real_realloc(pointer, size);
+}
+
+void *operator new(size_t size)
+{
+    void *pointer;
+
+    allocations.fetch_add(1, std::memory_order_relaxed);
+
+    if ((pointer = __real_malloc(size ? size : 1)) == NULL)
+        throw std::bad_alloc();
+
+    return pointer;
+}
+
+void *operator new[](size_t size)
+{
+    return operator new(size);
+}
+
+void operator delete(void *pointer) noexcept
+{
+    free(pointer);
+}
+
+void operator delete[](void *pointer) noexcept
+{
+    free(pointer);
+}
+
+void operator delete(void *pointer, size_t size) noexcept
+{
+    free(pointer);
+}
+
+void operator delete[](void *pointer, size_t size) noexcept
+{
+    free(pointer);
+}
+
+/*
+ * A measured API.
+ *     - run: one call, returns EXIT_SUCCESS on success.
+ *     - slow: runs a tenth of the iterations.
+ *     - per_vendor: measured on one adapter of each manufacturer.
+ */
+struct bench
+{
+    char const *name;
+    int (*run)(int device_id, int iteration, struct hci_error *error);
+    bool slow;
+    bool per_vendor;
+};
+
+static int run_list(int device_id, int iteration, struct hci_error *error)
+{
+    struct hci_dev_info devices[HCI_MAX_DEV];
+    int count;
+
+    return list_devices(devices, &count, NULL, error);
+}
+
+static int run_list_ids(int device_id, int iteration, struct hci_error *error)
+{
+    struct hci_dev_info devices[HCI_MAX_DEV];
+    struct hci_list_options options;
+    uint16_t id = device_id;
+    int count;
+
+    options.ids = &id;
+    options.id_count = 1;
+    options.resolve_address = true;
+
+    return list_devices(devices, &count, &options, error);
+}
+
+static int run_info(int device_id, int iteration, struct hci_error *error)
+{
+    struct hci_dev_info device_info;
+
+    return hci_device_info(device_id, &device_info, error);
+}
+
+static int run_up_down(int device_id, int iteration, struct hci_error *error)
+{
+    return hci_interface_up_down(device_id, iteration & 1, error);
+}
+
+static int run_up_down_wait(int device_id, int iteration, struct hci_error *error)
+{
+    return hci_interface_up_down_wait(device_id, iteration & 1, WAIT_TIMEOUT_MS, error);
+}
+
+static int run_capabilities(int device_id, int iteration, struct hci_error *error)
+{
+    struct hci_capabilities caps;
+
+    return hci_capabilities(device_id, &caps, error);
+}
+
+static int run_connections(int device_id, int iteration, struct hci_error *error)
+{
+    struct hci_connection connections[HCI_CONN_MAX];
+    int count;
+
+    return hci_connections(device_id, connections, &count, error);
+}
+
+static int run_connections_quality(int device_id, int iteration, struct hci_error *error)
+{
+    struct hci_connection connections[HCI_CONN_MAX];
+    int count;
+
+    if (hci_connections(device_id, connections, &count, error) != EXIT_SUCCESS)
+        return EXIT_FAILURE;
+
+    return hci_connections_quality(device_id, connections, count, error);
+}
+
+static struct hci_exporter exporter;
+static char exporter_text[HCI_EXPORTER_TEXT_SIZE];
+
+static int run_exporter_render(int device_id, int iteration, struct hci_error *error)
+{
+    return hci_exporter_render(&exporter, exporter_text, sizeof(exporter_text)) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+static int run_pick_adapter(int device_id, int iteration, struct hci_error *error)
+{
+    struct hci_picker_filter filter = { HCI_PICKER_ANY, -1, (iteration & 1) != 0 };
+
+    return hci_picker_pick(&filter, error) < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/*
+ * Get a new address for each spoof of a device.
+ */
+static void spoof_address(int device_id, int iteration, char *address)
+{
+    sprintf(address, "00:1B:DC:%02X:%02X:%02X", 0x10 + device_id, (iteration >> 8) & 0xff, iteration & 0xff);
+}
+
+static int run_spoof(int device_id, int iteration, struct hci_error *error)
+{
+    char address[18];
+    int status;
+
+    spoof_address(device_id, iteration, address);
+    status = hci_spoof_mac(device_id, address, NULL, error);
+
+    // Vendors without reset leave it to the caller
+    return status == ECANCELED ? EXIT_SUCCESS : status;
+}
+
+static int run_spoof_wait(int device_id, int iteration, struct hci_error *error)
+{
+    char address[18];
+
+    spoof_address(device_id, iteration, address);
+    return hci_spoof_mac_wait(device_id, address, WAIT_TIMEOUT_MS, NULL, error);
+}
+
+static struct bench const benches[] =
+{
+    { "list_devices",         run_list,          false, false },
+    { "list_devices(ids)",    run_list_ids,      false, false },
+    { "hci_device_info",      run_info,          false, false },
+    { "hci_capabilities",     run_capabilities,  false, false },
+    { "connections",          run_connections,   false, false },
+    { "connections(quality)", run_connections_quality, false, false },
+    { "exporter_render",      run_exporter_render, false, false },
+    { "pick_adapter",         run_pick_adapter,  false, false },
+    { "up_down",              run_up_down,       false, false },
+    { "up_down_wait",         run_up_down_wait,  false, false },
+    { "spoof_mac",            run_spoof,         true,  true  },
+    { "spoof_mac_wait",       run_spoof_wait,    true,  true  },
+};
+
+static uint16_t const manufacturers[] = { 0, 10, 13, 15, 18, 48, 57 };
+
+static int option(int argc, char **argv, char const *name, int default_value)
+{
+    for (int i = 1; i < argc - 1; i++)
+    {
+        if (argv[i][0] == '-' && argv[i][1] == '-' && !strcmp(argv[i] + 2, name))
+            return atoi(argv[i + 1]);
+    }
+
+    return default_value;
+}
+
+static bool flag(int argc, char **argv, char const *name)
+{
+    for (int i = 1; i < argc; i++)
+    {
+        if (argv[i][0] == '-' && argv[i][1] == '-' && !strcmp(argv[i] + 2, name))
+            return true;
+    }
+
+    return false;
+}
+
+/*
+ * Measure an API on a device and print a line of results.
+ * Params:
+ *     - bench: API.
+ *     - device_id: device ID.
+ *     - iterations: measured calls, after a tenth of them to warm up.
+ *     - samples: buffer of iterations entries.
+ *     - histogram: also print the latency histogram.
+ */
+static void measure(struct bench const *bench, int device_id, int iterations,
+                    std::vector<double> &samples, bool histogram)
+{
+    uint32_t buckets[LATENCY_BUCKETS] = { 0 };
+    struct hci_error error;
+    char name[64];
+    int failures = 0;
+
+    for (int i = 0; i < iterations / 10; i++)
+        bench->run(device_id, i, &error);
+
+    uint64_t before = allocations.load();
+
+    for (int i = 0; i < iterations; i++)
+    {
+        uint64_t start = hci_monotonic_ns();
+
+        if (bench->run(device_id, iterations / 10 + i, &error) != EXIT_SUCCESS)
+            failures++;
+
+        samples[i] = (hci_monotonic_ns() - start) / 1e3;
+    }
+
+    uint64_t count = allocations.load() - before;
+
+    // Leave the device up for the next bench
+    hci_interface_up_down(device_id, true, &error);
+
+    for (int i = 0; i < iterations; i++)
+    {
+        int bucket = 0;
+
+        while (bucket < LATENCY_BUCKETS - 1 && (1ULL << bucket) <= samples[i])
+            bucket++;
+        buckets[bucket]++;
+    }
+
+    std::sort(samples.begin(), samples.begin() + iterations);
+
+    if (bench->per_vendor)
+        snprintf(name, sizeof(name), "%s[%u]", bench->name, manufacturers[device_id % 7]);
+    else
+        snprintf(name, sizeof(name), "%s", bench->name);
+
+    printf("%-22s %7d %5d %10.1f %10.1f %10.1f %12.2f\n", name, iterations, failures,
+           samples[iterations / 2], samples[iterations - 1 - iterations / 100],
+           samples[iterations - 1], (double)count / iterations);
+
+    if (!histogram)
+        return;
+
+    for (int i = 0; i < LATENCY_BUCKETS; i++)
+    {
+        if (buckets[i])
+            printf("    < %10llu us %7u\n", 1ULL << i, buckets[i]);
+    }
+}
+
+static void scan_notify(void *arg)
+{
+    ((std::atomic<bool> *)arg)->store(true);
+}
+
+/*
+ * Scan every device and print the reports ingested, the batches taken and
+ * the allocations made meanwhile.
+ * Params:
+ *     - count: number of devices.
+ *     - duration_ms: scan duration.
+ */
+static void measure_scan(int count, int duration_ms)
+{
+    struct hci_scan_options options;
+    struct hci_scan_stats stats[HCI_MAX_DEV];
+    struct hci_error error;
+    std::atomic<bool> ready(false);
+    uint64_t reports = 0, drops = 0, merged = 0, entries = 0, batches = 0;
+    static struct hci_scan scan;
+
+    options.id_count = count;
+    for (int i = 0; i < count; i++)
+        options.ids[i] = i;
+    options.interval_ms = 100;
+    options.capacity = 4096;
+    options.active = false;
+    options.notify = scan_notify;
+    options.notify_arg = &ready;
+
+    if (hci_scan_start(&scan, &options, &error) != EXIT_SUCCESS)
+    {
+        printf("scan: %s (%s)\n", strerror(error.code), error.step);
+        return;
+    }
+
+    uint64_t before = allocations.load();
+    uint64_t start = hci_monotonic_ns();
+
+    while (hci_monotonic_ns() - start < duration_ms * 1000000ULL)
+    {
+        struct hci_scan_report const *batch;
+        int size;
+
+        if (!ready.exchange(false) || (batch = hci_scan_take(&scan, &size)) == NULL)
+        {
+            usleep(1000);
+            continue;
+        }
+
+        for (int i = 0; i < size; i++)
+            merged += batch[i].count;
+        entries += size;
+        batches++;
+        hci_scan_release(&scan);
+    }
+
+    uint64_t elapsed_ns = hci_monotonic_ns() - start;
+    uint64_t count_allocations = allocations.load() - before;
+
+    hci_scan_stop(&scan);
+
+    for (int i = 0, n = hci_scan_stats(&scan, stats, HCI_MAX_DEV); i < n; i++)
+    {
+        reports += stats[i].reports;
+        drops += stats[i].drops;
+    }
+
+    printf("\nscan: %d devices, %.0f reports/s, %llu batches of %.1f entries (%.1f reports each), "
+           "%llu drops, %llu allocations\n",
+           count, reports * 1e9 / elapsed_ns, (unsigned long long)batches,
+           batches ? (double)entries / batches : 0.0, entries ? (double)merged / entries : 0.0,
+           (unsigned long long)drops, (unsigned long long)count_allocations);
+}
+
+int main(int argc, char **argv)
+{
+    struct hci_sim_options options;
+    uint16_t device_manufacturers[HCI_MAX_DEV];
+    struct hci_error error;
+    int iterations = option(argc, argv, "iterations", 1000);
+    bool histogram = flag(argc, argv, "histogram");
+
+    options.count = option(argc, argv, "devices", 7);
+    options.command_us = option(argc, argv, "command-us", 50);
+    options.reset_us = option(argc, argv, "reset-us", 2000);
+    options.up_us = option(argc, argv, "up-us", 1000);
+    options.ioctl_us = option(argc, argv, "ioctl-us", 0);
+    options.advertisers = option(argc, argv, "advertisers", 256);
+    options.advertising_us = option(argc, argv, "advertising-us", 50);
+    options.connections = option(argc, argv, "connections", 8);
+    options.credits = option(argc, argv, "credits", 1);
+    options.manufacturers = device_manufacturers;
+
+    if (iterations < 10 || options.count <= 0 || options.count > HCI_MAX_DEV)
+    {
+        fprintf(stderr, "Usage: %s [--iterations N (>= 10)] [--devices N (1-%d)] [--command-us N]\n"
+                        "       [--reset-us N] [--up-us N] [--ioctl-us N] [--histogram]\n"
+                        "       [--advertisers N] [--advertising-us N] [--scan-ms N]\n"
+                        "       [--connections N] [--credits N]\n",
+                argv[0], HCI_MAX_DEV);
+        return EXIT_FAILURE;
+    }
+
+    for (int i = 0; i < options.count; i++)
+        device_manufacturers[i] = manufacturers[i % 7];
+
+    if (hci_sim_start(&options, &error) != EXIT_SUCCESS)
+    {
+        fprintf(stderr, "Can't start the simulator: %s (%s)\n", strerror(error.code), error.step);
+        return EXIT_FAILURE;
+    }
+
+    struct hci_exporter_options exporter_options = { 100, 0, "" };
+
+    exporter.running = false;
+    if (hci_exporter_start(&exporter, &exporter_options, &error) != EXIT_SUCCESS)
+    {
+        fprintf(stderr, "Can't start the exporter: %s (%s)\n", strerror(error.code), error.step);
+        return EXIT_FAILURE;
+    }
+
+    std::vector<double> samples(iterations);
+
+    printf("devices: %d, command %d us, reset %d us, up %d us, ioctl %d us\n\n",
+           options.count, options.command_us, options.reset_us, options.up_us, options.ioctl_us);
+    printf("%-22s %7s %5s %10s %10s %10s %12s\n",
+           "api", "calls", "fail", "p50 us", "p99 us", "max us", "allocs/call");
+
+    for (size_t i = 0; i < sizeof(benches) / sizeof(benches[0]); i++)
+    {
+        struct bench const *bench = &benches[i];
+        int count = bench->slow ? iterations / 10 : iterations;
+
+        if (!bench->per_vendor)
+        {
+            measure(bench, 0, count, samples, histogram);
+            continue;
+        }
+
+        for (int device_id = 0; device_id < options.count && device_id < 7; device_id++)
+            measure(bench, device_id, count, samples, histogram);
+    }
+
+    measure_scan(options.count, option(argc, argv, "scan-ms", 1000));
+
+    hci_exporter_stop(&exporter);
+    hci_sim_stop();
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,94 @@
+'use strict';
+
+/*
+ * list() latency and GC pressure.
+ *
+ * Usage: node --expose-gc bench/list.js [--iterations N] [--vhci N]
+ *
+ * --vhci N opens /dev/vhci N times, so the kernel creates N virtual
+ * controllers for the run (needs root and the hci_vhci module). Use it to
+ * measure with 16 adapters on a host without that many dongles.
+ */
+
+var fs = require('fs');
+var perf_hooks = require('perf_hooks');
+var btim = require('..');
+
+function option(name, default_value) {
+  var index = process.argv.indexOf('--' + name);
+  return index >= 0 ? parseInt(process.argv[index + 1], 10) : default_value;
+}
+
+function percentile(sorted, p) {
+  return sorted[Math.min(sorted.length - 1, Math.floor(sorted.length * p))];
+}
+
+function open_vhci(count, callback) {
+  var descriptors = [];
+
+  for (var i = 0; i < count; i++)
+    descriptors.push(fs.openSync('/dev/vhci', 'r+'));
+
+  // The kernel registers a controller when no vendor packet came within 1s
+  setTimeout(function () { callback(descriptors); }, 1500);
+}
+
+function run(descriptors) {
+  var iterations = option('iterations', 10000);
+  var gc = { count: 0, duration: 0 };
+  var latencies = new Float64Array(iterations);
+  var observer = new perf_hooks.PerformanceObserver(function (list) {
+    list.getEntries().forEach(function (entry) {
+      gc.count++;
+      gc.duration += entry.duration;
+    });
+  });
+  var devices = btim.list().length;
+
+  // Warm up
+  for (var i = 0; i < 1000; i++)
+    btim.list();
+
+  if (global.gc)
+    global.gc();
+
+  observer.observe({ entryTypes: ['gc'] });
+
+  var heap_before = process.memoryUsage().heapUsed;
+  var start = process.hrtime.bigint();
+
+  for (var i = 0; i < iterations; i++) {
+    var t0 = process.hrtime.bigint();
+    btim.list();
+    latencies[i] = Number(process.hrtime.bigint() - t0) / 1e3;
+  }
+
+  var total_ms = Number(process.hrtime.bigint() - start) / 1e6;
+  var heap_after = process.memoryUsage().heapUsed;
+
+  setImmediate(function () {
+    observer.disconnect();
+
+    latencies.sort();
+
+    console.log('devices:        %d', devices);
+    console.log('iterations:     %d', iterations);
+    console.log('latency (us):   p50 %s  p99 %s  max %s',
+      percentile(latencies, 0.5).toFixed(1),
+      percentile(latencies, 0.99).toFixed(1),
+      latencies[iterations - 1].toFixed(1));
+    console.log('throughput:     %s calls/s', (iterations / total_ms * 1e3).toFixed(0));
+    console.log('gc:             %d collections, %s ms', gc.count, gc.duration.toFixed(1));
+    console.log('heap growth:    %s KiB', ((heap_after - heap_before) / 1024).toFixed(0));
+
+    descriptors.forEach(function (descriptor) { fs.closeSync(descriptor); });
+    btim.close();
+  });
+}
+
+var vhci = option('vhci', 0);
+
+if (vhci > 0)
+  open_vhci(vhci, run);
+else
+  run([]);
@@ -1,22 +1,102 @@
 {
     "targets": [
+        {
+            "target_name": "btim_core",
+            "type": "static_library",
+            "sources": [
+                "hci_backend.cpp",
+                "hci_bdaddr.cpp",
+                "hci_capture.cpp",
+                "hci_caps.cpp",
+                "hci_conn.cpp",
+                "hci_control.cpp",
+                "hci_daemon.cpp",
+                "hci_engine.cpp",
+                "hci_events.cpp",
+                "hci_executor.cpp",
+                "hci_exporter.cpp",
+                "hci_metrics.cpp",
+                "hci_picker.cpp",
+                "hci_pool.cpp",
+                "hci_raw.cpp",
+                "hci_sampler.cpp",
+                "hci_scan.cpp",
+                "hci_sim.cpp",
+                "hci_spoof.cpp",
+                "hci_timeouts.cpp",
+                "hci_wait.cpp"
+            ],
+            "cflags": [ "-fpermissive", "-fPIC" ],
+            "link_settings": {
+                "libraries": [
+                    "-lbluetooth",
+                    "-lpthread",
+                ],
+            },
+        },
         {
             "target_name": "btim",
+            "dependencies": [ "btim_core" ],
             "sources": [
                 "hci_updown.cpp",
                 "hci_list.cpp",
                 "hci_spoof_mac.cpp",
+                "hci_watch.cpp",
+                "hci_sampler_node.cpp",
+                "hci_capture_node.cpp",
+                "hci_scan_node.cpp",
+                "hci_conn_node.cpp",
+                "hci_exporter_node.cpp",
+                "hci_metrics_node.cpp",
+                "hci_picker_node.cpp",
+                "hci_error.cpp",
+                "hci_queue.cpp",
                 "hci.cpp"
             ],
             "cflags": [ "-fpermissive" ],
-            "link_settings": {
-                "libraries": [
-                    "-lbluetooth",
-                ],
-            },
             "include_dirs": [
                 "<!(node -e \"require('nan')\")"
             ]
         },
+        {
+            "target_name": "btim_cli",
+            "type": "executable",
+            "product_name": "btim",
+            "dependencies": [ "btim_core" ],
+            "sources": [
+                "cli/btim.cpp"
+            ],
+            "cflags": [ "-fpermissive" ],
+        },
+        {
+            "target_name": "btim_bench",
+            "type": "executable",
+            "dependencies": [ "btim_core" ],
+            "sources": [
+                "bench/btim_bench.cpp"
+            ],
+            "cflags": [ "-fpermissive" ],
+            "ldflags": [
+                "-Wl,--wrap=malloc,--wrap=calloc,--wrap=realloc",
+            ],
+        },
+        {
+            "target_name": "btim_test",
+            "type": "executable",
+            "dependencies": [ "btim_core" ],
+            "sources": [
+                "test/btim_test.cpp"
+            ],
+            "cflags": [ "-fpermissive" ],
+        },
+        {
+            "target_name": "btimd",
+            "type": "executable",
+            "dependencies": [ "btim_core" ],
+            "sources": [
+                "daemon/btimd.cpp"
+            ],
+            "cflags": [ "-fpermissive" ],
+        },
     ]
 }
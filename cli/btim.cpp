@@ -0,0 +1,373 @@
+/*
+ * btim: the core of the addon as a command, for scripts which would
+ * otherwise start node to bring an adapter up or change its address.
+ *
+ * Usage: btim list [--raw] [ID...]
+ *        btim info [--raw] ID
+ *        btim up ID [--timeout-ms N]
+ *        btim down ID [--timeout-ms N]
+ *        btim spoof ID MAC [--timeout-ms N]
+ *
+ * Results are printed as JSON, in the shape of the addon's: list and info
+ * as list() and getInfo(), up, down and spoof as promises.up() (without
+ * queuedMs) and promises.spoof_mac(). With --raw, list and info print the
+ * packed records of listRaw() instead (hci_raw.hpp). Failures are printed
+ * on stderr and exit with status 1.
+ *
+ * No thread is started and nothing is read before it is needed, so a run
+ * costs about its ioctls. --simulate N runs against N simulated adapters,
+ * as the native benchmark does.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <bluetooth/bluetooth.h>
+#include <bluetooth/hci.h>
+#include <bluetooth/hci_lib.h>
+
+#include "../hci_bdaddr.hpp"
+#include "../hci_core.hpp"
+#include "../hci_executor.hpp"
+#include "../hci_raw.hpp"
+#include "../hci_sim.hpp"
+
+#define DEFAULT_UPDOWN_TIMEOUT_MS 5000
+#define DEFAULT_SPOOF_TIMEOUT_MS  15000
+
+/*
+ * Command line, options apart.
+ *     - args: positional arguments, the command first.
+ *     - raw: print packed records.
+ *     - timeout_ms: -1 for the default of the command.
+ *     - simulated: number of simulated adapters, 0 for the kernel's.
+ */
+struct cli_options
+{
+    char const *args[2 + HCI_MAX_DEV];
+    int arg_count;
+    bool raw;
+    int timeout_ms;
+    int simulated;
+};
+
+static void usage(char const *name)
+{
+    fprintf(stderr,
+            "Usage: %s list [--raw] [ID...]\n"
+            "       %s info [--raw] ID\n"
+            "       %s up ID [--timeout-ms N]\n"
+            "       %s down ID [--timeout-ms N]\n"
+            "       %s spoof ID MAC [--timeout-ms N]\n"
+            "Options: --simulate N (0-%d) serves simulated adapters\n",
+            name, name, name, name, name, HCI_MAX_DEV);
+}
+
+/*
+ * Split the command line.
+ * Params:
+ *     - argc, argv: command line.
+ *     - options: receives the arguments and options.
+ * Return values:
+ *     - false: the command line is malformed.
+ *     - true: on success.
+ */
+static bool parse_options(int argc, char **argv, struct cli_options *options)
+{
+    options->arg_count = 0;
+    options->raw = false;
+    options->timeout_ms = -1;
+    options->simulated = 0;
+
+    for (int i = 1; i < argc; i++)
+    {
+        char *end;
+
+        if (!strcmp(argv[i], "--raw"))
+            options->raw = true;
+        else if (!strcmp(argv[i], "--timeout-ms") && i + 1 < argc)
+        {
+            options->timeout_ms = strtol(argv[++i], &end, 10);
+            if (*end || options->timeout_ms < 0)
+                return false;
+        }
+        else if (!strcmp(argv[i], "--simulate") && i + 1 < argc)
+        {
+            options->simulated = strtol(argv[++i], &end, 10);
+            if (*end || options->simulated < 0 || options->simulated > HCI_MAX_DEV)
+                return false;
+        }
+        else if (argv[i][0] == '-' || options->arg_count == sizeof(options->args) / sizeof(options->args[0]))
+            return false;
+        else
+            options->args[options->arg_count++] = argv[i];
+    }
+
+    return options->arg_count > 0;
+}
+
+/*
+ * Parse a dev_id, "0" or "hci0".
+ * Params:
+ *     - arg: argument.
+ *     - device_id: receives the dev_id.
+ * Return values:
+ *     - false: the argument isn't a dev_id.
+ *     - true: on success.
+ */
+static bool parse_id(char const *arg, uint16_t *device_id)
+{
+    char *end;
+    long value;
+
+    if (!strncmp(arg, "hci", 3))
+        arg += 3;
+
+    value = strtol(arg, &end, 10);
+    if (end == arg || *end || value < 0 || value > 0xffff)
+        return false;
+
+    *device_id = (uint16_t)value;
+    return true;
+}
+
+static int fail(int device_id, struct hci_error const *error)
+{
+    if (device_id >= 0)
+        fprintf(stderr, "btim: %s failed on hci%d: %s\n", error->step, device_id, strerror(error->code));
+    else
+        fprintf(stderr, "btim: %s failed: %s\n", error->step, strerror(error->code));
+
+    return EXIT_FAILURE;
+}
+
+static double elapsed_ms(uint64_t start_ns)
+{
+    return (hci_monotonic_ns() - start_ns) / 1e6;
+}
+
+/*
+ * Print the counters of a device, as in the rx and tx objects of list().
+ */
+static void print_counters(char const *key, uint32_t bytes, uint32_t acl, uint32_t sco, uint32_t events,
+                           uint32_t errors)
+{
+    printf("\"%s\":{\"bytes\":%u,\"acl\":%u,\"sco\":%u,\"events\":%u,\"errors\":%u}",
+           key, bytes, acl, sco, events, errors);
+}
+
+/*
+ * Print a device as a list() entry. Device names, types, buses and flags
+ * never need escaping.
+ * Params:
+ *     - device_info: info about a HCI device.
+ */
+static void print_device(struct hci_dev_info const *device_info)
+{
+    struct hci_dev_stats const *device_stats = &device_info->stat;
+    int type = (device_info->type & 0x30) >> 4;
+    char *device_status = hci_dflagstostr(device_info->flags);
+    char mac_address[18];
+
+    ba2str(&device_info->bdaddr, mac_address);
+
+    printf("{\"%s\":{\"type\":\"%s\",\"bus\":\"%s\",\"address\":\"%s\",\"acl_mtu\":\"%u:%u\","
+           "\"sco_mtu\":\"%u:%u\",\"status\":\"%s\",",
+           device_info->name, hci_typetostr(type), hci_bustostr(device_info->type & 0x0f), mac_address,
+           device_info->acl_mtu, device_info->acl_pkts, device_info->sco_mtu, device_info->sco_pkts,
+           device_status);
+    print_counters("rx", device_stats->byte_rx, device_stats->acl_rx, device_stats->sco_rx,
+                   device_stats->evt_rx, device_stats->err_rx);
+    putchar(',');
+    print_counters("tx", device_stats->byte_tx, device_stats->acl_tx, device_stats->sco_tx,
+                   device_stats->cmd_tx, device_stats->err_tx);
+    fputs("}}", stdout);
+
+    bt_free(device_status);
+}
+
+/*
+ * Read the address of a RAW device which doesn't report one. The addon
+ * caches it in the background; a single run reads it right away.
+ * Params:
+ *     - device_info: info about a HCI device, updated.
+ */
+static void resolve_address(struct hci_dev_info *device_info)
+{
+    struct hci_error error;
+
+    if (hci_test_bit(HCI_RAW, &device_info->flags) && !bacmp(&device_info->bdaddr, BDADDR_ANY))
+        hci_bdaddr_read(device_info->dev_id, &device_info->bdaddr, &error);
+}
+
+/*
+ * Print devices, as JSON or packed records.
+ * Params:
+ *     - devices: infos about HCI devices.
+ *     - count: number of devices.
+ *     - raw: print packed records.
+ *     - array: print a JSON array, not a single object.
+ */
+static int print_devices(struct hci_dev_info *devices, int count, bool raw, bool array)
+{
+    if (raw)
+    {
+        static unsigned char buffer[HCI_RAW_HEADER_SIZE + HCI_MAX_DEV * HCI_RAW_RECORD_SIZE];
+        size_t size = hci_raw_size(count);
+
+        hci_raw_pack(devices, count, buffer);
+        return fwrite(buffer, 1, size, stdout) == size ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    if (array)
+        putchar('[');
+
+    for (int i = 0; i < count; i++)
+    {
+        if (i)
+            putchar(',');
+        print_device(&devices[i]);
+    }
+
+    puts(array ? "]" : "");
+
+    return EXIT_SUCCESS;
+}
+
+static int cli_list(struct cli_options const *options)
+{
+    static struct hci_dev_info devices[HCI_MAX_DEV];
+    struct hci_list_options list_options;
+    struct hci_error error;
+    uint16_t ids[HCI_MAX_DEV];
+    int count;
+
+    list_options.ids = options->arg_count > 1 ? ids : NULL;
+    list_options.id_count = options->arg_count - 1;
+    list_options.resolve_address = false;
+
+    for (int i = 1; i < options->arg_count; i++)
+    {
+        if (!parse_id(options->args[i], &ids[i - 1]))
+            return -1;
+    }
+
+    if (list_devices(devices, &count, &list_options, &error) != EXIT_SUCCESS)
+        return fail(-1, &error);
+
+    for (int i = 0; i < count; i++)
+        resolve_address(&devices[i]);
+
+    return print_devices(devices, count, options->raw, true);
+}
+
+static int cli_info(struct cli_options const *options)
+{
+    struct hci_dev_info device_info;
+    struct hci_error error;
+    uint16_t device_id;
+
+    if (options->arg_count != 2 || !parse_id(options->args[1], &device_id))
+        return -1;
+
+    if (hci_device_info(device_id, &device_info, &error) != EXIT_SUCCESS)
+        return fail(device_id, &error);
+
+    resolve_address(&device_info);
+
+    return print_devices(&device_info, 1, options->raw, false);
+}
+
+static int cli_up_down(struct cli_options const *options, bool status)
+{
+    struct hci_error error;
+    uint16_t device_id;
+    uint64_t start_ns = hci_monotonic_ns();
+    int timeout_ms = options->timeout_ms >= 0 ? options->timeout_ms : DEFAULT_UPDOWN_TIMEOUT_MS;
+
+    if (options->arg_count != 2 || !parse_id(options->args[1], &device_id))
+        return -1;
+
+    if (hci_interface_up_down_wait(device_id, status, timeout_ms, &error) != EXIT_SUCCESS)
+        return fail(device_id, &error);
+
+    printf("{\"id\":%u,\"elapsedMs\":%.3f}\n", device_id, elapsed_ms(start_ns));
+
+    return EXIT_SUCCESS;
+}
+
+static int cli_spoof(struct cli_options const *options)
+{
+    struct hci_spoof_timings timings;
+    struct hci_error error;
+    uint16_t device_id;
+    uint64_t start_ns = hci_monotonic_ns();
+    int timeout_ms = options->timeout_ms >= 0 ? options->timeout_ms : DEFAULT_SPOOF_TIMEOUT_MS;
+
+    if (options->arg_count != 3 || !parse_id(options->args[1], &device_id))
+        return -1;
+
+    if (hci_spoof_mac_wait(device_id, options->args[2], timeout_ms, &timings, &error) != EXIT_SUCCESS)
+        return fail(device_id, &error);
+
+    printf("{\"id\":%u,\"elapsedMs\":%.3f,\"timings\":{\"writeMs\":%.3f,\"vendorResetMs\":%.3f,"
+           "\"kernelResetMs\":%.3f,\"upMs\":%.3f,\"downtimeMs\":%.3f,\"resetsSkipped\":%s}}\n",
+           device_id, elapsed_ms(start_ns), timings.write, timings.vendor_reset, timings.kernel_reset,
+           timings.up, timings.downtime, timings.resets_skipped ? "true" : "false");
+
+    return EXIT_SUCCESS;
+}
+
+int main(int argc, char **argv)
+{
+    static uint16_t const manufacturers[HCI_MAX_DEV] = { 0, 10, 13, 15, 18, 48, 57 };
+    struct cli_options options;
+    struct hci_sim_options sim_options;
+    struct hci_error error;
+    char const *command;
+    int result = -1;
+
+    if (!parse_options(argc, argv, &options))
+    {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    if (options.simulated)
+    {
+        memset(&sim_options, 0, sizeof(sim_options));
+        sim_options.manufacturers = manufacturers;
+        sim_options.count = options.simulated;
+        sim_options.command_us = 50;
+        sim_options.reset_us = 2000;
+        sim_options.up_us = 1000;
+
+        if (hci_sim_start(&sim_options, &error) != EXIT_SUCCESS)
+            return fail(-1, &error);
+    }
+
+    command = options.args[0];
+
+    if (!strcmp(command, "list"))
+        result = cli_list(&options);
+    else if (!strcmp(command, "info"))
+        result = cli_info(&options);
+    else if (!strcmp(command, "up"))
+        result = cli_up_down(&options, true);
+    else if (!strcmp(command, "down"))
+        result = cli_up_down(&options, false);
+    else if (!strcmp(command, "spoof"))
+        result = cli_spoof(&options);
+
+    if (options.simulated)
+        hci_sim_stop();
+
+    if (result < 0)
+    {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    return result;
+}
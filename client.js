@@ -0,0 +1,289 @@
+'use strict';
+
+/*
+ * Thin client of btimd, which owns the HCI sockets of the host: see
+ * hci_daemon.hpp for the protocol. The native addon isn't loaded, so
+ * require('btim/client') works where btim isn't built. Requests are
+ * pipelined on one connection and answered in completion order.
+ */
+
+var net = require('net');
+var os = require('os');
+var raw = require('./raw');
+
+var DEFAULT_PATH = '/run/btimd.sock';
+
+var LIST = 1;
+var INFO = 2;
+var UP = 3;
+var DOWN = 4;
+var SPOOF = 5;
+var CONNECTIONS = 6;
+var STATS = 7;
+
+var QUALITY = 0x01;
+
+var REQUEST_SIZE = 16;
+var RESPONSE_SIZE = 12;
+
+var ERRNO_CODES = {};
+
+Object.keys(os.constants.errno).forEach(function (code) {
+  ERRNO_CODES[os.constants.errno[code]] = code;
+});
+
+/*
+ * Same shape as the errors of the addon: `errno`, `code`, `step`, `id`.
+ */
+function daemon_error(errno, step, id) {
+  var code = ERRNO_CODES[errno] || 'EIO';
+  var error = new Error(code + ', ' + step + ' failed' + (id >= 0 ? ' on hci' + id : ''));
+
+  error.errno = errno;
+  error.code = code;
+  error.syscall = step;
+  error.step = step;
+  if (id >= 0)
+    error.id = id;
+
+  return error;
+}
+
+function u64(buffer, offset) {
+  return buffer.readUInt32LE(offset) + buffer.readUInt32LE(offset + 4) * 0x100000000;
+}
+
+function timings(id, body) {
+  return { id: id, queuedMs: body.readUInt32LE(0) / 1000, elapsedMs: body.readUInt32LE(4) / 1000 };
+}
+
+var decoders = {};
+
+decoders[LIST] = function (id, body) {
+  return new raw.RawList(body);
+}
+
+decoders[INFO] = function (id, body) {
+  return new raw.RawList(body).get(0);
+}
+
+decoders[UP] = timings;
+decoders[DOWN] = timings;
+
+decoders[SPOOF] = function (id, body) {
+  var result = timings(id, body);
+
+  result.timings = {
+    writeMs: body.readUInt32LE(8) / 1000,
+    vendorResetMs: body.readUInt32LE(12) / 1000,
+    kernelResetMs: body.readUInt32LE(16) / 1000,
+    upMs: body.readUInt32LE(20) / 1000,
+    downtimeMs: body.readUInt32LE(24) / 1000,
+    resetsSkipped: body.readUInt8(28) !== 0
+  };
+
+  return result;
+}
+
+decoders[CONNECTIONS] = function (id, body) {
+  return new raw.ConnectionList(body);
+}
+
+decoders[STATS] = function (id, body) {
+  return {
+    requests: u64(body, 0),
+    enumerations: u64(body, 8),
+    cacheHits: u64(body, 16),
+    clients: u64(body, 24)
+  };
+}
+
+/*
+ * A connection to btimd. It doesn't keep the process alive while no
+ * request is pending.
+ */
+function Client(path) {
+  var self = this;
+
+  this.path = path || DEFAULT_PATH;
+  this.socket = net.createConnection(this.path);
+  this.pending = {};
+  this.waiting = 0;
+  this.tag = 0;
+  this.input = null;
+  this.closed = false;
+
+  this.socket.unref();
+
+  this.socket.on('data', function (chunk) {
+    self.receive(chunk);
+  });
+
+  this.socket.on('error', function (error) {
+    self.fail(error);
+  });
+
+  this.socket.on('close', function () {
+    self.fail(new Error('Connection to btimd closed'));
+  });
+}
+
+Client.prototype.receive = function receive(chunk) {
+  var input = this.input ? Buffer.concat([this.input, chunk]) : chunk;
+  var offset = 0;
+
+  while (input.length - offset >= 4) {
+    var size = input.readUInt32LE(offset);
+
+    if (size < RESPONSE_SIZE) {
+      this.socket.destroy(new Error('Malformed response from btimd'));
+      return;
+    }
+
+    if (input.length - offset < size)
+      break;
+
+    this.complete(input.slice(offset, offset + size));
+    offset += size;
+  }
+
+  this.input = offset < input.length ? input.slice(offset) : null;
+}
+
+Client.prototype.complete = function complete(frame) {
+  var tag = frame.readUInt32LE(4);
+  var errno = frame.readUInt32LE(8);
+  var body = frame.slice(RESPONSE_SIZE);
+  var request = this.pending[tag];
+
+  if (!request)
+    return;
+
+  delete this.pending[tag];
+  if (--this.waiting === 0)
+    this.socket.unref();
+
+  if (errno)
+    request.reject(daemon_error(errno, body.toString('latin1'), request.id));
+  else
+    request.resolve(decoders[request.operation](request.id, body));
+}
+
+Client.prototype.fail = function fail(error) {
+  var pending = this.pending;
+
+  this.closed = true;
+  this.pending = {};
+  this.waiting = 0;
+
+  Object.keys(pending).forEach(function (tag) {
+    pending[tag].reject(error);
+  });
+}
+
+/*
+ * Send a request.
+ * operation: LIST...; id: dev_id; flags: QUALITY; timeout_ms: 0 for the
+ * daemon's default; address: for SPOOF.
+ */
+Client.prototype.request = function request(operation, id, flags, timeout_ms, address) {
+  var self = this;
+
+  return new Promise(function (resolve, reject) {
+    var frame = Buffer.alloc(address ? REQUEST_SIZE + 6 : REQUEST_SIZE);
+    var tag = self.tag = (self.tag + 1) >>> 0;
+
+    if (self.closed) {
+      reject(new Error('Connection to btimd closed'));
+      return;
+    }
+
+    frame.writeUInt32LE(frame.length, 0);
+    frame.writeUInt32LE(tag, 4);
+    frame.writeUInt8(operation, 8);
+    frame.writeUInt8(flags, 9);
+    frame.writeUInt16LE(id, 10);
+    frame.writeUInt32LE(timeout_ms, 12);
+
+    if (address) {
+      address.split(':').forEach(function (byte, i) {
+        frame.writeUInt8(parseInt(byte, 16), 16 + i);
+      });
+    }
+
+    self.pending[tag] = { operation: operation, id: operation === LIST || operation === STATS ? -1 : id,
+                          resolve: resolve, reject: reject };
+    if (self.waiting++ === 0)
+      self.socket.ref();
+
+    self.socket.write(frame);
+  });
+}
+
+function check_id(id) {
+  if (typeof id !== 'number' || id < 0 || id > 0xffff)
+    throw new TypeError('interface_number should be a number');
+}
+
+function timeout_ms(options) {
+  return options && options.timeoutMs !== undefined ? options.timeoutMs : 0;
+}
+
+/*
+ * Adapters, as a RawList: the daemon enumerates them once for all its
+ * clients, again after a device event or --cache-ms.
+ */
+Client.prototype.list = function list() {
+  return this.request(LIST, 0, 0, 0);
+}
+
+/*
+ * An adapter, as a RawDevice.
+ */
+Client.prototype.getInfo = function getInfo(interface_number) {
+  check_id(interface_number);
+  return this.request(INFO, interface_number, 0, 0);
+}
+
+Client.prototype.up = function up(interface_number, options) {
+  check_id(interface_number);
+  return this.request(UP, interface_number, 0, timeout_ms(options));
+}
+
+Client.prototype.down = function down(interface_number, options) {
+  check_id(interface_number);
+  return this.request(DOWN, interface_number, 0, timeout_ms(options));
+}
+
+Client.prototype.spoof_mac = function spoof_mac(interface_number, mac_address, options) {
+  check_id(interface_number);
+  if (!/^([0-9a-f]{2}:){5}[0-9a-f]{2}$/i.test(mac_address))
+    throw new TypeError('mac_address should look like 11:22:33:44:55:66');
+  return this.request(SPOOF, interface_number, 0, timeout_ms(options), mac_address);
+}
+
+/*
+ * Connections of an adapter, as a ConnectionList.
+ */
+Client.prototype.connections = function connections(interface_number, options) {
+  check_id(interface_number);
+  return this.request(CONNECTIONS, interface_number, options && options.quality ? QUALITY : 0, 0);
+}
+
+/*
+ * The daemon's counters: { requests, enumerations, cacheHits, clients }.
+ */
+Client.prototype.stats = function stats() {
+  return this.request(STATS, 0, 0, 0);
+}
+
+Client.prototype.close = function close() {
+  this.socket.end();
+}
+
+module.exports = function connect(path) {
+  return new Client(path);
+}
+
+module.exports.Client = Client;
+module.exports.defaultPath = DEFAULT_PATH;
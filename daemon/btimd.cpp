@@ -0,0 +1,103 @@
+/*
+ * btimd: owns the HCI sockets of the host and serves btim clients over a
+ * Unix socket (see hci_daemon.hpp for the protocol), so that several
+ * processes share one enumeration and their operations on an adapter are
+ * serialized.
+ *
+ * Usage: btimd [--socket PATH] [--mode OCTAL] [--cache-ms N] [--simulate N]
+ *
+ * --socket defaults to /run/btimd.sock, --cache-ms (100) bounds how long an
+ * enumeration answers list and info requests when no device event comes.
+ * --simulate N serves N simulated adapters instead of the kernel's, as the
+ * native benchmark does.
+ */
+
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../hci_core.hpp"
+#include "../hci_daemon.hpp"
+#include "../hci_sim.hpp"
+
+static char const *option(int argc, char **argv, char const *name, char const *default_value)
+{
+    for (int i = 1; i < argc - 1; i++)
+    {
+        if (argv[i][0] == '-' && argv[i][1] == '-' && !strcmp(argv[i] + 2, name))
+            return argv[i + 1];
+    }
+
+    return default_value;
+}
+
+int main(int argc, char **argv)
+{
+    static uint16_t const manufacturers[HCI_MAX_DEV] = { 0, 10, 13, 15, 18, 48, 57 };
+    struct hci_daemon_options options;
+    struct hci_sim_options sim_options;
+    struct hci_daemon daemon;
+    struct hci_error error;
+    char const *path = option(argc, argv, "socket", "/run/btimd.sock");
+    int simulated = atoi(option(argc, argv, "simulate", "0"));
+    sigset_t signals;
+    int signal;
+
+    options.mode = strtol(option(argc, argv, "mode", "0"), NULL, 8);
+    options.cache_ms = atoi(option(argc, argv, "cache-ms", "100"));
+
+    if (strlen(path) >= sizeof(options.path) || options.cache_ms < 0 ||
+        simulated < 0 || simulated > HCI_MAX_DEV)
+    {
+        fprintf(stderr, "Usage: %s [--socket PATH] [--mode OCTAL] [--cache-ms N] [--simulate N (0-%d)]\n",
+                argv[0], HCI_MAX_DEV);
+        return EXIT_FAILURE;
+    }
+
+    strcpy(options.path, path);
+
+    if (simulated)
+    {
+        memset(&sim_options, 0, sizeof(sim_options));
+        sim_options.manufacturers = manufacturers;
+        sim_options.count = simulated;
+        sim_options.command_us = 50;
+        sim_options.reset_us = 2000;
+        sim_options.up_us = 1000;
+        sim_options.connections = 8;
+
+        if (hci_sim_start(&sim_options, &error) != EXIT_SUCCESS)
+        {
+            fprintf(stderr, "Can't start the simulator: %s (%s)\n", strerror(error.code), error.step);
+            return EXIT_FAILURE;
+        }
+    }
+
+    // Handled by sigwait() below, the daemon thread inherits the mask
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+    daemon.running = false;
+    if (hci_daemon_start(&daemon, &options, &error) != EXIT_SUCCESS)
+    {
+        fprintf(stderr, "Can't serve %s: %s (%s)\n", options.path, strerror(error.code), error.step);
+        return EXIT_FAILURE;
+    }
+
+    sigwait(&signals, &signal);
+
+    hci_daemon_stop(&daemon);
+
+    fprintf(stderr, "%llu requests, %llu enumerations, %llu answered from cache\n",
+            (unsigned long long)daemon.requests, (unsigned long long)daemon.enumerations,
+            (unsigned long long)daemon.cache_hits);
+
+    if (simulated)
+        hci_sim_stop();
+
+    return EXIT_SUCCESS;
+}
@@ -1,12 +1,185 @@
+#include <errno.h>
+
+#include <atomic>
+
+#include <bluetooth/bluetooth.h>
+#include <bluetooth/hci.h>
+
 #include <nan.h>
 
 #include "hci.hpp"
+#include "hci_core.hpp"
+#include "hci_events.hpp"
+#include "hci_executor.hpp"
+#include "hci_pool.hpp"
+#include "hci_queue.hpp"
+
+/*
+ * Instances of the addon alive in the process.
+ */
+static std::atomic<int> instances;
+
+/*
+ * Close the cached HCI sockets, without waiting for those in use: they are
+ * closed when the calls using them complete. The sockets are shared by
+ * every instance: while worker threads have btim loaded too, nothing is
+ * closed.
+ * Params:
+ *     - info: Contains a return value: false when the sockets were left
+ *       open for other instances.
+ */
+static void HCI_close(const Nan::FunctionCallbackInfo<v8::Value>& info)
+{
+    if (instances.load() > 1)
+    {
+        info.GetReturnValue().Set(Nan::False());
+        return;
+    }
+
+    hci_pool_close();
+    hci_events_close();
+
+    info.GetReturnValue().Set(Nan::True());
+}
+
+/*
+ * Get the instance a binding belongs to.
+ * Params:
+ *     - info: Contains the instance as data.
+ * Return value: the instance.
+ */
+struct hci_instance *hci_instance_get(const Nan::FunctionCallbackInfo<v8::Value>& info)
+{
+    return (struct hci_instance *)info.Data().As<v8::External>()->Value();
+}
+
+/*
+ * Read a dev_id: any index the kernel may assign, HCI_DEV_NONE excluded.
+ * Params:
+ *     - value: argument.
+ *     - device_id: receives the dev_id.
+ * Return values:
+ *     - false: not a dev_id.
+ *     - true: on success.
+ */
+static bool device_id_value(v8::Local<v8::Value> value, int *device_id)
+{
+    double number = Nan::To<double>(value).FromJust();
+
+    if (!(number >= 0 && number < HCI_DEV_NONE) || number != (int)number)
+        return false;
+
+    *device_id = (int)number;
+    return true;
+}
+
+/*
+ * Read a dev_id argument.
+ * Params:
+ *     - value: argument.
+ *     - device_id: receives the dev_id.
+ * Return values:
+ *     - false: out of range, a RangeError is pending.
+ *     - true: on success.
+ */
+bool hci_device_id_arg(v8::Local<v8::Value> value, int *device_id)
+{
+    if (device_id_value(value, device_id))
+        return true;
+
+    Nan::ThrowRangeError("device id should be between 0 and 65534");
+    return false;
+}
+
+/*
+ * Take the executor lane of a device for one of the original synchronous
+ * calls, which report failures through their status only. Like a failed
+ * ioctl, an id which isn't a dev_id and a task running on the device, which
+ * the main thread can't wait for, fail without throwing.
+ * Params:
+ *     - value: dev_id argument.
+ *     - device_id: receives the dev_id.
+ * Return values:
+ *     - false: the call fails with EXIT_FAILURE.
+ *     - true: the lane is locked, release it with hci_executor_unlock().
+ */
+bool hci_device_sync_lock(v8::Local<v8::Value> value, int *device_id)
+{
+    return device_id_value(value, device_id) && hci_executor_trylock(*device_id);
+}
+
+/*
+ * Take the executor lane of a device for a synchronous call. The main
+ * thread never waits for a task of the device, which may take its whole
+ * timeout: the call fails with EBUSY instead.
+ * Params:
+ *     - device_id: device ID.
+ * Return values:
+ *     - false: a task of the device is running, an exception is pending.
+ *     - true: the lane is locked, release it with hci_executor_unlock().
+ */
+bool hci_device_trylock(int device_id)
+{
+    struct hci_error error;
+
+    if (hci_executor_trylock(device_id))
+        return true;
+
+    hci_set_error(&error, EBUSY, "executor");
+    v8::Isolate::GetCurrent()->ThrowException(hci_error_to_js(device_id, &error));
+    return false;
+}
 
+/*
+ * Read a timeout argument, in milliseconds.
+ * Params:
+ *     - value: argument.
+ *     - timeout_ms: receives the timeout.
+ * Return values:
+ *     - false: negative or not an int32, a RangeError is pending.
+ *     - true: on success.
+ */
+bool hci_timeout_arg(v8::Local<v8::Value> value, int *timeout_ms)
+{
+    if (!value->IsInt32() || Nan::To<int32_t>(value).FromJust() < 0)
+    {
+        Nan::ThrowRangeError("timeoutMs should be a positive integer");
+        return false;
+    }
+
+    *timeout_ms = Nan::To<int32_t>(value).FromJust();
+    return true;
+}
+
+/*
+ * Free an instance when its environment goes away: the main thread exits or
+ * a worker thread terminates.
+ * Params:
+ *     - arg: the instance.
+ */
+static void instance_cleanup(void *arg)
+{
+    struct hci_instance *instance = (struct hci_instance *)arg;
+
+    hci_watch_cleanup(instance);
+    hci_list_cleanup(instance);
+    hci_queue_delete(instance->queue);
+
+    delete instance;
+    instances--;
+}
 
 void Init(v8::Local<v8::Object> exports)
 {
-    exports->Set(Nan::New("list").ToLocalChecked(),
-                 Nan::New<v8::FunctionTemplate>(HCI_list)->GetFunction());
+    struct hci_instance *instance = new hci_instance();
+    v8::Local<v8::Value> data = Nan::New<v8::External>(instance);
+
+    instance->queue = hci_queue_new();
+    instance->watch = NULL;
+    instance->list = NULL;
+    instances++;
+
+    node::AddEnvironmentCleanupHook(v8::Isolate::GetCurrent(), instance_cleanup, instance);
 
     exports->Set(Nan::New("spoof_mac").ToLocalChecked(),
                  Nan::New<v8::FunctionTemplate>(HCI_spoof_mac)->GetFunction());
@@ -16,6 +189,45 @@ void Init(v8::Local<v8::Object> exports)
 
     exports->Set(Nan::New("interface_down").ToLocalChecked(),
                  Nan::New<v8::FunctionTemplate>(HCI_Down)->GetFunction());
+
+    exports->Set(Nan::New("spoof_mac_async").ToLocalChecked(),
+                 Nan::New<v8::FunctionTemplate>(HCI_spoof_mac_async, data)->GetFunction());
+
+    exports->Set(Nan::New("interface_up_async").ToLocalChecked(),
+                 Nan::New<v8::FunctionTemplate>(HCI_Up_async, data)->GetFunction());
+
+    exports->Set(Nan::New("interface_down_async").ToLocalChecked(),
+                 Nan::New<v8::FunctionTemplate>(HCI_Down_async, data)->GetFunction());
+
+    exports->Set(Nan::New("capabilities_async").ToLocalChecked(),
+                 Nan::New<v8::FunctionTemplate>(HCI_capabilities_async, data)->GetFunction());
+
+    exports->Set(Nan::New("set_command_timeout").ToLocalChecked(),
+                 Nan::New<v8::FunctionTemplate>(HCI_set_command_timeout)->GetFunction());
+
+    exports->Set(Nan::New("command_latency").ToLocalChecked(),
+                 Nan::New<v8::FunctionTemplate>(HCI_command_latency)->GetFunction());
+
+    exports->Set(Nan::New("downtime").ToLocalChecked(),
+                 Nan::New<v8::FunctionTemplate>(HCI_downtime)->GetFunction());
+
+    exports->Set(Nan::New("watch_start").ToLocalChecked(),
+                 Nan::New<v8::FunctionTemplate>(HCI_watch_start, data)->GetFunction());
+
+    exports->Set(Nan::New("watch_stop").ToLocalChecked(),
+                 Nan::New<v8::FunctionTemplate>(HCI_watch_stop, data)->GetFunction());
+
+    exports->Set(Nan::New("close").ToLocalChecked(),
+                 Nan::New<v8::FunctionTemplate>(HCI_close)->GetFunction());
+
+    HCI_list_init(exports, instance);
+    HCI_sampler_init(exports);
+    HCI_capture_init(exports);
+    HCI_scan_init(exports);
+    HCI_conn_init(exports, data);
+    HCI_exporter_init(exports);
+    HCI_metrics_init(exports);
+    HCI_picker_init(exports);
 }
 
-NODE_MODULE(hcifuctions, Init)
+NAN_MODULE_WORKER_ENABLED(btim, Init)
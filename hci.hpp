@@ -1,6 +1,54 @@
 #pragma once
 
-void HCI_list(const Nan::FunctionCallbackInfo<v8::Value>& info);
+struct hci_error;
+struct hci_queue;
+struct hci_watch;
+struct hci_list_state;
+
+/*
+ * State of an instance of the addon. The main thread and each worker thread
+ * loading btim get their own, freed when their environment goes away.
+ *     - queue: completions of the DeviceWorkers queued by the instance.
+ *     - watch: device event subscription, NULL when not watching.
+ *     - list: hci_list.cpp's cached strings and snapshots.
+ */
+struct hci_instance
+{
+    struct hci_queue *queue;
+    struct hci_watch *watch;
+    struct hci_list_state *list;
+};
+
 void HCI_spoof_mac(const Nan::FunctionCallbackInfo<v8::Value>& info);
 void HCI_Up(const Nan::FunctionCallbackInfo<v8::Value>& info);
 void HCI_Down(const Nan::FunctionCallbackInfo<v8::Value>& info);
+
+void HCI_spoof_mac_async(const Nan::FunctionCallbackInfo<v8::Value>& info);
+void HCI_Up_async(const Nan::FunctionCallbackInfo<v8::Value>& info);
+void HCI_Down_async(const Nan::FunctionCallbackInfo<v8::Value>& info);
+void HCI_capabilities_async(const Nan::FunctionCallbackInfo<v8::Value>& info);
+void HCI_set_command_timeout(const Nan::FunctionCallbackInfo<v8::Value>& info);
+void HCI_command_latency(const Nan::FunctionCallbackInfo<v8::Value>& info);
+void HCI_downtime(const Nan::FunctionCallbackInfo<v8::Value>& info);
+
+void HCI_watch_start(const Nan::FunctionCallbackInfo<v8::Value>& info);
+void HCI_watch_stop(const Nan::FunctionCallbackInfo<v8::Value>& info);
+
+void HCI_list_init(v8::Local<v8::Object> exports, struct hci_instance *instance);
+void HCI_sampler_init(v8::Local<v8::Object> exports);
+void HCI_capture_init(v8::Local<v8::Object> exports);
+void HCI_scan_init(v8::Local<v8::Object> exports);
+void HCI_conn_init(v8::Local<v8::Object> exports, v8::Local<v8::Value> instance);
+void HCI_exporter_init(v8::Local<v8::Object> exports);
+void HCI_metrics_init(v8::Local<v8::Object> exports);
+void HCI_picker_init(v8::Local<v8::Object> exports);
+
+struct hci_instance *hci_instance_get(const Nan::FunctionCallbackInfo<v8::Value>& info);
+bool hci_device_id_arg(v8::Local<v8::Value> value, int *device_id);
+bool hci_device_trylock(int device_id);
+bool hci_device_sync_lock(v8::Local<v8::Value> value, int *device_id);
+bool hci_timeout_arg(v8::Local<v8::Value> value, int *timeout_ms);
+void hci_watch_cleanup(struct hci_instance *instance);
+void hci_list_cleanup(struct hci_instance *instance);
+
+v8::Local<v8::Value> hci_error_to_js(int device_id, struct hci_error const *error);
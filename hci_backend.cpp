@@ -0,0 +1,245 @@
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+
+#include <atomic>
+
+#include <bluetooth/bluetooth.h>
+#include <bluetooth/hci.h>
+#include <bluetooth/hci_lib.h>
+
+#include "hci_backend.hpp"
+#include "hci_events.hpp"
+#include "hci_executor.hpp"
+#include "hci_metrics.hpp"
+#include "hci_pool.hpp"
+
+static std::atomic<struct hci_backend const *> current(&hci_backend_kernel);
+
+/*
+ * Open the kernel's control socket.
+ * Params:
+ *     - error: details about the failed step.
+ * Return value: the socket, or -1 on failure.
+ */
+static int kernel_open_control(struct hci_error *error)
+{
+    int descriptor = socket(AF_BLUETOOTH, SOCK_RAW | SOCK_CLOEXEC, BTPROTO_HCI);
+
+    if (descriptor < 0)
+        hci_set_error(error, errno, "socket");
+
+    return descriptor;
+}
+
+/*
+ * Open a raw socket bound to a device.
+ * Params:
+ *     - device_id: device ID.
+ *     - error: details about the failed step.
+ * Return value: the socket, or -1 on failure.
+ */
+static int kernel_open_device(int device_id, struct hci_error *error)
+{
+    struct hci_filter filter;
+    int descriptor;
+
+    if ((descriptor = hci_open_dev(device_id)) < 0)
+    {
+        hci_set_error(error, errno, "hci_open_dev");
+        return -1;
+    }
+
+    // Only command results and hardware errors reach the descriptor until a
+    // request asks for more
+    hci_filter_clear(&filter);
+    hci_filter_set_ptype(HCI_EVENT_PKT, &filter);
+    hci_filter_set_event(EVT_CMD_COMPLETE, &filter);
+    hci_filter_set_event(EVT_CMD_STATUS, &filter);
+    hci_filter_set_event(EVT_VENDOR, &filter);
+    hci_filter_set_event(EVT_HARDWARE_ERROR, &filter);
+    setsockopt(descriptor, SOL_HCI, HCI_FILTER, &filter, sizeof(filter));
+
+    return descriptor;
+}
+
+/*
+ * Open a socket receiving the kernel's device events (stack internal
+ * events of the raw HCI channel, not bound to any device).
+ * Params:
+ *     - error: details about the failed step.
+ * Return value: a non-blocking descriptor, or -1 on failure.
+ */
+static int kernel_open_events(struct hci_error *error)
+{
+    struct sockaddr_hci address;
+    struct hci_filter filter;
+    int descriptor;
+
+    descriptor = socket(AF_BLUETOOTH, SOCK_RAW | SOCK_CLOEXEC | SOCK_NONBLOCK, BTPROTO_HCI);
+    if (descriptor < 0)
+    {
+        hci_set_error(error, errno, "socket");
+        return -1;
+    }
+
+    hci_filter_clear(&filter);
+    hci_filter_set_ptype(HCI_EVENT_PKT, &filter);
+    hci_filter_set_event(EVT_STACK_INTERNAL, &filter);
+
+    if (setsockopt(descriptor, SOL_HCI, HCI_FILTER, &filter, sizeof(filter)) < 0)
+    {
+        hci_set_error(error, errno, "HCI_FILTER");
+        close(descriptor);
+        return -1;
+    }
+
+    memset(&address, 0, sizeof(address));
+    address.hci_family = AF_BLUETOOTH;
+    address.hci_dev = HCI_DEV_NONE;
+
+    if (bind(descriptor, (struct sockaddr *)&address, sizeof(address)) < 0)
+    {
+        hci_set_error(error, errno, "bind");
+        close(descriptor);
+        return -1;
+    }
+
+    return descriptor;
+}
+
+/*
+ * Open a socket bound to the monitor channel, which copies the traffic of
+ * every device. Needs CAP_NET_RAW.
+ * Params:
+ *     - error: details about the failed step.
+ * Return value: the socket, or -1 on failure.
+ */
+static int kernel_open_monitor(struct hci_error *error)
+{
+    struct sockaddr_hci address;
+    int descriptor;
+
+    descriptor = socket(AF_BLUETOOTH, SOCK_RAW | SOCK_CLOEXEC, BTPROTO_HCI);
+    if (descriptor < 0)
+    {
+        hci_set_error(error, errno, "socket");
+        return -1;
+    }
+
+    memset(&address, 0, sizeof(address));
+    address.hci_family = AF_BLUETOOTH;
+    address.hci_dev = HCI_DEV_NONE;
+    address.hci_channel = HCI_CHANNEL_MONITOR;
+
+    if (bind(descriptor, (struct sockaddr *)&address, sizeof(address)) < 0)
+    {
+        hci_set_error(error, errno, "bind");
+        close(descriptor);
+        return -1;
+    }
+
+    return descriptor;
+}
+
+static int kernel_set_filter(int descriptor, struct hci_filter const *filter)
+{
+    return setsockopt(descriptor, SOL_HCI, HCI_FILTER, filter, sizeof(*filter));
+}
+
+static int kernel_ioctl(int descriptor, unsigned long request, void *arg)
+{
+    return ioctl(descriptor, request, arg);
+}
+
+static int kernel_send_command(int descriptor, uint16_t ogf, uint16_t ocf, uint8_t plen, void const *params)
+{
+    return hci_send_cmd(descriptor, ogf, ocf, plen, (void *)params);
+}
+
+struct hci_backend const hci_backend_kernel =
+{
+    "kernel",
+    kernel_open_control,
+    kernel_open_device,
+    kernel_open_events,
+    kernel_open_monitor,
+    kernel_set_filter,
+    kernel_ioctl,
+    kernel_send_command
+};
+
+/*
+ * Get the backend HCI requests go to.
+ */
+struct hci_backend const *hci_backend_get(void)
+{
+    return current.load(std::memory_order_acquire);
+}
+
+/*
+ * Send HCI requests to another backend. Descriptors opened by the previous
+ * one are closed and what is cached about devices is dropped; requests in
+ * flight must have completed.
+ * Params:
+ *     - backend: new backend.
+ */
+void hci_backend_set(struct hci_backend const *backend)
+{
+    current.store(backend, std::memory_order_release);
+
+    hci_pool_close();
+    hci_events_close();
+}
+
+/*
+ * Get the adapter a device ioctl is about.
+ * Return value: its device ID, -1 for none.
+ */
+static int ioctl_device(unsigned long request, void *arg)
+{
+    switch (request)
+    {
+    case HCIDEVUP:
+    case HCIDEVDOWN:
+    case HCIDEVRESET:
+        return (int)(long)arg;
+
+    case HCIGETDEVINFO:
+        return ((struct hci_dev_info *)arg)->dev_id;
+
+    case HCIGETCONNLIST:
+        return ((struct hci_conn_list_req *)arg)->dev_id;
+    }
+
+    return -1;
+}
+
+/*
+ * Run a device ioctl on the current backend, measured into the latency
+ * histograms and traced by the ioctl__start and ioctl__done probes.
+ * Params:
+ *     - descriptor: descriptor opened by the backend.
+ *     - request, arg: ioctl.
+ * Return value: the result of the ioctl, errno is kept.
+ */
+int hci_backend_ioctl(int descriptor, unsigned long request, void *arg)
+{
+    int device_id = ioctl_device(request, arg);
+    uint64_t start = hci_monotonic_ns();
+
+    HCI_PROBE2(ioctl__start, device_id, request);
+
+    int result = hci_backend_get()->ioctl(descriptor, request, arg);
+    int code = result < 0 ? errno : 0;
+    uint64_t latency_ns = hci_monotonic_ns() - start;
+
+    hci_metrics_record(HCI_METRICS_IOCTL, _IOC_NR(request), device_id, latency_ns, result < 0);
+    HCI_PROBE4(ioctl__done, device_id, request, code, latency_ns);
+
+    if (result < 0)
+        errno = code;
+    return result;
+}
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "hci_core.hpp"
+
+/*
+ * Where HCI requests go. Every socket, ioctl and command of btim goes
+ * through the current backend, so that a simulated one can stand in for the
+ * kernel.
+ *     - open_control: socket for device ioctls.
+ *     - open_device: descriptor bound to a device, receiving the results of
+ *       its commands (Command Complete/Status, vendor and Hardware Error
+ *       events).
+ *     - open_events: non-blocking descriptor receiving the stack internal
+ *       device events.
+ *     - open_monitor: descriptor receiving a copy of the traffic of every
+ *       device, as frames of the monitor channel.
+ *     - set_filter: set the HCI_FILTER of a device descriptor, the packets
+ *       it receives.
+ *     - ioctl: device ioctl (HCIGETDEVLIST, HCIGETDEVINFO, HCIDEVUP,
+ *       HCIDEVDOWN, HCIDEVRESET) on a descriptor opened by the backend.
+ *     - send_command: write a command packet, like hci_send_cmd().
+ * Descriptors are pollable and closed with close().
+ */
+struct hci_backend
+{
+    char const *name;
+    int (*open_control)(struct hci_error *error);
+    int (*open_device)(int device_id, struct hci_error *error);
+    int (*open_events)(struct hci_error *error);
+    int (*open_monitor)(struct hci_error *error);
+    int (*set_filter)(int descriptor, struct hci_filter const *filter);
+    int (*ioctl)(int descriptor, unsigned long request, void *arg);
+    int (*send_command)(int descriptor, uint16_t ogf, uint16_t ocf, uint8_t plen, void const *params);
+};
+
+/*
+ * Header of a frame of the monitor channel, little endian.
+ *     - opcode: HCI_MONITOR_* kind of frame.
+ *     - index: device ID, HCI_DEV_NONE for frames about no device.
+ *     - length: length of the payload which follows.
+ */
+struct hci_monitor_header
+{
+    uint16_t opcode;
+    uint16_t index;
+    uint16_t length;
+} __attribute__ ((packed));
+
+#define HCI_MONITOR_COMMAND_PKT 2
+#define HCI_MONITOR_EVENT_PKT   3
+
+extern struct hci_backend const hci_backend_kernel;
+
+struct hci_backend const *hci_backend_get(void);
+void hci_backend_set(struct hci_backend const *backend);
+int hci_backend_ioctl(int descriptor, unsigned long request, void *arg);
@@ -0,0 +1,255 @@
+#include <errno.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+#include <bluetooth/bluetooth.h>
+#include <bluetooth/hci.h>
+#include <bluetooth/hci_lib.h>
+
+#include "hci_backend.hpp"
+#include "hci_bdaddr.hpp"
+#include "hci_engine.hpp"
+#include "hci_executor.hpp"
+
+/*
+ * Delay before a failed resolution is tried again.
+ */
+#define BDADDR_RETRY_NS 5000000000ULL
+
+enum
+{
+    BDADDR_EMPTY,
+    BDADDR_PENDING,
+    BDADDR_RESOLVED,
+    BDADDR_FAILED
+};
+
+/*
+ * Address of a RAW device, which the kernel reports as BDADDR_ANY.
+ *     - epoch: bumped on invalidation, so that a resolution started before
+ *       is dropped.
+ *     - failed_ns: time of the last failed resolution.
+ */
+struct hci_bdaddr_entry
+{
+    int device_id;
+    int state;
+    uint32_t epoch;
+    uint64_t failed_ns;
+    bdaddr_t bdaddr;
+};
+
+static std::mutex bdaddr_lock;
+static std::condition_variable bdaddr_done;
+static struct hci_bdaddr_entry entries[HCI_MAX_DEV];
+
+/*
+ * Run READ_BD_ADDR on an engine.
+ * Params:
+ *     - engine: engine of the device.
+ *     - bdaddr: receives the address.
+ *     - error: details about the failed step.
+ * Return values:
+ *     - EXIT_FAILURE: on failure.
+ *     - EXIT_SUCCESS: on success.
+ */
+static int read_bdaddr(struct hci_engine *engine, bdaddr_t *bdaddr, struct hci_error *error)
+{
+    struct hci_command command;
+    read_bd_addr_rp response;
+
+    hci_command_init(&command, OGF_INFO_PARAM, OCF_READ_BD_ADDR, NULL, 0, 1000);
+    command.response = (uint8_t *)&response;
+    command.rsize = sizeof(response);
+
+    if (hci_engine_run(engine, &command, 1) != EXIT_SUCCESS || command.rlen < (int)sizeof(response) ||
+        response.status)
+        return hci_set_error(error, command.result ? command.result : EIO, "hci_read_bd_addr");
+
+    bacpy(bdaddr, &response.bdaddr);
+
+    return EXIT_SUCCESS;
+}
+
+/*
+ * Read the address of a device from its controller, on its pooled
+ * descriptor.
+ * Params:
+ *     - device_id: device ID.
+ *     - bdaddr: receives the address.
+ *     - error: details about the failed step.
+ * Return values:
+ *     - EXIT_FAILURE: on failure.
+ *     - EXIT_SUCCESS: on success.
+ */
+int hci_bdaddr_read(int device_id, bdaddr_t *bdaddr, struct hci_error *error)
+{
+    struct hci_engine engine;
+
+    if (hci_engine_open(&engine, device_id, error) != EXIT_SUCCESS)
+        return EXIT_FAILURE;
+
+    if (read_bdaddr(&engine, bdaddr, error) != EXIT_SUCCESS)
+    {
+        hci_engine_close(&engine, error->code);
+        return EXIT_FAILURE;
+    }
+
+    hci_engine_close(&engine, 0);
+
+    return EXIT_SUCCESS;
+}
+
+/*
+ * Read the address of a device on a descriptor of its own, which doesn't
+ * wait for the pooled one to be given back.
+ * Params:
+ *     - device_id: device ID.
+ *     - bdaddr: receives the address.
+ *     - error: details about the failed step.
+ * Return values:
+ *     - EXIT_FAILURE: on failure.
+ *     - EXIT_SUCCESS: on success.
+ */
+static int read_direct(int device_id, bdaddr_t *bdaddr, struct hci_error *error)
+{
+    struct hci_engine engine;
+    int result;
+
+    engine.device_id = device_id;
+    engine.credits = 1;
+    engine.window = 1;
+    engine.manufacturer = -1;
+
+    if ((engine.descriptor = hci_backend_get()->open_device(device_id, error)) < 0)
+        return EXIT_FAILURE;
+
+    result = read_bdaddr(&engine, bdaddr, error);
+    close(engine.descriptor);
+
+    return result;
+}
+
+/*
+ * Read the address of a device in the background and cache it, unless the
+ * entry was invalidated meanwhile.
+ * Params:
+ *     - device_id: device ID.
+ *     - epoch: epoch of the entry when the read was started.
+ */
+static void resolve_thread(int device_id, uint32_t epoch)
+{
+    struct hci_bdaddr_entry *entry = &entries[device_id % HCI_MAX_DEV];
+    struct hci_error error;
+    bdaddr_t bdaddr;
+    int result = read_direct(device_id, &bdaddr, &error);
+
+    std::lock_guard<std::mutex> guard(bdaddr_lock);
+
+    if (entry->device_id != device_id || entry->epoch != epoch)
+        return;
+
+    if (result != EXIT_SUCCESS)
+    {
+        entry->state = BDADDR_FAILED;
+        entry->failed_ns = hci_monotonic_ns();
+    }
+    else
+    {
+        entry->state = BDADDR_RESOLVED;
+        bacpy(&entry->bdaddr, &bdaddr);
+    }
+
+    bdaddr_done.notify_all();
+}
+
+/*
+ * Start reading the address of a RAW device unless it is cached, being read
+ * or failed less than BDADDR_RETRY_NS ago. The read runs on a thread and a
+ * descriptor of its own, neither behind the commands queued for the device
+ * nor behind the reads of other devices.
+ * Params:
+ *     - device_id: device ID.
+ */
+void hci_bdaddr_request(int device_id)
+{
+    struct hci_bdaddr_entry *entry = &entries[device_id % HCI_MAX_DEV];
+    std::lock_guard<std::mutex> guard(bdaddr_lock);
+
+    if (entry->device_id != device_id)
+    {
+        entry->device_id = device_id;
+        entry->state = BDADDR_EMPTY;
+        entry->epoch++;
+    }
+
+    if (entry->state == BDADDR_PENDING || entry->state == BDADDR_RESOLVED ||
+        (entry->state == BDADDR_FAILED && hci_monotonic_ns() - entry->failed_ns < BDADDR_RETRY_NS))
+        return;
+
+    entry->state = BDADDR_PENDING;
+    std::thread(resolve_thread, device_id, entry->epoch).detach();
+}
+
+/*
+ * Get the address of a RAW device, waiting for a read started with
+ * hci_bdaddr_request() until a deadline at most.
+ * Params:
+ *     - device_id: device ID.
+ *     - bdaddr: receives the address.
+ *     - deadline_ns: hci_monotonic_ns() time after which a pending read is
+ *       left to complete in the background.
+ * Return values:
+ *     - true: the address is known.
+ *     - false: it isn't, yet or at all.
+ */
+bool hci_bdaddr_resolve(int device_id, bdaddr_t *bdaddr, uint64_t deadline_ns)
+{
+    struct hci_bdaddr_entry *entry = &entries[device_id % HCI_MAX_DEV];
+    std::unique_lock<std::mutex> guard(bdaddr_lock);
+
+    while (entry->device_id == device_id && entry->state == BDADDR_PENDING)
+    {
+        uint64_t now = hci_monotonic_ns();
+
+        if (now >= deadline_ns)
+            return false;
+
+        bdaddr_done.wait_for(guard, std::chrono::nanoseconds(deadline_ns - now));
+    }
+
+    if (entry->device_id != device_id || entry->state != BDADDR_RESOLVED)
+        return false;
+
+    bacpy(bdaddr, &entry->bdaddr);
+    return true;
+}
+
+/*
+ * Forget the address of a device, e.g. when it was re-registered, reset or
+ * given a new address.
+ * Params:
+ *     - device_id: device ID, -1 for all devices.
+ */
+void hci_bdaddr_invalidate(int device_id)
+{
+    std::lock_guard<std::mutex> guard(bdaddr_lock);
+
+    for (int i = 0; i < HCI_MAX_DEV; i++)
+    {
+        struct hci_bdaddr_entry *entry = &entries[i];
+
+        if (device_id < 0 || entry->device_id == device_id)
+        {
+            entry->state = BDADDR_EMPTY;
+            entry->epoch++;
+        }
+    }
+
+    // Nothing to wait for anymore
+    bdaddr_done.notify_all();
+}
@@ -0,0 +1,10 @@
+#pragma once
+
+#include <bluetooth/bluetooth.h>
+
+#include "hci_core.hpp"
+
+void hci_bdaddr_request(int device_id);
+bool hci_bdaddr_resolve(int device_id, bdaddr_t *bdaddr, uint64_t deadline_ns);
+void hci_bdaddr_invalidate(int device_id);
+int hci_bdaddr_read(int device_id, bdaddr_t *bdaddr, struct hci_error *error);
@@ -0,0 +1,106 @@
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <mutex>
+
+#include <bluetooth/bluetooth.h>
+#include <bluetooth/hci.h>
+
+#include "hci_caps.hpp"
+#include "hci_metrics.hpp"
+
+/*
+ * A cached capability record.
+ */
+struct hci_caps_entry
+{
+    bool valid;
+    struct hci_capabilities caps;
+};
+
+static std::mutex caps_lock;
+static struct hci_caps_entry entries[HCI_MAX_DEV];
+
+/*
+ * Find the sysfs path of the device an adapter hangs off.
+ * Params:
+ *     - device_id: device ID.
+ *     - bus: receives the path, empty when there is none.
+ *     - size: size of bus.
+ */
+static void bus_identity(int device_id, char *bus, size_t size)
+{
+    char link[64];
+    char path[PATH_MAX];
+
+    snprintf(link, sizeof(link), "/sys/class/bluetooth/hci%d/device", device_id);
+
+    if (realpath(link, path))
+        snprintf(bus, size, "%s", path);
+    else
+        bus[0] = '\0';
+}
+
+/*
+ * Get the cached capabilities of an adapter. The entry only matches when the
+ * adapter still hangs off the same device, so a controller plugged in with
+ * a reused dev_id is probed again.
+ * Params:
+ *     - device_id: device ID.
+ *     - caps: receives the capabilities on a hit. On a miss, device_id and
+ *       bus are set for hci_caps_store().
+ * Return values:
+ *     - true: the capabilities were cached.
+ *     - false: the adapter must be probed.
+ */
+bool hci_caps_lookup(int device_id, struct hci_capabilities *caps)
+{
+    caps->device_id = device_id;
+    bus_identity(device_id, caps->bus, sizeof(caps->bus));
+
+    std::lock_guard<std::mutex> guard(caps_lock);
+    struct hci_caps_entry *entry = &entries[device_id % HCI_MAX_DEV];
+
+    if (!entry->valid || entry->caps.device_id != device_id || strcmp(entry->caps.bus, caps->bus))
+        return false;
+
+    *caps = entry->caps;
+    return true;
+}
+
+/*
+ * Cache the capabilities of an adapter. Its operations are measured as
+ * its manufacturer's from then on.
+ * Params:
+ *     - caps: capabilities, as filled by hci_caps_lookup() and the probe.
+ */
+void hci_caps_store(struct hci_capabilities const *caps)
+{
+    std::lock_guard<std::mutex> guard(caps_lock);
+    struct hci_caps_entry *entry = &entries[caps->device_id % HCI_MAX_DEV];
+
+    entry->valid = true;
+    entry->caps = *caps;
+
+    hci_metrics_set_manufacturer(caps->device_id, caps->manufacturer);
+}
+
+/*
+ * Forget the capabilities of an adapter, e.g. when it was plugged in or out.
+ * Params:
+ *     - device_id: device ID, -1 for all adapters.
+ */
+void hci_caps_invalidate(int device_id)
+{
+    std::lock_guard<std::mutex> guard(caps_lock);
+
+    for (int i = 0; i < HCI_MAX_DEV; i++)
+    {
+        if (device_id < 0 || entries[i].caps.device_id == device_id)
+            entries[i].valid = false;
+    }
+
+    hci_metrics_set_manufacturer(device_id, -1);
+}
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "hci_core.hpp"
+
+/*
+ * What a controller can do about its address, probed once per adapter.
+ *     - bus: path of the adapter's parent device in sysfs, empty for
+ *       virtual controllers. Together with device_id it identifies the
+ *       adapter.
+ *     - manufacturer, hci_ver, hci_rev, lmp_ver, lmp_subver: local version
+ *       information.
+ *     - vendor: index of the entry of the vendor table, -1 when the
+ *       manufacturer isn't supported.
+ *     - has_reset: the vendor can reset the controller after a write.
+ */
+struct hci_capabilities
+{
+    int device_id;
+    char bus[256];
+    uint16_t manufacturer;
+    uint8_t hci_ver;
+    uint16_t hci_rev;
+    uint8_t lmp_ver;
+    uint16_t lmp_subver;
+    int vendor;
+    bool has_reset;
+};
+
+bool hci_caps_lookup(int device_id, struct hci_capabilities *caps);
+void hci_caps_store(struct hci_capabilities const *caps);
+void hci_caps_invalidate(int device_id);
+int hci_capabilities(int device_id, struct hci_capabilities *caps, struct hci_error *error);
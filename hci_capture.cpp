@@ -0,0 +1,499 @@
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include <chrono>
+
+#include <bluetooth/bluetooth.h>
+#include <bluetooth/hci.h>
+
+#include "hci_backend.hpp"
+#include "hci_capture.hpp"
+
+#define CAPTURE_POLL_MS     100
+#define CAPTURE_OUTPUT_SIZE (64 * 1024)
+#define CAPTURE_PADDING     0xffff
+#define CAPTURE_ALIGN(size) (((size) + 7) & ~(size_t)7)
+
+// btsnoop file format, as written by btmon: a header then records whose
+// flags carry the monitor frame's index and opcode
+#define BTSNOOP_DATALINK_MONITOR 2001
+#define BTSNOOP_EPOCH_DELTA      0x00dcddb30f2f8000ULL
+
+/*
+ * A frame in the ring, followed by its payload. Records are 8 bytes
+ * aligned and never wrap: the end of the ring is skipped with a padding
+ * record when a frame doesn't fit.
+ *     - size: bytes taken in the ring, payload and alignment included.
+ *     - opcode: monitor opcode, CAPTURE_PADDING for padding records.
+ *     - index: device ID.
+ *     - length: original payload length.
+ *     - included: payload bytes kept.
+ *     - drops: frames dropped so far, by the kernel or the ring.
+ *     - timestamp: microseconds since the epoch.
+ */
+struct capture_record
+{
+    uint32_t size;
+    uint16_t opcode;
+    uint16_t index;
+    uint32_t length;
+    uint32_t included;
+    uint32_t drops;
+    uint32_t reserved;
+    uint64_t timestamp;
+};
+
+static_assert(sizeof(struct capture_record) == 32, "Unexpected capture record layout");
+
+#define CAPTURE_RECORD_MAX CAPTURE_ALIGN(sizeof(struct capture_record) + HCI_CAPTURE_SNAPLEN)
+
+struct btsnoop_header
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t datalink;
+} __attribute__ ((packed));
+
+struct btsnoop_record
+{
+    uint32_t length;
+    uint32_t included;
+    uint32_t flags;
+    uint32_t drops;
+    uint64_t timestamp;
+} __attribute__ ((packed));
+
+/*
+ * Read the receive time and the kernel drop counter of a frame.
+ * Params:
+ *     - message: received message.
+ *     - timestamp: set to microseconds since the epoch.
+ *     - kernel_drops: set to the frames dropped by the kernel so far, when
+ *       reported.
+ */
+static void capture_control(struct msghdr *message, uint64_t *timestamp, uint32_t *kernel_drops)
+{
+    struct timespec now;
+
+    *timestamp = 0;
+
+    for (struct cmsghdr *control = CMSG_FIRSTHDR(message); control; control = CMSG_NXTHDR(message, control))
+    {
+        if (control->cmsg_level != SOL_SOCKET)
+            continue;
+
+        if (control->cmsg_type == SO_TIMESTAMP)
+        {
+            struct timeval time;
+
+            memcpy(&time, CMSG_DATA(control), sizeof(time));
+            *timestamp = time.tv_sec * 1000000ULL + time.tv_usec;
+        }
+        else if (control->cmsg_type == SO_RXQ_OVFL)
+            memcpy(kernel_drops, CMSG_DATA(control), sizeof(*kernel_drops));
+    }
+
+    if (!*timestamp)
+    {
+        clock_gettime(CLOCK_REALTIME, &now);
+        *timestamp = now.tv_sec * 1000000ULL + now.tv_nsec / 1000;
+    }
+}
+
+/*
+ * Read frames into the ring until stopped. Frames are received in place,
+ * after their record header; nothing is allocated.
+ * Params:
+ *     - capture: capture.
+ */
+static void capture_reader(struct hci_capture *capture)
+{
+    size_t size = capture->options.ring_bytes;
+    uint8_t discard[HCI_CAPTURE_SNAPLEN];
+    union
+    {
+        struct cmsghdr align;
+        uint8_t buffer[CMSG_SPACE(sizeof(struct timeval)) + CMSG_SPACE(sizeof(uint32_t))];
+    } control;
+    struct hci_monitor_header header;
+    struct iovec iov[2];
+    struct msghdr message;
+    uint32_t kernel_drops = 0;
+
+    while (capture->running.load(std::memory_order_relaxed))
+    {
+        uint64_t head = capture->head.load(std::memory_order_relaxed);
+        uint64_t used = head - capture->tail.load(std::memory_order_acquire);
+        size_t offset = head % size;
+        struct capture_record *record = (struct capture_record *)(capture->ring + offset);
+        bool full;
+
+        if (size - offset < CAPTURE_RECORD_MAX)
+        {
+            // Skip the end of the ring once the writer is past it
+            if (size - used >= size - offset)
+            {
+                record->size = size - offset;
+                record->opcode = CAPTURE_PADDING;
+                capture->head.store(head + record->size, std::memory_order_release);
+                continue;
+            }
+
+            full = true;
+        }
+        else
+            full = size - used < CAPTURE_RECORD_MAX;
+
+        iov[0].iov_base = &header;
+        iov[0].iov_len = sizeof(header);
+        iov[1].iov_base = full ? discard : (uint8_t *)(record + 1);
+        iov[1].iov_len = HCI_CAPTURE_SNAPLEN;
+
+        memset(&message, 0, sizeof(message));
+        message.msg_iov = iov;
+        message.msg_iovlen = 2;
+        message.msg_control = control.buffer;
+        message.msg_controllen = sizeof(control.buffer);
+
+        ssize_t length = recvmsg(capture->descriptor, &message, MSG_TRUNC);
+
+        if (length < 0)
+        {
+            // Timed out: check whether the capture is stopped
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+                continue;
+            break;
+        }
+
+        if (length == 0)
+            break;
+
+        if ((size_t)length < sizeof(header))
+            continue;
+
+        uint64_t timestamp;
+
+        capture_control(&message, &timestamp, &kernel_drops);
+        capture->counters[HCI_CAPTURE_KERNEL_DROPS].store(kernel_drops, std::memory_order_relaxed);
+
+        uint16_t index = btohs(header.index);
+
+        if (index != HCI_DEV_NONE && (index >= 32 || !(capture->options.devices & (1U << index))))
+        {
+            capture->counters[HCI_CAPTURE_FILTERED].fetch_add(1, std::memory_order_relaxed);
+            continue;
+        }
+
+        if (full)
+        {
+            capture->counters[HCI_CAPTURE_RING_DROPS].fetch_add(1, std::memory_order_relaxed);
+            capture->wake.notify_one();
+            continue;
+        }
+
+        size_t payload = length - sizeof(header);
+
+        if (payload > HCI_CAPTURE_SNAPLEN)
+            capture->counters[HCI_CAPTURE_TRUNCATED].fetch_add(1, std::memory_order_relaxed);
+
+        record->opcode = btohs(header.opcode);
+        record->index = index;
+        record->length = payload;
+        record->included = payload > HCI_CAPTURE_SNAPLEN ? HCI_CAPTURE_SNAPLEN : payload;
+        record->drops = kernel_drops + capture->counters[HCI_CAPTURE_RING_DROPS].load(std::memory_order_relaxed);
+        record->timestamp = timestamp;
+        record->size = CAPTURE_ALIGN(sizeof(*record) + record->included);
+
+        // Publish the record
+        capture->head.store(head + record->size, std::memory_order_release);
+
+        // The writer polls anyway; only hurry it when the ring fills up
+        if (used + record->size > size / 2)
+            capture->wake.notify_one();
+    }
+}
+
+/*
+ * Open the current file, truncated, and start it with the btsnoop header.
+ * Params:
+ *     - capture: capture.
+ * Return value: the descriptor, or -1 on failure.
+ */
+static int capture_open_file(struct hci_capture *capture)
+{
+    struct btsnoop_header header = { { 'b', 't', 's', 'n', 'o', 'o', 'p', '\0' }, htobe32(1),
+                                     htobe32(BTSNOOP_DATALINK_MONITOR) };
+
+    capture->file = open(capture->options.path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    capture->file_bytes = 0;
+
+    if (capture->file < 0)
+        return -1;
+
+    memcpy(capture->output, &header, sizeof(header));
+    capture->output_length = sizeof(header);
+    capture->file_bytes = sizeof(header);
+    capture->counters[HCI_CAPTURE_FILES].fetch_add(1, std::memory_order_relaxed);
+
+    return capture->file;
+}
+
+/*
+ * Write the output buffer to the current file. Frames which can't be
+ * written are counted as write errors and dropped.
+ * Params:
+ *     - capture: capture.
+ */
+static void capture_flush(struct hci_capture *capture)
+{
+    size_t written = 0;
+
+    while (capture->file >= 0 && written < capture->output_length)
+    {
+        ssize_t result = write(capture->file, capture->output + written, capture->output_length - written);
+
+        if (result < 0 && errno == EINTR)
+            continue;
+        if (result <= 0)
+            break;
+
+        written += result;
+    }
+
+    if (written < capture->output_length)
+        capture->counters[HCI_CAPTURE_WRITE_ERRORS].fetch_add(capture->output_records, std::memory_order_relaxed);
+
+    capture->output_length = 0;
+    capture->output_records = 0;
+}
+
+/*
+ * Close the current file, shift the older ones (path -> path.1 ->
+ * path.2...) and open a new one.
+ * Params:
+ *     - capture: capture.
+ */
+static void capture_rotate(struct hci_capture *capture)
+{
+    char from[PATH_MAX + 16];
+    char to[PATH_MAX + 16];
+
+    capture_flush(capture);
+
+    if (capture->file >= 0)
+        close(capture->file);
+
+    for (int i = capture->options.max_files - 1; i > 0; i--)
+    {
+        if (i == 1)
+            snprintf(from, sizeof(from), "%s", capture->options.path);
+        else
+            snprintf(from, sizeof(from), "%s.%d", capture->options.path, i - 1);
+        snprintf(to, sizeof(to), "%s.%d", capture->options.path, i);
+
+        rename(from, to);
+    }
+
+    capture_open_file(capture);
+}
+
+/*
+ * Append a frame to the output buffer as a btsnoop record.
+ * Params:
+ *     - capture: capture.
+ *     - record: frame.
+ */
+static void capture_write(struct hci_capture *capture, struct capture_record const *record)
+{
+    struct btsnoop_record header;
+    size_t length = sizeof(header) + record->included;
+
+    if (capture->file < 0)
+        capture_open_file(capture);
+    else if (capture->file_bytes + length > capture->options.max_bytes)
+        capture_rotate(capture);
+
+    if (capture->file < 0)
+    {
+        capture->counters[HCI_CAPTURE_WRITE_ERRORS].fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+
+    if (capture->output_length + length > CAPTURE_OUTPUT_SIZE)
+        capture_flush(capture);
+
+    header.length = htobe32(record->length);
+    header.included = htobe32(record->included);
+    header.flags = htobe32((uint32_t)record->index << 16 | record->opcode);
+    header.drops = htobe32(record->drops);
+    header.timestamp = htobe64(record->timestamp + BTSNOOP_EPOCH_DELTA);
+
+    memcpy(capture->output + capture->output_length, &header, sizeof(header));
+    memcpy(capture->output + capture->output_length + sizeof(header), record + 1, record->included);
+    capture->output_length += length;
+    capture->output_records++;
+    capture->file_bytes += length;
+
+    capture->counters[HCI_CAPTURE_PACKETS].fetch_add(1, std::memory_order_relaxed);
+    capture->counters[HCI_CAPTURE_BYTES].fetch_add(record->length, std::memory_order_relaxed);
+}
+
+/*
+ * Write the frames of the ring to files until stopped, then write what is
+ * left.
+ * Params:
+ *     - capture: capture.
+ */
+static void capture_writer(struct hci_capture *capture)
+{
+    size_t size = capture->options.ring_bytes;
+    std::unique_lock<std::mutex> guard(capture->lock);
+
+    for (;;)
+    {
+        bool writing = capture->writing;
+
+        guard.unlock();
+
+        uint64_t tail = capture->tail.load(std::memory_order_relaxed);
+        uint64_t head = capture->head.load(std::memory_order_acquire);
+
+        while (tail != head)
+        {
+            struct capture_record *record = (struct capture_record *)(capture->ring + tail % size);
+
+            if (record->opcode != CAPTURE_PADDING)
+                capture_write(capture, record);
+
+            // Hand the space back to the reader as soon as possible
+            tail += record->size;
+            capture->tail.store(tail, std::memory_order_release);
+        }
+
+        capture_flush(capture);
+
+        guard.lock();
+
+        if (!writing)
+            break;
+
+        capture->wake.wait_for(guard, std::chrono::milliseconds(CAPTURE_POLL_MS));
+    }
+}
+
+/*
+ * Start capturing the monitor channel into btsnoop files.
+ * Params:
+ *     - capture: capture to start.
+ *     - options: devices, files and ring size.
+ *     - error: details about the failed step.
+ * Return values:
+ *     - EXIT_FAILURE: on failure.
+ *     - EXIT_SUCCESS: on success.
+ */
+int hci_capture_start(struct hci_capture *capture, struct hci_capture_options const *options,
+                      struct hci_error *error)
+{
+    struct timeval timeout = { 0, CAPTURE_POLL_MS * 1000 };
+    size_t page = sysconf(_SC_PAGESIZE);
+    int enable = 1;
+
+    for (int i = 0; i < HCI_CAPTURE_COUNTERS; i++)
+        capture->counters[i] = 0;
+
+    if (!options->path[0] || options->max_files < 1 || options->ring_bytes < 4 * CAPTURE_RECORD_MAX ||
+        options->max_bytes < sizeof(struct btsnoop_header) + sizeof(struct btsnoop_record) + HCI_CAPTURE_SNAPLEN)
+        return hci_set_error(error, EINVAL, "capture");
+
+    capture->options = *options;
+    capture->options.ring_bytes = (options->ring_bytes + page - 1) / page * page;
+    capture->memory_size = capture->options.ring_bytes + CAPTURE_OUTPUT_SIZE;
+    capture->memory = (uint8_t *)mmap(NULL, capture->memory_size, PROT_READ | PROT_WRITE,
+                                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if (capture->memory == MAP_FAILED)
+        return hci_set_error(error, errno, "mmap");
+
+    capture->ring = capture->memory;
+    capture->output = capture->memory + capture->options.ring_bytes;
+    capture->output_length = 0;
+    capture->output_records = 0;
+    capture->head = 0;
+    capture->tail = 0;
+
+    if ((capture->descriptor = hci_backend_get()->open_monitor(error)) < 0)
+    {
+        munmap(capture->memory, capture->memory_size);
+        return EXIT_FAILURE;
+    }
+
+    // Timestamps and drop counters come with the frames; the timeout lets
+    // the reader notice a stop
+    setsockopt(capture->descriptor, SOL_SOCKET, SO_TIMESTAMP, &enable, sizeof(enable));
+    setsockopt(capture->descriptor, SOL_SOCKET, SO_RXQ_OVFL, &enable, sizeof(enable));
+    setsockopt(capture->descriptor, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    if (capture_open_file(capture) < 0)
+    {
+        hci_set_error(error, errno, "open");
+        close(capture->descriptor);
+        munmap(capture->memory, capture->memory_size);
+        return EXIT_FAILURE;
+    }
+
+    capture->running = true;
+    capture->writing = true;
+    capture->reader = std::thread(capture_reader, capture);
+    capture->writer = std::thread(capture_writer, capture);
+
+    return EXIT_SUCCESS;
+}
+
+/*
+ * Stop a capture: wait for the reader, then for the writer to write what
+ * was read.
+ * Params:
+ *     - capture: capture to stop.
+ */
+void hci_capture_stop(struct hci_capture *capture)
+{
+    if (!capture->running.exchange(false))
+        return;
+
+    capture->reader.join();
+
+    {
+        std::lock_guard<std::mutex> guard(capture->lock);
+        capture->writing = false;
+    }
+
+    capture->wake.notify_one();
+    capture->writer.join();
+
+    close(capture->descriptor);
+    if (capture->file >= 0)
+        close(capture->file);
+    munmap(capture->memory, capture->memory_size);
+}
+
+/*
+ * Read the counters of a capture, running or stopped.
+ * Params:
+ *     - capture: capture.
+ *     - stats: set to its counters.
+ */
+void hci_capture_stats(struct hci_capture *capture, struct hci_capture_stats *stats)
+{
+    uint64_t *counters = (uint64_t *)stats;
+
+    for (int i = 0; i < HCI_CAPTURE_COUNTERS; i++)
+        counters[i] = capture->counters[i].load(std::memory_order_relaxed);
+}
@@ -0,0 +1,110 @@
+#pragma once
+
+#include <limits.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+#include "hci_core.hpp"
+
+/*
+ * Counters of a capture.
+ *     - packets, bytes: frames written to files.
+ *     - filtered: frames of devices which aren't captured.
+ *     - kernel_drops: frames the kernel dropped because the socket was full.
+ *     - ring_drops: frames dropped because the ring was full.
+ *     - truncated: frames longer than HCI_CAPTURE_SNAPLEN, cut.
+ *     - write_errors: failed writes, the frames are lost.
+ *     - files: files opened so far.
+ */
+struct hci_capture_stats
+{
+    uint64_t packets;
+    uint64_t bytes;
+    uint64_t filtered;
+    uint64_t kernel_drops;
+    uint64_t ring_drops;
+    uint64_t truncated;
+    uint64_t write_errors;
+    uint64_t files;
+};
+
+/*
+ * Indexes of the counters of a capture, in the order of
+ * struct hci_capture_stats.
+ */
+enum
+{
+    HCI_CAPTURE_PACKETS,
+    HCI_CAPTURE_BYTES,
+    HCI_CAPTURE_FILTERED,
+    HCI_CAPTURE_KERNEL_DROPS,
+    HCI_CAPTURE_RING_DROPS,
+    HCI_CAPTURE_TRUNCATED,
+    HCI_CAPTURE_WRITE_ERRORS,
+    HCI_CAPTURE_FILES,
+    HCI_CAPTURE_COUNTERS
+};
+
+/*
+ * Options of a capture.
+ *     - devices: mask of the dev_ids to capture, bit n for hciN; frames
+ *       about no device are always kept.
+ *     - path: current file; older ones are renamed path.1, path.2...
+ *     - max_bytes: size of a file before it is rotated.
+ *     - max_files: number of files kept, including the current one.
+ *     - ring_bytes: size of the ring between the reader and the writer.
+ */
+struct hci_capture_options
+{
+    uint32_t devices;
+    char path[PATH_MAX];
+    uint64_t max_bytes;
+    int max_files;
+    size_t ring_bytes;
+};
+
+/*
+ * Longest frame payload kept, like a snaplen.
+ */
+#define HCI_CAPTURE_SNAPLEN 4096
+
+/*
+ * A capture of the monitor channel: a reader thread copies frames into an
+ * mmap'd ring, a writer thread appends them to btsnoop files.
+ *     - running: the reader reads frames.
+ *     - writing: the writer writes frames, cleared once the reader stopped
+ *       so that nothing read is lost.
+ *     - head: bytes written to the ring so far, only updated by the reader.
+ *     - tail: bytes consumed so far, only updated by the writer.
+ */
+struct hci_capture
+{
+    std::thread reader;
+    std::thread writer;
+    std::mutex lock;
+    std::condition_variable wake;
+    std::atomic<bool> running;
+    bool writing;
+    struct hci_capture_options options;
+    int descriptor;
+    int file;
+    uint64_t file_bytes;
+    uint8_t *memory;
+    size_t memory_size;
+    uint8_t *ring;
+    uint8_t *output;
+    size_t output_length;
+    uint32_t output_records;
+    std::atomic<uint64_t> head;
+    std::atomic<uint64_t> tail;
+    std::atomic<uint64_t> counters[HCI_CAPTURE_COUNTERS];
+};
+
+int hci_capture_start(struct hci_capture *capture, struct hci_capture_options const *options,
+                      struct hci_error *error);
+void hci_capture_stop(struct hci_capture *capture);
+void hci_capture_stats(struct hci_capture *capture, struct hci_capture_stats *stats);
@@ -0,0 +1,161 @@
+#include <limits.h>
+#include <string.h>
+
+#include <bluetooth/bluetooth.h>
+#include <bluetooth/hci.h>
+
+#include <nan.h>
+
+#include "hci.hpp"
+#include "hci_capture.hpp"
+
+/*
+ * A capture owned by javascript.
+ */
+class HciCapture : public Nan::ObjectWrap
+{
+public:
+    static void Init(v8::Local<v8::Object> exports);
+
+private:
+    struct hci_capture capture;
+
+    HciCapture() { capture.running = false; }
+    ~HciCapture()
+    {
+        node::RemoveEnvironmentCleanupHook(v8::Isolate::GetCurrent(), Cleanup, this);
+        hci_capture_stop(&capture);
+    }
+
+    static void Cleanup(void *arg);
+    static void New(const Nan::FunctionCallbackInfo<v8::Value>& info);
+    static void Stop(const Nan::FunctionCallbackInfo<v8::Value>& info);
+    static void Stats(const Nan::FunctionCallbackInfo<v8::Value>& info);
+};
+
+/*
+ * Stop a capture when its environment goes away. What was read is still
+ * written.
+ * Params:
+ *     - arg: the capture.
+ */
+void HciCapture::Cleanup(void *arg)
+{
+    hci_capture_stop(&((HciCapture *)arg)->capture);
+}
+
+/*
+ * Create and start a capture.
+ * Params:
+ *     - info: Contains the path of the file, its maximum size in bytes, the
+ *       number of files kept, the mask of the captured devices and the size
+ *       of the ring in bytes.
+ */
+void HciCapture::New(const Nan::FunctionCallbackInfo<v8::Value>& info)
+{
+    struct hci_capture_options options;
+    struct hci_error error;
+
+    if (!info.IsConstructCall())
+    {
+        Nan::ThrowTypeError("Use new");
+        return;
+    }
+
+    if (!info[0]->IsString() || !info[1]->IsNumber() || !info[2]->IsNumber() ||
+        !info[3]->IsNumber() || !info[4]->IsNumber())
+    {
+        Nan::ThrowTypeError("1st argument should be a string and the next ones numbers");
+        return;
+    }
+
+    Nan::Utf8String path(info[0]);
+
+    if (path.length() <= 0 || path.length() >= PATH_MAX)
+    {
+        Nan::ThrowTypeError("Invalid path");
+        return;
+    }
+
+    memcpy(options.path, *path, path.length() + 1);
+    options.max_bytes = Nan::To<int64_t>(info[1]).FromJust();
+    options.max_files = Nan::To<int32_t>(info[2]).FromJust();
+    options.devices = Nan::To<uint32_t>(info[3]).FromJust();
+    options.ring_bytes = Nan::To<int64_t>(info[4]).FromJust();
+
+    HciCapture *obj = new HciCapture();
+
+    obj->Wrap(info.This());
+    node::AddEnvironmentCleanupHook(info.GetIsolate(), Cleanup, obj);
+
+    if (hci_capture_start(&obj->capture, &options, &error) != EXIT_SUCCESS)
+    {
+        v8::Isolate::GetCurrent()->ThrowException(hci_error_to_js(-1, &error));
+        return;
+    }
+
+    info.GetReturnValue().Set(info.This());
+}
+
+/*
+ * Stop a capture, once what was read is written.
+ * Params:
+ *     - info: Contains arguments and a return value.
+ */
+void HciCapture::Stop(const Nan::FunctionCallbackInfo<v8::Value>& info)
+{
+    hci_capture_stop(&Nan::ObjectWrap::Unwrap<HciCapture>(info.Holder())->capture);
+}
+
+/*
+ * Get the counters of a capture.
+ * Params:
+ *     - info: Contains arguments and a return value.
+ */
+void HciCapture::Stats(const Nan::FunctionCallbackInfo<v8::Value>& info)
+{
+    struct hci_capture_stats stats;
+    v8::Local<v8::Object> result = Nan::New<v8::Object>();
+
+    hci_capture_stats(&Nan::ObjectWrap::Unwrap<HciCapture>(info.Holder())->capture, &stats);
+
+    Nan::Set(result, Nan::New("packets").ToLocalChecked(), Nan::New<v8::Number>(stats.packets));
+    Nan::Set(result, Nan::New("bytes").ToLocalChecked(), Nan::New<v8::Number>(stats.bytes));
+    Nan::Set(result, Nan::New("filtered").ToLocalChecked(), Nan::New<v8::Number>(stats.filtered));
+    Nan::Set(result, Nan::New("kernelDrops").ToLocalChecked(), Nan::New<v8::Number>(stats.kernel_drops));
+    Nan::Set(result, Nan::New("ringDrops").ToLocalChecked(), Nan::New<v8::Number>(stats.ring_drops));
+    Nan::Set(result, Nan::New("truncated").ToLocalChecked(), Nan::New<v8::Number>(stats.truncated));
+    Nan::Set(result, Nan::New("writeErrors").ToLocalChecked(), Nan::New<v8::Number>(stats.write_errors));
+    Nan::Set(result, Nan::New("files").ToLocalChecked(), Nan::New<v8::Number>(stats.files));
+
+    info.GetReturnValue().Set(result);
+}
+
+/*
+ * Register the HciCapture class.
+ * Params:
+ *     - exports: module exports.
+ */
+void HciCapture::Init(v8::Local<v8::Object> exports)
+{
+    v8::Local<v8::FunctionTemplate> tpl = Nan::New<v8::FunctionTemplate>(New);
+
+    tpl->SetClassName(Nan::New("HciCapture").ToLocalChecked());
+    tpl->InstanceTemplate()->SetInternalFieldCount(1);
+
+    Nan::SetPrototypeMethod(tpl, "stop", Stop);
+    Nan::SetPrototypeMethod(tpl, "stats", Stats);
+
+    Nan::Set(exports, Nan::New("HciCapture").ToLocalChecked(),
+             Nan::GetFunction(tpl).ToLocalChecked());
+}
+
+/*
+ * Register the capture bindings.
+ * Params:
+ *     - exports: module exports.
+ */
+void HCI_capture_init(v8::Local<v8::Object> exports)
+{
+    HciCapture::Init(exports);
+}
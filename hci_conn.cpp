@@ -0,0 +1,163 @@
+#include <errno.h>
+#include <string.h>
+
+#include <bluetooth/bluetooth.h>
+#include <bluetooth/hci.h>
+#include <bluetooth/hci_lib.h>
+
+#include "hci_backend.hpp"
+#include "hci_conn.hpp"
+#include "hci_engine.hpp"
+#include "hci_pool.hpp"
+
+// Connections whose reads are sent in one engine run
+#define CONN_BATCH 16
+
+/*
+ * Read the connections of an adapter.
+ * Params:
+ *     - device_id: device ID.
+ *     - connections: array of HCI_CONN_MAX entries receiving the
+ *       connections, without link quality values.
+ *     - count: number of filled entries.
+ *     - error: details about the failed step.
+ * Return values:
+ *     - EXIT_FAILURE: on failure.
+ *     - EXIT_SUCCESS: on success.
+ */
+int hci_connections(int device_id, struct hci_connection *connections, int *count, struct hci_error *error)
+{
+    unsigned char buffer[sizeof(struct hci_conn_list_req) + HCI_CONN_MAX * sizeof(struct hci_conn_info)];
+    struct hci_conn_list_req *connections_list = (struct hci_conn_list_req *)buffer;
+    int hci_socket;
+
+    *count = 0;
+
+    if ((hci_socket = hci_pool_control_acquire(error)) < 0)
+        return EXIT_FAILURE;
+
+    connections_list->dev_id = device_id;
+    connections_list->conn_num = HCI_CONN_MAX;
+
+    if (hci_backend_ioctl(hci_socket, HCIGETCONNLIST, (void *)connections_list) < 0)
+    {
+        hci_set_error(error, errno, "HCIGETCONNLIST");
+        hci_pool_control_release(hci_socket);
+        return EXIT_FAILURE;
+    }
+
+    hci_pool_control_release(hci_socket);
+
+    for (int i = 0; i < connections_list->conn_num; i++)
+    {
+        memset(&connections[i], 0, sizeof(connections[i]));
+        connections[i].info = connections_list->conn_info[i];
+    }
+
+    *count = connections_list->conn_num;
+
+    return EXIT_SUCCESS;
+}
+
+/*
+ * Read the link quality values of connections: RSSI, link quality and
+ * current TX power of each ACL or LE link (link quality is BR/EDR only),
+ * pipelined on the adapter's command engine rather than one round trip
+ * each. A value whose read fails is left out of `valid`.
+ * Params:
+ *     - device_id: device ID.
+ *     - connections, count: connections returned by hci_connections().
+ *     - error: details about the failed step.
+ * Return values:
+ *     - EXIT_FAILURE: the adapter couldn't be used.
+ *     - EXIT_SUCCESS: on success, even when reads failed.
+ */
+int hci_connections_quality(int device_id, struct hci_connection *connections, int count,
+                            struct hci_error *error)
+{
+    struct hci_command commands[CONN_BATCH * 3];
+    uint16_t handles[CONN_BATCH];
+    read_transmit_power_level_cp power[CONN_BATCH];
+    uint8_t responses[CONN_BATCH * 3][4];
+    uint8_t kinds[CONN_BATCH * 3];
+    struct hci_connection *owners[CONN_BATCH * 3];
+    struct hci_engine engine;
+
+    if (hci_engine_open(&engine, device_id, error) != EXIT_SUCCESS)
+        return EXIT_FAILURE;
+
+    for (int first = 0; first < count; first += CONN_BATCH)
+    {
+        int last = first + CONN_BATCH < count ? first + CONN_BATCH : count;
+        int used = 0, code = 0;
+
+        for (int i = first; i < last; i++)
+        {
+            struct hci_connection *connection = &connections[i];
+            int slot = i - first;
+
+            connection->valid = 0;
+            if (connection->info.type != ACL_LINK && connection->info.type != LE_LINK)
+                continue;
+
+            handles[slot] = htobs(connection->info.handle);
+            power[slot].handle = htobs(connection->info.handle);
+            power[slot].type = 0x00; // Current level
+
+            hci_command_init(&commands[used], OGF_STATUS_PARAM, OCF_READ_RSSI, &handles[slot], 2, 1000);
+            kinds[used] = HCI_CONN_RSSI;
+            owners[used++] = connection;
+
+            if (connection->info.type == ACL_LINK)
+            {
+                hci_command_init(&commands[used], OGF_STATUS_PARAM, OCF_READ_LINK_QUALITY, &handles[slot], 2, 1000);
+                kinds[used] = HCI_CONN_LINK_QUALITY;
+                owners[used++] = connection;
+            }
+
+            hci_command_init(&commands[used], OGF_HOST_CTL, OCF_READ_TRANSMIT_POWER_LEVEL,
+                             &power[slot], READ_TRANSMIT_POWER_LEVEL_CP_SIZE, 1000);
+            kinds[used] = HCI_CONN_TX_POWER;
+            owners[used++] = connection;
+        }
+
+        for (int i = 0; i < used; i++)
+        {
+            commands[i].response = responses[i];
+            commands[i].rsize = sizeof(responses[i]);
+        }
+
+        // Error statuses only fail their own read
+        if (used > 0 && hci_engine_run(&engine, commands, used) != EXIT_SUCCESS)
+            code = errno;
+
+        for (int i = 0; i < used; i++)
+        {
+            struct hci_connection *connection = owners[i];
+            int8_t value = (int8_t)responses[i][3];
+
+            if (commands[i].result || commands[i].rlen < 4 || responses[i][0] ||
+                (responses[i][1] | responses[i][2] << 8) != connection->info.handle)
+                continue;
+
+            connection->valid |= kinds[i];
+            if (kinds[i] == HCI_CONN_RSSI)
+                connection->rssi = value;
+            else if (kinds[i] == HCI_CONN_LINK_QUALITY)
+                connection->link_quality = (uint8_t)value;
+            else
+                connection->tx_power = value;
+        }
+
+        // The adapter is down, went away or wedged: the others would fail too
+        if (code)
+        {
+            hci_engine_close(&engine, code);
+            return hci_set_error(error, code, "read_link_quality");
+        }
+    }
+
+    hci_engine_close(&engine, 0);
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "hci_core.hpp"
+
+/*
+ * Most connections read from an adapter.
+ */
+#define HCI_CONN_MAX 128
+
+/*
+ * Link quality values read, in hci_connection.valid.
+ */
+#define HCI_CONN_RSSI         0x01
+#define HCI_CONN_LINK_QUALITY 0x02
+#define HCI_CONN_TX_POWER     0x04
+
+/*
+ * A connection of an adapter.
+ *     - info: as listed by HCIGETCONNLIST.
+ *     - valid: HCI_CONN_* values read; reads fail e.g. on SCO links or
+ *       link quality on LE links.
+ *     - rssi, tx_power: in dBm.
+ *     - link_quality: 0 to 255, vendor defined.
+ */
+struct hci_connection
+{
+    struct hci_conn_info info;
+    uint8_t valid;
+    int8_t rssi;
+    uint8_t link_quality;
+    int8_t tx_power;
+};
+
+int hci_connections(int device_id, struct hci_connection *connections, int *count, struct hci_error *error);
+int hci_connections_quality(int device_id, struct hci_connection *connections, int count,
+                            struct hci_error *error);
@@ -0,0 +1,186 @@
+#include <stdlib.h>
+
+#include <bluetooth/bluetooth.h>
+#include <bluetooth/hci.h>
+
+#include <nan.h>
+
+#include "hci.hpp"
+#include "hci_conn.hpp"
+#include "hci_queue.hpp"
+#include "hci_raw.hpp"
+
+/*
+ * Read the connections of an adapter, and their link quality values if
+ * asked. Must run on the device's executor lane.
+ * Params:
+ *     - device_id: device ID.
+ *     - quality: read RSSI, link quality and TX power.
+ *     - connections: array of HCI_CONN_MAX entries.
+ *     - count: number of filled entries.
+ *     - error: details about the failed step.
+ * Return values:
+ *     - EXIT_FAILURE: on failure.
+ *     - EXIT_SUCCESS: on success.
+ */
+static int read_connections(int device_id, bool quality, struct hci_connection *connections, int *count,
+                            struct hci_error *error)
+{
+    if (hci_connections(device_id, connections, count, error) != EXIT_SUCCESS)
+        return EXIT_FAILURE;
+
+    if (quality && *count > 0)
+        return hci_connections_quality(device_id, connections, *count, error);
+
+    return EXIT_SUCCESS;
+}
+
+/*
+ * Build the buffer returned by connections().
+ * Params:
+ *     - device_id: device ID.
+ *     - connections, count: connections read.
+ */
+static v8::Local<v8::Object> connections_buffer(int device_id, struct hci_connection *connections, int count)
+{
+    v8::Local<v8::Object> buffer = Nan::NewBuffer(hci_raw_connections_size(count)).ToLocalChecked();
+
+    hci_raw_connections_pack(device_id, connections, count, (unsigned char *)node::Buffer::Data(buffer));
+
+    return buffer;
+}
+
+/*
+ * Read the quality option.
+ * Params:
+ *     - value: undefined or { quality }.
+ *     - quality: receives the option.
+ * Return values:
+ *     - false: the value isn't an options object.
+ *     - true: on success.
+ */
+static bool connections_options(v8::Local<v8::Value> value, bool *quality)
+{
+    *quality = false;
+
+    if (value->IsUndefined() || value->IsNull())
+        return true;
+
+    if (!value->IsObject())
+        return false;
+
+    v8::Local<v8::Value> option = Nan::Get(value.As<v8::Object>(), Nan::New("quality").ToLocalChecked())
+        .ToLocalChecked();
+
+    *quality = Nan::To<bool>(option).FromJust();
+
+    return true;
+}
+
+/*
+ * A wrapper to read the connections of an adapter.
+ * Params:
+ *     - info: Contains a device ID, options { quality } and a return value:
+ *       packed records (see hci_raw.hpp).
+ */
+static void HCI_connections(const Nan::FunctionCallbackInfo<v8::Value>& info)
+{
+    struct hci_connection connections[HCI_CONN_MAX];
+    struct hci_error error;
+    bool quality;
+    int count;
+
+    if (!info[0]->IsUint32() || !connections_options(info[1], &quality))
+    {
+        Nan::ThrowTypeError("Arguments should be a device id and optional options");
+        return;
+    }
+
+    int device_id;
+
+    if (!hci_device_id_arg(info[0], &device_id) || !hci_device_trylock(device_id))
+        return;
+
+    int status = read_connections(device_id, quality, connections, &count, &error);
+    hci_executor_unlock(device_id);
+
+    if (status != EXIT_SUCCESS)
+    {
+        v8::Isolate::GetCurrent()->ThrowException(hci_error_to_js(device_id, &error));
+        return;
+    }
+
+    info.GetReturnValue().Set(connections_buffer(device_id, connections, count));
+}
+
+/*
+ * Read the connections of an adapter on the device's executor lane.
+ */
+class ConnectionsWorker : public DeviceWorker
+{
+public:
+    ConnectionsWorker(Nan::Callback *callback, int device_id, bool quality)
+        : DeviceWorker(callback, "btim:connections", device_id), quality(quality), count(0) {}
+
+    void Execute()
+    {
+        if (read_connections(device_id, quality, connections, &count, &error) != EXIT_SUCCESS)
+            SetErrorMessage(error.step);
+    }
+
+protected:
+    /*
+     * Return value: packed records, without timings.
+     */
+    v8::Local<v8::Object> Result()
+    {
+        return connections_buffer(device_id, connections, count);
+    }
+
+private:
+    bool quality;
+    int count;
+    struct hci_connection connections[HCI_CONN_MAX];
+};
+
+/*
+ * A wrapper to read the connections of an adapter without blocking the
+ * event loop.
+ * Params:
+ *     - info: Contains a device ID, options { quality } and a
+ *       callback(error, buffer).
+ */
+static void HCI_connections_async(const Nan::FunctionCallbackInfo<v8::Value>& info)
+{
+    bool quality;
+
+    if (!info[0]->IsUint32() || !connections_options(info[1], &quality) || !info[2]->IsFunction())
+    {
+        Nan::ThrowTypeError("Arguments should be a device id, optional options and a callback");
+        return;
+    }
+
+    int device_id;
+
+    if (!hci_device_id_arg(info[0], &device_id))
+        return;
+
+    Nan::Callback *callback = new Nan::Callback(info[2].As<v8::Function>());
+
+    hci_queue_worker(hci_instance_get(info), new ConnectionsWorker(callback, device_id, quality));
+}
+
+/*
+ * Register the connection functions.
+ * Params:
+ *     - exports: module exports.
+ *     - instance: instance completing the asynchronous reads.
+ */
+void HCI_conn_init(v8::Local<v8::Object> exports, v8::Local<v8::Value> instance)
+{
+    Nan::Set(exports, Nan::New("connections").ToLocalChecked(),
+             Nan::GetFunction(Nan::New<v8::FunctionTemplate>(HCI_connections)).ToLocalChecked());
+
+    Nan::Set(exports, Nan::New("connections_async").ToLocalChecked(),
+             Nan::GetFunction(Nan::New<v8::FunctionTemplate>(HCI_connections_async, instance)).ToLocalChecked());
+}
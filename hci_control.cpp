@@ -0,0 +1,223 @@
+#include <stdio.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <bluetooth/bluetooth.h>
+#include <bluetooth/hci.h>
+#include <bluetooth/hci_lib.h>
+
+#include "hci_backend.hpp"
+#include "hci_bdaddr.hpp"
+#include "hci_core.hpp"
+#include "hci_events.hpp"
+#include "hci_executor.hpp"
+#include "hci_picker.hpp"
+#include "hci_pool.hpp"
+
+/*
+ * Time list_devices() waits for the addresses of RAW devices being read.
+ * Those which take longer are listed with BDADDR_ANY meanwhile.
+ */
+#define RESOLVE_WAIT_NS 100000000ULL
+
+/*
+ * Tell whether a device is RAW and doesn't report its address.
+ * Params:
+ *     - device_info: info about a HCI device.
+ * Return value: true if its address needs to be read.
+ */
+static bool address_missing(struct hci_dev_info *device_info)
+{
+    return hci_test_bit(HCI_RAW, &device_info->flags) && !bacmp(&device_info->bdaddr, BDADDR_ANY);
+}
+
+/*
+ * Fill the addresses of RAW devices which don't report one, from the cache
+ * or else from their controllers. The reads run concurrently and are waited
+ * for RESOLVE_WAIT_NS at most: devices whose address isn't known by then
+ * keep BDADDR_ANY, and get it on a later call.
+ * Params:
+ *     - devices: infos about HCI devices, updated.
+ *     - count: number of devices.
+ */
+void hci_resolve_addresses(struct hci_dev_info *devices, int count)
+{
+    uint64_t deadline_ns = hci_monotonic_ns() + RESOLVE_WAIT_NS;
+    bool missing = false;
+    bdaddr_t bdaddr;
+
+    for (int i = 0; i < count && !missing; i++)
+        missing = address_missing(&devices[i]);
+
+    if (!missing)
+        return;
+
+    // Addresses may be stale when devices came and went unnoticed
+    hci_events_sync();
+
+    for (int i = 0; i < count; i++)
+    {
+        if (address_missing(&devices[i]))
+            hci_bdaddr_request(devices[i].dev_id);
+    }
+
+    for (int i = 0; i < count; i++)
+    {
+        if (address_missing(&devices[i]) && hci_bdaddr_resolve(devices[i].dev_id, &bdaddr, deadline_ns))
+            bacpy(&devices[i].bdaddr, &bdaddr);
+    }
+}
+
+/*
+ * Read infos about a single HCI interface.
+ * Params:
+ *     - device_id: id of the device.
+ *     - device_info: receives infos about the device.
+ *     - error: details about the failed step.
+ * Return values:
+ *     - EXIT_FAILURE: on failure.
+ *     - EXIT_SUCCESS: on success.
+ */
+int hci_device_info(int device_id, struct hci_dev_info *device_info, struct hci_error *error)
+{
+    int hci_socket;
+    int result;
+
+    if ((hci_socket = hci_pool_control_acquire(error)) < 0)
+        return EXIT_FAILURE;
+
+    device_info->dev_id = device_id;
+
+    if (hci_backend_ioctl(hci_socket, HCIGETDEVINFO, (void *)device_info) < 0)
+        result = hci_set_error(error, errno, "HCIGETDEVINFO");
+    else
+        result = EXIT_SUCCESS;
+
+    hci_pool_control_release(hci_socket);
+
+    return result;
+}
+
+/*
+ * Read infos about HCI interfaces.
+ * Params:
+ *     - devices: array of HCI_MAX_DEV entries receiving device infos.
+ *     - count: number of filled entries.
+ *     - options: devices to read and work to do, NULL for all of it.
+ *     - error: details about the failed step.
+ * Return values:
+ *     - EXIT_FAILURE: on failure.
+ *     - EXIT_SUCCESS: on success.
+ */
+int list_devices(struct hci_dev_info *devices, int *count, struct hci_list_options const *options,
+                 struct hci_error *error)
+{
+    unsigned char buffer[sizeof(struct hci_dev_list_req) + HCI_MAX_DEV * sizeof(struct hci_dev_req)];
+    struct hci_dev_list_req *devices_list = (struct hci_dev_list_req *)buffer;
+    struct hci_dev_req *dr;
+    bool resolve = !options || options->resolve_address;
+    int hci_socket;
+
+    *count = 0;
+
+    if ((hci_socket = hci_pool_control_acquire(error)) < 0)
+    {
+        perror("Can't open HCI socket.");
+        return EXIT_FAILURE;
+    }
+
+    // Requested devices: no need to enumerate, missing ones are skipped
+    if (options && options->ids)
+    {
+        for (int i = 0; i < options->id_count && *count < HCI_MAX_DEV; i++)
+        {
+            struct hci_dev_info *device_info = &devices[*count];
+
+            device_info->dev_id = options->ids[i];
+
+            if (hci_backend_ioctl(hci_socket, HCIGETDEVINFO, (void *)device_info) < 0)
+                continue;
+
+            (*count)++;
+        }
+    }
+    else
+    {
+        devices_list->dev_num = HCI_MAX_DEV;
+        dr = devices_list->dev_req;
+
+        if (hci_backend_ioctl(hci_socket, HCIGETDEVLIST, (void *)devices_list) < 0)
+        {
+            hci_set_error(error, errno, "HCIGETDEVLIST");
+            hci_pool_control_release(hci_socket);
+            perror("Can't get device list");
+            return EXIT_FAILURE;
+        }
+
+        hci_pool_prune(devices_list);
+
+        for (int i = 0; i < devices_list->dev_num; i++)
+        {
+            struct hci_dev_info *device_info = &devices[*count];
+
+            device_info->dev_id = (dr+i)->dev_id;
+
+            if (hci_backend_ioctl(hci_socket, HCIGETDEVINFO, (void *)device_info) < 0)
+                continue;
+
+            (*count)++;
+        }
+    }
+
+    // Resolving waits for controllers: not while holding the control socket
+    hci_pool_control_release(hci_socket);
+
+    if (resolve)
+        hci_resolve_addresses(devices, *count);
+
+    return EXIT_SUCCESS;
+}
+
+/*
+ * A helper function to bring HCI interafaces up or down.
+ * Params:
+ *     - device_id: device ID.
+ *     - status: true (up), false (down).
+ *     - error: details about the failed step.
+ * Return values:
+ *     - EXIT_FAILURE: on failure.
+ *     - EXIT_SUCCESS: on success.
+ */
+int hci_interface_up_down(int device_id, bool status, struct hci_error *error)
+{
+    int hci_socket;
+    int result;
+
+    if ((hci_socket = hci_pool_control_acquire(error)) < 0)
+    {
+        perror("Can't open HCI socket.");
+        return EXIT_FAILURE;
+    }
+
+    if (status)
+        result = hci_backend_ioctl(hci_socket, HCIDEVUP, (void *)(long)device_id);
+    else
+        result = hci_backend_ioctl(hci_socket, HCIDEVDOWN, (void *)(long)device_id);
+
+    // An interface which is already up is fine
+    if (result < 0 && !(status && errno == EALREADY))
+        hci_set_error(error, errno, status ? "HCIDEVUP" : "HCIDEVDOWN");
+    else
+        result = 0;
+
+    hci_pool_control_release(hci_socket);
+
+    if (result < 0)
+        return EXIT_FAILURE;
+
+    // Not to pick it before its event is read
+    hci_picker_invalidate(device_id);
+
+    return EXIT_SUCCESS;
+}
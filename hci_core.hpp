@@ -0,0 +1,99 @@
+#pragma once
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <bluetooth/bluetooth.h>
+#include <bluetooth/hci.h>
+
+/*
+ * Details about a failed HCI operation.
+ *     - code: errno value.
+ *     - step: name of the step which failed.
+ */
+struct hci_error
+{
+    int code;
+    char const *step;
+};
+
+/*
+ * Record a failure.
+ * Params:
+ *     - error: error to fill.
+ *     - code: errno value.
+ *     - step: name of the step which failed.
+ * Return values:
+ *     - EXIT_FAILURE: always.
+ */
+static inline int hci_set_error(struct hci_error *error, int code, char const *step)
+{
+    error->code = code;
+    error->step = step;
+    return EXIT_FAILURE;
+}
+
+/*
+ * Options of list_devices().
+ *     - ids: dev_ids to read, NULL for all devices.
+ *     - id_count: number of entries in ids.
+ *     - resolve_address: read the address of RAW devices reporting none.
+ */
+struct hci_list_options
+{
+    uint16_t const *ids;
+    int id_count;
+    bool resolve_address;
+};
+
+/*
+ * Where the time of a spoof went, in milliseconds.
+ *     - write: vendor write, and reading the address back in low downtime
+ *       mode.
+ *     - vendor_reset, kernel_reset: vendor reset and HCIDEVRESET, 0 when
+ *       skipped.
+ *     - up: from the resets to the device up with the new address.
+ *     - downtime: from the write to the device up with the new address.
+ *     - resets_skipped: the controller took the address without reset.
+ *     - manufacturer: company ID of the controller.
+ *     - write_ns: start of the write, comparable with hci_monotonic_ns().
+ * up and downtime are only measured by hci_spoof_mac_wait().
+ */
+struct hci_spoof_timings
+{
+    double write;
+    double vendor_reset;
+    double kernel_reset;
+    double up;
+    double downtime;
+    bool resets_skipped;
+    int manufacturer;
+    uint64_t write_ns;
+};
+
+/*
+ * Downtime of the spoofs of a vendor, from the write to the device up with
+ * the new address.
+ */
+struct hci_spoof_downtime
+{
+    int manufacturer;
+    uint32_t spoofs;
+    uint32_t resets_skipped;
+    double total_ms;
+    double max_ms;
+    double last_ms;
+};
+
+int list_devices(struct hci_dev_info *devices, int *count, struct hci_list_options const *options,
+                 struct hci_error *error);
+int hci_device_info(int device_id, struct hci_dev_info *device_info, struct hci_error *error);
+void hci_resolve_addresses(struct hci_dev_info *devices, int count);
+int hci_interface_up_down(int device_id, bool status, struct hci_error *error);
+int hci_spoof_mac(int device_id, char const *new_mac_address, struct hci_spoof_timings *timings,
+                  struct hci_error *error);
+int hci_interface_up_down_wait(int device_id, bool status, int timeout_ms, struct hci_error *error);
+int hci_spoof_mac_wait(int device_id, char const *new_mac_address, int timeout_ms,
+                       struct hci_spoof_timings *timings, struct hci_error *error);
+int hci_spoof_downtimes(struct hci_spoof_downtime *stats, int max);
@@ -0,0 +1,891 @@
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include <new>
+
+#include <bluetooth/bluetooth.h>
+#include <bluetooth/hci.h>
+
+#include "hci_conn.hpp"
+#include "hci_daemon.hpp"
+#include "hci_events.hpp"
+#include "hci_raw.hpp"
+
+// Output buffered for a client: starts at that size, which fits any single
+// response, and grows up to the maximum while the client doesn't read
+#define DAEMON_OUTPUT_SIZE (8 * 1024)
+#define DAEMON_OUTPUT_MAX  (1024 * 1024)
+
+#define DAEMON_INPUT_SIZE 4096
+
+#define DAEMON_UPDOWN_TIMEOUT_MS 5000
+#define DAEMON_SPOOF_TIMEOUT_MS  15000
+
+/*
+ * A connected client.
+ *     - descriptor: -1 once disconnected. The client is freed when none of
+ *       its calls is running anymore.
+ *     - input: start of a request not fully received yet.
+ *     - output: responses not sent yet.
+ *     - calls: requests running on the device lanes.
+ */
+struct daemon_client
+{
+    int descriptor;
+    unsigned char input[DAEMON_INPUT_SIZE];
+    size_t input_length;
+    unsigned char *output;
+    size_t output_length;
+    size_t output_size;
+    int calls;
+};
+
+/*
+ * A request run on the lane of its device.
+ */
+struct daemon_call
+{
+    struct hci_task task;
+    struct hci_daemon *daemon;
+    struct daemon_client *client;
+    uint32_t tag;
+    int operation;
+    int flags;
+    int timeout_ms;
+    char address[18];
+    int status;
+    struct hci_error error;
+    struct hci_spoof_timings timings;
+    int count;
+    struct hci_connection connections[HCI_CONN_MAX];
+};
+
+static uint16_t get16(unsigned char const *p)
+{
+    return p[0] | p[1] << 8;
+}
+
+static uint32_t get32(unsigned char const *p)
+{
+    return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static void put32(unsigned char *p, uint32_t value)
+{
+    p[0] = value;
+    p[1] = value >> 8;
+    p[2] = value >> 16;
+    p[3] = value >> 24;
+}
+
+static void put64(unsigned char *p, uint64_t value)
+{
+    put32(p, (uint32_t)value);
+    put32(p + 4, (uint32_t)(value >> 32));
+}
+
+static uint32_t microseconds(double ms)
+{
+    return ms > 0 ? (uint32_t)(ms * 1000) : 0;
+}
+
+/*
+ * Wake up the daemon thread: called from a lane, with the completion queue
+ * locked.
+ * Params:
+ *     - arg: the daemon.
+ */
+static void daemon_notify(void *arg)
+{
+    uint64_t one = 1;
+
+    // Ignored: the counter is far from overflowing
+    (void)!write(((struct hci_daemon *)arg)->wakeup, &one, sizeof(one));
+}
+
+/*
+ * Drop the enumeration when btim itself changes a device, e.g. resets it.
+ * Params:
+ *     - event: device event.
+ *     - arg: the daemon.
+ */
+static void daemon_hook(struct hci_device_event const *event, void *arg)
+{
+    ((struct hci_daemon *)arg)->stale = true;
+}
+
+/*
+ * Disconnect a client. It is freed by the daemon loop once its calls are
+ * done.
+ * Params:
+ *     - daemon: daemon.
+ *     - client: client.
+ */
+static void client_drop(struct hci_daemon *daemon, struct daemon_client *client)
+{
+    if (client->descriptor < 0)
+        return;
+
+    close(client->descriptor);
+    client->descriptor = -1;
+    client->input_length = 0;
+    client->output_length = 0;
+    daemon->client_count--;
+}
+
+/*
+ * Start a response.
+ * Params:
+ *     - daemon: daemon.
+ *     - client: client receiving it.
+ *     - tag: tag of the request.
+ *     - code: errno value, 0 on success.
+ *     - size: size of the body.
+ * Return value: where to write the body, or NULL when the client was
+ * dropped for not reading its responses.
+ */
+static unsigned char *respond(struct hci_daemon *daemon, struct daemon_client *client, uint32_t tag,
+                              int code, size_t size)
+{
+    size_t frame_size = HCI_DAEMON_RESPONSE_SIZE + size;
+
+    if (client->descriptor < 0)
+        return NULL;
+
+    if (client->output_length + frame_size > client->output_size)
+    {
+        size_t output_size = client->output_size;
+        unsigned char *output;
+
+        while (output_size < client->output_length + frame_size)
+            output_size *= 2;
+
+        if (output_size > DAEMON_OUTPUT_MAX ||
+            (output = new (std::nothrow) unsigned char[output_size]) == NULL)
+        {
+            client_drop(daemon, client);
+            return NULL;
+        }
+
+        memcpy(output, client->output, client->output_length);
+        delete[] client->output;
+        client->output = output;
+        client->output_size = output_size;
+    }
+
+    unsigned char *frame = client->output + client->output_length;
+
+    client->output_length += frame_size;
+
+    put32(frame, frame_size);
+    put32(frame + 4, tag);
+    put32(frame + 8, code);
+
+    return frame + HCI_DAEMON_RESPONSE_SIZE;
+}
+
+/*
+ * Answer a request with a failure.
+ * Params:
+ *     - daemon: daemon.
+ *     - client: client receiving it.
+ *     - tag: tag of the request.
+ *     - error: details about the failed step.
+ */
+static void respond_error(struct hci_daemon *daemon, struct daemon_client *client, uint32_t tag,
+                          struct hci_error const *error)
+{
+    size_t length = strlen(error->step);
+    unsigned char *body = respond(daemon, client, tag, error->code ? error->code : EIO, length);
+
+    if (body)
+        memcpy(body, error->step, length);
+}
+
+/*
+ * Enumerate the adapters, unless the last enumeration is still valid.
+ * Params:
+ *     - daemon: daemon.
+ *     - error: details about the failed step.
+ * Return values:
+ *     - EXIT_FAILURE: on failure.
+ *     - EXIT_SUCCESS: on success.
+ */
+static int daemon_enumerate(struct hci_daemon *daemon, struct hci_error *error)
+{
+    struct hci_list_options options = { NULL, 0, true };
+    uint64_t now = hci_monotonic_ns();
+
+    if (!daemon->stale.exchange(false) &&
+        now - daemon->listed_ns < (uint64_t)daemon->options.cache_ms * 1000000)
+    {
+        daemon->cache_hits++;
+        return EXIT_SUCCESS;
+    }
+
+    if (list_devices(daemon->devices, &daemon->device_count, &options, error) != EXIT_SUCCESS)
+    {
+        daemon->stale = true;
+        return EXIT_FAILURE;
+    }
+
+    hci_raw_pack(daemon->devices, daemon->device_count, daemon->list);
+    daemon->list_length = hci_raw_size(daemon->device_count);
+    daemon->listed_ns = now;
+    daemon->enumerations++;
+
+    return EXIT_SUCCESS;
+}
+
+/*
+ * Find an adapter in the enumeration.
+ * Params:
+ *     - daemon: daemon.
+ *     - device_id: device ID.
+ *     - error: details about the failed step.
+ * Return value: its index, or -1 when missing.
+ */
+static int daemon_device(struct hci_daemon *daemon, int device_id, struct hci_error *error)
+{
+    if (daemon_enumerate(daemon, error) != EXIT_SUCCESS)
+        return -1;
+
+    for (int i = 0; i < daemon->device_count; i++)
+    {
+        if (daemon->devices[i].dev_id == device_id)
+            return i;
+    }
+
+    hci_set_error(error, ENODEV, "HCIGETDEVINFO");
+    return -1;
+}
+
+/*
+ * Run a call on its device's lane.
+ * Params:
+ *     - task: the call's task.
+ */
+static void call_execute(struct hci_task *task)
+{
+    struct daemon_call *call = (struct daemon_call *)task->data;
+    int device_id = task->device_id;
+
+    switch (call->operation)
+    {
+    case HCI_DAEMON_UP:
+    case HCI_DAEMON_DOWN:
+        call->status = hci_interface_up_down_wait(device_id, call->operation == HCI_DAEMON_UP,
+                                                  call->timeout_ms, &call->error);
+        break;
+
+    case HCI_DAEMON_SPOOF:
+        call->status = hci_spoof_mac_wait(device_id, call->address, call->timeout_ms,
+                                          &call->timings, &call->error);
+        break;
+
+    case HCI_DAEMON_CONNECTIONS:
+        call->status = hci_connections(device_id, call->connections, &call->count, &call->error);
+        if (call->status == EXIT_SUCCESS && (call->flags & HCI_DAEMON_QUALITY))
+            call->status = hci_connections_quality(device_id, call->connections, call->count,
+                                                   &call->error);
+        break;
+    }
+}
+
+/*
+ * Answer a call on the daemon thread.
+ * Params:
+ *     - task: the call's task.
+ */
+static void call_complete(struct hci_task *task)
+{
+    struct daemon_call *call = (struct daemon_call *)task->data;
+    struct hci_daemon *daemon = call->daemon;
+    struct daemon_client *client = call->client;
+    unsigned char *body;
+
+    client->calls--;
+    daemon->calls--;
+
+    if (call->operation != HCI_DAEMON_CONNECTIONS)
+        daemon->stale = true;
+
+    if (call->status != EXIT_SUCCESS)
+        respond_error(daemon, client, call->tag, &call->error);
+    else if (call->operation == HCI_DAEMON_CONNECTIONS)
+    {
+        if ((body = respond(daemon, client, call->tag, 0, hci_raw_connections_size(call->count))))
+            hci_raw_connections_pack(task->device_id, call->connections, call->count, body);
+    }
+    else if ((body = respond(daemon, client, call->tag, 0, call->operation == HCI_DAEMON_SPOOF ? 29 : 8)))
+    {
+        put32(body, (task->started_ns - task->queued_ns) / 1000);
+        put32(body + 4, (task->finished_ns - task->started_ns) / 1000);
+
+        if (call->operation == HCI_DAEMON_SPOOF)
+        {
+            put32(body + 8, microseconds(call->timings.write));
+            put32(body + 12, microseconds(call->timings.vendor_reset));
+            put32(body + 16, microseconds(call->timings.kernel_reset));
+            put32(body + 20, microseconds(call->timings.up));
+            put32(body + 24, microseconds(call->timings.downtime));
+            body[28] = call->timings.resets_skipped;
+        }
+    }
+
+    delete call;
+}
+
+/*
+ * Queue a request on the lane of its device.
+ * Params:
+ *     - daemon: daemon.
+ *     - client: client which sent it.
+ *     - request: the request frame.
+ *     - size: size of the frame.
+ */
+static void daemon_queue(struct hci_daemon *daemon, struct daemon_client *client,
+                         unsigned char const *request, uint32_t size)
+{
+    uint32_t tag = get32(request + 4);
+    int device_id = get16(request + 10);
+    struct daemon_call *call;
+    struct hci_error error;
+
+    if (request[8] == HCI_DAEMON_SPOOF && size < HCI_DAEMON_REQUEST_SIZE + 6)
+    {
+        hci_set_error(&error, EINVAL, "request");
+        respond_error(daemon, client, tag, &error);
+        return;
+    }
+
+    // Lanes are only created for adapters which exist
+    if (daemon_device(daemon, device_id, &error) < 0)
+    {
+        respond_error(daemon, client, tag, &error);
+        return;
+    }
+
+    if ((call = new (std::nothrow) daemon_call) == NULL)
+    {
+        hci_set_error(&error, ENOMEM, "request");
+        respond_error(daemon, client, tag, &error);
+        return;
+    }
+
+    call->daemon = daemon;
+    call->client = client;
+    call->tag = tag;
+    call->operation = request[8];
+    call->flags = request[9];
+    call->timeout_ms = get32(request + 12);
+    call->status = EXIT_FAILURE;
+    call->count = 0;
+
+    if (call->timeout_ms <= 0)
+        call->timeout_ms = call->operation == HCI_DAEMON_SPOOF ? DAEMON_SPOOF_TIMEOUT_MS : DAEMON_UPDOWN_TIMEOUT_MS;
+
+    if (call->operation == HCI_DAEMON_SPOOF)
+        snprintf(call->address, sizeof(call->address), "%02X:%02X:%02X:%02X:%02X:%02X",
+                 request[16], request[17], request[18], request[19], request[20], request[21]);
+
+    call->task.device_id = device_id;
+    call->task.execute = call_execute;
+    call->task.complete = call_complete;
+    call->task.data = call;
+    call->task.queue = &daemon->completions;
+
+    client->calls++;
+    daemon->calls++;
+
+    hci_executor_submit(&call->task);
+}
+
+/*
+ * Answer a request: reads right away, from the enumeration, the other
+ * operations once done on their device's lane.
+ * Params:
+ *     - daemon: daemon.
+ *     - client: client which sent it.
+ *     - request: the request frame.
+ *     - size: size of the frame.
+ */
+static void daemon_request(struct hci_daemon *daemon, struct daemon_client *client,
+                           unsigned char const *request, uint32_t size)
+{
+    uint32_t tag = get32(request + 4);
+    struct hci_error error;
+    unsigned char *body;
+    int index;
+
+    daemon->requests++;
+
+    switch (request[8])
+    {
+    case HCI_DAEMON_LIST:
+        if (daemon_enumerate(daemon, &error) != EXIT_SUCCESS)
+            respond_error(daemon, client, tag, &error);
+        else if ((body = respond(daemon, client, tag, 0, daemon->list_length)))
+            memcpy(body, daemon->list, daemon->list_length);
+        break;
+
+    case HCI_DAEMON_INFO:
+        if ((index = daemon_device(daemon, get16(request + 10), &error)) < 0)
+            respond_error(daemon, client, tag, &error);
+        else if ((body = respond(daemon, client, tag, 0, hci_raw_size(1))))
+            hci_raw_pack(&daemon->devices[index], 1, body);
+        break;
+
+    case HCI_DAEMON_UP:
+    case HCI_DAEMON_DOWN:
+    case HCI_DAEMON_SPOOF:
+    case HCI_DAEMON_CONNECTIONS:
+        daemon_queue(daemon, client, request, size);
+        break;
+
+    case HCI_DAEMON_STATS:
+        if ((body = respond(daemon, client, tag, 0, 32)))
+        {
+            put64(body, daemon->requests);
+            put64(body + 8, daemon->enumerations);
+            put64(body + 16, daemon->cache_hits);
+            put64(body + 24, daemon->client_count);
+        }
+        break;
+
+    default:
+        hci_set_error(&error, EOPNOTSUPP, "request");
+        respond_error(daemon, client, tag, &error);
+        break;
+    }
+}
+
+/*
+ * Read the requests of a client and answer them.
+ * Params:
+ *     - daemon: daemon.
+ *     - client: client with data to read.
+ */
+static void client_receive(struct hci_daemon *daemon, struct daemon_client *client)
+{
+    while (client->descriptor >= 0 && client->calls < HCI_DAEMON_MAX_CALLS)
+    {
+        ssize_t length = recv(client->descriptor, client->input + client->input_length,
+                              sizeof(client->input) - client->input_length, 0);
+        size_t offset = 0;
+
+        if (length < 0 && errno == EINTR)
+            continue;
+
+        if (length < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return;
+
+        if (length <= 0)
+        {
+            client_drop(daemon, client);
+            return;
+        }
+
+        client->input_length += length;
+
+        while (client->descriptor >= 0 && client->input_length - offset >= 4)
+        {
+            uint32_t size = get32(client->input + offset);
+
+            if (size < HCI_DAEMON_REQUEST_SIZE || size > HCI_DAEMON_REQUEST_SIZE + 6)
+            {
+                client_drop(daemon, client);
+                return;
+            }
+
+            if (client->input_length - offset < size)
+                break;
+
+            daemon_request(daemon, client, client->input + offset, size);
+            offset += size;
+        }
+
+        if (client->descriptor < 0)
+            return;
+
+        memmove(client->input, client->input + offset, client->input_length - offset);
+        client->input_length -= offset;
+    }
+}
+
+/*
+ * Send what a client can take of its responses.
+ * Params:
+ *     - daemon: daemon.
+ *     - client: client.
+ */
+static void client_flush(struct hci_daemon *daemon, struct daemon_client *client)
+{
+    size_t sent = 0;
+
+    while (sent < client->output_length)
+    {
+        ssize_t length = send(client->descriptor, client->output + sent, client->output_length - sent,
+                              MSG_NOSIGNAL | MSG_DONTWAIT);
+
+        if (length < 0 && errno == EINTR)
+            continue;
+
+        if (length < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+
+        if (length < 0)
+        {
+            client_drop(daemon, client);
+            return;
+        }
+
+        sent += length;
+    }
+
+    memmove(client->output, client->output + sent, client->output_length - sent);
+    client->output_length -= sent;
+}
+
+/*
+ * Accept the pending connections, as long as there is room for them.
+ * Params:
+ *     - daemon: daemon.
+ */
+static void daemon_accept(struct hci_daemon *daemon)
+{
+    for (int slot = 0; slot < HCI_DAEMON_MAX_CLIENTS; slot++)
+    {
+        struct daemon_client *client;
+        int descriptor;
+
+        if (daemon->clients[slot])
+            continue;
+
+        if ((descriptor = accept4(daemon->listener, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) < 0)
+            return;
+
+        if ((client = new (std::nothrow) daemon_client) == NULL ||
+            (client->output = new (std::nothrow) unsigned char[DAEMON_OUTPUT_SIZE]) == NULL)
+        {
+            delete client;
+            close(descriptor);
+            return;
+        }
+
+        client->descriptor = descriptor;
+        client->input_length = 0;
+        client->output_length = 0;
+        client->output_size = DAEMON_OUTPUT_SIZE;
+        client->calls = 0;
+
+        daemon->clients[slot] = client;
+        daemon->client_count++;
+    }
+}
+
+/*
+ * Free the clients which are gone and have no call running.
+ * Params:
+ *     - daemon: daemon.
+ */
+static void daemon_sweep(struct hci_daemon *daemon)
+{
+    for (int slot = 0; slot < HCI_DAEMON_MAX_CLIENTS; slot++)
+    {
+        struct daemon_client *client = daemon->clients[slot];
+
+        if (client && client->descriptor < 0 && client->calls == 0)
+        {
+            delete[] client->output;
+            delete client;
+            daemon->clients[slot] = NULL;
+        }
+    }
+}
+
+/*
+ * Apply the kernel's device events to the enumeration.
+ * Params:
+ *     - daemon: daemon.
+ */
+static void daemon_events(struct hci_daemon *daemon)
+{
+    struct hci_device_event event;
+    int result;
+
+    while ((result = hci_events_read(daemon->events, &event)) > 0)
+        daemon->stale = true;
+
+    // Events may be missed from now on: enumerations only expire
+    if (result < 0)
+    {
+        close(daemon->events);
+        daemon->events = -1;
+        daemon->stale = true;
+    }
+}
+
+/*
+ * Serve until stopped, then wait for the calls still running.
+ * Params:
+ *     - daemon: daemon.
+ */
+static void daemon_loop(struct hci_daemon *daemon)
+{
+    struct pollfd descriptors[3 + HCI_DAEMON_MAX_CLIENTS];
+    struct daemon_client *polled[HCI_DAEMON_MAX_CLIENTS];
+    uint64_t counter;
+
+    descriptors[0].fd = daemon->wakeup;
+    descriptors[0].events = POLLIN;
+    descriptors[1].fd = daemon->listener;
+    descriptors[1].events = POLLIN;
+    descriptors[2].events = POLLIN;
+
+    while (daemon->running.load(std::memory_order_relaxed))
+    {
+        bool full = true;
+        int count = 0;
+
+        for (int slot = 0; slot < HCI_DAEMON_MAX_CLIENTS; slot++)
+        {
+            struct daemon_client *client = daemon->clients[slot];
+
+            if (client == NULL)
+                full = false;
+
+            if (client == NULL || client->descriptor < 0)
+                continue;
+
+            descriptors[3 + count].fd = client->descriptor;
+            descriptors[3 + count].events = (client->calls < HCI_DAEMON_MAX_CALLS ? POLLIN : 0) |
+                                            (client->output_length ? POLLOUT : 0);
+            polled[count++] = client;
+        }
+
+        // Negative descriptors are ignored by poll: connections wait in the
+        // backlog while every slot is taken
+        descriptors[1].fd = full ? -1 : daemon->listener;
+        descriptors[2].fd = daemon->events;
+
+        if (poll(descriptors, 3 + count, -1) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+
+        if (descriptors[0].revents)
+        {
+            // Ignored: failing only means a spurious wakeup
+            (void)!read(daemon->wakeup, &counter, sizeof(counter));
+            hci_executor_drain(&daemon->completions);
+        }
+
+        if (descriptors[2].revents)
+            daemon_events(daemon);
+
+        // Clients are only freed by daemon_sweep(), below
+        for (int i = 0; i < count; i++)
+        {
+            // Responses to a client which hung up can't be delivered
+            if (descriptors[3 + i].revents & (POLLHUP | POLLERR))
+                client_drop(daemon, polled[i]);
+            else if (descriptors[3 + i].revents & POLLIN)
+                client_receive(daemon, polled[i]);
+        }
+
+        if (descriptors[1].revents)
+            daemon_accept(daemon);
+
+        for (int slot = 0; slot < HCI_DAEMON_MAX_CLIENTS; slot++)
+        {
+            struct daemon_client *client = daemon->clients[slot];
+
+            if (client && client->descriptor >= 0 && client->output_length)
+                client_flush(daemon, client);
+        }
+
+        daemon_sweep(daemon);
+    }
+
+    for (int slot = 0; slot < HCI_DAEMON_MAX_CLIENTS; slot++)
+    {
+        if (daemon->clients[slot])
+            client_drop(daemon, daemon->clients[slot]);
+    }
+
+    // The lanes still reference the completion queue
+    while (daemon->calls > 0)
+    {
+        if (poll(descriptors, 1, -1) < 0 && errno != EINTR)
+            break;
+        // Ignored: failing only means a spurious wakeup
+        (void)!read(daemon->wakeup, &counter, sizeof(counter));
+        hci_executor_drain(&daemon->completions);
+    }
+
+    daemon_sweep(daemon);
+}
+
+/*
+ * Open the socket of a daemon.
+ * Params:
+ *     - daemon: daemon, with its options set.
+ *     - error: details about the failed step.
+ * Return values:
+ *     - EXIT_FAILURE: on failure.
+ *     - EXIT_SUCCESS: on success.
+ */
+static int daemon_listen(struct hci_daemon *daemon, struct hci_error *error)
+{
+    struct sockaddr_un address;
+    struct stat status;
+
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strncpy(address.sun_path, daemon->options.path, sizeof(address.sun_path) - 1);
+
+    // A socket left by a previous daemon
+    if (stat(daemon->options.path, &status) == 0 && S_ISSOCK(status.st_mode))
+        unlink(daemon->options.path);
+
+    if ((daemon->listener = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0)
+        return hci_set_error(error, errno, "socket");
+
+    if (bind(daemon->listener, (struct sockaddr *)&address, sizeof(address)) < 0)
+        return hci_set_error(error, errno, "bind");
+
+    if (daemon->options.mode && chmod(daemon->options.path, daemon->options.mode) < 0)
+        return hci_set_error(error, errno, "chmod");
+
+    if (listen(daemon->listener, HCI_DAEMON_MAX_CLIENTS) < 0)
+        return hci_set_error(error, errno, "listen");
+
+    return EXIT_SUCCESS;
+}
+
+/*
+ * Free the resources of a daemon.
+ * Params:
+ *     - daemon: daemon.
+ */
+static void daemon_close(struct hci_daemon *daemon)
+{
+    if (daemon->listener >= 0)
+    {
+        close(daemon->listener);
+        unlink(daemon->options.path);
+    }
+
+    if (daemon->events >= 0)
+        close(daemon->events);
+
+    if (daemon->wakeup >= 0)
+        close(daemon->wakeup);
+
+    delete[] daemon->list;
+
+    daemon->listener = -1;
+    daemon->events = -1;
+    daemon->wakeup = -1;
+    daemon->list = NULL;
+}
+
+/*
+ * Start serving clients. Failing to receive the kernel's device events
+ * isn't fatal: enumerations then only expire after cache_ms.
+ * Params:
+ *     - daemon: daemon to start.
+ *     - options: socket and enumeration cache.
+ *     - error: details about the failed step.
+ * Return values:
+ *     - EXIT_FAILURE: on failure.
+ *     - EXIT_SUCCESS: on success.
+ */
+int hci_daemon_start(struct hci_daemon *daemon, struct hci_daemon_options const *options,
+                     struct hci_error *error)
+{
+    struct hci_error events_error;
+
+    if (!options->path[0] || options->cache_ms < 0)
+        return hci_set_error(error, EINVAL, "daemon");
+
+    daemon->options = *options;
+    daemon->options.path[sizeof(daemon->options.path) - 1] = '\0';
+    daemon->listener = -1;
+    daemon->calls = 0;
+    daemon->device_count = 0;
+    daemon->list_length = 0;
+    daemon->listed_ns = 0;
+    daemon->stale = true;
+    daemon->requests = 0;
+    daemon->enumerations = 0;
+    daemon->cache_hits = 0;
+    daemon->client_count = 0;
+    memset(daemon->clients, 0, sizeof(daemon->clients));
+
+    daemon->completions.head = daemon->completions.tail = NULL;
+    daemon->completions.notify = daemon_notify;
+    daemon->completions.notify_arg = daemon;
+
+    daemon->list = new (std::nothrow) unsigned char[hci_raw_size(HCI_MAX_DEV)];
+    daemon->events = hci_events_open(&events_error);
+
+    if ((daemon->wakeup = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) < 0)
+    {
+        hci_set_error(error, errno, "eventfd");
+        daemon_close(daemon);
+        return EXIT_FAILURE;
+    }
+
+    if (!daemon->list)
+    {
+        hci_set_error(error, ENOMEM, "daemon");
+        daemon_close(daemon);
+        return EXIT_FAILURE;
+    }
+
+    if (daemon_listen(daemon, error) != EXIT_SUCCESS)
+    {
+        daemon_close(daemon);
+        return EXIT_FAILURE;
+    }
+
+    hci_events_subscribe(daemon_hook, daemon);
+
+    daemon->running = true;
+    daemon->thread = std::thread(daemon_loop, daemon);
+
+    return EXIT_SUCCESS;
+}
+
+/*
+ * Stop a daemon: clients are disconnected, and the operations running are
+ * waited for.
+ * Params:
+ *     - daemon: daemon to stop.
+ */
+void hci_daemon_stop(struct hci_daemon *daemon)
+{
+    uint64_t one = 1;
+
+    if (!daemon->running.exchange(false))
+        return;
+
+    // Ignored: the counter is far from overflowing
+    (void)!write(daemon->wakeup, &one, sizeof(one));
+
+    daemon->thread.join();
+
+    hci_events_unsubscribe(daemon_hook, daemon);
+    daemon_close(daemon);
+}
@@ -0,0 +1,113 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <thread>
+
+#include "hci_core.hpp"
+#include "hci_executor.hpp"
+
+/*
+ * Protocol of btimd, over a Unix stream socket. Frames are little endian
+ * and start with their own length. A client may send requests without
+ * waiting for the answers: each response carries the tag of its request,
+ * and responses come in completion order.
+ *
+ * Request (HCI_DAEMON_REQUEST_SIZE bytes, + 6 for a spoof):
+ *     0  u32 length of the frame
+ *     4  u32 tag, echoed by the response
+ *     8  u8  operation (HCI_DAEMON_LIST...)
+ *     9  u8  flags (HCI_DAEMON_QUALITY)
+ *     10 u16 dev_id
+ *     12 u32 timeout in milliseconds, 0 for the default
+ *     16 u8  address[6], as written (11:22:33:44:55:66 starts with 0x11)
+ *
+ * Response (HCI_DAEMON_RESPONSE_SIZE bytes, then a body):
+ *     0  u32 length of the frame
+ *     4  u32 tag
+ *     8  u32 errno, 0 on success
+ *     12 body:
+ *         - on failure: name of the step which failed, not NUL terminated.
+ *         - list, info: packed adapter records (hci_raw.hpp).
+ *         - connections: packed connection records.
+ *         - up, down: u32 queued, u32 elapsed, in microseconds.
+ *         - spoof: the same, then u32 write, vendor reset, kernel reset,
+ *           up and downtime in microseconds, u8 resets skipped.
+ *         - stats: u64 requests, enumerations, cache hits and clients.
+ */
+#define HCI_DAEMON_LIST        1
+#define HCI_DAEMON_INFO        2
+#define HCI_DAEMON_UP          3
+#define HCI_DAEMON_DOWN        4
+#define HCI_DAEMON_SPOOF       5
+#define HCI_DAEMON_CONNECTIONS 6
+#define HCI_DAEMON_STATS       7
+
+// Read the link quality of the connections
+#define HCI_DAEMON_QUALITY 0x01
+
+#define HCI_DAEMON_REQUEST_SIZE  16
+#define HCI_DAEMON_RESPONSE_SIZE 12
+
+/*
+ * Clients served at once, and requests of a client running on device
+ * lanes: past that many, the client's socket isn't read until some end.
+ */
+#define HCI_DAEMON_MAX_CLIENTS 64
+#define HCI_DAEMON_MAX_CALLS   256
+
+struct daemon_client;
+
+/*
+ * Options of a daemon.
+ *     - path: Unix socket to serve.
+ *     - mode: permissions of the socket, 0 to leave them to the umask.
+ *     - cache_ms: how long an enumeration answers list and info requests,
+ *       unless a device event comes first.
+ */
+struct hci_daemon_options
+{
+    char path[108];
+    int mode;
+    int cache_ms;
+};
+
+/*
+ * A daemon: one thread serves every client. Reads are answered from a
+ * shared enumeration; up, down, spoof and connections run on the device
+ * lanes, so that the operations of all clients on an adapter are
+ * serialized, and complete back on the daemon thread.
+ *     - wakeup: eventfd signalled by the lanes and by hci_daemon_stop().
+ *     - events: kernel device events, -1 until opened.
+ *     - stale: the enumeration must be read again.
+ *     - calls: requests running on the lanes.
+ *     - requests, enumerations, cache_hits: daemon's own counters.
+ */
+struct hci_daemon
+{
+    std::thread thread;
+    std::atomic<bool> running;
+    int wakeup;
+    int listener;
+    int events;
+    struct hci_daemon_options options;
+    struct hci_completion_queue completions;
+    struct daemon_client *clients[HCI_DAEMON_MAX_CLIENTS];
+    int calls;
+    struct hci_dev_info devices[HCI_MAX_DEV];
+    int device_count;
+    unsigned char *list;
+    size_t list_length;
+    uint64_t listed_ns;
+    std::atomic<bool> stale;
+    std::atomic<uint64_t> requests;
+    std::atomic<uint64_t> enumerations;
+    std::atomic<uint64_t> cache_hits;
+    std::atomic<uint64_t> client_count;
+};
+
+int hci_daemon_start(struct hci_daemon *daemon, struct hci_daemon_options const *options,
+                     struct hci_error *error);
+void hci_daemon_stop(struct hci_daemon *daemon);
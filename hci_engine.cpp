@@ -0,0 +1,443 @@
+#include <errno.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#include <bluetooth/bluetooth.h>
+#include <bluetooth/hci.h>
+#include <bluetooth/hci_lib.h>
+
+#include "hci_backend.hpp"
+#include "hci_engine.hpp"
+#include "hci_executor.hpp"
+#include "hci_metrics.hpp"
+#include "hci_pool.hpp"
+#include "hci_timeouts.hpp"
+
+enum
+{
+    COMMAND_QUEUED,
+    COMMAND_SENT,
+    COMMAND_DONE
+};
+
+/*
+ * Take the descriptor of a device for a series of commands. Events left
+ * over by earlier requests are dropped.
+ * Params:
+ *     - engine: engine to set up.
+ *     - device_id: device ID.
+ *     - error: details about the failed step.
+ * Return values:
+ *     - EXIT_FAILURE: on failure.
+ *     - EXIT_SUCCESS: on success.
+ */
+int hci_engine_open(struct hci_engine *engine, int device_id, struct hci_error *error)
+{
+    unsigned char buffer[HCI_MAX_EVENT_SIZE + HCI_TYPE_LEN];
+
+    engine->device_id = device_id;
+    engine->credits = 1;
+    engine->window = 1;
+    engine->manufacturer = -1;
+
+    if ((engine->descriptor = hci_pool_acquire(device_id, error)) < 0)
+        return EXIT_FAILURE;
+
+    while (recv(engine->descriptor, buffer, sizeof(buffer), MSG_DONTWAIT) > 0)
+        ;
+
+    return EXIT_SUCCESS;
+}
+
+/*
+ * Give back the descriptor of an engine.
+ * Params:
+ *     - engine: engine set up with hci_engine_open().
+ *     - code: errno of the last failed operation, or 0.
+ */
+void hci_engine_close(struct hci_engine *engine, int code)
+{
+    hci_pool_release(engine->device_id, code);
+    engine->descriptor = -1;
+}
+
+/*
+ * Set up a command completed by a Command Complete event.
+ * Params:
+ *     - command: command to set up.
+ *     - ogf, ocf: opcode.
+ *     - params, plen: command parameters.
+ *     - timeout_ms: give up this long after the command was sent.
+ */
+void hci_command_init(struct hci_command *command, uint16_t ogf, uint16_t ocf,
+                      void const *params, uint8_t plen, int timeout_ms)
+{
+    memset(command, 0, sizeof(*command));
+    command->ogf = ogf;
+    command->ocf = ocf;
+    command->params = params;
+    command->plen = plen;
+    command->event = EVT_CMD_COMPLETE;
+    command->timeout_ms = timeout_ms;
+}
+
+/*
+ * Complete a command. The latency of successful commands feeds the
+ * adapter's profile; the latency of every command sent is measured.
+ * Params:
+ *     - engine: engine.
+ *     - command: command to complete.
+ *     - result: 0 or an errno value.
+ */
+static void complete(struct hci_engine *engine, struct hci_command *command, int result)
+{
+    command->state = COMMAND_DONE;
+    command->result = result;
+    command->done_ns = hci_monotonic_ns();
+
+    if (result == 0 && command->check)
+        command->result = command->check(command);
+
+    if (command->result == 0 && !(command->flags & (HCI_COMMAND_NOWAIT | HCI_COMMAND_UNPROFILED)))
+    {
+        hci_timeout_record(engine->device_id, cmd_opcode_pack(command->ogf, command->ocf),
+                           command->done_ns - command->sent_ns);
+    }
+
+    if (command->sent_ns)
+    {
+        uint16_t opcode = cmd_opcode_pack(command->ogf, command->ocf);
+        uint64_t latency_ns = command->done_ns - command->sent_ns;
+
+        hci_metrics_record(HCI_METRICS_COMMAND, opcode, engine->device_id, latency_ns, command->result != 0);
+        HCI_PROBE4(command__done, engine->device_id, opcode, command->result, latency_ns);
+    }
+}
+
+/*
+ * Take the credits granted by a Command Complete or Command Status event.
+ */
+static void set_credits(struct hci_engine *engine, int credits)
+{
+    engine->credits = credits;
+    if (credits > engine->window)
+        engine->window = credits;
+}
+
+/*
+ * Keep the return parameters of a command.
+ */
+static void set_response(struct hci_command *command, uint8_t const *data, int length)
+{
+    command->rlen = length < command->rsize ? length : command->rsize;
+    if (command->response && command->rlen > 0)
+        memcpy(command->response, data, command->rlen);
+}
+
+/*
+ * Find the oldest command waiting for an event.
+ * Params:
+ *     - commands, count: commands of the run.
+ *     - opcode: opcode of the event, ignored for vendor events.
+ *     - event: kind of event.
+ * Return value: the command, NULL when no command waits for it.
+ */
+static struct hci_command *find_sent(struct hci_command *commands, int count, uint16_t opcode, uint8_t event)
+{
+    for (int i = 0; i < count; i++)
+    {
+        struct hci_command *command = &commands[i];
+
+        if (command->state != COMMAND_SENT)
+            continue;
+
+        if (event == EVT_VENDOR)
+        {
+            if (command->event == EVT_VENDOR)
+                return command;
+        }
+        else if (cmd_opcode_pack(command->ogf, command->ocf) == opcode)
+        {
+            return command;
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Apply an event to the commands in flight.
+ * Params:
+ *     - engine: engine.
+ *     - commands, count: commands of the run.
+ *     - buffer, length: packet read from the descriptor.
+ * Return value: number of commands completed.
+ */
+static int dispatch(struct hci_engine *engine, struct hci_command *commands, int count,
+                    uint8_t const *buffer, int length)
+{
+    hci_event_hdr const *header = (hci_event_hdr const *)(buffer + HCI_TYPE_LEN);
+    uint8_t const *data = (uint8_t const *)(header + 1);
+    struct hci_command *command;
+    int size;
+
+    if (length < HCI_TYPE_LEN + HCI_EVENT_HDR_SIZE || buffer[0] != HCI_EVENT_PKT)
+        return 0;
+
+    size = length - HCI_TYPE_LEN - HCI_EVENT_HDR_SIZE;
+
+    switch (header->evt)
+    {
+    case EVT_CMD_COMPLETE:
+    {
+        evt_cmd_complete const *event = (evt_cmd_complete const *)data;
+
+        if (size < EVT_CMD_COMPLETE_SIZE)
+            return 0;
+
+        set_credits(engine, event->ncmd);
+
+        command = find_sent(commands, count, btohs(event->opcode), EVT_CMD_COMPLETE);
+        if (command == NULL || command->event != EVT_CMD_COMPLETE)
+            return 0;
+
+        set_response(command, data + EVT_CMD_COMPLETE_SIZE, size - EVT_CMD_COMPLETE_SIZE);
+        command->status = size > EVT_CMD_COMPLETE_SIZE ? data[EVT_CMD_COMPLETE_SIZE] : 0;
+        complete(engine, command, 0);
+        return 1;
+    }
+
+    case EVT_CMD_STATUS:
+    {
+        evt_cmd_status const *event = (evt_cmd_status const *)data;
+
+        if (size < EVT_CMD_STATUS_SIZE)
+            return 0;
+
+        set_credits(engine, event->ncmd);
+
+        command = find_sent(commands, count, btohs(event->opcode), EVT_CMD_STATUS);
+        if (command == NULL)
+            return 0;
+
+        if (event->status)
+        {
+            command->status = event->status;
+            complete(engine, command, EIO);
+            return 1;
+        }
+
+        if (command->event != EVT_CMD_STATUS)
+            return 0;
+
+        complete(engine, command, 0);
+        return 1;
+    }
+
+    case EVT_HARDWARE_ERROR:
+    {
+        int completed = 0;
+
+        // The controller is wedged: fail everything in flight now
+        for (int i = 0; i < count; i++)
+        {
+            if (commands[i].state == COMMAND_SENT)
+            {
+                commands[i].status = size > 0 ? data[0] : 0;
+                complete(engine, &commands[i], EIO);
+                completed++;
+            }
+        }
+
+        return completed;
+    }
+
+    case EVT_VENDOR:
+        command = find_sent(commands, count, 0, EVT_VENDOR);
+        if (command == NULL)
+            return 0;
+
+        set_response(command, data, size);
+        complete(engine, command, 0);
+        return 1;
+    }
+
+    return 0;
+}
+
+/*
+ * Run commands on a device. Commands are sent in order as long as the
+ * controller has credits, so several can be in flight; their results are
+ * matched by opcode (vendor events go to the oldest command waiting for
+ * one). Credits are tracked here because vendor commands written on a raw
+ * socket bypass the kernel's own command flow control. Once a command
+ * fails, the ones not sent yet are cancelled.
+ * Failures are reported as soon as the controller tells: an error status,
+ * a Hardware Error event, or the device going away (EPIPE on the
+ * descriptor, or end of file reported as ENODEV) end the wait before the
+ * timeout.
+ * Params:
+ *     - engine: engine set up with hci_engine_open().
+ *     - commands, count: commands to run.
+ * Return values:
+ *     - EXIT_FAILURE: a command failed, errno is set to its result.
+ *     - EXIT_SUCCESS: every command succeeded.
+ */
+int hci_engine_run(struct hci_engine *engine, struct hci_command *commands, int count)
+{
+    uint8_t buffer[HCI_MAX_EVENT_SIZE + HCI_TYPE_LEN];
+    int next = 0, pending = 0, done = 0;
+    int failure = 0;
+
+    for (int i = 0; i < count; i++)
+    {
+        commands[i].state = COMMAND_QUEUED;
+        commands[i].sent_ns = 0;
+    }
+
+    while (done < count)
+    {
+        // Like the kernel's command timer: nothing in flight means a credit
+        if (pending == 0 && engine->credits <= 0)
+            engine->credits = 1;
+
+        while (next < count && engine->credits > 0 && pending < engine->window && !failure)
+        {
+            struct hci_command *command = &commands[next];
+
+            if ((command->flags & HCI_COMMAND_BARRIER) && pending > 0)
+                break;
+
+            command->timeout_ms = hci_timeout_resolve(engine->device_id, engine->manufacturer,
+                                                      cmd_opcode_pack(command->ogf, command->ocf),
+                                                      command->timeout_ms,
+                                                      !(command->flags & HCI_COMMAND_UNPROFILED));
+            command->sent_ns = hci_monotonic_ns();
+            next++;
+
+            HCI_PROBE2(command__send, engine->device_id, cmd_opcode_pack(command->ogf, command->ocf));
+
+            if (hci_backend_get()->send_command(engine->descriptor, command->ogf, command->ocf,
+                                                command->plen, command->params) < 0)
+            {
+                failure = errno;
+                complete(engine, command, errno);
+                done++;
+                break;
+            }
+
+            engine->credits--;
+
+            if (command->flags & HCI_COMMAND_NOWAIT)
+            {
+                complete(engine, command, 0);
+                done++;
+                continue;
+            }
+
+            command->state = COMMAND_SENT;
+            pending++;
+        }
+
+        if (failure)
+        {
+            while (next < count)
+            {
+                complete(engine, &commands[next++], ECANCELED);
+                done++;
+            }
+        }
+
+        if (pending == 0)
+            continue;
+
+        // Wait until the nearest deadline of the commands in flight
+        uint64_t now = hci_monotonic_ns();
+        uint64_t deadline = UINT64_MAX;
+
+        for (int i = 0; i < next; i++)
+        {
+            if (commands[i].state != COMMAND_SENT)
+                continue;
+
+            uint64_t command_deadline = commands[i].sent_ns + (uint64_t)commands[i].timeout_ms * 1000000ULL;
+
+            if (command_deadline <= now)
+            {
+                complete(engine, &commands[i], ETIMEDOUT);
+                failure = failure ? failure : ETIMEDOUT;
+                pending--;
+                done++;
+            }
+            else if (command_deadline < deadline)
+            {
+                deadline = command_deadline;
+            }
+        }
+
+        if (pending == 0)
+            continue;
+
+        struct pollfd descriptor = { engine->descriptor, POLLIN, 0 };
+        int ready = poll(&descriptor, 1, (int)((deadline - now + 999999ULL) / 1000000ULL));
+
+        if (ready < 0 && errno != EINTR)
+        {
+            failure = errno;
+            break;
+        }
+
+        if (ready <= 0)
+            continue;
+
+        ssize_t length = recv(engine->descriptor, buffer, sizeof(buffer), MSG_DONTWAIT);
+
+        if (length < 0)
+        {
+            if (errno == EAGAIN || errno == EINTR)
+                continue;
+            failure = errno;
+            break;
+        }
+
+        // End of file: the socket was shut down, nothing will answer
+        if (length == 0)
+        {
+            failure = ENODEV;
+            break;
+        }
+
+        int completed = dispatch(engine, commands, next, buffer, length);
+
+        pending -= completed;
+        done += completed;
+
+        for (int i = 0; i < next && !failure; i++)
+        {
+            if (commands[i].state == COMMAND_DONE && commands[i].result)
+                failure = commands[i].result;
+        }
+    }
+
+    // The descriptor failed: nothing more will complete
+    for (int i = 0; i < count; i++)
+    {
+        if (commands[i].state != COMMAND_DONE)
+            complete(engine, &commands[i], i < next ? failure : ECANCELED);
+    }
+
+    if (failure == 0)
+    {
+        for (int i = 0; i < count && !failure; i++)
+            failure = commands[i].result;
+    }
+
+    if (failure)
+    {
+        errno = failure;
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,82 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "hci_core.hpp"
+
+/*
+ * Flags of a command.
+ *     - HCI_COMMAND_BARRIER: sent once every previous command completed.
+ *     - HCI_COMMAND_NOWAIT: complete as soon as it is sent, e.g. a reset
+ *       whose completion is checked by the next command.
+ *     - HCI_COMMAND_UNPROFILED: neither bounded by nor feeding the learned
+ *       latencies, e.g. a command waiting out a reset.
+ */
+#define HCI_COMMAND_BARRIER    0x01
+#define HCI_COMMAND_NOWAIT     0x02
+#define HCI_COMMAND_UNPROFILED 0x04
+
+/*
+ * A command run by hci_engine_run().
+ *     - ogf, ocf: opcode.
+ *     - params, plen: command parameters.
+ *     - event: event completing the command, EVT_CMD_COMPLETE,
+ *       EVT_CMD_STATUS or EVT_VENDOR.
+ *     - timeout_ms: give up this long after the command was sent. This is a
+ *       default: a user policy replaces it, otherwise the latencies learned
+ *       on the adapter may lower it; the timeout applied is written back.
+ *     - check: validates the response, returns 0 or an errno value. May be
+ *       NULL.
+ *     - response, rsize: buffer receiving the return parameters.
+ * Filled by the engine:
+ *     - rlen: length of the return parameters.
+ *     - status: HCI status reported by the controller.
+ *     - result: 0 on success, or an errno value: EIO for an error status or
+ *       a hardware error, ETIMEDOUT, EPIPE when the device went away,
+ *       ECANCELED when an earlier command failed first.
+ *     - sent_ns, done_ns: times, comparable with hci_monotonic_ns().
+ */
+struct hci_command
+{
+    uint16_t ogf;
+    uint16_t ocf;
+    void const *params;
+    uint8_t plen;
+    uint8_t event;
+    int flags;
+    int timeout_ms;
+    int (*check)(struct hci_command const *command);
+    uint8_t *response;
+    int rsize;
+
+    int rlen;
+    uint8_t status;
+    int result;
+    uint64_t sent_ns;
+    uint64_t done_ns;
+    int state;
+};
+
+/*
+ * Command engine of a device: owns the device's pooled descriptor and the
+ * number of commands the controller accepts (Num_HCI_Command_Packets).
+ *     - window: most commands the controller accepted at once. A grant
+ *       doesn't count the commands sent while it was on its way, so the
+ *       commands in flight never exceed the window.
+ *     - manufacturer: company ID of the controller, selecting the timeout
+ *       policies; -1 until known.
+ */
+struct hci_engine
+{
+    int device_id;
+    int descriptor;
+    int credits;
+    int window;
+    int manufacturer;
+};
+
+int hci_engine_open(struct hci_engine *engine, int device_id, struct hci_error *error);
+void hci_engine_close(struct hci_engine *engine, int code);
+void hci_command_init(struct hci_command *command, uint16_t ogf, uint16_t ocf,
+                      void const *params, uint8_t plen, int timeout_ms);
+int hci_engine_run(struct hci_engine *engine, struct hci_command *commands, int count);
@@ -0,0 +1,34 @@
+#include <stdio.h>
+#include <string.h>
+
+#include <nan.h>
+
+#include "hci.hpp"
+#include "hci_core.hpp"
+
+/*
+ * Convert a failed HCI operation into a javascript error.
+ * Params:
+ *     - device_id: device ID, or -1 when the operation isn't bound to a device.
+ *     - error: details about the failed step.
+ * Return value: an Error with "errno", "code", "syscall", "step" and "id" set.
+ */
+v8::Local<v8::Value> hci_error_to_js(int device_id, struct hci_error const *error)
+{
+    char message[128];
+
+    if (device_id >= 0)
+        snprintf(message, sizeof(message), "%s failed on hci%d", error->step, device_id);
+    else
+        snprintf(message, sizeof(message), "%s failed", error->step);
+
+    v8::Local<v8::Value> exception = Nan::ErrnoException(error->code, error->step, message);
+    v8::Local<v8::Object> obj = exception.As<v8::Object>();
+
+    Nan::Set(obj, Nan::New("step").ToLocalChecked(), Nan::New(error->step).ToLocalChecked());
+
+    if (device_id >= 0)
+        Nan::Set(obj, Nan::New("id").ToLocalChecked(), Nan::New(device_id));
+
+    return exception;
+}
@@ -0,0 +1,303 @@
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include <mutex>
+
+#include <bluetooth/bluetooth.h>
+#include <bluetooth/hci.h>
+#include <bluetooth/hci_lib.h>
+
+#include "hci_backend.hpp"
+#include "hci_bdaddr.hpp"
+#include "hci_caps.hpp"
+#include "hci_events.hpp"
+#include "hci_executor.hpp"
+#include "hci_picker.hpp"
+#include "hci_pool.hpp"
+#include "hci_timeouts.hpp"
+
+/*
+ * Receiver of events emitted locally, e.g. resets issued by btim.
+ */
+struct hci_event_subscriber
+{
+    hci_event_hook hook;
+    void *arg;
+    struct hci_event_subscriber *next;
+};
+
+static std::mutex subscribers_lock;
+static struct hci_event_subscriber *subscribers;
+
+/*
+ * Delay before hci_events_sync() opens its socket again after a failure.
+ */
+#define EVENTS_RETRY_NS 1000000000ULL
+
+// Socket read by hci_events_sync(), and when it last failed to open
+static std::mutex sync_lock;
+static int sync_descriptor = -1;
+static uint64_t sync_failed_ns;
+
+static char const *event_names[] =
+{
+    "register", "unregister", "up", "down", "reset"
+};
+
+/*
+ * Get the current time.
+ * Return value: milliseconds since the epoch.
+ */
+static double now_ms(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_REALTIME, &now);
+
+    return now.tv_sec * 1e3 + now.tv_nsec / 1e6;
+}
+
+/*
+ * Drop what is cached about a device when its state changes.
+ * Params:
+ *     - event: device event.
+ */
+static void invalidate_caches(struct hci_device_event const *event)
+{
+    // Any change of state may change whether and how much it can be used
+    hci_picker_invalidate(event->device_id);
+
+    switch (event->type)
+    {
+    case HCI_DEVICE_REGISTER:
+    case HCI_DEVICE_UNREGISTER:
+        hci_caps_invalidate(event->device_id);
+        hci_timeout_invalidate(event->device_id);
+        // Fall through
+    case HCI_DEVICE_RESET:
+        hci_pool_invalidate(event->device_id);
+        hci_bdaddr_invalidate(event->device_id);
+        break;
+    }
+}
+
+/*
+ * Drop what is cached about every device, when events may have been missed.
+ */
+static void invalidate_all_caches(void)
+{
+    hci_caps_invalidate(-1);
+    hci_timeout_invalidate(-1);
+    hci_bdaddr_invalidate(-1);
+    hci_picker_invalidate(-1);
+}
+
+/*
+ * Open a socket receiving the kernel's device events (stack internal
+ * events of the raw HCI channel, not bound to any device).
+ * Params:
+ *     - error: details about the failed step.
+ * Return value: a non-blocking descriptor, or -1 on failure.
+ */
+int hci_events_open(struct hci_error *error)
+{
+    return hci_backend_get()->open_events(error);
+}
+
+/*
+ * Read the next device event.
+ * Params:
+ *     - descriptor: socket opened with hci_events_open().
+ *     - event: event to fill.
+ * Return values:
+ *     - 1: an event was read.
+ *     - 0: nothing to read right now.
+ *     - -1: on failure, errno is set.
+ */
+int hci_events_read(int descriptor, struct hci_device_event *event)
+{
+    unsigned char buffer[HCI_MAX_EVENT_SIZE + HCI_TYPE_LEN];
+
+    for (;;)
+    {
+        ssize_t length = recv(descriptor, buffer, sizeof(buffer), 0);
+
+        if (length < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            return -1;
+        }
+
+        // The simulated backend closed its end
+        if (length == 0)
+        {
+            errno = EPIPE;
+            return -1;
+        }
+
+        hci_event_hdr *header = (hci_event_hdr *)(buffer + HCI_TYPE_LEN);
+        evt_stack_internal *internal = (evt_stack_internal *)(header + 1);
+        evt_si_device *device = (evt_si_device *)internal->data;
+
+        if (length < (ssize_t)(HCI_TYPE_LEN + HCI_EVENT_HDR_SIZE +
+            sizeof(*internal) + sizeof(*device)) ||
+            header->evt != EVT_STACK_INTERNAL ||
+            btohs(internal->type) != EVT_SI_DEVICE)
+            continue;
+
+        // The kernel broadcasts no other device event, suspend and resume included
+        switch (btohs(device->event))
+        {
+        case HCI_DEV_REG:     event->type = HCI_DEVICE_REGISTER;   break;
+        case HCI_DEV_UNREG:   event->type = HCI_DEVICE_UNREGISTER; break;
+        case HCI_DEV_UP:      event->type = HCI_DEVICE_UP;         break;
+        case HCI_DEV_DOWN:    event->type = HCI_DEVICE_DOWN;       break;
+        default:              continue;
+        }
+
+        event->device_id = btohs(device->dev_id);
+        event->timestamp = now_ms();
+
+        invalidate_caches(event);
+
+        return 1;
+    }
+}
+
+/*
+ * Apply the device events received since the last call to the caches, for
+ * callers relying on them while nobody watches events. When events may have
+ * been missed, i.e. the socket was just opened or failed, every cache is
+ * dropped. A socket which fails to open is tried again after
+ * EVENTS_RETRY_NS only, the caches being kept meanwhile.
+ */
+void hci_events_sync(void)
+{
+    std::lock_guard<std::mutex> guard(sync_lock);
+    struct hci_device_event event;
+    struct hci_error error;
+    int result;
+
+    if (sync_descriptor < 0)
+    {
+        uint64_t now_ns = hci_monotonic_ns();
+
+        if (sync_failed_ns && now_ns - sync_failed_ns < EVENTS_RETRY_NS)
+            return;
+
+        if ((sync_descriptor = hci_events_open(&error)) < 0)
+            sync_failed_ns = now_ns;
+
+        invalidate_all_caches();
+        return;
+    }
+
+    while ((result = hci_events_read(sync_descriptor, &event)) > 0)
+        ;
+
+    if (result < 0)
+    {
+        close(sync_descriptor);
+        sync_descriptor = -1;
+        sync_failed_ns = 0;
+        invalidate_all_caches();
+    }
+}
+
+/*
+ * Close the socket read by hci_events_sync().
+ */
+void hci_events_close(void)
+{
+    std::lock_guard<std::mutex> guard(sync_lock);
+
+    if (sync_descriptor >= 0)
+    {
+        close(sync_descriptor);
+        sync_descriptor = -1;
+    }
+}
+
+/*
+ * Report an event the kernel doesn't broadcast, e.g. a reset issued by btim.
+ * Params:
+ *     - type: event type.
+ *     - device_id: device ID.
+ */
+void hci_events_emit(int type, int device_id)
+{
+    struct hci_device_event event;
+
+    event.type = type;
+    event.device_id = device_id;
+    event.timestamp = now_ms();
+
+    invalidate_caches(&event);
+
+    std::lock_guard<std::mutex> guard(subscribers_lock);
+
+    for (struct hci_event_subscriber *subscriber = subscribers; subscriber; subscriber = subscriber->next)
+        subscriber->hook(&event, subscriber->arg);
+}
+
+/*
+ * Receive the events reported with hci_events_emit(). The hook is called on
+ * the emitting thread.
+ * Params:
+ *     - hook: function to call.
+ *     - arg: argument given to the hook.
+ */
+void hci_events_subscribe(hci_event_hook hook, void *arg)
+{
+    struct hci_event_subscriber *subscriber = new hci_event_subscriber;
+
+    subscriber->hook = hook;
+    subscriber->arg = arg;
+
+    std::lock_guard<std::mutex> guard(subscribers_lock);
+
+    subscriber->next = subscribers;
+    subscribers = subscriber;
+}
+
+/*
+ * Stop receiving the events reported with hci_events_emit().
+ * Params:
+ *     - hook: function given to hci_events_subscribe().
+ *     - arg: argument given to hci_events_subscribe().
+ */
+void hci_events_unsubscribe(hci_event_hook hook, void *arg)
+{
+    std::lock_guard<std::mutex> guard(subscribers_lock);
+
+    for (struct hci_event_subscriber **link = &subscribers; *link; link = &(*link)->next)
+    {
+        struct hci_event_subscriber *subscriber = *link;
+
+        if (subscriber->hook == hook && subscriber->arg == arg)
+        {
+            *link = subscriber->next;
+            delete subscriber;
+            return;
+        }
+    }
+}
+
+/*
+ * Get the name of an event type.
+ * Params:
+ *     - type: event type.
+ * Return value: the name, as reported to javascript.
+ */
+char const *hci_device_event_name(int type)
+{
+    if (type < 0 || type > HCI_DEVICE_RESET)
+        return "unknown";
+
+    return event_names[type];
+}
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "hci_core.hpp"
+
+enum hci_device_event_type
+{
+    HCI_DEVICE_REGISTER,
+    HCI_DEVICE_UNREGISTER,
+    HCI_DEVICE_UP,
+    HCI_DEVICE_DOWN,
+    HCI_DEVICE_RESET
+};
+
+/*
+ * A change of a device's state.
+ *     - timestamp: milliseconds since the epoch.
+ */
+struct hci_device_event
+{
+    int type;
+    int device_id;
+    double timestamp;
+};
+
+typedef void (*hci_event_hook)(struct hci_device_event const *event, void *arg);
+
+int hci_events_open(struct hci_error *error);
+int hci_events_read(int descriptor, struct hci_device_event *event);
+void hci_events_sync(void);
+void hci_events_close(void);
+void hci_events_emit(int type, int device_id);
+void hci_events_subscribe(hci_event_hook hook, void *arg);
+void hci_events_unsubscribe(hci_event_hook hook, void *arg);
+char const *hci_device_event_name(int type);
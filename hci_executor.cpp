@@ -0,0 +1,292 @@
+#include <time.h>
+
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+#include "hci_executor.hpp"
+
+/*
+ * Time a lane waits for a task before its thread exits. Lanes come back on
+ * the next use, so ids which are never used again cost nothing.
+ */
+#define LANE_IDLE_MS 30000
+
+/*
+ * A serialized queue of tasks for one device, served by its own thread.
+ *     - running: held while a task of the device executes, so other callers
+ *       can take their turn with hci_executor_lock() or
+ *       hci_executor_trylock().
+ *     - users: callers between get_lane() and put_lane(), guarded by
+ *       lanes_lock. A lane is only reaped when it has none.
+ */
+struct hci_lane
+{
+    int device_id;
+    std::mutex lock;
+    std::condition_variable ready;
+    std::mutex running;
+    struct hci_task *head;
+    struct hci_task *tail;
+    int users;
+    struct hci_lane *next;
+};
+
+static std::mutex lanes_lock;
+static struct hci_lane *lanes;
+
+/*
+ * Get a monotonic timestamp.
+ * Return value: nanoseconds since an arbitrary point.
+ */
+uint64_t hci_monotonic_ns(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+/*
+ * Find the lane of a device. lanes_lock must be held.
+ * Params:
+ *     - device_id: device ID.
+ * Return value: the lane, or NULL when the device has none.
+ */
+static struct hci_lane *find_lane(int device_id)
+{
+    for (struct hci_lane *lane = lanes; lane; lane = lane->next)
+    {
+        if (lane->device_id == device_id)
+            return lane;
+    }
+
+    return NULL;
+}
+
+/*
+ * Remove an idle lane, unless a task or a user came meanwhile.
+ * Params:
+ *     - lane: lane whose thread is about to exit.
+ * Return values:
+ *     - false: the lane is still needed.
+ *     - true: the lane was freed.
+ */
+static bool reap_lane(struct hci_lane *lane)
+{
+    std::lock_guard<std::mutex> guard(lanes_lock);
+
+    lane->lock.lock();
+    bool idle = lane->head == NULL && lane->users == 0;
+    lane->lock.unlock();
+
+    if (!idle)
+        return false;
+
+    for (struct hci_lane **link = &lanes; *link; link = &(*link)->next)
+    {
+        if (*link == lane)
+        {
+            *link = lane->next;
+            break;
+        }
+    }
+
+    delete lane;
+    return true;
+}
+
+/*
+ * Serve the tasks of a lane until it stays idle for LANE_IDLE_MS.
+ * Params:
+ *     - lane: lane to serve.
+ */
+static void lane_loop(struct hci_lane *lane)
+{
+    for (;;)
+    {
+        struct hci_task *task;
+
+        {
+            std::unique_lock<std::mutex> guard(lane->lock);
+
+            while (lane->head == NULL)
+            {
+                if (lane->ready.wait_for(guard, std::chrono::milliseconds(LANE_IDLE_MS)) == std::cv_status::no_timeout ||
+                    lane->head != NULL)
+                    continue;
+
+                guard.unlock();
+                if (reap_lane(lane))
+                    return;
+                guard.lock();
+            }
+
+            task = lane->head;
+            lane->head = task->next;
+            if (lane->head == NULL)
+                lane->tail = NULL;
+        }
+
+        struct hci_completion_queue *queue = task->queue;
+
+        lane->running.lock();
+        task->started_ns = hci_monotonic_ns();
+        task->execute(task);
+        lane->running.unlock();
+
+        if (queue == NULL)
+            continue;
+
+        task->finished_ns = hci_monotonic_ns();
+        task->next = NULL;
+
+        queue->lock.lock();
+        if (queue->tail)
+            queue->tail->next = task;
+        else
+            queue->head = task;
+        queue->tail = task;
+
+        // Notified under the lock: once it is released, the queue may be freed
+        queue->notify(queue->notify_arg);
+        queue->lock.unlock();
+    }
+}
+
+/*
+ * Find the lane of a device, creating it on first use, and keep it from
+ * being reaped until put_lane().
+ * Params:
+ *     - device_id: device ID.
+ * Return value: the lane.
+ */
+static struct hci_lane *get_lane(int device_id)
+{
+    std::lock_guard<std::mutex> guard(lanes_lock);
+    struct hci_lane *lane = find_lane(device_id);
+
+    if (lane == NULL)
+    {
+        lane = new hci_lane();
+        lane->device_id = device_id;
+        lane->head = lane->tail = NULL;
+        lane->users = 0;
+        lane->next = lanes;
+        lanes = lane;
+
+        std::thread(lane_loop, lane).detach();
+    }
+
+    lane->users++;
+    return lane;
+}
+
+/*
+ * Let a lane taken with get_lane() be reaped once idle.
+ * Params:
+ *     - lane: lane.
+ */
+static void put_lane(struct hci_lane *lane)
+{
+    std::lock_guard<std::mutex> guard(lanes_lock);
+
+    lane->users--;
+}
+
+/*
+ * Queue a task on its device's lane.
+ * Params:
+ *     - task: task to run. device_id, execute, complete and queue must be set.
+ */
+void hci_executor_submit(struct hci_task *task)
+{
+    struct hci_lane *lane = get_lane(task->device_id);
+
+    task->queued_ns = hci_monotonic_ns();
+    task->started_ns = task->finished_ns = 0;
+    task->next = NULL;
+
+    lane->lock.lock();
+    if (lane->tail)
+        lane->tail->next = task;
+    else
+        lane->head = task;
+    lane->tail = task;
+
+    lane->ready.notify_one();
+    lane->lock.unlock();
+
+    // The queued task keeps the lane alive from now on
+    put_lane(lane);
+}
+
+/*
+ * Call complete() on every finished task of a completion queue.
+ * Params:
+ *     - queue: completion queue.
+ */
+void hci_executor_drain(struct hci_completion_queue *queue)
+{
+    struct hci_task *task;
+
+    queue->lock.lock();
+    task = queue->head;
+    queue->head = queue->tail = NULL;
+    queue->lock.unlock();
+
+    while (task)
+    {
+        struct hci_task *next = task->next;
+
+        task->complete(task);
+        task = next;
+    }
+}
+
+/*
+ * Wait until no task of a device is running and keep the lane busy.
+ * Params:
+ *     - device_id: device ID.
+ */
+void hci_executor_lock(int device_id)
+{
+    // The lane stays taken until hci_executor_unlock()
+    get_lane(device_id)->running.lock();
+}
+
+/*
+ * Keep the lane of a device busy if no task of it is running, without
+ * waiting: the main thread can't wait for a task which may take seconds.
+ * Params:
+ *     - device_id: device ID.
+ * Return values:
+ *     - false: a task of the device is running.
+ *     - true: the lane is locked.
+ */
+bool hci_executor_trylock(int device_id)
+{
+    struct hci_lane *lane = get_lane(device_id);
+
+    if (lane->running.try_lock())
+        return true;
+
+    put_lane(lane);
+    return false;
+}
+
+/*
+ * Release a lane locked with hci_executor_lock() or hci_executor_trylock().
+ * Params:
+ *     - device_id: device ID.
+ */
+void hci_executor_unlock(int device_id)
+{
+    std::lock_guard<std::mutex> guard(lanes_lock);
+    struct hci_lane *lane = find_lane(device_id);
+
+    lane->running.unlock();
+    lane->users--;
+}
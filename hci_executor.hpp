@@ -0,0 +1,50 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <mutex>
+
+struct hci_completion_queue;
+
+/*
+ * A unit of work bound to a device.
+ *     - device_id: device the task talks to. Tasks of a device run one at a
+ *       time, in submission order.
+ *     - execute: called on the device's worker thread.
+ *     - complete: called by hci_executor_drain() on the thread owning the
+ *       completion queue. It owns the task from then on.
+ *     - queue: completion queue, or NULL when execute() owns the task.
+ */
+struct hci_task
+{
+    int device_id;
+    void (*execute)(struct hci_task *task);
+    void (*complete)(struct hci_task *task);
+    void *data;
+    struct hci_completion_queue *queue;
+    uint64_t queued_ns;
+    uint64_t started_ns;
+    uint64_t finished_ns;
+    struct hci_task *next;
+};
+
+/*
+ * Tasks done by a worker thread, waiting for their complete() call.
+ *     - notify: called from the worker thread after a task was added, with
+ *       the lock held.
+ */
+struct hci_completion_queue
+{
+    std::mutex lock;
+    struct hci_task *head;
+    struct hci_task *tail;
+    void (*notify)(void *arg);
+    void *notify_arg;
+};
+
+uint64_t hci_monotonic_ns(void);
+void hci_executor_submit(struct hci_task *task);
+void hci_executor_drain(struct hci_completion_queue *queue);
+void hci_executor_lock(int device_id);
+bool hci_executor_trylock(int device_id);
+void hci_executor_unlock(int device_id);
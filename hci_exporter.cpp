@@ -0,0 +1,539 @@
+#include <errno.h>
+#include <poll.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include <new>
+
+#include <bluetooth/bluetooth.h>
+#include <bluetooth/hci.h>
+#include <bluetooth/hci_lib.h>
+
+#include "hci_backend.hpp"
+#include "hci_executor.hpp"
+#include "hci_exporter.hpp"
+#include "hci_pool.hpp"
+
+// Time a scraper gets to send its request and read the answer
+#define EXPORTER_CLIENT_TIMEOUT_US 200000
+
+/*
+ * Metric families of the counters, in the order of the HCI_EXPORTER_*
+ * counters.
+ */
+static struct
+{
+    char const *name;
+    char const *help;
+} const exporter_counters[HCI_EXPORTER_COUNTERS] =
+{
+    { "btim_rx_bytes",       "Bytes received" },
+    { "btim_rx_acl_packets", "ACL packets received" },
+    { "btim_rx_sco_packets", "SCO packets received" },
+    { "btim_rx_events",      "HCI events received" },
+    { "btim_rx_errors",      "Receive errors" },
+    { "btim_tx_bytes",       "Bytes sent" },
+    { "btim_tx_acl_packets", "ACL packets sent" },
+    { "btim_tx_sco_packets", "SCO packets sent" },
+    { "btim_tx_commands",    "HCI commands sent" },
+    { "btim_tx_errors",      "Send errors" },
+};
+
+/*
+ * Text being rendered into a fixed size buffer. Once full, the rest is
+ * dropped.
+ */
+struct exporter_text
+{
+    char *buffer;
+    size_t size;
+    size_t length;
+};
+
+static void append(struct exporter_text *text, char const *format, ...)
+{
+    va_list arguments;
+    int length;
+
+    if (text->length >= text->size)
+        return;
+
+    va_start(arguments, format);
+    length = vsnprintf(text->buffer + text->length, text->size - text->length, format, arguments);
+    va_end(arguments);
+
+    if (length > 0)
+        text->length += (size_t)length < text->size - text->length ? length : text->size - text->length;
+}
+
+/*
+ * Sample the counters of every adapter, and update their totals and rates.
+ * Params:
+ *     - exporter: exporter.
+ *     - devices_list: buffer for HCIGETDEVLIST.
+ */
+static void exporter_sample(struct hci_exporter *exporter, struct hci_dev_list_req *devices_list)
+{
+    struct hci_dev_info device_info;
+    struct hci_error error;
+    bool seen[HCI_MAX_DEV] = { false };
+    uint64_t now = hci_monotonic_ns();
+    double elapsed = (now - exporter->sampled_ns) / 1e9;
+    int control;
+
+    devices_list->dev_num = HCI_MAX_DEV;
+
+    if ((control = hci_pool_control_acquire(&error)) < 0)
+    {
+        exporter->errors++;
+        return;
+    }
+
+    if (hci_backend_ioctl(control, HCIGETDEVLIST, (void *)devices_list) < 0)
+    {
+        hci_pool_control_release(control);
+        exporter->errors++;
+        return;
+    }
+
+    for (int i = 0; i < devices_list->dev_num; i++)
+    {
+        device_info.dev_id = devices_list->dev_req[i].dev_id;
+
+        if (hci_backend_ioctl(control, HCIGETDEVINFO, (void *)&device_info) < 0)
+        {
+            exporter->errors++;
+            continue;
+        }
+
+        struct hci_exporter_device *device = &exporter->devices[device_info.dev_id % HCI_MAX_DEV];
+        struct hci_dev_stats *stats = &device_info.stat;
+        uint32_t const counters[HCI_EXPORTER_COUNTERS] =
+        {
+            stats->byte_rx, stats->acl_rx, stats->sco_rx, stats->evt_rx, stats->err_rx,
+            stats->byte_tx, stats->acl_tx, stats->sco_tx, stats->cmd_tx, stats->err_tx
+        };
+        uint32_t deltas[HCI_EXPORTER_COUNTERS];
+
+        // Another adapter took the slot
+        if (device->sampled && device->info.dev_id != device_info.dev_id)
+            memset(device, 0, sizeof(*device));
+
+        for (int counter = 0; counter < HCI_EXPORTER_COUNTERS; counter++)
+        {
+            uint32_t delta = counters[counter] - device->last[counter];
+
+            // Counters start over when the adapter comes back; a drop of
+            // more than half the range is a reset rather than a wrap
+            if (!device->present || (counters[counter] < device->last[counter] && delta >= 0x80000000u))
+                delta = counters[counter];
+
+            deltas[counter] = delta;
+            device->totals[counter] += delta;
+            device->rates[counter] = device->present && elapsed > 0 ? delta / elapsed : 0;
+            device->last[counter] = counters[counter];
+        }
+
+        uint32_t rx_packets = deltas[HCI_EXPORTER_RX_ACL] + deltas[HCI_EXPORTER_RX_SCO] +
+                              deltas[HCI_EXPORTER_RX_EVENTS] + deltas[HCI_EXPORTER_RX_ERRORS];
+        uint32_t tx_packets = deltas[HCI_EXPORTER_TX_ACL] + deltas[HCI_EXPORTER_TX_SCO] +
+                              deltas[HCI_EXPORTER_TX_COMMANDS] + deltas[HCI_EXPORTER_TX_ERRORS];
+
+        device->rx_error_ratio = device->present && rx_packets ?
+            (double)deltas[HCI_EXPORTER_RX_ERRORS] / rx_packets : 0;
+        device->tx_error_ratio = device->present && tx_packets ?
+            (double)deltas[HCI_EXPORTER_TX_ERRORS] / tx_packets : 0;
+
+        device->info = device_info;
+        device->present = true;
+        device->sampled = true;
+        seen[device_info.dev_id % HCI_MAX_DEV] = true;
+    }
+
+    hci_pool_control_release(control);
+
+    for (int i = 0; i < HCI_MAX_DEV; i++)
+    {
+        if (!seen[i])
+            exporter->devices[i].present = false;
+    }
+
+    exporter->sampled_ns = now;
+    exporter->samples++;
+}
+
+/*
+ * Render a gauge family of the adapters present.
+ * Params:
+ *     - exporter: exporter.
+ *     - text: text rendered.
+ *     - name, help: family.
+ *     - field: offset of the double to render in hci_exporter_device.
+ */
+static void render_gauge(struct hci_exporter *exporter, struct exporter_text *text,
+                         char const *name, char const *help, size_t field)
+{
+    append(text, "# TYPE %s gauge\n# HELP %s %s.\n", name, name, help);
+
+    for (int i = 0; i < HCI_MAX_DEV; i++)
+    {
+        struct hci_exporter_device *device = &exporter->devices[i];
+
+        if (device->present)
+            append(text, "%s{adapter=\"%s\"} %.9g\n", name, device->info.name,
+                   *(double *)((char *)device + field));
+    }
+}
+
+/*
+ * Render the metrics of the adapters into exporter->rendering, then make
+ * them the text served.
+ * Params:
+ *     - exporter: exporter.
+ */
+static void exporter_render(struct hci_exporter *exporter)
+{
+    struct exporter_text text = { exporter->rendering, HCI_EXPORTER_TEXT_SIZE, 0 };
+    char name[64], help[96];
+
+    append(&text, "# TYPE btim_adapter info\n# HELP btim_adapter Adapters present.\n");
+
+    for (int i = 0; i < HCI_MAX_DEV; i++)
+    {
+        struct hci_exporter_device *device = &exporter->devices[i];
+        uint8_t const *address = device->info.bdaddr.b;
+
+        if (device->present)
+            append(&text, "btim_adapter_info{adapter=\"%s\",address=\"%02X:%02X:%02X:%02X:%02X:%02X\"} 1\n",
+                   device->info.name, address[5], address[4], address[3], address[2], address[1], address[0]);
+    }
+
+    append(&text, "# TYPE btim_adapter_up gauge\n# HELP btim_adapter_up Whether the adapter is up.\n");
+
+    for (int i = 0; i < HCI_MAX_DEV; i++)
+    {
+        struct hci_exporter_device *device = &exporter->devices[i];
+
+        if (device->present)
+            append(&text, "btim_adapter_up{adapter=\"%s\"} %d\n", device->info.name,
+                   hci_test_bit(HCI_UP, &device->info.flags) ? 1 : 0);
+    }
+
+    for (int counter = 0; counter < HCI_EXPORTER_COUNTERS; counter++)
+    {
+        char const *family = exporter_counters[counter].name;
+
+        append(&text, "# TYPE %s counter\n# HELP %s %s.\n", family, family, exporter_counters[counter].help);
+
+        for (int i = 0; i < HCI_MAX_DEV; i++)
+        {
+            struct hci_exporter_device *device = &exporter->devices[i];
+
+            if (device->present)
+                append(&text, "%s_total{adapter=\"%s\"} %llu\n", family, device->info.name,
+                       (unsigned long long)device->totals[counter]);
+        }
+    }
+
+    for (int counter = 0; counter < HCI_EXPORTER_COUNTERS; counter++)
+    {
+        snprintf(name, sizeof(name), "%s_rate", exporter_counters[counter].name);
+        snprintf(help, sizeof(help), "%s per second, over the last interval", exporter_counters[counter].help);
+        render_gauge(exporter, &text, name, help,
+                     offsetof(struct hci_exporter_device, rates) + counter * sizeof(double));
+    }
+
+    render_gauge(exporter, &text, "btim_rx_error_ratio", "Receive errors per packet, over the last interval",
+                 offsetof(struct hci_exporter_device, rx_error_ratio));
+    render_gauge(exporter, &text, "btim_tx_error_ratio", "Send errors per packet, over the last interval",
+                 offsetof(struct hci_exporter_device, tx_error_ratio));
+
+    append(&text, "# TYPE btim_exporter_samples counter\n# HELP btim_exporter_samples Samples of the adapters.\n"
+                  "btim_exporter_samples_total %llu\n", (unsigned long long)exporter->samples.load());
+    append(&text, "# TYPE btim_exporter_errors counter\n# HELP btim_exporter_errors Failed reads of the adapters.\n"
+                  "btim_exporter_errors_total %llu\n", (unsigned long long)exporter->errors.load());
+    append(&text, "# EOF\n");
+
+    std::lock_guard<std::mutex> guard(exporter->lock);
+
+    exporter->rendering = exporter->text;
+    exporter->text = text.buffer;
+    exporter->length = text.length;
+}
+
+/*
+ * Answer a scraper with the last rendered text, whatever it asked for.
+ * Only the exporter thread swaps the text, so it is read without the lock.
+ * Params:
+ *     - exporter: exporter.
+ */
+static void exporter_serve(struct hci_exporter *exporter)
+{
+    struct timeval timeout = { 0, EXPORTER_CLIENT_TIMEOUT_US };
+    char request[1024], header[192];
+    int client, length;
+
+    if ((client = accept4(exporter->listener, NULL, NULL, SOCK_CLOEXEC)) < 0)
+        return;
+
+    setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+    if (recv(client, request, sizeof(request), 0) > 0)
+    {
+        length = snprintf(header, sizeof(header),
+                          "HTTP/1.1 200 OK\r\n"
+                          "Content-Type: application/openmetrics-text; version=1.0.0; charset=utf-8\r\n"
+                          "Content-Length: %zu\r\n"
+                          "Connection: close\r\n\r\n", exporter->length);
+
+        if (send(client, header, length, MSG_NOSIGNAL | MSG_MORE) == length &&
+            send(client, exporter->text, exporter->length, MSG_NOSIGNAL) >= 0)
+            exporter->scrapes++;
+    }
+
+    close(client);
+}
+
+/*
+ * Sample, render and serve until stopped.
+ * Params:
+ *     - exporter: exporter.
+ */
+static void exporter_loop(struct hci_exporter *exporter)
+{
+    // Allocated once, the loop itself doesn't allocate
+    unsigned char buffer[sizeof(struct hci_dev_list_req) + HCI_MAX_DEV * sizeof(struct hci_dev_req)];
+    struct hci_dev_list_req *devices_list = (struct hci_dev_list_req *)buffer;
+    uint64_t interval_ns = exporter->options.interval_ms * 1000000ULL;
+    uint64_t next = hci_monotonic_ns() + interval_ns;
+    struct pollfd descriptors[2];
+
+    descriptors[0].fd = exporter->wakeup;
+    descriptors[0].events = POLLIN;
+    descriptors[1].fd = exporter->listener;
+    descriptors[1].events = POLLIN;
+
+    while (exporter->running.load(std::memory_order_relaxed))
+    {
+        uint64_t now = hci_monotonic_ns();
+
+        if (now >= next)
+        {
+            exporter_sample(exporter, devices_list);
+            exporter_render(exporter);
+
+            // Keep the pace, unless far behind
+            next += interval_ns;
+            if (next <= now)
+                next = now + interval_ns;
+            continue;
+        }
+
+        if (poll(descriptors, exporter->listener >= 0 ? 2 : 1, (next - now + 999999) / 1000000) < 0 &&
+            errno != EINTR)
+            break;
+
+        if (exporter->listener >= 0 && descriptors[1].revents)
+            exporter_serve(exporter);
+    }
+}
+
+/*
+ * Open the HTTP server socket of an exporter.
+ * Params:
+ *     - exporter: exporter, with its options set.
+ *     - error: details about the failed step.
+ * Return values:
+ *     - EXIT_FAILURE: on failure.
+ *     - EXIT_SUCCESS: on success, or when not serving.
+ */
+static int exporter_listen(struct hci_exporter *exporter, struct hci_error *error)
+{
+    struct hci_exporter_options *options = &exporter->options;
+    struct sockaddr_storage address;
+    socklen_t address_size;
+    struct stat status;
+    int one = 1;
+
+    memset(&address, 0, sizeof(address));
+
+    if (options->path[0])
+    {
+        struct sockaddr_un *local = (struct sockaddr_un *)&address;
+
+        local->sun_family = AF_UNIX;
+        strncpy(local->sun_path, options->path, sizeof(local->sun_path) - 1);
+        address_size = sizeof(*local);
+
+        // A socket left by a previous exporter
+        if (stat(options->path, &status) == 0 && S_ISSOCK(status.st_mode))
+            unlink(options->path);
+    }
+    else if (options->port)
+    {
+        struct sockaddr_in *inet = (struct sockaddr_in *)&address;
+
+        inet->sin_family = AF_INET;
+        inet->sin_port = htons(options->port);
+        inet->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        address_size = sizeof(*inet);
+    }
+    else
+        return EXIT_SUCCESS;
+
+    if ((exporter->listener = socket(address.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0)
+        return hci_set_error(error, errno, "socket");
+
+    if (address.ss_family == AF_INET)
+        setsockopt(exporter->listener, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    if (bind(exporter->listener, (struct sockaddr *)&address, address_size) < 0)
+        return hci_set_error(error, errno, "bind");
+
+    if (listen(exporter->listener, 16) < 0)
+        return hci_set_error(error, errno, "listen");
+
+    return EXIT_SUCCESS;
+}
+
+/*
+ * Free the resources of an exporter.
+ * Params:
+ *     - exporter: exporter.
+ */
+static void exporter_close(struct hci_exporter *exporter)
+{
+    if (exporter->listener >= 0)
+    {
+        close(exporter->listener);
+        if (exporter->options.path[0])
+            unlink(exporter->options.path);
+    }
+
+    if (exporter->wakeup >= 0)
+        close(exporter->wakeup);
+
+    std::lock_guard<std::mutex> guard(exporter->lock);
+
+    delete[] exporter->text;
+    delete[] exporter->rendering;
+
+    exporter->listener = -1;
+    exporter->wakeup = -1;
+    exporter->text = NULL;
+    exporter->rendering = NULL;
+}
+
+/*
+ * Start sampling the adapters into OpenMetrics text. The adapters are
+ * sampled once before returning, so the text is never empty.
+ * Params:
+ *     - exporter: exporter to start.
+ *     - options: interval and where to serve the text.
+ *     - error: details about the failed step.
+ * Return values:
+ *     - EXIT_FAILURE: on failure.
+ *     - EXIT_SUCCESS: on success.
+ */
+int hci_exporter_start(struct hci_exporter *exporter, struct hci_exporter_options const *options,
+                       struct hci_error *error)
+{
+    unsigned char buffer[sizeof(struct hci_dev_list_req) + HCI_MAX_DEV * sizeof(struct hci_dev_req)];
+
+    if (options->interval_ms <= 0 || options->port < 0 || options->port > 0xffff ||
+        (options->port && options->path[0]))
+        return hci_set_error(error, EINVAL, "exporter");
+
+    exporter->options = *options;
+    exporter->options.path[sizeof(exporter->options.path) - 1] = '\0';
+    exporter->listener = -1;
+    exporter->length = 0;
+    exporter->sampled_ns = hci_monotonic_ns();
+    exporter->samples = 0;
+    exporter->errors = 0;
+    exporter->scrapes = 0;
+    memset(exporter->devices, 0, sizeof(exporter->devices));
+
+    exporter->text = new (std::nothrow) char[HCI_EXPORTER_TEXT_SIZE];
+    exporter->rendering = new (std::nothrow) char[HCI_EXPORTER_TEXT_SIZE];
+
+    if ((exporter->wakeup = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) < 0)
+    {
+        hci_set_error(error, errno, "eventfd");
+        exporter_close(exporter);
+        return EXIT_FAILURE;
+    }
+
+    if (!exporter->text || !exporter->rendering)
+    {
+        hci_set_error(error, ENOMEM, "exporter");
+        exporter_close(exporter);
+        return EXIT_FAILURE;
+    }
+
+    if (exporter_listen(exporter, error) != EXIT_SUCCESS)
+    {
+        exporter_close(exporter);
+        return EXIT_FAILURE;
+    }
+
+    exporter_sample(exporter, (struct hci_dev_list_req *)buffer);
+    exporter_render(exporter);
+
+    exporter->running = true;
+    exporter->thread = std::thread(exporter_loop, exporter);
+
+    return EXIT_SUCCESS;
+}
+
+/*
+ * Stop an exporter and wait for its thread.
+ * Params:
+ *     - exporter: exporter to stop.
+ */
+void hci_exporter_stop(struct hci_exporter *exporter)
+{
+    uint64_t one = 1;
+
+    if (!exporter->running.exchange(false))
+        return;
+
+    // Ignored: the poll timeout notices the stop anyway
+    (void)!write(exporter->wakeup, &one, sizeof(one));
+
+    exporter->thread.join();
+    exporter_close(exporter);
+}
+
+/*
+ * Copy the last rendered text: a scrape doesn't sample nor render.
+ * Params:
+ *     - exporter: exporter.
+ *     - buffer: receives the text, not NUL terminated.
+ *     - size: size of the buffer, HCI_EXPORTER_TEXT_SIZE fits any text.
+ * Return value: length of the text copied, 0 when stopped.
+ */
+size_t hci_exporter_render(struct hci_exporter *exporter, char *buffer, size_t size)
+{
+    std::lock_guard<std::mutex> guard(exporter->lock);
+
+    if (!exporter->text)
+        return 0;
+
+    size_t length = exporter->length < size ? exporter->length : size;
+
+    memcpy(buffer, exporter->text, length);
+    exporter->scrapes++;
+
+    return length;
+}
@@ -0,0 +1,100 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <atomic>
+#include <mutex>
+#include <thread>
+
+#include "hci_core.hpp"
+
+/*
+ * Size of the rendered text: enough for every metric of HCI_MAX_DEV
+ * adapters.
+ */
+#define HCI_EXPORTER_TEXT_SIZE (64 * 1024)
+
+/*
+ * Counters of hci_dev_stats, in the order of hci_exporter_device.totals.
+ */
+enum
+{
+    HCI_EXPORTER_RX_BYTES,
+    HCI_EXPORTER_RX_ACL,
+    HCI_EXPORTER_RX_SCO,
+    HCI_EXPORTER_RX_EVENTS,
+    HCI_EXPORTER_RX_ERRORS,
+    HCI_EXPORTER_TX_BYTES,
+    HCI_EXPORTER_TX_ACL,
+    HCI_EXPORTER_TX_SCO,
+    HCI_EXPORTER_TX_COMMANDS,
+    HCI_EXPORTER_TX_ERRORS,
+    HCI_EXPORTER_COUNTERS
+};
+
+/*
+ * An adapter as last sampled, indexed by dev_id modulo HCI_MAX_DEV.
+ *     - present: seen by the last sample.
+ *     - sampled: seen at least once, the slot is in use.
+ *     - last: raw 32 bits kernel counters.
+ *     - totals: counters made monotonic: wraps are carried over, and a
+ *       reset (HCIDEVRESETSTAT, adapter plugged again) doesn't go back.
+ *     - rates: per second, over the last interval.
+ *     - rx_error_ratio, tx_error_ratio: errors per packet, over the last
+ *       interval.
+ */
+struct hci_exporter_device
+{
+    bool present;
+    bool sampled;
+    struct hci_dev_info info;
+    uint32_t last[HCI_EXPORTER_COUNTERS];
+    uint64_t totals[HCI_EXPORTER_COUNTERS];
+    double rates[HCI_EXPORTER_COUNTERS];
+    double rx_error_ratio;
+    double tx_error_ratio;
+};
+
+/*
+ * Options of an exporter.
+ *     - interval_ms: delay between two samples.
+ *     - port: serve the metrics over HTTP on 127.0.0.1:port, 0 for none.
+ *     - path: serve them on a Unix socket, empty for none.
+ */
+struct hci_exporter_options
+{
+    int interval_ms;
+    int port;
+    char path[108];
+};
+
+/*
+ * An exporter: a thread samples the adapters each interval and renders
+ * OpenMetrics text into `rendering`, then swaps it with `text`. Scrapes only
+ * copy `text`.
+ *     - wakeup: eventfd stopping the thread.
+ *     - listener: HTTP server socket, -1 when not serving.
+ *     - samples, errors, scrapes: exporter's own counters.
+ */
+struct hci_exporter
+{
+    std::thread thread;
+    std::mutex lock;
+    std::atomic<bool> running;
+    int wakeup;
+    int listener;
+    struct hci_exporter_options options;
+    struct hci_exporter_device devices[HCI_MAX_DEV];
+    uint64_t sampled_ns;
+    char *text;
+    char *rendering;
+    size_t length;
+    std::atomic<uint64_t> samples;
+    std::atomic<uint64_t> errors;
+    std::atomic<uint64_t> scrapes;
+};
+
+int hci_exporter_start(struct hci_exporter *exporter, struct hci_exporter_options const *options,
+                       struct hci_error *error);
+void hci_exporter_stop(struct hci_exporter *exporter);
+size_t hci_exporter_render(struct hci_exporter *exporter, char *buffer, size_t size);
@@ -0,0 +1,191 @@
+#include <string.h>
+
+#include <bluetooth/bluetooth.h>
+#include <bluetooth/hci.h>
+
+#include <nan.h>
+
+#include "hci.hpp"
+#include "hci_exporter.hpp"
+
+/*
+ * An exporter owned by javascript. While serving over HTTP, it is kept
+ * alive until stopped.
+ */
+class HciExporter : public Nan::ObjectWrap
+{
+public:
+    static void Init(v8::Local<v8::Object> exports);
+
+private:
+    struct hci_exporter exporter;
+    bool serving;
+
+    HciExporter() : serving(false) { exporter.running = false; }
+    ~HciExporter()
+    {
+        node::RemoveEnvironmentCleanupHook(v8::Isolate::GetCurrent(), Cleanup, this);
+        hci_exporter_stop(&exporter);
+    }
+
+    static void Cleanup(void *arg);
+    static void New(const Nan::FunctionCallbackInfo<v8::Value>& info);
+    static void Render(const Nan::FunctionCallbackInfo<v8::Value>& info);
+    static void Stop(const Nan::FunctionCallbackInfo<v8::Value>& info);
+    static void Stats(const Nan::FunctionCallbackInfo<v8::Value>& info);
+};
+
+/*
+ * Stop an exporter when its environment goes away, closing its sockets.
+ * Params:
+ *     - arg: the exporter.
+ */
+void HciExporter::Cleanup(void *arg)
+{
+    hci_exporter_stop(&((HciExporter *)arg)->exporter);
+}
+
+/*
+ * Create and start an exporter.
+ * Params:
+ *     - info: Contains the sample interval in milliseconds, a TCP port on
+ *       127.0.0.1 (0 for none) and a Unix socket path ('' for none).
+ */
+void HciExporter::New(const Nan::FunctionCallbackInfo<v8::Value>& info)
+{
+    struct hci_exporter_options options;
+    struct hci_error error;
+
+    if (!info.IsConstructCall())
+    {
+        Nan::ThrowTypeError("Use new");
+        return;
+    }
+
+    if (!info[0]->IsNumber() || !info[1]->IsNumber() || !info[2]->IsString())
+    {
+        Nan::ThrowTypeError("Arguments should be two numbers and a string");
+        return;
+    }
+
+    Nan::Utf8String path(info[2]);
+
+    if ((size_t)path.length() >= sizeof(options.path))
+    {
+        Nan::ThrowRangeError("path is too long for a Unix socket");
+        return;
+    }
+
+    options.interval_ms = Nan::To<int32_t>(info[0]).FromJust();
+    options.port = Nan::To<int32_t>(info[1]).FromJust();
+    strcpy(options.path, *path);
+
+    HciExporter *obj = new HciExporter();
+
+    obj->Wrap(info.This());
+    node::AddEnvironmentCleanupHook(info.GetIsolate(), Cleanup, obj);
+
+    if (hci_exporter_start(&obj->exporter, &options, &error) != EXIT_SUCCESS)
+    {
+        v8::Isolate::GetCurrent()->ThrowException(hci_error_to_js(-1, &error));
+        return;
+    }
+
+    Nan::Set(info.This(), Nan::New("textSize").ToLocalChecked(), Nan::New(HCI_EXPORTER_TEXT_SIZE));
+
+    // Serving keeps the object alive
+    if (options.port || options.path[0])
+    {
+        obj->serving = true;
+        obj->Ref();
+    }
+
+    info.GetReturnValue().Set(info.This());
+}
+
+/*
+ * Copy the last rendered OpenMetrics text into a buffer.
+ * Params:
+ *     - info: Contains a Buffer of at least textSize bytes and a return
+ *       value: the length of the text.
+ */
+void HciExporter::Render(const Nan::FunctionCallbackInfo<v8::Value>& info)
+{
+    HciExporter *obj = Nan::ObjectWrap::Unwrap<HciExporter>(info.Holder());
+
+    if (!node::Buffer::HasInstance(info[0]))
+    {
+        Nan::ThrowTypeError("1st argument should be a Buffer");
+        return;
+    }
+
+    size_t length = hci_exporter_render(&obj->exporter, node::Buffer::Data(info[0]),
+                                        node::Buffer::Length(info[0]));
+
+    info.GetReturnValue().Set(Nan::New((double)length));
+}
+
+/*
+ * Stop sampling and serving.
+ * Params:
+ *     - info: Contains arguments and a return value.
+ */
+void HciExporter::Stop(const Nan::FunctionCallbackInfo<v8::Value>& info)
+{
+    HciExporter *obj = Nan::ObjectWrap::Unwrap<HciExporter>(info.Holder());
+
+    hci_exporter_stop(&obj->exporter);
+
+    if (obj->serving)
+    {
+        obj->serving = false;
+        obj->Unref();
+    }
+}
+
+/*
+ * Get the exporter's counters: { samples, errors, scrapes }.
+ * Params:
+ *     - info: Contains arguments and a return value.
+ */
+void HciExporter::Stats(const Nan::FunctionCallbackInfo<v8::Value>& info)
+{
+    struct hci_exporter *exporter = &Nan::ObjectWrap::Unwrap<HciExporter>(info.Holder())->exporter;
+    v8::Local<v8::Object> result = Nan::New<v8::Object>();
+
+    Nan::Set(result, Nan::New("samples").ToLocalChecked(), Nan::New<v8::Number>(exporter->samples.load()));
+    Nan::Set(result, Nan::New("errors").ToLocalChecked(), Nan::New<v8::Number>(exporter->errors.load()));
+    Nan::Set(result, Nan::New("scrapes").ToLocalChecked(), Nan::New<v8::Number>(exporter->scrapes.load()));
+
+    info.GetReturnValue().Set(result);
+}
+
+/*
+ * Register the HciExporter class.
+ * Params:
+ *     - exports: module exports.
+ */
+void HciExporter::Init(v8::Local<v8::Object> exports)
+{
+    v8::Local<v8::FunctionTemplate> tpl = Nan::New<v8::FunctionTemplate>(New);
+
+    tpl->SetClassName(Nan::New("HciExporter").ToLocalChecked());
+    tpl->InstanceTemplate()->SetInternalFieldCount(1);
+
+    Nan::SetPrototypeMethod(tpl, "render", Render);
+    Nan::SetPrototypeMethod(tpl, "stop", Stop);
+    Nan::SetPrototypeMethod(tpl, "stats", Stats);
+
+    Nan::Set(exports, Nan::New("HciExporter").ToLocalChecked(),
+             Nan::GetFunction(tpl).ToLocalChecked());
+}
+
+/*
+ * Register the exporter bindings.
+ * Params:
+ *     - exports: module exports.
+ */
+void HCI_exporter_init(v8::Local<v8::Object> exports)
+{
+    HciExporter::Init(exports);
+}
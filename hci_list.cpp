@@ -1,10 +1,9 @@
 #include <stdio.h>
 #include <errno.h>
 #include <unistd.h>
+#include <stdint.h>
 #include <stdlib.h>
-#include <sys/ioctl.h>
-#include <sys/socket.h>
-#include <sys/queue.h>
+#include <string.h>
 
 #include <bluetooth/bluetooth.h>
 #include <bluetooth/hci.h>
@@ -12,200 +11,1038 @@
 
 #include <nan.h>
 
-static struct hci_dev_info device_info;
-STAILQ_HEAD(, interface) interfaces;
+#include "hci.hpp"
+#include "hci_core.hpp"
+#include "hci_raw.hpp"
 
-struct interface
+enum
 {
-    v8::Local<v8::Object> description;
-    STAILQ_ENTRY(interface) next;
+    KEY_BYTES,
+    KEY_ACL,
+    KEY_SCO,
+    KEY_EVENTS,
+    KEY_ERRORS,
+    KEY_TYPE,
+    KEY_BUS,
+    KEY_ADDRESS,
+    KEY_ACL_MTU,
+    KEY_SCO_MTU,
+    KEY_STATUS,
+    KEY_RX,
+    KEY_TX,
+    KEY_COUNT
 };
 
 /*
- * Get device header infos
+ * Fields of a device object which can be requested, one bit per key.
+ */
+#define FIELD(key) (1u << ((key) - KEY_TYPE))
+#define FIELD_ALL (FIELD(KEY_TX + 1) - 1)
+
+static char const *const key_names[KEY_COUNT] =
+{
+    "bytes", "acl", "sco", "events", "errors",
+    "type", "bus", "address", "acl_mtu", "sco_mtu", "status", "rx", "tx"
+};
+
+/*
+ * Strings describing a device, rebuilt only when what they describe changes.
+ */
+struct list_device_strings
+{
+    bool valid;
+    uint16_t dev_id;
+    bdaddr_t bdaddr;
+    uint32_t flags;
+    uint16_t acl_mtu, acl_pkts;
+    uint16_t sco_mtu, sco_pkts;
+    Nan::Persistent<v8::String> name;
+    Nan::Persistent<v8::String> address;
+    Nan::Persistent<v8::String> status;
+    Nan::Persistent<v8::String> acl;
+    Nan::Persistent<v8::String> sco;
+};
+
+/*
+ * Number of enumerations kept for listChanges().
+ */
+#define LIST_SNAPSHOTS 8
+
+/*
+ * An enumeration of the devices, as seen by listChanges().
+ *     - generation: generation of the enumeration, 0 for an empty slot.
+ *     - count: number of devices.
+ *     - devices: infos about the devices.
+ */
+struct list_snapshot
+{
+    uint32_t generation;
+    int count;
+    struct hci_dev_info devices[HCI_MAX_DEV];
+};
+
+/*
+ * State of the list bindings, owned by the module instance.
+ *     - keys: internalized property names.
+ *     - info_template, counters_template: templates giving every device
+ *       object the same shape.
+ *     - types, buses: names of device types and buses.
+ *     - devices: cached strings, indexed by dev_id modulo HCI_MAX_DEV.
+ *     - generation: generation of the last enumeration which differed from
+ *       the one before.
+ *     - snapshots: last enumerations, indexed by generation modulo
+ *       LIST_SNAPSHOTS.
+ */
+struct hci_list_state
+{
+    Nan::Persistent<v8::String> keys[KEY_COUNT];
+    Nan::Persistent<v8::ObjectTemplate> info_template;
+    Nan::Persistent<v8::ObjectTemplate> counters_template;
+    Nan::Persistent<v8::String> types[4];
+    Nan::Persistent<v8::String> buses[16];
+    struct list_device_strings devices[HCI_MAX_DEV];
+    uint32_t generation;
+    struct list_snapshot snapshots[LIST_SNAPSHOTS];
+};
+
+/*
+ * Format an unsigned number.
  * Params:
- *     - devices_info: info about a HCI device.
+ *     - buffer: receives the digits, not NUL terminated.
+ *     - value: number to format.
+ * Return value: number of digits written.
  */
-static void interface_infos(v8::Isolate *isolate, struct hci_dev_info *device_info)
+static int format_unsigned(char *buffer, unsigned value)
 {
-    char mac_address[18];
-    char buffer[101]; // Let be large
-    struct hci_dev_stats *device_stats = &device_info->stat;
-    char *device_status;
+    char digits[10];
+    int count = 0;
+
+    do
+    {
+        digits[count++] = '0' + value % 10;
+        value /= 10;
+    } while (value);
+
+    for (int i = 0; i < count; i++)
+        buffer[i] = digits[count - 1 - i];
+
+    return count;
+}
+
+/*
+ * Build a "mtu:packets" string.
+ * Params:
+ *     - mtu: MTU.
+ *     - packets: number of packets.
+ * Return value: the string.
+ */
+static v8::Local<v8::String> mtu_string(unsigned mtu, unsigned packets)
+{
+    char buffer[24];
+    int length = format_unsigned(buffer, mtu);
 
-    ba2str(&device_info->bdaddr, mac_address);
+    buffer[length++] = ':';
+    length += format_unsigned(buffer + length, packets);
 
-    device_status = hci_dflagstostr(device_info->flags);
+    return Nan::New(buffer, length).ToLocalChecked();
+}
+
+/*
+ * Get a cached internalized string, creating it on first use.
+ * Params:
+ *     - cache: cache slot.
+ *     - value: string value.
+ * Return value: the string.
+ */
+static v8::Local<v8::String> cached_string(Nan::Persistent<v8::String> *cache, char const *value)
+{
+    if (cache->IsEmpty())
+    {
+        cache->Reset(v8::String::NewFromUtf8(v8::Isolate::GetCurrent(), value,
+                     v8::NewStringType::kInternalized).ToLocalChecked());
+    }
+
+    return Nan::New(*cache);
+}
+
+/*
+ * Refresh the cached strings of a device. Strings of fields that weren't
+ * requested are left as they are.
+ * Params:
+ *     - state: list state.
+ *     - device_info: info about a HCI device.
+ *     - fields: mask of requested fields.
+ * Return value: the cached strings.
+ */
+static struct list_device_strings *device_strings(struct hci_list_state *state, struct hci_dev_info *device_info,
+                                                  unsigned fields)
+{
+    struct list_device_strings *strings = &state->devices[device_info->dev_id % HCI_MAX_DEV];
+
+    if (!strings->valid || strings->dev_id != device_info->dev_id)
+    {
+        strings->valid = true;
+        strings->dev_id = device_info->dev_id;
+        strings->name.Reset(Nan::New(device_info->name).ToLocalChecked());
+        strings->address.Reset();
+        strings->status.Reset();
+        strings->acl.Reset();
+        strings->sco.Reset();
+    }
+
+    if ((fields & FIELD(KEY_ADDRESS)) &&
+        (strings->address.IsEmpty() || bacmp(&strings->bdaddr, &device_info->bdaddr)))
+    {
+        char mac_address[18];
+
+        ba2str(&device_info->bdaddr, mac_address);
+        bacpy(&strings->bdaddr, &device_info->bdaddr);
+        strings->address.Reset(Nan::New(mac_address).ToLocalChecked());
+    }
+
+    if ((fields & FIELD(KEY_STATUS)) &&
+        (strings->status.IsEmpty() || strings->flags != device_info->flags))
+    {
+        char *device_status = hci_dflagstostr(device_info->flags);
+
+        strings->flags = device_info->flags;
+        strings->status.Reset(Nan::New(device_status).ToLocalChecked());
+        bt_free(device_status);
+    }
+
+    if ((fields & FIELD(KEY_ACL_MTU)) &&
+        (strings->acl.IsEmpty() || strings->acl_mtu != device_info->acl_mtu ||
+         strings->acl_pkts != device_info->acl_pkts))
+    {
+        strings->acl_mtu = device_info->acl_mtu;
+        strings->acl_pkts = device_info->acl_pkts;
+        strings->acl.Reset(mtu_string(device_info->acl_mtu, device_info->acl_pkts));
+    }
+
+    if ((fields & FIELD(KEY_SCO_MTU)) &&
+        (strings->sco.IsEmpty() || strings->sco_mtu != device_info->sco_mtu ||
+         strings->sco_pkts != device_info->sco_pkts))
+    {
+        strings->sco_mtu = device_info->sco_mtu;
+        strings->sco_pkts = device_info->sco_pkts;
+        strings->sco.Reset(mtu_string(device_info->sco_mtu, device_info->sco_pkts));
+    }
+
+    return strings;
+}
+
+/*
+ * Fill an object made from the counters template.
+ * Params:
+ *     - state: list state.
+ *     - obj: object to fill.
+ *     - bytes, acl, sco, events, errors: counter values.
+ */
+static void set_counters(struct hci_list_state *state, v8::Local<v8::Object> obj,
+                         uint32_t bytes, uint32_t acl, uint32_t sco, uint32_t events, uint32_t errors)
+{
+    Nan::Set(obj, Nan::New(state->keys[KEY_BYTES]), Nan::New(bytes));
+    Nan::Set(obj, Nan::New(state->keys[KEY_ACL]), Nan::New(acl));
+    Nan::Set(obj, Nan::New(state->keys[KEY_SCO]), Nan::New(sco));
+    Nan::Set(obj, Nan::New(state->keys[KEY_EVENTS]), Nan::New(events));
+    Nan::Set(obj, Nan::New(state->keys[KEY_ERRORS]), Nan::New(errors));
+}
+
+/*
+ * Get device header infos
+ * Params:
+ *     - state: list state.
+ *     - device_info: info about a HCI device.
+ *     - fields: mask of requested fields.
+ * Return value: an object describing the device.
+ */
+static v8::Local<v8::Object> interface_infos(struct hci_list_state *state, struct hci_dev_info *device_info,
+                                             unsigned fields)
+{
+    struct hci_dev_stats *device_stats = &device_info->stat;
+    struct list_device_strings *strings = device_strings(state, device_info, fields);
+    int type = (device_info->type & 0x30) >> 4;
+    int bus = device_info->type & 0x0f;
+    v8::Local<v8::Object> obj_info;
 
     /*
-     * Fill an object with all infos
+     * All fields: objects of fixed shape. Otherwise only the requested
+     * properties are built.
      */
+    if (fields == FIELD_ALL)
+        obj_info = Nan::NewInstance(Nan::New(state->info_template)).ToLocalChecked();
+    else
+        obj_info = Nan::New<v8::Object>();
 
-    // RX
-    v8::Local<v8::Object> obj_rx = v8::Object::New(isolate);
+    if (fields & FIELD(KEY_TYPE))
+        Nan::Set(obj_info, Nan::New(state->keys[KEY_TYPE]),
+                 cached_string(&state->types[type], hci_typetostr(type)));
+
+    if (fields & FIELD(KEY_BUS))
+        Nan::Set(obj_info, Nan::New(state->keys[KEY_BUS]),
+                 cached_string(&state->buses[bus], hci_bustostr(bus)));
 
-    obj_rx->Set(v8::String::NewFromUtf8(isolate, "bytes"),
-                v8::Number::New(isolate, device_stats->byte_rx));
+    if (fields & FIELD(KEY_ADDRESS))
+        Nan::Set(obj_info, Nan::New(state->keys[KEY_ADDRESS]), Nan::New(strings->address));
 
-    obj_rx->Set(v8::String::NewFromUtf8(isolate, "acl"),
-                v8::Number::New(isolate, device_stats->acl_rx));
+    if (fields & FIELD(KEY_ACL_MTU))
+        Nan::Set(obj_info, Nan::New(state->keys[KEY_ACL_MTU]), Nan::New(strings->acl));
 
-    obj_rx->Set(v8::String::NewFromUtf8(isolate, "sco"),
-                v8::Number::New(isolate, device_stats->sco_rx));
+    if (fields & FIELD(KEY_SCO_MTU))
+        Nan::Set(obj_info, Nan::New(state->keys[KEY_SCO_MTU]), Nan::New(strings->sco));
 
-    obj_rx->Set(v8::String::NewFromUtf8(isolate, "events"),
-                v8::Number::New(isolate, device_stats->evt_rx));
+    if (fields & FIELD(KEY_STATUS))
+        Nan::Set(obj_info, Nan::New(state->keys[KEY_STATUS]), Nan::New(strings->status));
 
-    obj_rx->Set(v8::String::NewFromUtf8(isolate, "errors"),
-                v8::Number::New(isolate, device_stats->err_rx));
+    // RX
+    if (fields & FIELD(KEY_RX))
+    {
+        v8::Local<v8::Object> obj_rx = Nan::NewInstance(Nan::New(state->counters_template)).ToLocalChecked();
+        set_counters(state, obj_rx, device_stats->byte_rx, device_stats->acl_rx,
+                     device_stats->sco_rx, device_stats->evt_rx, device_stats->err_rx);
+        Nan::Set(obj_info, Nan::New(state->keys[KEY_RX]), obj_rx);
+    }
 
     // TX
-    v8::Local<v8::Object> obj_tx = v8::Object::New(isolate);
+    if (fields & FIELD(KEY_TX))
+    {
+        v8::Local<v8::Object> obj_tx = Nan::NewInstance(Nan::New(state->counters_template)).ToLocalChecked();
+        set_counters(state, obj_tx, device_stats->byte_tx, device_stats->acl_tx,
+                     device_stats->sco_tx, device_stats->cmd_tx, device_stats->err_tx);
+        Nan::Set(obj_info, Nan::New(state->keys[KEY_TX]), obj_tx);
+    }
 
-    obj_tx->Set(v8::String::NewFromUtf8(isolate, "bytes"),
-                v8::Number::New(isolate, device_stats->byte_tx));
+    // Construct the object
+    v8::Local<v8::Object> obj = Nan::New<v8::Object>();
+    Nan::Set(obj, Nan::New(strings->name), obj_info);
 
-    obj_tx->Set(v8::String::NewFromUtf8(isolate, "acl"),
-                v8::Number::New(isolate, device_stats->acl_tx));
+    return obj;
+}
 
-    obj_tx->Set(v8::String::NewFromUtf8(isolate, "sco"),
-                v8::Number::New(isolate, device_stats->sco_tx));
+/*
+ * Build the array returned to javascript.
+ * Params:
+ *     - state: list state.
+ *     - devices: infos about HCI devices.
+ *     - count: number of devices.
+ *     - fields: mask of requested fields.
+ * Return value: an array with one object per device.
+ */
+static v8::Local<v8::Array> interfaces_array(struct hci_list_state *state, struct hci_dev_info *devices, int count,
+                                             unsigned fields)
+{
+    v8::Local<v8::Array> array = Nan::New<v8::Array>(count);
 
-    obj_tx->Set(v8::String::NewFromUtf8(isolate, "events"),
-                v8::Number::New(isolate, device_stats->cmd_tx));
+    for (int i = 0; i < count; i++)
+        Nan::Set(array, i, interface_infos(state, &devices[i], fields));
 
-    obj_tx->Set(v8::String::NewFromUtf8(isolate, "errors"),
-                v8::Number::New(isolate, device_stats->err_tx));
+    return array;
+}
 
-    // Other info
-    v8::Local<v8::Object> obj_info = v8::Object::New(isolate);
+/*
+ * Find a device in an enumeration.
+ * Params:
+ *     - devices: infos about HCI devices.
+ *     - count: number of devices.
+ *     - dev_id: id of the device.
+ * Return value: the device, NULL if absent.
+ */
+static struct hci_dev_info const *find_device(struct hci_dev_info const *devices, int count, uint16_t dev_id)
+{
+    for (int i = 0; i < count; i++)
+    {
+        if (devices[i].dev_id == dev_id)
+            return &devices[i];
+    }
 
-    obj_info->Set(v8::String::NewFromUtf8(isolate, "type"),
-                  v8::String::NewFromUtf8(isolate,
-                      hci_typetostr((device_info->type & 0x30) >> 4)));
+    return NULL;
+}
 
-    obj_info->Set(v8::String::NewFromUtf8(isolate, "bus"),
-                  v8::String::NewFromUtf8(isolate,
-                      hci_bustostr(device_info->type & 0x0f)));
+/*
+ * Compare what list() describes of a device, counters aside. Fields are
+ * compared one by one: padding isn't written by the kernel.
+ * Return value: true if the device changed.
+ */
+static bool device_changed(struct hci_dev_info const *old_info, struct hci_dev_info const *new_info)
+{
+    return strncmp(old_info->name, new_info->name, sizeof(old_info->name)) ||
+           bacmp(&old_info->bdaddr, &new_info->bdaddr) ||
+           old_info->flags != new_info->flags ||
+           old_info->type != new_info->type ||
+           old_info->acl_mtu != new_info->acl_mtu ||
+           old_info->acl_pkts != new_info->acl_pkts ||
+           old_info->sco_mtu != new_info->sco_mtu ||
+           old_info->sco_pkts != new_info->sco_pkts;
+}
 
-    obj_info->Set(v8::String::NewFromUtf8(isolate, "address"),
-                  v8::String::NewFromUtf8(isolate, mac_address));
+/*
+ * Record an enumeration, starting a new generation if it differs from the
+ * last one.
+ * Params:
+ *     - state: list state.
+ *     - devices: infos about HCI devices.
+ *     - count: number of devices.
+ * Return value: generation of the enumeration.
+ */
+static uint32_t record_snapshot(struct hci_list_state *state, struct hci_dev_info const *devices, int count)
+{
+    struct list_snapshot *last = &state->snapshots[state->generation % LIST_SNAPSHOTS];
 
-    snprintf(buffer, 100, "%d:%d", device_info->acl_mtu, device_info->acl_pkts);
-    obj_info->Set(v8::String::NewFromUtf8(isolate, "acl_mtu"),
-                  v8::String::NewFromUtf8(isolate, buffer));
+    if (state->generation && last->count == count)
+    {
+        bool same = true;
 
-    snprintf(buffer, 100, "%d:%d", device_info->sco_mtu, device_info->sco_pkts);
-    obj_info->Set(v8::String::NewFromUtf8(isolate, "sco_mtu"),
-                  v8::String::NewFromUtf8(isolate, buffer));
+        for (int i = 0; i < count && same; i++)
+        {
+            same = last->devices[i].dev_id == devices[i].dev_id &&
+                   !device_changed(&last->devices[i], &devices[i]) &&
+                   !memcmp(&last->devices[i].stat, &devices[i].stat, sizeof(devices[i].stat));
+        }
 
-    obj_info->Set(v8::String::NewFromUtf8(isolate, "status"),
-                  v8::String::NewFromUtf8(isolate, device_status));
+        if (same)
+            return state->generation;
+    }
 
-    // Construct the object
-    obj_info->Set(v8::String::NewFromUtf8(isolate, "rx"), obj_rx);
-    obj_info->Set(v8::String::NewFromUtf8(isolate, "tx"), obj_tx);
+    // Generation 0 means "no snapshot"
+    if (++state->generation == 0)
+        state->generation = 1;
 
-    v8::Local<v8::Object> obj = v8::Object::New(isolate);
-    obj->Set(v8::String::NewFromUtf8(isolate, device_info->name), obj_info);
+    struct list_snapshot *snapshot = &state->snapshots[state->generation % LIST_SNAPSHOTS];
 
-    // Add to the list
-    struct interface *bluetooth_interface
-        = (struct interface *)malloc(sizeof(struct interface));
-    bluetooth_interface->description = obj;
-    STAILQ_INSERT_TAIL(&interfaces, bluetooth_interface, next);
+    snapshot->generation = state->generation;
+    snapshot->count = count;
+    memcpy(snapshot->devices, devices, count * sizeof(*devices));
 
-    bt_free(device_status);
+    return state->generation;
 }
 
 /*
- * Put HCI interfaces into a linked list.
- * Return values:
- *     - EXIT_FAILURE: on failure.
- *     - EXIT_SUCCESS: on success.
+ * Build the result of listChanges():
+ * { generation, full, added, changed, removed, counters }.
+ * Params:
+ *     - state: list state.
+ *     - since: generation known by the caller, 0 for none.
+ *     - devices: infos about HCI devices.
+ *     - count: number of devices.
+ * Return value: the changes since the given generation, or every device
+ * with full set when that generation is no longer known.
  */
-static void list_devices(v8::Isolate *isolate)
+static v8::Local<v8::Object> list_changes(struct hci_list_state *state, uint32_t since,
+                                          struct hci_dev_info *devices, int count)
 {
-    struct hci_dev_list_req *devices_list;
-    struct hci_dev_req *dr;
-    int hci_socket;
+    struct list_snapshot const *old = &state->snapshots[since % LIST_SNAPSHOTS];
+    bool full = since == 0 || old->generation != since;
+    v8::Local<v8::Array> added = Nan::New<v8::Array>();
+    v8::Local<v8::Array> changed = Nan::New<v8::Array>();
+    v8::Local<v8::Array> removed = Nan::New<v8::Array>();
+    v8::Local<v8::Array> counters = Nan::New<v8::Array>();
+    v8::Local<v8::ObjectTemplate> counters_template = Nan::New(state->counters_template);
 
-    if ((hci_socket = socket(AF_BLUETOOTH, SOCK_RAW, BTPROTO_HCI)) < 0)
+    for (int i = 0; i < count; i++)
     {
-        perror("Can't open HCI socket.");
-        return EXIT_FAILURE;
+        struct hci_dev_info const *old_info = full ? NULL : find_device(old->devices, old->count, devices[i].dev_id);
+
+        if (!old_info)
+        {
+            Nan::Set(added, added->Length(), interface_infos(state, &devices[i], FIELD_ALL));
+            continue;
+        }
+
+        if (device_changed(old_info, &devices[i]))
+        {
+            Nan::Set(changed, changed->Length(), interface_infos(state, &devices[i], FIELD_ALL));
+            continue;
+        }
+
+        struct hci_dev_stats const *old_stats = &old_info->stat;
+        struct hci_dev_stats const *stats = &devices[i].stat;
+
+        if (!memcmp(old_stats, stats, sizeof(*stats)))
+            continue;
+
+        // Counters wrap around: unsigned differences stay right
+        v8::Local<v8::Object> obj_rx = Nan::NewInstance(counters_template).ToLocalChecked();
+        set_counters(state, obj_rx, stats->byte_rx - old_stats->byte_rx, stats->acl_rx - old_stats->acl_rx,
+                     stats->sco_rx - old_stats->sco_rx, stats->evt_rx - old_stats->evt_rx,
+                     stats->err_rx - old_stats->err_rx);
+
+        v8::Local<v8::Object> obj_tx = Nan::NewInstance(counters_template).ToLocalChecked();
+        set_counters(state, obj_tx, stats->byte_tx - old_stats->byte_tx, stats->acl_tx - old_stats->acl_tx,
+                     stats->sco_tx - old_stats->sco_tx, stats->cmd_tx - old_stats->cmd_tx,
+                     stats->err_tx - old_stats->err_tx);
+
+        v8::Local<v8::Object> obj_delta = Nan::New<v8::Object>();
+        Nan::Set(obj_delta, Nan::New(state->keys[KEY_RX]), obj_rx);
+        Nan::Set(obj_delta, Nan::New(state->keys[KEY_TX]), obj_tx);
+
+        v8::Local<v8::Object> obj = Nan::New<v8::Object>();
+        Nan::Set(obj, Nan::New(device_strings(state, &devices[i], 0)->name), obj_delta);
+        Nan::Set(counters, counters->Length(), obj);
     }
 
-    if ((devices_list = (hci_dev_list_req *)malloc(HCI_MAX_DEV * sizeof(struct hci_dev_req))) == NULL)
+    if (!full)
     {
-        perror("Can't allocate memory");
-        return EXIT_FAILURE;
+        for (int i = 0; i < old->count; i++)
+        {
+            struct hci_dev_info const *old_info = &old->devices[i];
+
+            if (!find_device(devices, count, old_info->dev_id))
+            {
+                Nan::Set(removed, removed->Length(),
+                         Nan::New(old_info->name, strnlen(old_info->name, sizeof(old_info->name))).ToLocalChecked());
+            }
+        }
     }
 
-    devices_list->dev_num = HCI_MAX_DEV;
-    dr = devices_list->dev_req;
+    // The old snapshot may be overwritten: only now
+    uint32_t generation = record_snapshot(state, devices, count);
+
+    v8::Local<v8::Object> result = Nan::New<v8::Object>();
+    Nan::Set(result, Nan::New("generation").ToLocalChecked(), Nan::New(generation));
+    Nan::Set(result, Nan::New("full").ToLocalChecked(), Nan::New(full));
+    Nan::Set(result, Nan::New("added").ToLocalChecked(), added);
+    Nan::Set(result, Nan::New("changed").ToLocalChecked(), changed);
+    Nan::Set(result, Nan::New("removed").ToLocalChecked(), removed);
+    Nan::Set(result, Nan::New("counters").ToLocalChecked(), counters);
+
+    return result;
+}
+
+/*
+ * Build the buffer returned by listRaw().
+ * Params:
+ *     - devices: infos about HCI devices.
+ *     - count: number of devices.
+ * Return value: a Buffer holding the packed records.
+ */
+static v8::Local<v8::Object> raw_buffer(struct hci_dev_info *devices, int count)
+{
+    v8::Local<v8::Object> buffer = Nan::NewBuffer(hci_raw_size(count)).ToLocalChecked();
+
+    hci_raw_pack(devices, count, (unsigned char *)node::Buffer::Data(buffer));
+
+    return buffer;
+}
 
-    if (ioctl(hci_socket, HCIGETDEVLIST, (void *)devices_list) < 0)
+/*
+ * Create the state of the list bindings.
+ * Return value: the state.
+ */
+static struct hci_list_state *list_state_new(void)
+{
+    struct hci_list_state *state = new hci_list_state();
+    v8::Local<v8::ObjectTemplate> info_template = Nan::New<v8::ObjectTemplate>();
+    v8::Local<v8::ObjectTemplate> counters_template = Nan::New<v8::ObjectTemplate>();
+
+    for (int i = 0; i < KEY_COUNT; i++)
     {
-        perror("Can't get device list");
-        return EXIT_FAILURE;
+        state->keys[i].Reset(v8::String::NewFromUtf8(v8::Isolate::GetCurrent(), key_names[i],
+                             v8::NewStringType::kInternalized).ToLocalChecked());
     }
 
-    for (int i = 0; i < devices_list->dev_num; i++)
+    // Properties in the order they are filled
+    for (int i = KEY_BYTES; i <= KEY_ERRORS; i++)
+        counters_template->Set(Nan::New(state->keys[i]), Nan::New(0));
+
+    for (int i = KEY_TYPE; i <= KEY_TX; i++)
+        info_template->Set(Nan::New(state->keys[i]), Nan::Null());
+
+    state->info_template.Reset(info_template);
+    state->counters_template.Reset(counters_template);
+
+    return state;
+}
+
+/*
+ * Read the options of list() and getInfo(): { ids: [dev_id...], fields: [name...] }.
+ * Params:
+ *     - value: options object, or undefined for all devices and fields.
+ *     - ids: array of HCI_MAX_DEV entries receiving the requested dev_ids.
+ *     - options: receives the options of list_devices().
+ *     - fields: receives the mask of requested fields.
+ * Return values:
+ *     - false: invalid options, an exception is pending.
+ *     - true: on success.
+ */
+static bool list_options(v8::Local<v8::Value> value, uint16_t *ids,
+                         struct hci_list_options *options, unsigned *fields)
+{
+    options->ids = NULL;
+    options->id_count = 0;
+    options->resolve_address = true;
+    *fields = FIELD_ALL;
+
+    if (value->IsUndefined() || value->IsNull())
+        return true;
+
+    if (!value->IsObject())
     {
-        device_info.dev_id = (dr+i)->dev_id;
+        Nan::ThrowTypeError("options should be an object");
+        return false;
+    }
 
-        if (ioctl(hci_socket, HCIGETDEVINFO, (void *)&device_info) < 0)
-            continue;
+    v8::Local<v8::Object> obj = value.As<v8::Object>();
+    v8::Local<v8::Value> ids_value = Nan::Get(obj, Nan::New("ids").ToLocalChecked()).ToLocalChecked();
+    v8::Local<v8::Value> fields_value = Nan::Get(obj, Nan::New("fields").ToLocalChecked()).ToLocalChecked();
+
+    if (!ids_value->IsUndefined())
+    {
+        if (!ids_value->IsArray() || ids_value.As<v8::Array>()->Length() > HCI_MAX_DEV)
+        {
+            Nan::ThrowTypeError("ids should be an array of at most 16 device ids");
+            return false;
+        }
+
+        v8::Local<v8::Array> array = ids_value.As<v8::Array>();
 
-        if (hci_test_bit(HCI_RAW, &device_info.flags) &&
-            !bacmp(&device_info.bdaddr, BDADDR_ANY))
+        for (uint32_t i = 0; i < array->Length(); i++)
         {
-            int device = hci_open_dev(device_info.dev_id);
-            hci_read_bd_addr(device, &device_info.bdaddr, 1000);
-            hci_close_dev(device);
+            v8::Local<v8::Value> id = Nan::Get(array, i).ToLocalChecked();
+
+            if (!id->IsUint32() || Nan::To<uint32_t>(id).FromJust() > 0xffff)
+            {
+                Nan::ThrowTypeError("ids should be an array of device ids");
+                return false;
+            }
+
+            ids[i] = Nan::To<uint32_t>(id).FromJust();
         }
 
-        interface_infos(isolate, &device_info);
+        options->ids = ids;
+        options->id_count = array->Length();
     }
 
-    free(devices_list);
-    close(hci_socket);
-    return EXIT_SUCCESS;
+    if (!fields_value->IsUndefined())
+    {
+        if (!fields_value->IsArray())
+        {
+            Nan::ThrowTypeError("fields should be an array of names");
+            return false;
+        }
+
+        v8::Local<v8::Array> array = fields_value.As<v8::Array>();
+
+        *fields = 0;
+
+        for (uint32_t i = 0; i < array->Length(); i++)
+        {
+            Nan::Utf8String name(Nan::Get(array, i).ToLocalChecked());
+            int key = KEY_TYPE;
+
+            while (key <= KEY_TX && (!*name || strcmp(*name, key_names[key])))
+                key++;
+
+            if (key > KEY_TX)
+            {
+                Nan::ThrowTypeError("unknown field");
+                return false;
+            }
+
+            *fields |= FIELD(key);
+        }
+
+        options->resolve_address = (*fields & FIELD(KEY_ADDRESS)) != 0;
+    }
+
+    return true;
 }
 
 
 /*
  * List HCI devices.
  * Params:
- *     - info: Contains arguments and a return value.
+ *     - info: Contains options and a return value.
  */
-void HCI_list(const Nan::FunctionCallbackInfo<v8::Value>& info)
+static void HCI_list(const Nan::FunctionCallbackInfo<v8::Value>& info)
 {
-    v8::Isolate *isolate = info.GetIsolate();
-    v8::Local<v8::Array> array = v8::Array::New(isolate);
-    int idx_item = 0;
-    struct interface *bluetooth_interface;
+    struct hci_list_state *state = (struct hci_list_state *)info.Data().As<v8::External>()->Value();
+    struct hci_dev_info devices[HCI_MAX_DEV];
+    struct hci_list_options options;
+    struct hci_error error;
+    uint16_t ids[HCI_MAX_DEV];
+    unsigned fields;
+    int count;
 
-    STAILQ_INIT(&interfaces);
+    if (!list_options(info[0], ids, &options, &fields))
+        return;
 
     // Get bluetooth interfaces
-    list_devices(isolate);
+    list_devices(devices, &count, &options, &error);
+
+    info.GetReturnValue().Set(interfaces_array(state, devices, count, fields));
+}
 
-    // Populate the array
-    STAILQ_FOREACH(bluetooth_interface, &interfaces, next)
+/*
+ * Get infos about a single HCI device, with one HCIGETDEVINFO.
+ * Params:
+ *     - info: Contains the device id, options and a return value.
+ */
+static void HCI_get_info(const Nan::FunctionCallbackInfo<v8::Value>& info)
+{
+    struct hci_list_state *state = (struct hci_list_state *)info.Data().As<v8::External>()->Value();
+    struct hci_dev_info device_info;
+    struct hci_list_options options;
+    struct hci_error error;
+    uint16_t ids[HCI_MAX_DEV];
+    unsigned fields;
+
+    if (!info[0]->IsUint32())
     {
-        array->Set(idx_item, bluetooth_interface->description);
-        idx_item++;
+        Nan::ThrowTypeError("1st argument should be a device id");
+        return;
     }
 
-    // Delete the list and free allocated memory
-    while (!STAILQ_EMPTY(&interfaces))
+    if (!list_options(info[1], ids, &options, &fields))
+        return;
+
+    int device_id = Nan::To<uint32_t>(info[0]).FromJust();
+
+    if (hci_device_info(device_id, &device_info, &error) != EXIT_SUCCESS)
     {
-        bluetooth_interface = STAILQ_FIRST(&interfaces);
-        STAILQ_REMOVE_HEAD(&interfaces, next);
-        free(bluetooth_interface);
+        v8::Isolate::GetCurrent()->ThrowException(hci_error_to_js(device_id, &error));
+        return;
     }
 
-    info.GetReturnValue().Set(array);
+    if (options.resolve_address)
+        hci_resolve_addresses(&device_info, 1);
+
+    info.GetReturnValue().Set(interface_infos(state, &device_info, fields));
+}
+
+/*
+ * List HCI devices as packed records.
+ * Params:
+ *     - info: Contains options and a return value.
+ */
+static void HCI_list_raw(const Nan::FunctionCallbackInfo<v8::Value>& info)
+{
+    struct hci_dev_info devices[HCI_MAX_DEV];
+    struct hci_list_options options;
+    struct hci_error error;
+    uint16_t ids[HCI_MAX_DEV];
+    unsigned fields;
+    int count;
+
+    if (!list_options(info[0], ids, &options, &fields))
+        return;
+
+    // Records always hold every field
+    options.resolve_address = true;
+
+    list_devices(devices, &count, &options, &error);
+
+    info.GetReturnValue().Set(raw_buffer(devices, count));
+}
+
+/*
+ * Read HCI devices on the thread pool.
+ */
+class ListWorker : public Nan::AsyncWorker
+{
+public:
+    /*
+     * Params:
+     *     - callback: callback(error, result).
+     *     - state: list state.
+     *     - raw: give packed records instead of objects.
+     *     - device_id: device read by getInfo(), -1 for a list.
+     */
+    ListWorker(Nan::Callback *callback, struct hci_list_state *state, bool raw, int device_id)
+        : Nan::AsyncWorker(callback, "btim:list"), state(state), raw(raw), device_id(device_id), count(0) {}
+
+    bool SetOptions(v8::Local<v8::Value> value)
+    {
+        if (!list_options(value, ids, &options, &fields))
+            return false;
+
+        if (raw)
+            options.resolve_address = true;
+
+        return true;
+    }
+
+    void Execute()
+    {
+        if (device_id >= 0)
+        {
+            if (hci_device_info(device_id, devices, &error) != EXIT_SUCCESS)
+                SetErrorMessage(error.step);
+            else if (options.resolve_address)
+                hci_resolve_addresses(devices, 1);
+            count = 1;
+        }
+        else if (list_devices(devices, &count, &options, &error) != EXIT_SUCCESS)
+            SetErrorMessage(error.step);
+    }
+
+    void HandleOKCallback()
+    {
+        Nan::HandleScope scope;
+        v8::Local<v8::Value> result;
+
+        if (raw)
+            result = raw_buffer(devices, count);
+        else if (device_id >= 0)
+            result = interface_infos(state, devices, fields);
+        else
+            result = interfaces_array(state, devices, count, fields);
+
+        v8::Local<v8::Value> argv[] = { Nan::Null(), result };
+
+        callback->Call(2, argv, async_resource);
+    }
+
+    void HandleErrorCallback()
+    {
+        Nan::HandleScope scope;
+
+        v8::Local<v8::Value> argv[] = { hci_error_to_js(device_id, &error) };
+
+        callback->Call(1, argv, async_resource);
+    }
+
+private:
+    struct hci_list_state *state;
+    bool raw;
+    int device_id;
+    uint16_t ids[HCI_MAX_DEV];
+    struct hci_list_options options;
+    unsigned fields;
+    struct hci_dev_info devices[HCI_MAX_DEV];
+    struct hci_error error;
+    int count;
+};
+
+/*
+ * Queue a ListWorker.
+ * Params:
+ *     - info: Contains options and a callback(error, interfaces).
+ *     - raw: give packed records instead of objects.
+ *     - device_id: device read by getInfo(), -1 for a list.
+ */
+static void list_async(const Nan::FunctionCallbackInfo<v8::Value>& info, bool raw, int device_id)
+{
+    struct hci_list_state *state = (struct hci_list_state *)info.Data().As<v8::External>()->Value();
+    int first = device_id >= 0 ? 1 : 0;
+
+    if (!info[first + 1]->IsFunction())
+    {
+        Nan::ThrowTypeError("Last argument should be a callback");
+        return;
+    }
+
+    Nan::Callback *callback = new Nan::Callback(info[first + 1].As<v8::Function>());
+    ListWorker *worker = new ListWorker(callback, state, raw, device_id);
+
+    if (!worker->SetOptions(info[first]))
+    {
+        delete worker;
+        return;
+    }
+
+    Nan::AsyncQueueWorker(worker);
+}
+
+/*
+ * List HCI devices without blocking the event loop.
+ * Params:
+ *     - info: Contains options and a callback(error, interfaces).
+ */
+static void HCI_list_async(const Nan::FunctionCallbackInfo<v8::Value>& info)
+{
+    list_async(info, false, -1);
+}
+
+/*
+ * Get infos about a single HCI device without blocking the event loop.
+ * Params:
+ *     - info: Contains the device id, options and a callback(error, interface).
+ */
+static void HCI_get_info_async(const Nan::FunctionCallbackInfo<v8::Value>& info)
+{
+    if (!info[0]->IsUint32())
+    {
+        Nan::ThrowTypeError("1st argument should be a device id");
+        return;
+    }
+
+    list_async(info, false, Nan::To<uint32_t>(info[0]).FromJust());
+}
+
+/*
+ * List HCI devices as packed records without blocking the event loop.
+ * Params:
+ *     - info: Contains options and a callback(error, buffer).
+ */
+static void HCI_list_raw_async(const Nan::FunctionCallbackInfo<v8::Value>& info)
+{
+    list_async(info, true, -1);
+}
+
+/*
+ * Read the generation given to listChanges().
+ * Params:
+ *     - value: generation, or undefined for none.
+ *     - since: receives the generation.
+ * Return values:
+ *     - false: invalid generation, an exception is pending.
+ *     - true: on success.
+ */
+static bool since_generation(v8::Local<v8::Value> value, uint32_t *since)
+{
+    *since = 0;
+
+    if (value->IsUndefined() || value->IsNull())
+        return true;
+
+    if (!value->IsUint32())
+    {
+        Nan::ThrowTypeError("1st argument should be a generation");
+        return false;
+    }
+
+    *since = Nan::To<uint32_t>(value).FromJust();
+    return true;
+}
+
+/*
+ * List what changed since a previous call.
+ * Params:
+ *     - info: Contains the generation returned by the previous call and a
+ *       return value.
+ */
+static void HCI_list_changes(const Nan::FunctionCallbackInfo<v8::Value>& info)
+{
+    struct hci_list_state *state = (struct hci_list_state *)info.Data().As<v8::External>()->Value();
+    struct hci_dev_info devices[HCI_MAX_DEV];
+    struct hci_error error;
+    uint32_t since;
+    int count;
+
+    if (!since_generation(info[0], &since))
+        return;
+
+    if (list_devices(devices, &count, NULL, &error) != EXIT_SUCCESS)
+    {
+        v8::Isolate::GetCurrent()->ThrowException(hci_error_to_js(-1, &error));
+        return;
+    }
+
+    info.GetReturnValue().Set(list_changes(state, since, devices, count));
+}
+
+/*
+ * Read HCI devices on the thread pool for listChanges(). Snapshots are only
+ * touched on the main thread, when the result is built.
+ */
+class ChangesWorker : public Nan::AsyncWorker
+{
+public:
+    ChangesWorker(Nan::Callback *callback, struct hci_list_state *state, uint32_t since)
+        : Nan::AsyncWorker(callback, "btim:list_changes"), state(state), since(since), count(0) {}
+
+    void Execute()
+    {
+        struct hci_list_options options = { NULL, 0, true };
+
+        if (list_devices(devices, &count, &options, &error) != EXIT_SUCCESS)
+            SetErrorMessage(error.step);
+    }
+
+    void HandleOKCallback()
+    {
+        Nan::HandleScope scope;
+
+        v8::Local<v8::Value> argv[] = { Nan::Null(), list_changes(state, since, devices, count) };
+
+        callback->Call(2, argv, async_resource);
+    }
+
+    void HandleErrorCallback()
+    {
+        Nan::HandleScope scope;
+
+        v8::Local<v8::Value> argv[] = { hci_error_to_js(-1, &error) };
+
+        callback->Call(1, argv, async_resource);
+    }
+
+private:
+    struct hci_list_state *state;
+    uint32_t since;
+    struct hci_dev_info devices[HCI_MAX_DEV];
+    struct hci_error error;
+    int count;
+};
+
+/*
+ * List what changed since a previous call without blocking the event loop.
+ * Params:
+ *     - info: Contains the generation and a callback(error, changes).
+ */
+static void HCI_list_changes_async(const Nan::FunctionCallbackInfo<v8::Value>& info)
+{
+    struct hci_list_state *state = (struct hci_list_state *)info.Data().As<v8::External>()->Value();
+    uint32_t since;
+
+    if (!since_generation(info[0], &since))
+        return;
+
+    if (!info[1]->IsFunction())
+    {
+        Nan::ThrowTypeError("2nd argument should be a callback");
+        return;
+    }
+
+    Nan::Callback *callback = new Nan::Callback(info[1].As<v8::Function>());
+
+    Nan::AsyncQueueWorker(new ChangesWorker(callback, state, since));
+}
+
+/*
+ * Free the state of the list bindings of an instance.
+ * Params:
+ *     - instance: instance of the addon.
+ */
+void hci_list_cleanup(struct hci_instance *instance)
+{
+    delete instance->list;
+    instance->list = NULL;
+}
+
+/*
+ * Register the list bindings.
+ * Params:
+ *     - exports: module exports.
+ *     - instance: instance owning their state.
+ */
+void HCI_list_init(v8::Local<v8::Object> exports, struct hci_instance *instance)
+{
+    instance->list = list_state_new();
+
+    v8::Local<v8::Value> state = Nan::New<v8::External>(instance->list);
+
+    Nan::Set(exports, Nan::New("list").ToLocalChecked(),
+             Nan::GetFunction(Nan::New<v8::FunctionTemplate>(HCI_list, state)).ToLocalChecked());
+
+    Nan::Set(exports, Nan::New("list_async").ToLocalChecked(),
+             Nan::GetFunction(Nan::New<v8::FunctionTemplate>(HCI_list_async, state)).ToLocalChecked());
+
+    Nan::Set(exports, Nan::New("get_info").ToLocalChecked(),
+             Nan::GetFunction(Nan::New<v8::FunctionTemplate>(HCI_get_info, state)).ToLocalChecked());
+
+    Nan::Set(exports, Nan::New("get_info_async").ToLocalChecked(),
+             Nan::GetFunction(Nan::New<v8::FunctionTemplate>(HCI_get_info_async, state)).ToLocalChecked());
+
+    Nan::Set(exports, Nan::New("list_changes").ToLocalChecked(),
+             Nan::GetFunction(Nan::New<v8::FunctionTemplate>(HCI_list_changes, state)).ToLocalChecked());
+
+    Nan::Set(exports, Nan::New("list_changes_async").ToLocalChecked(),
+             Nan::GetFunction(Nan::New<v8::FunctionTemplate>(HCI_list_changes_async, state)).ToLocalChecked());
+
+    Nan::Set(exports, Nan::New("list_raw").ToLocalChecked(),
+             Nan::GetFunction(Nan::New<v8::FunctionTemplate>(HCI_list_raw)).ToLocalChecked());
+
+    Nan::Set(exports, Nan::New("list_raw_async").ToLocalChecked(),
+             Nan::GetFunction(Nan::New<v8::FunctionTemplate>(HCI_list_raw_async, state)).ToLocalChecked());
 }
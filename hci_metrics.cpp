@@ -0,0 +1,231 @@
+#include <string.h>
+#include <sys/ioctl.h>
+
+#include <atomic>
+
+#include <bluetooth/bluetooth.h>
+#include <bluetooth/hci.h>
+
+#include "hci_metrics.hpp"
+
+/*
+ * Histograms kept, by open addressing: (operation, manufacturer) pairs past
+ * that many are counted as dropped.
+ */
+#define METRICS_SLOTS 256
+
+/*
+ * Latencies of an operation, updated without lock.
+ *     - key: metrics_key() of the operation, 0 for a free slot. Set once.
+ */
+struct metrics_histogram
+{
+    std::atomic<uint64_t> key;
+    std::atomic<uint64_t> count;
+    std::atomic<uint64_t> errors;
+    std::atomic<uint64_t> total_ns;
+    std::atomic<uint64_t> buckets[HCI_METRICS_BUCKETS];
+};
+
+static struct metrics_histogram histograms[METRICS_SLOTS];
+static std::atomic<uint64_t> metrics_dropped;
+
+/*
+ * Manufacturer of each adapter, indexed by dev_id modulo HCI_MAX_DEV:
+ * (dev_id + 1) << 16 | company ID, 0 when unknown.
+ */
+static std::atomic<uint32_t> manufacturers[HCI_MAX_DEV];
+
+static uint64_t metrics_key(int kind, uint16_t code, int manufacturer)
+{
+    return (uint64_t)kind << 32 | (uint64_t)code << 16 | (uint16_t)manufacturer;
+}
+
+static int device_manufacturer(int device_id)
+{
+    if (device_id < 0)
+        return -1;
+
+    uint32_t value = manufacturers[device_id % HCI_MAX_DEV].load(std::memory_order_relaxed);
+
+    return value >> 16 == (uint32_t)device_id + 1 ? (int)(value & 0xffff) : -1;
+}
+
+/*
+ * Find the histogram of an operation, taking a free slot when missing.
+ * Params:
+ *     - key: metrics_key() of the operation.
+ * Return value: the histogram, NULL when the table is full.
+ */
+static struct metrics_histogram *get_histogram(uint64_t key)
+{
+    uint32_t slot = (uint32_t)((key * 0x9e3779b97f4a7c15ULL) >> 56) % METRICS_SLOTS;
+
+    for (int probe = 0; probe < METRICS_SLOTS; probe++)
+    {
+        struct metrics_histogram *histogram = &histograms[(slot + probe) % METRICS_SLOTS];
+        uint64_t current = histogram->key.load(std::memory_order_acquire);
+
+        if (current == 0 && histogram->key.compare_exchange_strong(current, key, std::memory_order_acq_rel))
+            return histogram;
+
+        // Lost the race for the slot, current holds the winner's key
+        if (current == key)
+            return histogram;
+    }
+
+    return NULL;
+}
+
+/*
+ * Record the latency of an operation.
+ * Params:
+ *     - kind: HCI_METRICS_IOCTL or HCI_METRICS_COMMAND.
+ *     - code: ioctl number or command opcode.
+ *     - device_id: adapter the operation was about, -1 for none.
+ *     - latency_ns: time the operation took.
+ *     - failed: the operation failed.
+ */
+void hci_metrics_record(int kind, uint16_t code, int device_id, uint64_t latency_ns, bool failed)
+{
+    struct metrics_histogram *histogram = get_histogram(metrics_key(kind, code, device_manufacturer(device_id)));
+    uint64_t latency_us = latency_ns / 1000;
+    int bucket = 0;
+
+    if (histogram == NULL)
+    {
+        metrics_dropped.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+
+    while (bucket < HCI_METRICS_BUCKETS - 1 && (1ULL << bucket) <= latency_us)
+        bucket++;
+
+    histogram->buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+    histogram->total_ns.fetch_add(latency_ns, std::memory_order_relaxed);
+    if (failed)
+        histogram->errors.fetch_add(1, std::memory_order_relaxed);
+    histogram->count.fetch_add(1, std::memory_order_relaxed);
+}
+
+/*
+ * Set the manufacturer the operations on an adapter are accounted to.
+ * Params:
+ *     - device_id: device ID, -1 for all adapters.
+ *     - manufacturer: company ID, -1 to forget it.
+ */
+void hci_metrics_set_manufacturer(int device_id, int manufacturer)
+{
+    if (device_id < 0)
+    {
+        for (int i = 0; i < HCI_MAX_DEV; i++)
+            manufacturers[i].store(0);
+        return;
+    }
+
+    std::atomic<uint32_t> *slot = &manufacturers[device_id % HCI_MAX_DEV];
+    uint32_t value = slot->load();
+
+    if (manufacturer >= 0)
+        slot->store((uint32_t)(device_id + 1) << 16 | (uint16_t)manufacturer);
+    else if (value >> 16 == (uint32_t)device_id + 1)
+        slot->compare_exchange_strong(value, 0);
+}
+
+/*
+ * Read the histograms. Counters keep moving while they are read: an entry
+ * may be a few operations behind its buckets.
+ * Params:
+ *     - entries: array receiving the histograms.
+ *     - max: size of the array.
+ *     - dropped: receives the operations not measured because the table
+ *       was full. May be NULL.
+ * Return value: number of entries filled.
+ */
+int hci_metrics_read(struct hci_metrics_entry *entries, int max, uint64_t *dropped)
+{
+    int count = 0;
+
+    for (int i = 0; i < METRICS_SLOTS && count < max; i++)
+    {
+        struct metrics_histogram *histogram = &histograms[i];
+        uint64_t key = histogram->key.load(std::memory_order_acquire);
+        struct hci_metrics_entry *entry = &entries[count];
+
+        if (key == 0 || histogram->count.load(std::memory_order_relaxed) == 0)
+            continue;
+
+        entry->kind = (int)(key >> 32);
+        entry->code = (uint16_t)(key >> 16);
+        entry->manufacturer = (uint16_t)key == 0xffff ? -1 : (int)(key & 0xffff);
+        entry->count = histogram->count.load(std::memory_order_relaxed);
+        entry->errors = histogram->errors.load(std::memory_order_relaxed);
+        entry->total_ns = histogram->total_ns.load(std::memory_order_relaxed);
+        for (int bucket = 0; bucket < HCI_METRICS_BUCKETS; bucket++)
+            entry->buckets[bucket] = histogram->buckets[bucket].load(std::memory_order_relaxed);
+        count++;
+    }
+
+    if (dropped)
+        *dropped = metrics_dropped.load(std::memory_order_relaxed);
+
+    return count;
+}
+
+/*
+ * Get a percentile of a histogram.
+ * Params:
+ *     - entry: histogram.
+ *     - fraction: e.g. 0.99 for the 99th percentile.
+ * Return value: upper bound of the bucket holding it, in microseconds.
+ */
+uint64_t hci_metrics_percentile(struct hci_metrics_entry const *entry, double fraction)
+{
+    uint64_t total = 0, seen = 0;
+    int i;
+
+    for (i = 0; i < HCI_METRICS_BUCKETS; i++)
+        total += entry->buckets[i];
+
+    uint64_t rank = (uint64_t)(total * fraction + 0.5);
+
+    for (i = 0; i < HCI_METRICS_BUCKETS - 1; i++)
+    {
+        seen += entry->buckets[i];
+        if (seen >= rank && seen)
+            break;
+    }
+
+    return 1ULL << i;
+}
+
+/*
+ * Name of an ioctl measured.
+ * Params:
+ *     - code: ioctl number.
+ * Return value: its name, NULL when unknown.
+ */
+char const *hci_metrics_ioctl_name(uint16_t code)
+{
+    static struct
+    {
+        unsigned long request;
+        char const *name;
+    } const names[] =
+    {
+        { HCIDEVUP,       "HCIDEVUP" },
+        { HCIDEVDOWN,     "HCIDEVDOWN" },
+        { HCIDEVRESET,    "HCIDEVRESET" },
+        { HCIGETDEVLIST,  "HCIGETDEVLIST" },
+        { HCIGETDEVINFO,  "HCIGETDEVINFO" },
+        { HCIGETCONNLIST, "HCIGETCONNLIST" },
+    };
+
+    for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++)
+    {
+        if (_IOC_NR(names[i].request) == code)
+            return names[i].name;
+    }
+
+    return NULL;
+}
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "hci_core.hpp"
+
+/*
+ * USDT probes (provider btim), when sys/sdt.h is available. Disabled probes
+ * are a nop, attach with e.g.
+ *     bpftrace -e 'usdt:build/Release/btim.node:btim:command__done { ... }'
+ *     - ioctl__start(device_id, request), ioctl__done(device_id, request,
+ *       errno, latency_ns): device ioctls, device_id is -1 for
+ *       HCIGETDEVLIST.
+ *     - command__send(device_id, opcode), command__done(device_id, opcode,
+ *       result, latency_ns): controller commands run by the engine.
+ */
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define HCI_PROBES 1
+#endif
+#endif
+
+#ifdef HCI_PROBES
+#define HCI_PROBE2(name, a, b)       DTRACE_PROBE2(btim, name, a, b)
+#define HCI_PROBE4(name, a, b, c, d) DTRACE_PROBE4(btim, name, a, b, c, d)
+#else
+#define HCI_PROBE2(name, a, b)       do {} while (0)
+#define HCI_PROBE4(name, a, b, c, d) do {} while (0)
+#endif
+
+/*
+ * Kinds of operations measured.
+ */
+#define HCI_METRICS_IOCTL   1
+#define HCI_METRICS_COMMAND 2
+
+#define HCI_METRICS_BUCKETS 32
+
+/*
+ * Latencies of an operation on the controllers of a manufacturer.
+ *     - kind: HCI_METRICS_IOCTL or HCI_METRICS_COMMAND.
+ *     - code: ioctl number (_IOC_NR) or command opcode.
+ *     - manufacturer: company ID, -1 when unknown (the adapter wasn't probed
+ *       yet, or the operation isn't about one adapter).
+ *     - count, errors: operations measured, and how many failed.
+ *     - total_ns: time spent in them.
+ *     - buckets: bucket i counts operations of less than 2^i microseconds.
+ */
+struct hci_metrics_entry
+{
+    int kind;
+    uint16_t code;
+    int manufacturer;
+    uint64_t count;
+    uint64_t errors;
+    uint64_t total_ns;
+    uint64_t buckets[HCI_METRICS_BUCKETS];
+};
+
+void hci_metrics_record(int kind, uint16_t code, int device_id, uint64_t latency_ns, bool failed);
+void hci_metrics_set_manufacturer(int device_id, int manufacturer);
+int hci_metrics_read(struct hci_metrics_entry *entries, int max, uint64_t *dropped);
+uint64_t hci_metrics_percentile(struct hci_metrics_entry const *entry, double fraction);
+char const *hci_metrics_ioctl_name(uint16_t code);
@@ -0,0 +1,86 @@
+#include <stdio.h>
+
+#include <memory>
+
+#include <bluetooth/bluetooth.h>
+#include <bluetooth/hci.h>
+
+#include <nan.h>
+
+#include "hci.hpp"
+#include "hci_metrics.hpp"
+
+#define METRICS_MAX 256
+
+/*
+ * Get the latencies of the ioctls and controller commands run so far, per
+ * manufacturer.
+ * Params:
+ *     - info: Contains a return value: { dropped, operations: [{ operation,
+ *       opcode, manufacturer, count, errors, totalMs, p50Us, p99Us,
+ *       buckets }] }.
+ */
+static void HCI_metrics(const Nan::FunctionCallbackInfo<v8::Value>& info)
+{
+    // Not static: instances on other threads read concurrently
+    std::unique_ptr<struct hci_metrics_entry[]> entries(new hci_metrics_entry[METRICS_MAX]);
+    uint64_t dropped;
+    int count = hci_metrics_read(entries.get(), METRICS_MAX, &dropped);
+    v8::Local<v8::Object> result = Nan::New<v8::Object>();
+    v8::Local<v8::Array> operations = Nan::New<v8::Array>(count);
+    char name[16];
+
+    for (int i = 0; i < count; i++)
+    {
+        struct hci_metrics_entry *entry = &entries[i];
+        v8::Local<v8::Object> obj = Nan::New<v8::Object>();
+        char const *operation = name;
+        int used = HCI_METRICS_BUCKETS;
+
+        if (entry->kind == HCI_METRICS_COMMAND)
+            operation = "command";
+        else if ((operation = hci_metrics_ioctl_name(entry->code)) == NULL)
+        {
+            snprintf(name, sizeof(name), "ioctl %u", entry->code);
+            operation = name;
+        }
+
+        while (used > 0 && entry->buckets[used - 1] == 0)
+            used--;
+
+        v8::Local<v8::Array> buckets = Nan::New<v8::Array>(used);
+
+        for (int bucket = 0; bucket < used; bucket++)
+            Nan::Set(buckets, bucket, Nan::New<v8::Number>(entry->buckets[bucket]));
+
+        Nan::Set(obj, Nan::New("operation").ToLocalChecked(), Nan::New(operation).ToLocalChecked());
+        if (entry->kind == HCI_METRICS_COMMAND)
+            Nan::Set(obj, Nan::New("opcode").ToLocalChecked(), Nan::New(entry->code));
+        Nan::Set(obj, Nan::New("manufacturer").ToLocalChecked(), Nan::New(entry->manufacturer));
+        Nan::Set(obj, Nan::New("count").ToLocalChecked(), Nan::New<v8::Number>(entry->count));
+        Nan::Set(obj, Nan::New("errors").ToLocalChecked(), Nan::New<v8::Number>(entry->errors));
+        Nan::Set(obj, Nan::New("totalMs").ToLocalChecked(), Nan::New(entry->total_ns / 1e6));
+        Nan::Set(obj, Nan::New("p50Us").ToLocalChecked(),
+                 Nan::New<v8::Number>(hci_metrics_percentile(entry, 0.50)));
+        Nan::Set(obj, Nan::New("p99Us").ToLocalChecked(),
+                 Nan::New<v8::Number>(hci_metrics_percentile(entry, 0.99)));
+        Nan::Set(obj, Nan::New("buckets").ToLocalChecked(), buckets);
+        Nan::Set(operations, i, obj);
+    }
+
+    Nan::Set(result, Nan::New("dropped").ToLocalChecked(), Nan::New<v8::Number>(dropped));
+    Nan::Set(result, Nan::New("operations").ToLocalChecked(), operations);
+
+    info.GetReturnValue().Set(result);
+}
+
+/*
+ * Register the metrics bindings.
+ * Params:
+ *     - exports: module exports.
+ */
+void HCI_metrics_init(v8::Local<v8::Object> exports)
+{
+    Nan::Set(exports, Nan::New("metrics").ToLocalChecked(),
+             Nan::GetFunction(Nan::New<v8::FunctionTemplate>(HCI_metrics)).ToLocalChecked());
+}
@@ -0,0 +1,413 @@
+#include <errno.h>
+#include <string.h>
+
+#include <mutex>
+
+#include <bluetooth/bluetooth.h>
+#include <bluetooth/hci.h>
+#include <bluetooth/hci_lib.h>
+
+#include "hci_conn.hpp"
+#include "hci_events.hpp"
+#include "hci_executor.hpp"
+#include "hci_picker.hpp"
+
+/*
+ * Age of the loads before a pick reads them again. Device events (up,
+ * down, plugged in or out...) get the adapter read on the next pick.
+ */
+#define PICKER_REFRESH_NS 100000000ULL
+
+/*
+ * Rate of sent bytes halving the score of an adapter.
+ */
+#define PICKER_RATE_SCALE 32768.0
+
+/*
+ * Length of the pick schedule of a filter, and filters scheduled at once.
+ */
+#define PICKER_SLOTS   64
+#define PICKER_INDEXES 8
+
+/*
+ * An adapter known to the picker, indexed by dev_id modulo HCI_MAX_DEV.
+ *     - present: listed by the last enumeration.
+ *     - stale: a device event came for stale_id, read it before the next
+ *       pick.
+ *     - sampled: byte_tx... hold counters read at sampled_ns.
+ */
+struct picker_adapter
+{
+    bool present;
+    bool stale;
+    int stale_id;
+    bool sampled;
+    int bus;
+    bool le;
+    struct hci_picker_load load;
+    uint32_t byte_tx;
+    uint32_t acl_tx;
+    uint32_t sco_tx;
+    uint32_t cmd_tx;
+    uint32_t err_tx;
+    uint64_t sampled_ns;
+};
+
+/*
+ * Pick schedule of a filter: adapters in proportion to their scores,
+ * interleaved (smooth weighted round robin), so that a pick reads a slot.
+ *     - generation: scores it was built from.
+ *     - slots: adapter indexes, length of them are set.
+ *     - cursor: next slot, kept across rebuilds so that picks keep
+ *       spreading.
+ *     - used: last use, the least recently used schedule is replaced.
+ */
+struct picker_index
+{
+    bool valid;
+    struct hci_picker_filter filter;
+    uint32_t generation;
+    uint8_t slots[PICKER_SLOTS];
+    int length;
+    uint32_t cursor;
+    uint64_t used;
+};
+
+static std::mutex picker_lock;
+static struct picker_adapter adapters[HCI_MAX_DEV];
+static struct picker_index indexes[PICKER_INDEXES];
+static uint32_t generation;
+static uint64_t uses;
+static uint64_t refreshed_ns;
+static bool any_stale;
+static bool all_stale = true;
+
+/*
+ * Get how much a counter grew. The kernel's counters are 32 bits and start
+ * over when the adapter is reset: a drop of more than half the range is a
+ * reset rather than a wrap.
+ * Params:
+ *     - value: current value.
+ *     - last: previous value.
+ * Return value: the increase.
+ */
+static uint32_t counter_delta(uint32_t value, uint32_t last)
+{
+    uint32_t delta = value - last;
+
+    return value < last && delta >= 0x80000000u ? value : delta;
+}
+
+/*
+ * Read the state and load of an adapter and score it.
+ * Params:
+ *     - adapter: adapter to update.
+ *     - device_info: info about the HCI device.
+ *     - rates: measure rates since the previous sample; otherwise they are
+ *       kept, e.g. when a device event comes right after a sample.
+ *     - now_ns: current time.
+ */
+static void sample_adapter(struct picker_adapter *adapter, struct hci_dev_info const *device_info, bool rates,
+                           uint64_t now_ns)
+{
+    static struct hci_connection connections[HCI_CONN_MAX];
+    struct hci_dev_stats const *stats = &device_info->stat;
+    struct hci_picker_load *load = &adapter->load;
+    struct hci_error error;
+    int count = 0;
+
+    // Another adapter took the slot
+    if (load->device_id != device_info->dev_id)
+    {
+        memset(adapter, 0, sizeof(*adapter));
+        load->device_id = device_info->dev_id;
+    }
+
+    adapter->present = true;
+    adapter->stale = false;
+    adapter->bus = device_info->type & 0x0f;
+    adapter->le = (device_info->features[4] & LMP_LE) != 0;
+    // hci_test_bit() takes a mutable pointer
+    uint32_t flags = device_info->flags;
+
+    load->usable = hci_test_bit(HCI_UP, &flags) && hci_test_bit(HCI_RUNNING, &flags) &&
+                   !hci_test_bit(HCI_RAW, &flags);
+    load->acl_pkts = device_info->acl_pkts;
+
+    if (load->usable && hci_connections(device_info->dev_id, connections, &count, &error) != EXIT_SUCCESS)
+        count = 0;
+
+    load->connections = count;
+
+    if (rates || !adapter->sampled)
+    {
+        if (adapter->sampled && now_ns > adapter->sampled_ns)
+        {
+            uint32_t packets = counter_delta(stats->acl_tx, adapter->acl_tx) +
+                               counter_delta(stats->sco_tx, adapter->sco_tx) +
+                               counter_delta(stats->cmd_tx, adapter->cmd_tx);
+            uint32_t errors = counter_delta(stats->err_tx, adapter->err_tx);
+
+            load->tx_rate = counter_delta(stats->byte_tx, adapter->byte_tx) / ((now_ns - adapter->sampled_ns) / 1e9);
+            load->error_ratio = packets + errors ? (double)errors / (packets + errors) : 0;
+        }
+
+        adapter->sampled = true;
+        adapter->sampled_ns = now_ns;
+        adapter->byte_tx = stats->byte_tx;
+        adapter->acl_tx = stats->acl_tx;
+        adapter->sco_tx = stats->sco_tx;
+        adapter->cmd_tx = stats->cmd_tx;
+        adapter->err_tx = stats->err_tx;
+    }
+
+    /*
+     * ACL buffers are what an adapter can have in flight, shared by its
+     * links. LE only controllers report none: count one.
+     */
+    if (load->usable)
+        load->score = (load->acl_pkts ? load->acl_pkts : 1) * (1 - load->error_ratio) /
+                      ((1 + load->connections) * (1 + load->tx_rate / PICKER_RATE_SCALE));
+    else
+        load->score = 0;
+}
+
+/*
+ * Read the adapters again when their loads are too old, or those which got
+ * a device event. Called with the lock held.
+ * Params:
+ *     - guard: the picker lock, released while device events are applied.
+ *     - error: details about the failed step.
+ * Return values:
+ *     - EXIT_FAILURE: the adapters couldn't be listed.
+ *     - EXIT_SUCCESS: on success.
+ */
+static int picker_refresh(std::unique_lock<std::mutex> &guard, struct hci_error *error)
+{
+    static struct hci_dev_info devices[HCI_MAX_DEV];
+    struct hci_list_options options = { NULL, 0, false };
+    uint64_t now_ns = hci_monotonic_ns();
+    int count;
+
+    if (!all_stale && now_ns - refreshed_ns < PICKER_REFRESH_NS)
+    {
+        if (!any_stale)
+            return EXIT_SUCCESS;
+
+        for (int i = 0; i < HCI_MAX_DEV; i++)
+        {
+            struct picker_adapter *adapter = &adapters[i];
+
+            if (!adapter->stale)
+                continue;
+
+            if (hci_device_info(adapter->stale_id, &devices[0], error) == EXIT_SUCCESS)
+                sample_adapter(adapter, &devices[0], false, now_ns);
+            else if (adapter->load.device_id == adapter->stale_id)
+                adapter->present = false;
+
+            adapter->stale = false;
+        }
+
+        any_stale = false;
+        generation++;
+
+        return EXIT_SUCCESS;
+    }
+
+    // Events nobody read meanwhile, which may invalidate adapters again
+    guard.unlock();
+    hci_events_sync();
+    guard.lock();
+
+    if (list_devices(devices, &count, &options, error) != EXIT_SUCCESS)
+        return EXIT_FAILURE;
+
+    now_ns = hci_monotonic_ns();
+
+    for (int i = 0; i < HCI_MAX_DEV; i++)
+    {
+        adapters[i].present = false;
+        adapters[i].stale = false;
+    }
+
+    for (int i = 0; i < count; i++)
+        sample_adapter(&adapters[devices[i].dev_id % HCI_MAX_DEV], &devices[i], true, now_ns);
+
+    refreshed_ns = now_ns;
+    any_stale = false;
+    all_stale = false;
+    generation++;
+
+    return EXIT_SUCCESS;
+}
+
+static bool same_filter(struct hci_picker_filter const *a, struct hci_picker_filter const *b)
+{
+    return a->ids == b->ids && a->bus == b->bus && a->le == b->le;
+}
+
+static bool filter_match(struct hci_picker_filter const *filter, struct picker_adapter const *adapter)
+{
+    int device_id = adapter->load.device_id;
+
+    return adapter->present && adapter->load.score > 0 &&
+           (filter->ids == HCI_PICKER_ANY || (device_id < 32 && (filter->ids & (1u << device_id)))) &&
+           (filter->bus < 0 || filter->bus == adapter->bus) &&
+           (!filter->le || adapter->le);
+}
+
+/*
+ * Get the schedule of a filter, rebuilt when scores changed since.
+ * Params:
+ *     - filter: adapters to choose among.
+ * Return value: the schedule, without slots when no adapter matches.
+ */
+static struct picker_index *picker_index(struct hci_picker_filter const *filter)
+{
+    struct picker_index *index = NULL;
+    double current[HCI_MAX_DEV];
+    int candidates[HCI_MAX_DEV];
+    int candidate_count = 0;
+    double total = 0;
+
+    for (int i = 0; i < PICKER_INDEXES && !index; i++)
+    {
+        if (indexes[i].valid && same_filter(&indexes[i].filter, filter))
+            index = &indexes[i];
+    }
+
+    // Replace the least recently used schedule
+    if (!index)
+    {
+        index = &indexes[0];
+        for (int i = 1; i < PICKER_INDEXES; i++)
+        {
+            if (indexes[i].used < index->used)
+                index = &indexes[i];
+        }
+
+        index->valid = false;
+        index->cursor = 0;
+    }
+
+    index->used = ++uses;
+
+    if (index->valid && index->generation == generation)
+        return index;
+
+    index->valid = true;
+    index->filter = *filter;
+    index->generation = generation;
+    index->length = 0;
+
+    for (int i = 0; i < HCI_MAX_DEV; i++)
+    {
+        if (filter_match(filter, &adapters[i]))
+        {
+            candidates[candidate_count++] = i;
+            current[i] = 0;
+            total += adapters[i].load.score;
+        }
+    }
+
+    if (!candidate_count)
+        return index;
+
+    for (int slot = 0; slot < PICKER_SLOTS; slot++)
+    {
+        int best = candidates[0];
+
+        for (int i = 0; i < candidate_count; i++)
+        {
+            current[candidates[i]] += adapters[candidates[i]].load.score;
+            if (current[candidates[i]] > current[best])
+                best = candidates[i];
+        }
+
+        current[best] -= total;
+        index->slots[slot] = best;
+    }
+
+    index->length = PICKER_SLOTS;
+
+    return index;
+}
+
+/*
+ * Pick the adapter outbound work should go to. Adapters are picked in
+ * proportion to their scores, so a burst of picks spreads over the idle
+ * ones rather than piling onto the best.
+ * Params:
+ *     - filter: adapters to choose among.
+ *     - error: details about the failed step.
+ * Return value: dev_id of the adapter, or -1 on failure (ENODEV when no
+ * usable adapter matches).
+ */
+int hci_picker_pick(struct hci_picker_filter const *filter, struct hci_error *error)
+{
+    std::unique_lock<std::mutex> guard(picker_lock);
+    struct picker_index *index;
+    struct picker_adapter *adapter;
+
+    if (picker_refresh(guard, error) != EXIT_SUCCESS)
+        return -1;
+
+    index = picker_index(filter);
+
+    if (!index->length)
+    {
+        hci_set_error(error, ENODEV, "pick_adapter");
+        return -1;
+    }
+
+    adapter = &adapters[index->slots[index->cursor++ % PICKER_SLOTS]];
+    adapter->load.picks++;
+
+    return adapter->load.device_id;
+}
+
+/*
+ * Get the loads of the adapters, as scored for picks.
+ * Params:
+ *     - loads: receives the loads.
+ *     - max: number of entries of loads.
+ *     - error: details about the failed step.
+ * Return value: number of filled entries, or -1 on failure.
+ */
+int hci_picker_loads(struct hci_picker_load *loads, int max, struct hci_error *error)
+{
+    std::unique_lock<std::mutex> guard(picker_lock);
+    int count = 0;
+
+    if (picker_refresh(guard, error) != EXIT_SUCCESS)
+        return -1;
+
+    for (int i = 0; i < HCI_MAX_DEV && count < max; i++)
+    {
+        if (adapters[i].present)
+            loads[count++] = adapters[i].load;
+    }
+
+    return count;
+}
+
+/*
+ * Read an adapter again before the next pick, e.g. when it went up or down.
+ * Params:
+ *     - device_id: device ID, -1 for all devices.
+ */
+void hci_picker_invalidate(int device_id)
+{
+    std::lock_guard<std::mutex> guard(picker_lock);
+
+    if (device_id < 0)
+    {
+        all_stale = true;
+        return;
+    }
+
+    adapters[device_id % HCI_MAX_DEV].stale = true;
+    adapters[device_id % HCI_MAX_DEV].stale_id = device_id;
+    any_stale = true;
+}
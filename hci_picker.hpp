@@ -0,0 +1,48 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "hci_core.hpp"
+
+// Filter matching every dev_id
+#define HCI_PICKER_ANY 0xffffffffu
+
+/*
+ * Adapters a pick chooses among.
+ *     - ids: mask of dev_ids, bit n for hciN, HCI_PICKER_ANY for any.
+ *     - bus: HCI_USB, HCI_UART..., -1 for any.
+ *     - le: only adapters supporting LE.
+ */
+struct hci_picker_filter
+{
+    uint32_t ids;
+    int bus;
+    bool le;
+};
+
+/*
+ * Load of an adapter, as scored by the picker.
+ *     - usable: up, running and not RAW; others are never picked.
+ *     - acl_pkts: ACL buffers of the controller.
+ *     - connections: links listed by HCIGETCONNLIST.
+ *     - tx_rate: bytes sent per second since the previous sample.
+ *     - error_ratio: failed sends over packets sent since the previous
+ *       sample.
+ *     - score: share of the picks the adapter gets among usable ones.
+ *     - picks: times it was picked.
+ */
+struct hci_picker_load
+{
+    int device_id;
+    bool usable;
+    uint16_t acl_pkts;
+    int connections;
+    double tx_rate;
+    double error_ratio;
+    double score;
+    uint64_t picks;
+};
+
+int hci_picker_pick(struct hci_picker_filter const *filter, struct hci_error *error);
+int hci_picker_loads(struct hci_picker_load *loads, int max, struct hci_error *error);
+void hci_picker_invalidate(int device_id);
@@ -0,0 +1,158 @@
+#include <string.h>
+
+#include <bluetooth/bluetooth.h>
+#include <bluetooth/hci.h>
+#include <bluetooth/hci_lib.h>
+
+#include <nan.h>
+
+#include "hci.hpp"
+#include "hci_picker.hpp"
+
+/*
+ * Read the filter of pickAdapter(): { ids: [dev_id...], bus: name, le }.
+ * Params:
+ *     - value: filter object, or undefined for every adapter.
+ *     - filter: receives the filter.
+ * Return values:
+ *     - false: invalid filter, an exception is pending.
+ *     - true: on success.
+ */
+static bool picker_filter(v8::Local<v8::Value> value, struct hci_picker_filter *filter)
+{
+    filter->ids = HCI_PICKER_ANY;
+    filter->bus = -1;
+    filter->le = false;
+
+    if (value->IsUndefined() || value->IsNull())
+        return true;
+
+    if (!value->IsObject())
+    {
+        Nan::ThrowTypeError("filter should be an object");
+        return false;
+    }
+
+    v8::Local<v8::Object> obj = value.As<v8::Object>();
+    v8::Local<v8::Value> ids_value = Nan::Get(obj, Nan::New("ids").ToLocalChecked()).ToLocalChecked();
+    v8::Local<v8::Value> bus_value = Nan::Get(obj, Nan::New("bus").ToLocalChecked()).ToLocalChecked();
+
+    if (!ids_value->IsUndefined())
+    {
+        if (!ids_value->IsArray())
+        {
+            Nan::ThrowTypeError("ids should be an array of device ids");
+            return false;
+        }
+
+        v8::Local<v8::Array> array = ids_value.As<v8::Array>();
+
+        filter->ids = 0;
+
+        for (uint32_t i = 0; i < array->Length(); i++)
+        {
+            v8::Local<v8::Value> id = Nan::Get(array, i).ToLocalChecked();
+
+            if (!id->IsUint32() || Nan::To<uint32_t>(id).FromJust() >= 32)
+            {
+                Nan::ThrowTypeError("ids should be an array of device ids below 32");
+                return false;
+            }
+
+            filter->ids |= 1u << Nan::To<uint32_t>(id).FromJust();
+        }
+    }
+
+    if (!bus_value->IsUndefined())
+    {
+        Nan::Utf8String name(bus_value);
+
+        while (++filter->bus < 16 && (!*name || strcmp(*name, hci_bustostr(filter->bus))))
+            ;
+
+        if (filter->bus == 16)
+        {
+            Nan::ThrowTypeError("unknown bus");
+            return false;
+        }
+    }
+
+    filter->le = Nan::To<bool>(Nan::Get(obj, Nan::New("le").ToLocalChecked()).ToLocalChecked()).FromJust();
+
+    return true;
+}
+
+/*
+ * Pick the adapter outbound work should go to.
+ * Params:
+ *     - info: Contains a filter and a return value: the dev_id.
+ */
+static void HCI_pick_adapter(const Nan::FunctionCallbackInfo<v8::Value>& info)
+{
+    struct hci_picker_filter filter;
+    struct hci_error error;
+    int device_id;
+
+    if (!picker_filter(info[0], &filter))
+        return;
+
+    if ((device_id = hci_picker_pick(&filter, &error)) < 0)
+    {
+        v8::Isolate::GetCurrent()->ThrowException(hci_error_to_js(-1, &error));
+        return;
+    }
+
+    info.GetReturnValue().Set(device_id);
+}
+
+/*
+ * Get the loads of the adapters, as scored by pickAdapter().
+ * Params:
+ *     - info: Contains a return value: [{ id, usable, aclPkts, connections,
+ *       txRate, errorRatio, score, picks }].
+ */
+static void HCI_adapter_load(const Nan::FunctionCallbackInfo<v8::Value>& info)
+{
+    struct hci_picker_load loads[HCI_MAX_DEV];
+    struct hci_error error;
+    int count;
+
+    if ((count = hci_picker_loads(loads, HCI_MAX_DEV, &error)) < 0)
+    {
+        v8::Isolate::GetCurrent()->ThrowException(hci_error_to_js(-1, &error));
+        return;
+    }
+
+    v8::Local<v8::Array> result = Nan::New<v8::Array>(count);
+
+    for (int i = 0; i < count; i++)
+    {
+        struct hci_picker_load *load = &loads[i];
+        v8::Local<v8::Object> obj = Nan::New<v8::Object>();
+
+        Nan::Set(obj, Nan::New("id").ToLocalChecked(), Nan::New(load->device_id));
+        Nan::Set(obj, Nan::New("usable").ToLocalChecked(), Nan::New(load->usable));
+        Nan::Set(obj, Nan::New("aclPkts").ToLocalChecked(), Nan::New(load->acl_pkts));
+        Nan::Set(obj, Nan::New("connections").ToLocalChecked(), Nan::New(load->connections));
+        Nan::Set(obj, Nan::New("txRate").ToLocalChecked(), Nan::New(load->tx_rate));
+        Nan::Set(obj, Nan::New("errorRatio").ToLocalChecked(), Nan::New(load->error_ratio));
+        Nan::Set(obj, Nan::New("score").ToLocalChecked(), Nan::New(load->score));
+        Nan::Set(obj, Nan::New("picks").ToLocalChecked(), Nan::New<v8::Number>(load->picks));
+        Nan::Set(result, i, obj);
+    }
+
+    info.GetReturnValue().Set(result);
+}
+
+/*
+ * Register the picker bindings.
+ * Params:
+ *     - exports: module exports.
+ */
+void HCI_picker_init(v8::Local<v8::Object> exports)
+{
+    Nan::Set(exports, Nan::New("pick_adapter").ToLocalChecked(),
+             Nan::GetFunction(Nan::New<v8::FunctionTemplate>(HCI_pick_adapter)).ToLocalChecked());
+    Nan::Set(exports, Nan::New("adapter_load").ToLocalChecked(),
+             Nan::GetFunction(Nan::New<v8::FunctionTemplate>(HCI_adapter_load)).ToLocalChecked());
+}
@@ -0,0 +1,270 @@
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include <atomic>
+#include <mutex>
+
+#include <bluetooth/bluetooth.h>
+#include <bluetooth/hci.h>
+#include <bluetooth/hci_lib.h>
+
+#include "hci_backend.hpp"
+#include "hci_pool.hpp"
+
+/*
+ * A cached descriptor bound to a device.
+ *     - in_use: held between hci_pool_acquire() and hci_pool_release().
+ *     - stale: the descriptor must be reopened before its next use.
+ */
+struct hci_pool_entry
+{
+    int device_id;
+    int descriptor;
+    std::mutex in_use;
+    std::atomic<bool> stale;
+    struct hci_pool_entry *next;
+};
+
+/*
+ * A control socket and its users, between hci_pool_control_acquire() and
+ * hci_pool_control_release(). Closing the pool retires the current socket:
+ * it is closed once its last user gave it back, never under an ioctl.
+ */
+struct hci_pool_control
+{
+    int descriptor;
+    int users;
+    struct hci_pool_control *next;
+};
+
+static std::mutex pool_lock;
+static struct hci_pool_control *control;
+static struct hci_pool_control *retired;
+static struct hci_pool_entry *entries;
+
+/*
+ * Find the entry of a device.
+ * Params:
+ *     - device_id: device ID.
+ *     - create: create the entry when missing.
+ * Return value: the entry, or NULL.
+ */
+static struct hci_pool_entry *get_entry(int device_id, bool create)
+{
+    std::lock_guard<std::mutex> guard(pool_lock);
+    struct hci_pool_entry *entry;
+
+    for (entry = entries; entry; entry = entry->next)
+    {
+        if (entry->device_id == device_id)
+            return entry;
+    }
+
+    if (!create)
+        return NULL;
+
+    entry = new hci_pool_entry();
+    entry->device_id = device_id;
+    entry->descriptor = -1;
+    entry->stale = false;
+    entry->next = entries;
+    entries = entry;
+
+    return entry;
+}
+
+/*
+ * Get the shared control socket, used for device ioctls, opening it when
+ * needed. It must be given back with hci_pool_control_release(), and isn't
+ * closed until then.
+ * Params:
+ *     - error: details about the failed step.
+ * Return value: the socket, or -1 on failure.
+ */
+int hci_pool_control_acquire(struct hci_error *error)
+{
+    std::lock_guard<std::mutex> guard(pool_lock);
+
+    if (control == NULL)
+    {
+        int descriptor = hci_backend_get()->open_control(error);
+
+        if (descriptor < 0)
+            return -1;
+
+        control = new hci_pool_control();
+        control->descriptor = descriptor;
+        control->users = 0;
+        control->next = NULL;
+    }
+
+    control->users++;
+
+    return control->descriptor;
+}
+
+/*
+ * Give back the control socket obtained with hci_pool_control_acquire(),
+ * closing it when it was retired and this was its last user.
+ * Params:
+ *     - descriptor: the socket.
+ */
+void hci_pool_control_release(int descriptor)
+{
+    std::lock_guard<std::mutex> guard(pool_lock);
+
+    if (control && control->descriptor == descriptor)
+    {
+        control->users--;
+        return;
+    }
+
+    for (struct hci_pool_control **link = &retired; *link; link = &(*link)->next)
+    {
+        struct hci_pool_control *socket = *link;
+
+        if (socket->descriptor != descriptor)
+            continue;
+
+        if (--socket->users == 0)
+        {
+            close(socket->descriptor);
+            *link = socket->next;
+            delete socket;
+        }
+        return;
+    }
+}
+
+/*
+ * Get the cached descriptor of a device for exclusive use, opening it when
+ * needed. It must be given back with hci_pool_release().
+ * Params:
+ *     - device_id: device ID.
+ *     - error: details about the failed step.
+ * Return value: the descriptor, or -1 on failure.
+ */
+int hci_pool_acquire(int device_id, struct hci_error *error)
+{
+    struct hci_pool_entry *entry = get_entry(device_id, true);
+
+    entry->in_use.lock();
+
+    if (entry->stale.exchange(false) && entry->descriptor >= 0)
+    {
+        hci_close_dev(entry->descriptor);
+        entry->descriptor = -1;
+    }
+
+    if (entry->descriptor >= 0)
+        return entry->descriptor;
+
+    entry->descriptor = hci_backend_get()->open_device(device_id, error);
+    if (entry->descriptor < 0)
+    {
+        entry->in_use.unlock();
+        return -1;
+    }
+
+    return entry->descriptor;
+}
+
+/*
+ * Give back a descriptor obtained with hci_pool_acquire().
+ * Params:
+ *     - device_id: device ID.
+ *     - code: errno of the last failed operation on the descriptor, or 0.
+ *       The descriptor is dropped when it tells that the device went away.
+ */
+void hci_pool_release(int device_id, int code)
+{
+    struct hci_pool_entry *entry = get_entry(device_id, false);
+
+    if (entry == NULL)
+        return;
+
+    if (code == ENODEV || code == ENXIO || code == EPIPE ||
+        code == EBADFD || code == EBADF)
+        entry->stale = true;
+
+    if (entry->stale.exchange(false) && entry->descriptor >= 0)
+    {
+        hci_close_dev(entry->descriptor);
+        entry->descriptor = -1;
+    }
+
+    entry->in_use.unlock();
+}
+
+/*
+ * Drop the cached descriptor of a device, e.g. after a reset. A descriptor
+ * in use is closed when given back.
+ * Params:
+ *     - device_id: device ID.
+ */
+void hci_pool_invalidate(int device_id)
+{
+    struct hci_pool_entry *entry = get_entry(device_id, false);
+
+    if (entry)
+        entry->stale = true;
+}
+
+/*
+ * Drop the cached descriptors of devices which disappeared.
+ * Params:
+ *     - devices_list: result of HCIGETDEVLIST.
+ */
+void hci_pool_prune(struct hci_dev_list_req const *devices_list)
+{
+    std::lock_guard<std::mutex> guard(pool_lock);
+
+    for (struct hci_pool_entry *entry = entries; entry; entry = entry->next)
+    {
+        bool present = false;
+
+        for (int i = 0; i < devices_list->dev_num && !present; i++)
+            present = devices_list->dev_req[i].dev_id == entry->device_id;
+
+        if (!present)
+            entry->stale = true;
+    }
+}
+
+/*
+ * Close the control socket and every cached descriptor, without waiting for
+ * those in use: they are closed when given back. The pool reopens them on
+ * next use.
+ */
+void hci_pool_close(void)
+{
+    std::lock_guard<std::mutex> guard(pool_lock);
+
+    if (control && control->users > 0)
+    {
+        control->next = retired;
+        retired = control;
+    }
+    else if (control)
+    {
+        close(control->descriptor);
+        delete control;
+    }
+
+    control = NULL;
+
+    for (struct hci_pool_entry *entry = entries; entry; entry = entry->next)
+    {
+        entry->stale = true;
+
+        if (!entry->in_use.try_lock())
+            continue;
+
+        if (entry->descriptor >= 0)
+            hci_close_dev(entry->descriptor);
+        entry->descriptor = -1;
+        entry->stale = false;
+        entry->in_use.unlock();
+    }
+}
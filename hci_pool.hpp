@@ -0,0 +1,11 @@
+#pragma once
+
+#include "hci_core.hpp"
+
+int hci_pool_control_acquire(struct hci_error *error);
+void hci_pool_control_release(int descriptor);
+int hci_pool_acquire(int device_id, struct hci_error *error);
+void hci_pool_release(int device_id, int code);
+void hci_pool_invalidate(int device_id);
+void hci_pool_prune(struct hci_dev_list_req const *devices_list);
+void hci_pool_close(void);
@@ -0,0 +1,221 @@
+#include <condition_variable>
+
+#include <nan.h>
+
+#include "hci.hpp"
+#include "hci_queue.hpp"
+
+/*
+ * Completions of the workers queued by an instance of the addon.
+ *     - async: wakes up the instance's loop.
+ *     - done: signalled with completions.lock held, each time a worker is
+ *       done executing.
+ *     - pending: workers queued and not completed yet.
+ */
+struct hci_queue
+{
+    uv_async_t async;
+    struct hci_completion_queue completions;
+    std::condition_variable_any done;
+    int pending;
+};
+
+/*
+ * Wake up the event loop: called from a worker thread, with the completion
+ * queue locked.
+ * Params:
+ *     - arg: the queue.
+ */
+static void completion_notify(void *arg)
+{
+    struct hci_queue *queue = (struct hci_queue *)arg;
+
+    uv_async_send(&queue->async);
+    queue->done.notify_all();
+}
+
+/*
+ * Run the completion callbacks of finished workers on the event loop.
+ * Params:
+ *     - handle: the uv_async_t handle.
+ */
+static void completion_callback(uv_async_t *handle)
+{
+    hci_executor_drain(&((struct hci_queue *)handle->data)->completions);
+}
+
+/*
+ * Free a queue once its handle is closed.
+ * Params:
+ *     - handle: the uv_async_t handle.
+ */
+static void completion_closed(uv_handle_t *handle)
+{
+    delete (struct hci_queue *)handle->data;
+}
+
+/*
+ * Run a worker on its device's thread.
+ * Params:
+ *     - task: the worker's task.
+ */
+static void worker_execute(struct hci_task *task)
+{
+    ((DeviceWorker *)task->data)->Execute();
+}
+
+/*
+ * Complete a worker on the event loop.
+ * Params:
+ *     - task: the worker's task.
+ */
+static void worker_complete(struct hci_task *task)
+{
+    DeviceWorker *worker = (DeviceWorker *)task->data;
+    struct hci_queue *queue = worker->queue;
+
+    worker->WorkComplete();
+    worker->Destroy();
+
+    // Let the process exit once nothing is pending
+    if (--queue->pending == 0)
+        uv_unref((uv_handle_t *)&queue->async);
+}
+
+/*
+ * Set up the completion queue of an instance, on its event loop.
+ * Return value: the queue, freed by hci_queue_delete().
+ */
+struct hci_queue *hci_queue_new(void)
+{
+    struct hci_queue *queue = new hci_queue();
+
+    queue->completions.head = queue->completions.tail = NULL;
+    queue->completions.notify = completion_notify;
+    queue->completions.notify_arg = queue;
+    queue->pending = 0;
+
+    uv_async_init(Nan::GetCurrentEventLoop(), &queue->async, completion_callback);
+    queue->async.data = queue;
+    uv_unref((uv_handle_t *)&queue->async);
+
+    return queue;
+}
+
+/*
+ * Free the completion queue of an instance whose environment is going
+ * away. Waits for the queued workers to be done executing, as the device
+ * threads still reference the queue, then drops them without calling
+ * javascript.
+ * Params:
+ *     - queue: queue to free.
+ */
+void hci_queue_delete(struct hci_queue *queue)
+{
+    struct hci_task *task;
+
+    {
+        std::unique_lock<std::mutex> guard(queue->completions.lock);
+
+        for (;;)
+        {
+            int done = 0;
+
+            for (task = queue->completions.head; task; task = task->next)
+                done++;
+
+            if (done == queue->pending)
+                break;
+
+            queue->done.wait(guard);
+        }
+
+        task = queue->completions.head;
+        queue->completions.head = queue->completions.tail = NULL;
+    }
+
+    while (task)
+    {
+        struct hci_task *next = task->next;
+
+        delete (DeviceWorker *)task->data;
+        task = next;
+    }
+
+    uv_close((uv_handle_t *)&queue->async, completion_closed);
+}
+
+/*
+ * Queue a worker on its device's lane.
+ * Params:
+ *     - instance: instance completing the worker.
+ *     - worker: worker to run.
+ */
+void hci_queue_worker(struct hci_instance *instance, DeviceWorker *worker)
+{
+    struct hci_queue *queue = instance->queue;
+    struct hci_task *task = &worker->task;
+
+    worker->queue = queue;
+
+    task->device_id = worker->device_id;
+    task->execute = worker_execute;
+    task->complete = worker_complete;
+    task->data = worker;
+    task->queue = &queue->completions;
+
+    if (queue->pending++ == 0)
+        uv_ref((uv_handle_t *)&queue->async);
+
+    hci_executor_submit(task);
+}
+
+/*
+ * Add the timings of the worker to an object.
+ * Params:
+ *     - obj: object receiving "queuedMs" and "elapsedMs".
+ */
+void DeviceWorker::SetTimings(v8::Local<v8::Object> obj)
+{
+    Nan::Set(obj, Nan::New("queuedMs").ToLocalChecked(),
+             Nan::New((task.started_ns - task.queued_ns) / 1e6));
+
+    Nan::Set(obj, Nan::New("elapsedMs").ToLocalChecked(),
+             Nan::New((task.finished_ns - task.started_ns) / 1e6));
+}
+
+/*
+ * Build the value passed to the callback on success.
+ * Return value: { id, queuedMs, elapsedMs }.
+ */
+v8::Local<v8::Object> DeviceWorker::Result()
+{
+    v8::Local<v8::Object> obj = Nan::New<v8::Object>();
+
+    Nan::Set(obj, Nan::New("id").ToLocalChecked(), Nan::New(device_id));
+    SetTimings(obj);
+
+    return obj;
+}
+
+void DeviceWorker::HandleOKCallback()
+{
+    Nan::HandleScope scope;
+
+    v8::Local<v8::Value> argv[] = { Nan::Null(), Result() };
+
+    callback->Call(2, argv, async_resource);
+}
+
+void DeviceWorker::HandleErrorCallback()
+{
+    Nan::HandleScope scope;
+
+    v8::Local<v8::Value> exception = hci_error_to_js(device_id, &error);
+
+    SetTimings(exception.As<v8::Object>());
+
+    v8::Local<v8::Value> argv[] = { exception };
+
+    callback->Call(1, argv, async_resource);
+}
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <nan.h>
+
+#include "hci_core.hpp"
+#include "hci_executor.hpp"
+
+struct hci_instance;
+
+/*
+ * An AsyncWorker bound to a device, run by the per-device executor instead
+ * of the libuv thread pool. Its callback receives (error) or
+ * (null, { id, queuedMs, elapsedMs }); errors carry the same timings.
+ */
+class DeviceWorker : public Nan::AsyncWorker
+{
+public:
+    DeviceWorker(Nan::Callback *callback, const char *resource_name, int device_id)
+        : Nan::AsyncWorker(callback, resource_name), device_id(device_id), queue(NULL) {}
+
+    int device_id;
+    struct hci_task task;
+    struct hci_queue *queue;
+
+protected:
+    struct hci_error error;
+
+    void SetTimings(v8::Local<v8::Object> obj);
+    virtual v8::Local<v8::Object> Result();
+    void HandleOKCallback();
+    void HandleErrorCallback();
+};
+
+struct hci_queue *hci_queue_new(void);
+void hci_queue_delete(struct hci_queue *queue);
+void hci_queue_worker(struct hci_instance *instance, DeviceWorker *worker);
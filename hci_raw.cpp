@@ -0,0 +1,127 @@
+#include <string.h>
+
+#include "hci_conn.hpp"
+#include "hci_raw.hpp"
+
+static void put16(unsigned char *p, uint16_t value)
+{
+    p[0] = value;
+    p[1] = value >> 8;
+}
+
+static void put32(unsigned char *p, uint32_t value)
+{
+    p[0] = value;
+    p[1] = value >> 8;
+    p[2] = value >> 16;
+    p[3] = value >> 24;
+}
+
+/*
+ * Get the size of packed records.
+ * Params:
+ *     - count: number of devices.
+ * Return value: size in bytes.
+ */
+size_t hci_raw_size(int count)
+{
+    return HCI_RAW_HEADER_SIZE + (size_t)count * HCI_RAW_RECORD_SIZE;
+}
+
+/*
+ * Pack device infos.
+ * Params:
+ *     - devices: infos about HCI devices.
+ *     - count: number of devices.
+ *     - buffer: receives hci_raw_size(count) bytes.
+ */
+void hci_raw_pack(struct hci_dev_info const *devices, int count, unsigned char *buffer)
+{
+    memset(buffer, 0, hci_raw_size(count));
+
+    put32(buffer, HCI_RAW_MAGIC);
+    put16(buffer + 4, HCI_RAW_VERSION);
+    put16(buffer + 6, HCI_RAW_HEADER_SIZE);
+    put16(buffer + 8, HCI_RAW_RECORD_SIZE);
+    put16(buffer + 10, count);
+
+    for (int i = 0; i < count; i++)
+    {
+        struct hci_dev_info const *device_info = &devices[i];
+        struct hci_dev_stats const *stats = &device_info->stat;
+        unsigned char *record = buffer + HCI_RAW_HEADER_SIZE + i * HCI_RAW_RECORD_SIZE;
+
+        put16(record, device_info->dev_id);
+        record[2] = device_info->type;
+        strncpy((char *)record + 4, device_info->name, 8);
+        memcpy(record + 12, device_info->bdaddr.b, 6);
+        put32(record + 20, device_info->flags);
+        put16(record + 24, device_info->acl_mtu);
+        put16(record + 26, device_info->acl_pkts);
+        put16(record + 28, device_info->sco_mtu);
+        put16(record + 30, device_info->sco_pkts);
+        put32(record + 32, device_info->pkt_type);
+        put32(record + 36, device_info->link_policy);
+        put32(record + 40, device_info->link_mode);
+        memcpy(record + 44, device_info->features, 8);
+        put32(record + 52, stats->err_rx);
+        put32(record + 56, stats->err_tx);
+        put32(record + 60, stats->cmd_tx);
+        put32(record + 64, stats->evt_rx);
+        put32(record + 68, stats->acl_tx);
+        put32(record + 72, stats->acl_rx);
+        put32(record + 76, stats->sco_tx);
+        put32(record + 80, stats->sco_rx);
+        put32(record + 84, stats->byte_rx);
+        put32(record + 88, stats->byte_tx);
+    }
+}
+
+/*
+ * Get the size of packed connection records.
+ * Params:
+ *     - count: number of connections.
+ * Return value: size in bytes.
+ */
+size_t hci_raw_connections_size(int count)
+{
+    return HCI_RAW_HEADER_SIZE + (size_t)count * HCI_RAW_CONN_RECORD_SIZE;
+}
+
+/*
+ * Pack the connections of an adapter.
+ * Params:
+ *     - device_id: device ID.
+ *     - connections: connections and their link quality values.
+ *     - count: number of connections.
+ *     - buffer: receives hci_raw_connections_size(count) bytes.
+ */
+void hci_raw_connections_pack(int device_id, struct hci_connection const *connections, int count,
+                              unsigned char *buffer)
+{
+    memset(buffer, 0, hci_raw_connections_size(count));
+
+    put32(buffer, HCI_RAW_CONN_MAGIC);
+    put16(buffer + 4, HCI_RAW_VERSION);
+    put16(buffer + 6, HCI_RAW_HEADER_SIZE);
+    put16(buffer + 8, HCI_RAW_CONN_RECORD_SIZE);
+    put16(buffer + 10, count);
+    put16(buffer + 12, device_id);
+
+    for (int i = 0; i < count; i++)
+    {
+        struct hci_connection const *connection = &connections[i];
+        unsigned char *record = buffer + HCI_RAW_HEADER_SIZE + i * HCI_RAW_CONN_RECORD_SIZE;
+
+        put16(record, connection->info.handle);
+        record[2] = connection->info.type;
+        record[3] = connection->info.out;
+        memcpy(record + 4, connection->info.bdaddr.b, 6);
+        put16(record + 10, connection->info.state);
+        put32(record + 12, connection->info.link_mode);
+        record[16] = connection->valid;
+        record[17] = connection->rssi;
+        record[18] = connection->link_quality;
+        record[19] = connection->tx_power;
+    }
+}
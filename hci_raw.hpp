@@ -0,0 +1,65 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <bluetooth/bluetooth.h>
+#include <bluetooth/hci.h>
+
+/*
+ * Packed adapter records, little endian.
+ *
+ * Header (HCI_RAW_HEADER_SIZE bytes):
+ *     0  u32 magic (HCI_RAW_MAGIC)
+ *     4  u16 version (HCI_RAW_VERSION)
+ *     6  u16 header size
+ *     8  u16 record size
+ *     10 u16 record count
+ *     12 u32 reserved
+ *
+ * Record (HCI_RAW_RECORD_SIZE bytes):
+ *     0  u16 dev_id
+ *     2  u8  type (bus in the low nibble, type in bits 4-5)
+ *     3  u8  reserved
+ *     4  char name[8], NUL padded
+ *     12 u8  bdaddr[6], as stored by the kernel (least significant first)
+ *     18 u16 reserved
+ *     20 u32 flags
+ *     24 u16 acl_mtu, u16 acl_pkts, u16 sco_mtu, u16 sco_pkts
+ *     32 u32 pkt_type, u32 link_policy, u32 link_mode
+ *     44 u8  features[8]
+ *     52 u32 err_rx, err_tx, cmd_tx, evt_rx, acl_tx, acl_rx, sco_tx,
+ *            sco_rx, byte_rx, byte_tx
+ *     92 u32 reserved
+ */
+#define HCI_RAW_MAGIC       0x4d495442 // "BTIM"
+#define HCI_RAW_VERSION     1
+#define HCI_RAW_HEADER_SIZE 16
+#define HCI_RAW_RECORD_SIZE 96
+
+/*
+ * Packed connection records of an adapter, little endian. The header is
+ * the adapters' one, with a different magic and the dev_id at offset 12.
+ *
+ * Record (HCI_RAW_CONN_RECORD_SIZE bytes):
+ *     0  u16 handle
+ *     2  u8  link type (SCO 0, ACL 1, eSCO 2, LE 0x80)
+ *     3  u8  outgoing
+ *     4  u8  bdaddr[6], least significant first
+ *     10 u16 state
+ *     12 u32 link_mode
+ *     16 u8  valid (1: rssi, 2: link quality, 4: tx power)
+ *     17 s8  rssi
+ *     18 u8  link quality
+ *     19 s8  tx power
+ */
+#define HCI_RAW_CONN_MAGIC       0x43495442 // "BTIC"
+#define HCI_RAW_CONN_RECORD_SIZE 20
+
+struct hci_connection;
+
+size_t hci_raw_size(int count);
+void hci_raw_pack(struct hci_dev_info const *devices, int count, unsigned char *buffer);
+size_t hci_raw_connections_size(int count);
+void hci_raw_connections_pack(int device_id, struct hci_connection const *connections, int count,
+                              unsigned char *buffer);
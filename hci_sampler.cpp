@@ -0,0 +1,182 @@
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+
+#include <chrono>
+
+#include <bluetooth/bluetooth.h>
+#include <bluetooth/hci.h>
+#include <bluetooth/hci_lib.h>
+
+#include "hci_backend.hpp"
+#include "hci_pool.hpp"
+#include "hci_sampler.hpp"
+
+static_assert(sizeof(struct hci_sample_record) == 56, "Unexpected sample record layout");
+
+/*
+ * Append a sample to the ring, unless the reader is a full ring behind.
+ * Params:
+ *     - sampler: sampler.
+ *     - timestamp: milliseconds since the epoch.
+ *     - device_info: device infos.
+ */
+static void sampler_write(struct hci_sampler *sampler, double timestamp, struct hci_dev_info *device_info)
+{
+    uint32_t *header = sampler->header;
+    uint32_t write = header[HCI_SAMPLER_HEADER_WRITE];
+    uint32_t read = __atomic_load_n(&header[HCI_SAMPLER_HEADER_READ], __ATOMIC_ACQUIRE);
+    struct hci_dev_stats *stats = &device_info->stat;
+
+    if (write - read >= sampler->capacity)
+    {
+        __atomic_add_fetch(&header[HCI_SAMPLER_HEADER_OVERRUNS], 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    struct hci_sample_record *record = &sampler->records[write % sampler->capacity];
+
+    record->timestamp = timestamp;
+    record->dev_id = device_info->dev_id;
+    record->flags = device_info->flags;
+    record->counters[0] = stats->byte_rx;
+    record->counters[1] = stats->acl_rx;
+    record->counters[2] = stats->sco_rx;
+    record->counters[3] = stats->evt_rx;
+    record->counters[4] = stats->err_rx;
+    record->counters[5] = stats->byte_tx;
+    record->counters[6] = stats->acl_tx;
+    record->counters[7] = stats->sco_tx;
+    record->counters[8] = stats->cmd_tx;
+    record->counters[9] = stats->err_tx;
+
+    // Publish the record
+    __atomic_store_n(&header[HCI_SAMPLER_HEADER_WRITE], write + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Sample every device once.
+ * Params:
+ *     - sampler: sampler.
+ *     - devices_list: buffer for HCIGETDEVLIST.
+ */
+static void sampler_tick(struct hci_sampler *sampler, struct hci_dev_list_req *devices_list)
+{
+    struct hci_dev_info device_info;
+    struct hci_error error;
+    struct timespec now;
+    int control;
+
+    devices_list->dev_num = HCI_MAX_DEV;
+
+    if ((control = hci_pool_control_acquire(&error)) < 0)
+    {
+        __atomic_add_fetch(&sampler->header[HCI_SAMPLER_HEADER_ERRORS], 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    if (hci_backend_ioctl(control, HCIGETDEVLIST, (void *)devices_list) < 0)
+    {
+        hci_pool_control_release(control);
+        __atomic_add_fetch(&sampler->header[HCI_SAMPLER_HEADER_ERRORS], 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    double timestamp = now.tv_sec * 1e3 + now.tv_nsec / 1e6;
+
+    for (int i = 0; i < devices_list->dev_num; i++)
+    {
+        device_info.dev_id = devices_list->dev_req[i].dev_id;
+
+        if (hci_backend_ioctl(control, HCIGETDEVINFO, (void *)&device_info) < 0)
+        {
+            __atomic_add_fetch(&sampler->header[HCI_SAMPLER_HEADER_ERRORS], 1, __ATOMIC_RELAXED);
+            continue;
+        }
+
+        sampler_write(sampler, timestamp, &device_info);
+    }
+
+    hci_pool_control_release(control);
+}
+
+/*
+ * Sample devices until stopped.
+ * Params:
+ *     - sampler: sampler.
+ */
+static void sampler_loop(struct hci_sampler *sampler)
+{
+    // Allocated once, the loop itself doesn't allocate
+    unsigned char buffer[sizeof(struct hci_dev_list_req) + HCI_MAX_DEV * sizeof(struct hci_dev_req)];
+    struct hci_dev_list_req *devices_list = (struct hci_dev_list_req *)buffer;
+    auto next = std::chrono::steady_clock::now();
+    std::unique_lock<std::mutex> guard(sampler->lock);
+
+    while (sampler->running)
+    {
+        guard.unlock();
+        sampler_tick(sampler, devices_list);
+        guard.lock();
+
+        // Keep the pace, whatever the time spent sampling
+        next += std::chrono::milliseconds(sampler->interval_ms);
+        sampler->wake.wait_until(guard, next, [sampler] { return !sampler->running; });
+    }
+}
+
+/*
+ * Start sampling device counters into a ring buffer.
+ * Params:
+ *     - sampler: sampler to start.
+ *     - memory: ring buffer memory, 8 bytes aligned.
+ *     - size: size of the memory.
+ *     - interval_ms: delay between two samples of the devices.
+ *     - error: details about the failed step.
+ * Return values:
+ *     - EXIT_FAILURE: on failure.
+ *     - EXIT_SUCCESS: on success.
+ */
+int hci_sampler_start(struct hci_sampler *sampler, void *memory, size_t size, int interval_ms, struct hci_error *error)
+{
+    if (((uintptr_t)memory & 7) || interval_ms <= 0 ||
+        size < HCI_SAMPLER_HEADER_SIZE + sizeof(struct hci_sample_record))
+        return hci_set_error(error, EINVAL, "sampler");
+
+    memset(memory, 0, HCI_SAMPLER_HEADER_SIZE);
+
+    sampler->header = (uint32_t *)memory;
+    sampler->records = (struct hci_sample_record *)((unsigned char *)memory + HCI_SAMPLER_HEADER_SIZE);
+    sampler->capacity = (size - HCI_SAMPLER_HEADER_SIZE) / sizeof(struct hci_sample_record);
+    sampler->interval_ms = interval_ms;
+    sampler->running = true;
+
+    sampler->header[HCI_SAMPLER_HEADER_VERSION] = HCI_SAMPLER_VERSION;
+    sampler->header[HCI_SAMPLER_HEADER_CAPACITY] = sampler->capacity;
+    sampler->header[HCI_SAMPLER_HEADER_RECORD_SIZE] = sizeof(struct hci_sample_record);
+
+    sampler->thread = std::thread(sampler_loop, sampler);
+
+    return EXIT_SUCCESS;
+}
+
+/*
+ * Stop a sampler and wait for its thread.
+ * Params:
+ *     - sampler: sampler to stop.
+ */
+void hci_sampler_stop(struct hci_sampler *sampler)
+{
+    {
+        std::lock_guard<std::mutex> guard(sampler->lock);
+
+        if (!sampler->running)
+            return;
+
+        sampler->running = false;
+    }
+
+    sampler->wake.notify_one();
+    sampler->thread.join();
+}
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+#include "hci_core.hpp"
+
+/*
+ * Layout of the sampler's ring buffer. The header is made of 32 bits
+ * words, indexed by the enum below, followed by `capacity` records.
+ *     - write: records written so far, only updated by the sampler.
+ *     - read: records consumed so far, only updated by the reader.
+ *     - overruns: samples dropped because the ring was full.
+ *     - errors: failed reads of device infos.
+ */
+#define HCI_SAMPLER_VERSION     1
+#define HCI_SAMPLER_HEADER_SIZE 32
+
+enum
+{
+    HCI_SAMPLER_HEADER_VERSION,
+    HCI_SAMPLER_HEADER_CAPACITY,
+    HCI_SAMPLER_HEADER_RECORD_SIZE,
+    HCI_SAMPLER_HEADER_WRITE,
+    HCI_SAMPLER_HEADER_READ,
+    HCI_SAMPLER_HEADER_OVERRUNS,
+    HCI_SAMPLER_HEADER_ERRORS
+};
+
+/*
+ * A sample of one device's counters.
+ *     - timestamp: milliseconds since the epoch.
+ *     - counters: byte_rx, acl_rx, sco_rx, evt_rx, err_rx,
+ *                 byte_tx, acl_tx, sco_tx, cmd_tx, err_tx.
+ */
+struct hci_sample_record
+{
+    double timestamp;
+    uint32_t dev_id;
+    uint32_t flags;
+    uint32_t counters[10];
+};
+
+struct hci_sampler
+{
+    std::thread thread;
+    std::mutex lock;
+    std::condition_variable wake;
+    bool running;
+    uint32_t *header;
+    struct hci_sample_record *records;
+    uint32_t capacity;
+    int interval_ms;
+};
+
+int hci_sampler_start(struct hci_sampler *sampler, void *memory, size_t size, int interval_ms, struct hci_error *error);
+void hci_sampler_stop(struct hci_sampler *sampler);
@@ -0,0 +1,127 @@
+#include <bluetooth/bluetooth.h>
+#include <bluetooth/hci.h>
+
+#include <nan.h>
+
+#include "hci.hpp"
+#include "hci_sampler.hpp"
+
+/*
+ * A sampler owned by javascript. It keeps the ring buffer alive while it
+ * samples.
+ */
+class StatsSampler : public Nan::ObjectWrap
+{
+public:
+    static void Init(v8::Local<v8::Object> exports);
+
+private:
+    struct hci_sampler sampler;
+    Nan::Persistent<v8::Object> memory;
+
+    StatsSampler() { sampler.running = false; }
+    ~StatsSampler()
+    {
+        node::RemoveEnvironmentCleanupHook(v8::Isolate::GetCurrent(), Cleanup, this);
+        StopSampling();
+    }
+
+    void StopSampling()
+    {
+        hci_sampler_stop(&sampler);
+        memory.Reset();
+    }
+
+    static void Cleanup(void *arg);
+    static void New(const Nan::FunctionCallbackInfo<v8::Value>& info);
+    static void Stop(const Nan::FunctionCallbackInfo<v8::Value>& info);
+};
+
+/*
+ * Stop a sampler when its environment goes away, before the memory it
+ * writes to is freed.
+ * Params:
+ *     - arg: the sampler.
+ */
+void StatsSampler::Cleanup(void *arg)
+{
+    ((StatsSampler *)arg)->StopSampling();
+}
+
+/*
+ * Create a sampler.
+ * Params:
+ *     - info: Contains a Uint8Array over a SharedArrayBuffer and an interval
+ *       in milliseconds.
+ */
+void StatsSampler::New(const Nan::FunctionCallbackInfo<v8::Value>& info)
+{
+    struct hci_error error;
+
+    if (!info.IsConstructCall())
+    {
+        Nan::ThrowTypeError("Use new");
+        return;
+    }
+
+    if (!info[0]->IsUint8Array() || !info[1]->IsNumber())
+    {
+        Nan::ThrowTypeError("1st argument should be a Uint8Array and the 2nd one a number");
+        return;
+    }
+
+    Nan::TypedArrayContents<uint8_t> contents(info[0]);
+    int interval_ms = Nan::To<int32_t>(info[1]).FromJust();
+    StatsSampler *obj = new StatsSampler();
+
+    obj->Wrap(info.This());
+    node::AddEnvironmentCleanupHook(info.GetIsolate(), Cleanup, obj);
+
+    if (hci_sampler_start(&obj->sampler, *contents, contents.length(), interval_ms, &error) != EXIT_SUCCESS)
+    {
+        v8::Isolate::GetCurrent()->ThrowException(hci_error_to_js(-1, &error));
+        return;
+    }
+
+    obj->memory.Reset(info[0].As<v8::Object>());
+
+    info.GetReturnValue().Set(info.This());
+}
+
+/*
+ * Stop a sampler.
+ * Params:
+ *     - info: Contains arguments and a return value.
+ */
+void StatsSampler::Stop(const Nan::FunctionCallbackInfo<v8::Value>& info)
+{
+    Nan::ObjectWrap::Unwrap<StatsSampler>(info.Holder())->StopSampling();
+}
+
+/*
+ * Register the StatsSampler class.
+ * Params:
+ *     - exports: module exports.
+ */
+void StatsSampler::Init(v8::Local<v8::Object> exports)
+{
+    v8::Local<v8::FunctionTemplate> tpl = Nan::New<v8::FunctionTemplate>(New);
+
+    tpl->SetClassName(Nan::New("StatsSampler").ToLocalChecked());
+    tpl->InstanceTemplate()->SetInternalFieldCount(1);
+
+    Nan::SetPrototypeMethod(tpl, "stop", Stop);
+
+    Nan::Set(exports, Nan::New("StatsSampler").ToLocalChecked(),
+             Nan::GetFunction(tpl).ToLocalChecked());
+}
+
+/*
+ * Register the sampler bindings.
+ * Params:
+ *     - exports: module exports.
+ */
+void HCI_sampler_init(v8::Local<v8::Object> exports)
+{
+    StatsSampler::Init(exports);
+}
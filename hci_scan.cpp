@@ -0,0 +1,546 @@
+#include <errno.h>
+#include <poll.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+
+#include <new>
+
+#include <bluetooth/bluetooth.h>
+#include <bluetooth/hci.h>
+#include <bluetooth/hci_lib.h>
+
+#include "hci_backend.hpp"
+#include "hci_engine.hpp"
+#include "hci_executor.hpp"
+#include "hci_scan.hpp"
+
+#define SCAN_MAX_CAPACITY 65536
+#define SCAN_RCVBUF       (1024 * 1024)
+#define SCAN_READ_BURST   256
+
+// Scan interval and window, in units of 0.625 ms: listen all the time
+#define SCAN_INTERVAL 0x0010
+#define SCAN_WINDOW   0x0010
+
+static int check_status(struct hci_command const *command)
+{
+    return command->status ? EIO : 0;
+}
+
+/*
+ * Enable or disable LE scanning on an adapter, on its executor lane. A scan
+ * left running (e.g. by another process) is stopped first, since its
+ * parameters can't change meanwhile. The controller doesn't filter
+ * duplicates: it would hide RSSI updates, reports are merged by btim.
+ * Params:
+ *     - device_id: device ID.
+ *     - enable: enable scanning, or only disable it.
+ *     - active: send scan requests.
+ *     - error: details about the failed step.
+ * Return values:
+ *     - EXIT_FAILURE: on failure.
+ *     - EXIT_SUCCESS: on success.
+ */
+static int scan_enable(int device_id, bool enable, bool active, struct hci_error *error)
+{
+    le_set_scan_enable_cp disable_cp = { 0x00, 0x00 };
+    le_set_scan_enable_cp enable_cp = { 0x01, 0x00 };
+    le_set_scan_parameters_cp parameters;
+    struct hci_command commands[3];
+    struct hci_engine engine;
+    int count = 0;
+
+    parameters.type = active ? 0x01 : 0x00;
+    parameters.interval = htobs(SCAN_INTERVAL);
+    parameters.window = htobs(SCAN_WINDOW);
+    parameters.own_bdaddr_type = LE_PUBLIC_ADDRESS;
+    parameters.filter = 0x00;
+
+    hci_executor_lock(device_id);
+
+    if (hci_engine_open(&engine, device_id, error) != EXIT_SUCCESS)
+    {
+        hci_executor_unlock(device_id);
+        return EXIT_FAILURE;
+    }
+
+    // Its status doesn't matter: the controller may not be scanning
+    hci_command_init(&commands[count++], OGF_LE_CTL, OCF_LE_SET_SCAN_ENABLE,
+                     &disable_cp, LE_SET_SCAN_ENABLE_CP_SIZE, 1000);
+
+    if (enable)
+    {
+        hci_command_init(&commands[count], OGF_LE_CTL, OCF_LE_SET_SCAN_PARAMETERS,
+                         &parameters, LE_SET_SCAN_PARAMETERS_CP_SIZE, 1000);
+        commands[count++].check = check_status;
+        hci_command_init(&commands[count], OGF_LE_CTL, OCF_LE_SET_SCAN_ENABLE,
+                         &enable_cp, LE_SET_SCAN_ENABLE_CP_SIZE, 1000);
+        commands[count++].check = check_status;
+    }
+
+    if (hci_engine_run(&engine, commands, count) != EXIT_SUCCESS)
+    {
+        int failed = 0;
+
+        while (failed < count - 1 && !commands[failed].result)
+            failed++;
+
+        hci_set_error(error, commands[failed].result,
+                      failed == 1 ? "le_set_scan_parameters" : "le_set_scan_enable");
+        hci_engine_close(&engine, error->code);
+        hci_executor_unlock(device_id);
+        return EXIT_FAILURE;
+    }
+
+    hci_engine_close(&engine, 0);
+    hci_executor_unlock(device_id);
+
+    return EXIT_SUCCESS;
+}
+
+/*
+ * Hash the key of a report (FNV-1a).
+ */
+static uint64_t scan_hash(uint16_t device_id, le_advertising_info const *info)
+{
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    uint8_t const *address = info->bdaddr.b;
+
+    hash = (hash ^ (device_id & 0xff)) * 0x100000001b3ULL;
+    hash = (hash ^ (device_id >> 8)) * 0x100000001b3ULL;
+    hash = (hash ^ info->evt_type) * 0x100000001b3ULL;
+    hash = (hash ^ info->bdaddr_type) * 0x100000001b3ULL;
+
+    for (int i = 0; i < 6; i++)
+        hash = (hash ^ address[i]) * 0x100000001b3ULL;
+
+    for (int i = 0; i < info->length; i++)
+        hash = (hash ^ info->data[i]) * 0x100000001b3ULL;
+
+    return hash;
+}
+
+/*
+ * Merge a report into the filled table.
+ * Params:
+ *     - scan: scan.
+ *     - adapter: adapter which received it.
+ *     - info: report.
+ *     - rssi: its RSSI.
+ *     - timestamp: milliseconds since the epoch.
+ */
+static void scan_merge(struct hci_scan *scan, struct hci_scan_adapter *adapter,
+                       le_advertising_info const *info, int8_t rssi, double timestamp)
+{
+    struct hci_scan_table *table = scan->filled;
+    uint64_t hash = scan_hash(adapter->device_id, info);
+    uint32_t slot = (uint32_t)(hash ^ (hash >> 32)) & table->mask;
+    struct hci_scan_report *report;
+
+    adapter->reports.fetch_add(1, std::memory_order_relaxed);
+
+    for (; table->slots[slot]; slot = (slot + 1) & table->mask)
+    {
+        report = &table->reports[table->slots[slot] - 1];
+
+        if (report->hash == hash && report->device_id == adapter->device_id &&
+            !bacmp(&report->address, &info->bdaddr))
+        {
+            report->count++;
+            report->rssi = rssi;
+            report->timestamp = timestamp;
+            return;
+        }
+    }
+
+    if (table->count == (uint32_t)scan->options.capacity)
+    {
+        adapter->drops.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+
+    report = &table->reports[table->count];
+    report->device_id = adapter->device_id;
+    report->type = info->evt_type;
+    report->address_type = info->bdaddr_type;
+    bacpy(&report->address, &info->bdaddr);
+    report->rssi = rssi;
+    report->length = info->length;
+    report->count = 1;
+    report->slot = slot;
+    report->timestamp = timestamp;
+    report->hash = hash;
+    memcpy(report->data, info->data, info->length);
+
+    table->slots[slot] = ++table->count;
+}
+
+/*
+ * Parse an LE Advertising Report event.
+ * Params:
+ *     - scan: scan.
+ *     - adapter: adapter which received it.
+ *     - buffer, length: packet read from the adapter's descriptor.
+ *     - timestamp: milliseconds since the epoch.
+ */
+static void scan_parse(struct hci_scan *scan, struct hci_scan_adapter *adapter,
+                       uint8_t const *buffer, int length, double timestamp)
+{
+    hci_event_hdr const *header = (hci_event_hdr const *)(buffer + HCI_TYPE_LEN);
+    uint8_t const *data = (uint8_t const *)(header + 1);
+
+    if (length < HCI_TYPE_LEN + HCI_EVENT_HDR_SIZE + 2 || buffer[0] != HCI_EVENT_PKT ||
+        header->evt != EVT_LE_META_EVENT || header->plen > length - HCI_TYPE_LEN - HCI_EVENT_HDR_SIZE)
+    {
+        adapter->malformed.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+
+    if (data[0] != EVT_LE_ADVERTISING_REPORT)
+        return;
+
+    uint8_t const *end = data + header->plen;
+    uint8_t const *next = data + 2;
+
+    for (int i = 0; i < data[1]; i++)
+    {
+        le_advertising_info const *info = (le_advertising_info const *)next;
+
+        // Each report is followed by its RSSI
+        if (next + LE_ADVERTISING_INFO_SIZE > end || info->length > HCI_SCAN_DATA_SIZE ||
+            next + LE_ADVERTISING_INFO_SIZE + info->length + 1 > end)
+        {
+            adapter->malformed.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+
+        scan_merge(scan, adapter, info, (int8_t)info->data[info->length], timestamp);
+        next += LE_ADVERTISING_INFO_SIZE + info->length + 1;
+    }
+}
+
+/*
+ * Read the events waiting on an adapter. An adapter whose descriptor fails
+ * (e.g. unplugged) is no longer polled.
+ * Params:
+ *     - scan: scan.
+ *     - adapter: adapter.
+ *     - descriptor: its poll entry.
+ */
+static void scan_read(struct hci_scan *scan, struct hci_scan_adapter *adapter, struct pollfd *descriptor)
+{
+    uint8_t buffer[HCI_TYPE_LEN + HCI_EVENT_HDR_SIZE + HCI_MAX_EVENT_SIZE];
+    struct timespec now;
+    ssize_t length = -1;
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    double timestamp = now.tv_sec * 1e3 + now.tv_nsec / 1e6;
+
+    for (int i = 0; i < SCAN_READ_BURST; i++)
+    {
+        if ((length = recv(adapter->descriptor, buffer, sizeof(buffer), MSG_DONTWAIT)) <= 0)
+            break;
+
+        scan_parse(scan, adapter, buffer, length, timestamp);
+    }
+
+    if (length == 0 || (length < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+    {
+        adapter->errors.fetch_add(1, std::memory_order_relaxed);
+        descriptor->fd = -1;
+    }
+}
+
+/*
+ * Hand the filled table over as the published batch, unless the previous
+ * batch wasn't released yet.
+ * Params:
+ *     - scan: scan.
+ */
+static void scan_publish(struct hci_scan *scan)
+{
+    bool notify = false;
+
+    {
+        std::lock_guard<std::mutex> guard(scan->lock);
+
+        if (!scan->ready && scan->filled->count > 0)
+        {
+            struct hci_scan_table *table = scan->published;
+
+            scan->published = scan->filled;
+            scan->filled = table;
+            scan->ready = true;
+            notify = true;
+        }
+    }
+
+    if (notify && scan->options.notify)
+        scan->options.notify(scan->options.notify_arg);
+}
+
+/*
+ * Read the adapters and publish batches until stopped.
+ * Params:
+ *     - scan: scan.
+ */
+static void scan_loop(struct hci_scan *scan)
+{
+    struct pollfd descriptors[HCI_MAX_DEV + 1];
+    uint64_t interval_ns = scan->options.interval_ms * 1000000ULL;
+    uint64_t next = hci_monotonic_ns() + interval_ns;
+    int count = scan->adapter_count;
+
+    for (int i = 0; i < count; i++)
+    {
+        descriptors[i].fd = scan->adapters[i].descriptor;
+        descriptors[i].events = POLLIN;
+    }
+
+    descriptors[count].fd = scan->wakeup;
+    descriptors[count].events = POLLIN;
+
+    while (scan->running.load(std::memory_order_relaxed))
+    {
+        uint64_t now = hci_monotonic_ns();
+
+        if (now >= next)
+        {
+            scan_publish(scan);
+
+            // Keep the pace, unless far behind
+            next += interval_ns;
+            if (next <= now)
+                next = now + interval_ns;
+            continue;
+        }
+
+        if (poll(descriptors, count + 1, (next - now + 999999) / 1000000) < 0 && errno != EINTR)
+            break;
+
+        for (int i = 0; i < count; i++)
+        {
+            if (descriptors[i].fd >= 0 && descriptors[i].revents)
+                scan_read(scan, &scan->adapters[i], &descriptors[i]);
+        }
+    }
+}
+
+/*
+ * Disable scanning on the adapters and free the scan's resources.
+ * Params:
+ *     - scan: scan.
+ */
+static void scan_close(struct hci_scan *scan)
+{
+    struct hci_error error;
+
+    for (int i = 0; i < scan->adapter_count; i++)
+    {
+        struct hci_scan_adapter *adapter = &scan->adapters[i];
+
+        scan_enable(adapter->device_id, false, false, &error);
+        close(adapter->descriptor);
+        adapter->descriptor = -1;
+    }
+
+    for (int i = 0; i < 2; i++)
+    {
+        delete[] scan->tables[i].reports;
+        delete[] scan->tables[i].slots;
+        scan->tables[i].reports = NULL;
+        scan->tables[i].slots = NULL;
+    }
+
+    if (scan->wakeup >= 0)
+        close(scan->wakeup);
+    scan->wakeup = -1;
+}
+
+/*
+ * Start scanning LE advertising reports on adapters. Each one gets its own
+ * descriptor, only receiving LE meta events.
+ * Params:
+ *     - scan: scan to start.
+ *     - options: adapters, batch interval and capacity.
+ *     - error: details about the failed step.
+ * Return values:
+ *     - EXIT_FAILURE: on failure.
+ *     - EXIT_SUCCESS: on success.
+ */
+int hci_scan_start(struct hci_scan *scan, struct hci_scan_options const *options, struct hci_error *error)
+{
+    struct hci_filter filter;
+    int buffer_size = SCAN_RCVBUF;
+    uint32_t slots = 1;
+
+    if (options->id_count < 1 || options->id_count > HCI_MAX_DEV || options->interval_ms <= 0 ||
+        options->capacity <= 0 || options->capacity > SCAN_MAX_CAPACITY)
+        return hci_set_error(error, EINVAL, "scan");
+
+    // At most half full, to keep probes short
+    while (slots < 2 * (uint32_t)options->capacity)
+        slots <<= 1;
+
+    scan->options = *options;
+    scan->adapter_count = 0;
+    scan->ready = false;
+
+    for (int i = 0; i < 2; i++)
+    {
+        scan->tables[i].reports = new (std::nothrow) struct hci_scan_report[options->capacity];
+        scan->tables[i].slots = new (std::nothrow) uint32_t[slots]();
+        scan->tables[i].mask = slots - 1;
+        scan->tables[i].count = 0;
+    }
+
+    scan->filled = &scan->tables[0];
+    scan->published = &scan->tables[1];
+
+    if ((scan->wakeup = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) < 0)
+    {
+        hci_set_error(error, errno, "eventfd");
+        scan_close(scan);
+        return EXIT_FAILURE;
+    }
+
+    if (!scan->tables[0].reports || !scan->tables[0].slots || !scan->tables[1].reports || !scan->tables[1].slots)
+    {
+        hci_set_error(error, ENOMEM, "scan");
+        scan_close(scan);
+        return EXIT_FAILURE;
+    }
+
+    hci_filter_clear(&filter);
+    hci_filter_set_ptype(HCI_EVENT_PKT, &filter);
+    hci_filter_set_event(EVT_LE_META_EVENT, &filter);
+
+    for (int i = 0; i < options->id_count; i++)
+    {
+        struct hci_scan_adapter *adapter = &scan->adapters[scan->adapter_count];
+        int descriptor;
+
+        if ((descriptor = hci_backend_get()->open_device(options->ids[i], error)) < 0)
+        {
+            scan_close(scan);
+            return EXIT_FAILURE;
+        }
+
+        if (hci_backend_get()->set_filter(descriptor, &filter) < 0)
+        {
+            hci_set_error(error, errno, "HCI_FILTER");
+            close(descriptor);
+            scan_close(scan);
+            return EXIT_FAILURE;
+        }
+
+        // Bursts are absorbed by the socket while a batch is merged
+        setsockopt(descriptor, SOL_SOCKET, SO_RCVBUF, &buffer_size, sizeof(buffer_size));
+
+        adapter->device_id = options->ids[i];
+        adapter->descriptor = descriptor;
+        adapter->reports = 0;
+        adapter->drops = 0;
+        adapter->malformed = 0;
+        adapter->errors = 0;
+        scan->adapter_count++;
+
+        if (scan_enable(adapter->device_id, true, options->active, error) != EXIT_SUCCESS)
+        {
+            scan_close(scan);
+            return EXIT_FAILURE;
+        }
+    }
+
+    scan->running = true;
+    scan->thread = std::thread(scan_loop, scan);
+
+    return EXIT_SUCCESS;
+}
+
+/*
+ * Stop a scan: its thread is joined, scanning disabled on the adapters.
+ * A batch not taken yet is dropped.
+ * Params:
+ *     - scan: scan to stop.
+ */
+void hci_scan_stop(struct hci_scan *scan)
+{
+    uint64_t one = 1;
+
+    if (!scan->running.exchange(false))
+        return;
+
+    // Ignored: the poll timeout notices the stop anyway
+    (void)!write(scan->wakeup, &one, sizeof(one));
+
+    scan->thread.join();
+    scan_close(scan);
+}
+
+/*
+ * Get the published batch. It stays valid until hci_scan_release().
+ * Params:
+ *     - scan: scan.
+ *     - count: receives the number of reports.
+ * Return value: the reports, NULL when no batch is ready.
+ */
+struct hci_scan_report const *hci_scan_take(struct hci_scan *scan, int *count)
+{
+    std::lock_guard<std::mutex> guard(scan->lock);
+
+    if (!scan->ready)
+        return NULL;
+
+    *count = scan->published->count;
+    return scan->published->reports;
+}
+
+/*
+ * Give the published batch back, so that the next one can be published.
+ * Params:
+ *     - scan: scan.
+ */
+void hci_scan_release(struct hci_scan *scan)
+{
+    std::lock_guard<std::mutex> guard(scan->lock);
+    struct hci_scan_table *table = scan->published;
+
+    if (!scan->ready)
+        return;
+
+    // Only the used slots are cleared
+    for (uint32_t i = 0; i < table->count; i++)
+        table->slots[table->reports[i].slot] = 0;
+
+    table->count = 0;
+    scan->ready = false;
+}
+
+/*
+ * Get the counters of the adapters of a scan, running or stopped.
+ * Params:
+ *     - scan: scan.
+ *     - stats, max: buffer receiving the counters.
+ * Return value: number of adapters.
+ */
+int hci_scan_stats(struct hci_scan *scan, struct hci_scan_stats *stats, int max)
+{
+    int count = scan->adapter_count < max ? scan->adapter_count : max;
+
+    for (int i = 0; i < count; i++)
+    {
+        struct hci_scan_adapter *adapter = &scan->adapters[i];
+
+        stats[i].device_id = adapter->device_id;
+        stats[i].reports = adapter->reports.load(std::memory_order_relaxed);
+        stats[i].drops = adapter->drops.load(std::memory_order_relaxed);
+        stats[i].malformed = adapter->malformed.load(std::memory_order_relaxed);
+        stats[i].errors = adapter->errors.load(std::memory_order_relaxed);
+    }
+
+    return count;
+}
@@ -0,0 +1,131 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <atomic>
+#include <mutex>
+#include <thread>
+
+#include "hci_core.hpp"
+
+/*
+ * Longest advertising data of a legacy advertising report.
+ */
+#define HCI_SCAN_DATA_SIZE 31
+
+/*
+ * Advertising reports of an advertiser with a given payload, merged over a
+ * batch interval.
+ *     - device_id: adapter which received them.
+ *     - type: advertising event type (ADV_IND, SCAN_RSP...).
+ *     - address_type: LE_PUBLIC_ADDRESS or LE_RANDOM_ADDRESS.
+ *     - rssi: signal strength of the last report, in dBm.
+ *     - count: reports merged.
+ *     - timestamp: milliseconds since the epoch of the last report.
+ *     - hash: hash of the key (adapter, advertiser, type and payload).
+ *     - slot: where the report is in the table's index.
+ */
+struct hci_scan_report
+{
+    uint16_t device_id;
+    uint8_t type;
+    uint8_t address_type;
+    bdaddr_t address;
+    int8_t rssi;
+    uint8_t length;
+    uint32_t count;
+    uint32_t slot;
+    double timestamp;
+    uint64_t hash;
+    uint8_t data[HCI_SCAN_DATA_SIZE];
+};
+
+/*
+ * Fixed capacity table deduplicating reports, by open addressing.
+ *     - reports: the distinct reports, in arrival order.
+ *     - slots: index of size mask + 1, entries are a report's position plus
+ *       one, 0 when free.
+ */
+struct hci_scan_table
+{
+    struct hci_scan_report *reports;
+    uint32_t *slots;
+    uint32_t mask;
+    uint32_t count;
+};
+
+/*
+ * Counters of an adapter.
+ *     - reports: advertising reports received.
+ *     - drops: reports dropped because the table was full.
+ *     - malformed: events which couldn't be parsed.
+ *     - errors: failed reads; the adapter is no longer read after one.
+ */
+struct hci_scan_stats
+{
+    int device_id;
+    uint64_t reports;
+    uint64_t drops;
+    uint64_t malformed;
+    uint64_t errors;
+};
+
+/*
+ * An adapter scanned: its descriptor only receives LE meta events.
+ */
+struct hci_scan_adapter
+{
+    int device_id;
+    int descriptor;
+    std::atomic<uint64_t> reports;
+    std::atomic<uint64_t> drops;
+    std::atomic<uint64_t> malformed;
+    std::atomic<uint64_t> errors;
+};
+
+/*
+ * Options of a scan.
+ *     - ids, id_count: adapters to scan.
+ *     - interval_ms: delay between two batches.
+ *     - capacity: distinct reports per batch, more are dropped.
+ *     - active: send scan requests, to receive scan responses.
+ *     - notify: called from the scan thread when a batch is ready.
+ */
+struct hci_scan_options
+{
+    uint16_t ids[HCI_MAX_DEV];
+    int id_count;
+    int interval_ms;
+    int capacity;
+    bool active;
+    void (*notify)(void *arg);
+    void *notify_arg;
+};
+
+/*
+ * A scan of LE advertising reports. The scan thread merges reports into the
+ * filled table; each interval it hands it over as the published batch,
+ * unless the previous one wasn't taken yet, then reports keep being merged.
+ *     - wakeup: eventfd stopping the scan thread.
+ *     - ready: the published table holds a batch, until released.
+ */
+struct hci_scan
+{
+    std::thread thread;
+    std::mutex lock;
+    std::atomic<bool> running;
+    int wakeup;
+    struct hci_scan_options options;
+    struct hci_scan_adapter adapters[HCI_MAX_DEV];
+    int adapter_count;
+    struct hci_scan_table tables[2];
+    struct hci_scan_table *filled;
+    struct hci_scan_table *published;
+    bool ready;
+};
+
+int hci_scan_start(struct hci_scan *scan, struct hci_scan_options const *options, struct hci_error *error);
+void hci_scan_stop(struct hci_scan *scan);
+struct hci_scan_report const *hci_scan_take(struct hci_scan *scan, int *count);
+void hci_scan_release(struct hci_scan *scan);
+int hci_scan_stats(struct hci_scan *scan, struct hci_scan_stats *stats, int max);
@@ -0,0 +1,266 @@
+#include <bluetooth/bluetooth.h>
+#include <bluetooth/hci.h>
+
+#include <nan.h>
+
+#include "hci.hpp"
+#include "hci_scan.hpp"
+
+/*
+ * A scan owned by javascript. It is kept alive while it scans; batches
+ * are delivered on the loop through an async handle.
+ */
+class HciScan : public Nan::ObjectWrap
+{
+public:
+    static void Init(v8::Local<v8::Object> exports);
+
+private:
+    struct hci_scan scan;
+    uv_async_t *async;
+    Nan::Callback callback;
+    Nan::AsyncResource async_resource;
+
+    HciScan() : async(NULL), async_resource("btim:scan") { scan.running = false; scan.adapter_count = 0; }
+    ~HciScan()
+    {
+        node::RemoveEnvironmentCleanupHook(v8::Isolate::GetCurrent(), Cleanup, this);
+        StopScanning();
+    }
+
+    void StopScanning();
+
+    static void Cleanup(void *arg);
+    static void Notify(void *arg);
+    static void Closed(uv_handle_t *handle);
+    static void Deliver(uv_async_t *handle);
+    static void New(const Nan::FunctionCallbackInfo<v8::Value>& info);
+    static void Stop(const Nan::FunctionCallbackInfo<v8::Value>& info);
+    static void Stats(const Nan::FunctionCallbackInfo<v8::Value>& info);
+};
+
+/*
+ * Wake up the loop: called from the scan thread.
+ */
+void HciScan::Notify(void *arg)
+{
+    uv_async_send((uv_async_t *)arg);
+}
+
+/*
+ * Stop a scan when its environment goes away: nothing would deliver its
+ * batches anymore.
+ * Params:
+ *     - arg: the scan.
+ */
+void HciScan::Cleanup(void *arg)
+{
+    ((HciScan *)arg)->StopScanning();
+}
+
+void HciScan::Closed(uv_handle_t *handle)
+{
+    delete (uv_async_t *)handle;
+}
+
+void HciScan::StopScanning()
+{
+    if (async == NULL)
+        return;
+
+    hci_scan_stop(&scan);
+
+    uv_close((uv_handle_t *)async, Closed);
+    async = NULL;
+}
+
+/*
+ * Give the published batch to javascript, as an array of
+ * { id, address, addressType, type, rssi, count, timestamp, data }.
+ * Params:
+ *     - handle: the uv_async_t handle.
+ */
+void HciScan::Deliver(uv_async_t *handle)
+{
+    HciScan *obj = (HciScan *)handle->data;
+    struct hci_scan_report const *reports;
+    char address[18];
+    int count;
+
+    if ((reports = hci_scan_take(&obj->scan, &count)) == NULL)
+        return;
+
+    Nan::HandleScope scope;
+    v8::Local<v8::Array> batch = Nan::New<v8::Array>(count);
+
+    for (int i = 0; i < count; i++)
+    {
+        struct hci_scan_report const *report = &reports[i];
+        v8::Local<v8::Object> entry = Nan::New<v8::Object>();
+
+        ba2str(&report->address, address);
+
+        Nan::Set(entry, Nan::New("id").ToLocalChecked(), Nan::New(report->device_id));
+        Nan::Set(entry, Nan::New("address").ToLocalChecked(), Nan::New(address).ToLocalChecked());
+        Nan::Set(entry, Nan::New("addressType").ToLocalChecked(),
+                 Nan::New(report->address_type == LE_RANDOM_ADDRESS ? "random" : "public").ToLocalChecked());
+        Nan::Set(entry, Nan::New("type").ToLocalChecked(), Nan::New(report->type));
+        Nan::Set(entry, Nan::New("rssi").ToLocalChecked(), Nan::New(report->rssi));
+        Nan::Set(entry, Nan::New("count").ToLocalChecked(), Nan::New(report->count));
+        Nan::Set(entry, Nan::New("timestamp").ToLocalChecked(), Nan::New(report->timestamp));
+        Nan::Set(entry, Nan::New("data").ToLocalChecked(),
+                 Nan::CopyBuffer((char const *)report->data, report->length).ToLocalChecked());
+        Nan::Set(batch, i, entry);
+    }
+
+    hci_scan_release(&obj->scan);
+
+    v8::Local<v8::Value> argv[] = { batch };
+
+    obj->callback.Call(1, argv, &obj->async_resource);
+}
+
+/*
+ * Create and start a scan.
+ * Params:
+ *     - info: Contains an array of dev_ids, the batch interval in
+ *       milliseconds, the capacity of a batch, whether the scan is active,
+ *       and a callback(batch).
+ */
+void HciScan::New(const Nan::FunctionCallbackInfo<v8::Value>& info)
+{
+    struct hci_scan_options options;
+    struct hci_error error;
+
+    if (!info.IsConstructCall())
+    {
+        Nan::ThrowTypeError("Use new");
+        return;
+    }
+
+    if (!info[0]->IsArray() || !info[1]->IsNumber() || !info[2]->IsNumber() || !info[4]->IsFunction())
+    {
+        Nan::ThrowTypeError("Arguments should be an array, two numbers, a boolean and a callback");
+        return;
+    }
+
+    v8::Local<v8::Array> ids = info[0].As<v8::Array>();
+
+    if (ids->Length() < 1 || ids->Length() > HCI_MAX_DEV)
+    {
+        Nan::ThrowRangeError("Scan between 1 and 16 adapters");
+        return;
+    }
+
+    options.id_count = ids->Length();
+    for (int i = 0; i < options.id_count; i++)
+    {
+        int device_id;
+
+        if (!hci_device_id_arg(Nan::Get(ids, i).ToLocalChecked(), &device_id))
+            return;
+        options.ids[i] = device_id;
+    }
+
+    options.interval_ms = Nan::To<int32_t>(info[1]).FromJust();
+    options.capacity = Nan::To<int32_t>(info[2]).FromJust();
+    options.active = Nan::To<bool>(info[3]).FromJust();
+
+    HciScan *obj = new HciScan();
+
+    obj->Wrap(info.This());
+    obj->callback.Reset(info[4].As<v8::Function>());
+    node::AddEnvironmentCleanupHook(info.GetIsolate(), Cleanup, obj);
+
+    obj->async = new uv_async_t;
+    uv_async_init(Nan::GetCurrentEventLoop(), obj->async, Deliver);
+    obj->async->data = obj;
+
+    options.notify = Notify;
+    options.notify_arg = obj->async;
+
+    if (hci_scan_start(&obj->scan, &options, &error) != EXIT_SUCCESS)
+    {
+        uv_close((uv_handle_t *)obj->async, Closed);
+        obj->async = NULL;
+        v8::Isolate::GetCurrent()->ThrowException(hci_error_to_js(-1, &error));
+        return;
+    }
+
+    // Scanning keeps the object alive
+    obj->Ref();
+
+    info.GetReturnValue().Set(info.This());
+}
+
+/*
+ * Stop a scan. The batch not delivered yet is dropped.
+ * Params:
+ *     - info: Contains arguments and a return value.
+ */
+void HciScan::Stop(const Nan::FunctionCallbackInfo<v8::Value>& info)
+{
+    HciScan *obj = Nan::ObjectWrap::Unwrap<HciScan>(info.Holder());
+
+    if (obj->async == NULL)
+        return;
+
+    obj->StopScanning();
+    obj->Unref();
+}
+
+/*
+ * Get the counters of the adapters: [{ id, reports, drops, malformed,
+ * errors }].
+ * Params:
+ *     - info: Contains arguments and a return value.
+ */
+void HciScan::Stats(const Nan::FunctionCallbackInfo<v8::Value>& info)
+{
+    struct hci_scan_stats stats[HCI_MAX_DEV];
+    int count = hci_scan_stats(&Nan::ObjectWrap::Unwrap<HciScan>(info.Holder())->scan, stats, HCI_MAX_DEV);
+    v8::Local<v8::Array> result = Nan::New<v8::Array>(count);
+
+    for (int i = 0; i < count; i++)
+    {
+        v8::Local<v8::Object> entry = Nan::New<v8::Object>();
+
+        Nan::Set(entry, Nan::New("id").ToLocalChecked(), Nan::New(stats[i].device_id));
+        Nan::Set(entry, Nan::New("reports").ToLocalChecked(), Nan::New<v8::Number>(stats[i].reports));
+        Nan::Set(entry, Nan::New("drops").ToLocalChecked(), Nan::New<v8::Number>(stats[i].drops));
+        Nan::Set(entry, Nan::New("malformed").ToLocalChecked(), Nan::New<v8::Number>(stats[i].malformed));
+        Nan::Set(entry, Nan::New("errors").ToLocalChecked(), Nan::New<v8::Number>(stats[i].errors));
+        Nan::Set(result, i, entry);
+    }
+
+    info.GetReturnValue().Set(result);
+}
+
+/*
+ * Register the HciScan class.
+ * Params:
+ *     - exports: module exports.
+ */
+void HciScan::Init(v8::Local<v8::Object> exports)
+{
+    v8::Local<v8::FunctionTemplate> tpl = Nan::New<v8::FunctionTemplate>(New);
+
+    tpl->SetClassName(Nan::New("HciScan").ToLocalChecked());
+    tpl->InstanceTemplate()->SetInternalFieldCount(1);
+
+    Nan::SetPrototypeMethod(tpl, "stop", Stop);
+    Nan::SetPrototypeMethod(tpl, "stats", Stats);
+
+    Nan::Set(exports, Nan::New("HciScan").ToLocalChecked(),
+             Nan::GetFunction(tpl).ToLocalChecked());
+}
+
+/*
+ * Register the scan bindings.
+ * Params:
+ *     - exports: module exports.
+ */
+void HCI_scan_init(v8::Local<v8::Object> exports)
+{
+    HciScan::Init(exports);
+}
@@ -0,0 +1,1127 @@
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+#include <bluetooth/bluetooth.h>
+#include <bluetooth/hci.h>
+#include <bluetooth/hci_lib.h>
+
+#include "hci_backend.hpp"
+#include "hci_executor.hpp"
+#include "hci_sim.hpp"
+
+#define SIM_LINKS   64
+#define SIM_PACKETS 64
+#define SIM_PACKET_SIZE (HCI_TYPE_LEN + HCI_EVENT_HDR_SIZE + HCI_MAX_EVENT_SIZE)
+
+// BCCMD variables of CSR controllers
+#define CSR_VARID_PS         0x7003
+#define CSR_VARID_WARM_RESET 0x4001
+
+/*
+ * A simulated controller.
+ *     - controller: address the controller answers with.
+ *     - written: address written by a vendor command, used from the next
+ *       reset when pending.
+ *     - busy_ns: the controller answers nothing before this time, e.g.
+ *       while it resets.
+ *     - outstanding: commands sent and not answered yet.
+ *     - generation: times the adapter was plugged again.
+ *     - scanning: LE scan enabled, an advertising report is due at
+ *       report_ns; reports counts the ones sent.
+ */
+struct sim_device
+{
+    struct hci_dev_info info;
+    uint16_t manufacturer;
+    bdaddr_t controller;
+    bdaddr_t written;
+    bool pending;
+    uint64_t busy_ns;
+    int outstanding;
+    int generation;
+    bool scanning;
+    uint64_t report_ns;
+    uint32_t reports;
+};
+
+enum
+{
+    LINK_CONTROL,
+    LINK_DEVICE,
+    LINK_EVENTS,
+    LINK_MONITOR
+};
+
+/*
+ * A descriptor handed out by the backend: one end of a socket pair, the
+ * simulator writes to the other end (peer).
+ *     - device_id: device it is bound to, -1 for none.
+ *     - kind: LINK_* use of the descriptor; events links receive the
+ *       device events, monitor links a copy of every command and event.
+ *     - filter: events a device link receives, once filtered is set.
+ */
+struct sim_link
+{
+    int descriptor;
+    int peer;
+    int device_id;
+    int kind;
+    bool filtered;
+    struct hci_filter filter;
+};
+
+/*
+ * An event delivered once due.
+ *     - device_id: device answering, whose credits come back even when the
+ *       descriptor was closed meanwhile.
+ */
+struct sim_packet
+{
+    uint64_t due_ns;
+    uint64_t sequence;
+    int device_id;
+    int descriptor;
+    int peer;
+    int length;
+    uint8_t data[SIM_PACKET_SIZE];
+};
+
+/*
+ * Vendor command writing the address of a controller, as btim sends it.
+ *     - offset: where the address starts in the parameters.
+ *     - immediate: the controller uses the address right away instead of
+ *       from the next reset.
+ * CSR controllers (10) are answered through BCCMD instead.
+ */
+static struct {
+    uint16_t compid;
+    uint16_t ocf;
+    int offset;
+    bool immediate;
+} sim_vendor[] = {
+    {0,  0x000d, 0, false},
+    {13, 0x0006, 0, false},
+    {15, 0x0001, 0, true },
+    {18, 0x0001, 0, false},
+    {48, 0x0022, 2, false},
+    {57, 0x000d, 0, false},
+};
+
+static std::mutex sim_lock;
+static std::condition_variable sim_wakeup;
+static std::thread sim_thread;
+static bool sim_running;
+static struct hci_sim_options sim_options;
+static struct sim_device devices[HCI_MAX_DEV];
+static int device_count;
+static struct sim_link links[SIM_LINKS];
+static struct sim_packet packets[SIM_PACKETS];
+static int packet_count;
+static uint64_t packet_sequence;
+
+/*
+ * Take the time a simulated operation takes.
+ * Params:
+ *     - us: microseconds.
+ */
+static void sim_delay(int us)
+{
+    struct timespec delay = { us / 1000000, (us % 1000000) * 1000L };
+
+    if (us > 0)
+        nanosleep(&delay, NULL);
+}
+
+/*
+ * Tell whether the owner of a link closed its descriptor.
+ */
+static bool link_closed(struct sim_link const *link)
+{
+    struct pollfd descriptor = { link->peer, 0, 0 };
+
+    return poll(&descriptor, 1, 0) > 0 && (descriptor.revents & (POLLHUP | POLLERR));
+}
+
+/*
+ * Forget a link.
+ */
+static void link_drop(struct sim_link *link)
+{
+    close(link->peer);
+    link->descriptor = -1;
+    link->peer = -1;
+}
+
+/*
+ * Find the link of a descriptor.
+ * Return value: the link, or NULL.
+ */
+static struct sim_link *link_find(int descriptor)
+{
+    for (int i = 0; i < SIM_LINKS; i++)
+    {
+        if (links[i].descriptor == descriptor)
+            return &links[i];
+    }
+
+    return NULL;
+}
+
+/*
+ * Hand out a descriptor.
+ * Params:
+ *     - device_id: device it is bound to, -1 for none.
+ *     - kind: LINK_* use of the descriptor, events ones are non-blocking.
+ *     - error: details about the failed step.
+ * Return value: the descriptor, or -1 on failure.
+ */
+static int link_open(int device_id, int kind, struct hci_error *error)
+{
+    std::lock_guard<std::mutex> guard(sim_lock);
+    struct sim_link *link = NULL;
+    int flags = SOCK_SEQPACKET | SOCK_CLOEXEC | (kind == LINK_EVENTS ? SOCK_NONBLOCK : 0);
+    int pair[2];
+
+    if (socketpair(AF_UNIX, flags, 0, pair) < 0)
+    {
+        hci_set_error(error, errno, "socketpair");
+        return -1;
+    }
+
+    for (int i = 0; i < SIM_LINKS; i++)
+    {
+        // The number of a closed descriptor was reused
+        if (links[i].descriptor == pair[0] || (links[i].descriptor >= 0 && link_closed(&links[i])))
+            link_drop(&links[i]);
+
+        if (link == NULL && links[i].descriptor < 0)
+            link = &links[i];
+    }
+
+    if (link == NULL)
+    {
+        close(pair[0]);
+        close(pair[1]);
+        hci_set_error(error, EMFILE, "socketpair");
+        return -1;
+    }
+
+    link->descriptor = pair[0];
+    link->peer = pair[1];
+    link->device_id = device_id;
+    link->kind = kind;
+    link->filtered = false;
+
+    return link->descriptor;
+}
+
+/*
+ * Write a packet to the owner of a link. Links whose owner went away are
+ * dropped.
+ */
+static void link_send(struct sim_link *link, uint8_t const *data, int length)
+{
+    if (send(link->peer, data, length, MSG_DONTWAIT | MSG_NOSIGNAL) < 0 &&
+        (errno == EPIPE || errno == ECONNRESET))
+        link_drop(link);
+}
+
+/*
+ * Copy a packet to the monitor links.
+ * Params:
+ *     - opcode: HCI_MONITOR_* kind of packet.
+ *     - device_id: device ID.
+ *     - data, length: packet, without its type byte.
+ */
+static void monitor(uint16_t opcode, int device_id, uint8_t const *data, int length)
+{
+    uint8_t frame[sizeof(struct hci_monitor_header) + SIM_PACKET_SIZE];
+    struct hci_monitor_header *header = (struct hci_monitor_header *)frame;
+
+    header->opcode = htobs(opcode);
+    header->index = htobs(device_id);
+    header->length = htobs(length);
+    memcpy(header + 1, data, length);
+
+    for (int i = 0; i < SIM_LINKS; i++)
+    {
+        if (links[i].descriptor >= 0 && links[i].kind == LINK_MONITOR)
+            link_send(&links[i], frame, sizeof(*header) + length);
+    }
+}
+
+/*
+ * Tell whether the filter of a link lets an event through.
+ */
+static bool link_accepts(struct sim_link const *link, uint8_t event)
+{
+    return !link->filtered || hci_test_bit(event & HCI_FLT_EVENT_BITS, (void *)link->filter.event_mask);
+}
+
+/*
+ * Write an event to the monitor links, then to the owner of a device link:
+ * like the kernel, the monitor sees it first.
+ */
+static void device_send(struct sim_link *link, uint8_t const *data, int length)
+{
+    monitor(HCI_MONITOR_EVENT_PKT, link->device_id, data + HCI_TYPE_LEN, length - HCI_TYPE_LEN);
+    if (link_accepts(link, data[HCI_TYPE_LEN]))
+        link_send(link, data, length);
+}
+
+/*
+ * Account for the answer of a command as it leaves the controller: the
+ * credits it grants are those the other commands in flight left.
+ * Params:
+ *     - device_id: device ID.
+ *     - data: answer, whose Command Complete or Command Status gets the
+ *       credits.
+ */
+static void command_answered(int device_id, uint8_t *data)
+{
+    hci_event_hdr *header = (hci_event_hdr *)(data + HCI_TYPE_LEN);
+    struct sim_device *device = &devices[device_id];
+    int credits = sim_options.credits > 0 ? sim_options.credits : 1;
+
+    if (device->outstanding > 0)
+        device->outstanding--;
+    credits = credits > device->outstanding ? credits - device->outstanding : 0;
+
+    if (header->evt == EVT_CMD_COMPLETE)
+        ((evt_cmd_complete *)(header + 1))->ncmd = credits;
+    else if (header->evt == EVT_CMD_STATUS)
+        ((evt_cmd_status *)(header + 1))->ncmd = credits;
+}
+
+/*
+ * Deliver a packet now, or queue it until due.
+ * Params:
+ *     - link: link of the command.
+ *     - data, length: packet.
+ *     - due_ns: delivery time.
+ */
+static void deliver(struct sim_link *link, uint8_t *data, int length, uint64_t due_ns)
+{
+    if (due_ns <= hci_monotonic_ns() || packet_count == SIM_PACKETS)
+    {
+        command_answered(link->device_id, data);
+        device_send(link, data, length);
+        return;
+    }
+
+    struct sim_packet *packet = &packets[packet_count++];
+
+    packet->due_ns = due_ns;
+    packet->sequence = packet_sequence++;
+    packet->device_id = link->device_id;
+    packet->descriptor = link->descriptor;
+    packet->peer = link->peer;
+    packet->length = length;
+    memcpy(packet->data, data, length);
+
+    sim_wakeup.notify_one();
+}
+
+/*
+ * Send the advertising reports due on scanning devices to the device links
+ * filtering LE meta events in. Advertisers take turns; their payload
+ * changes every eighth round.
+ * Params:
+ *     - now: current time.
+ * Return value: when the next report is due, UINT64_MAX when none is.
+ */
+static uint64_t advertise(uint64_t now)
+{
+    uint8_t packet[HCI_TYPE_LEN + HCI_EVENT_HDR_SIZE + 2 + LE_ADVERTISING_INFO_SIZE + 12 + 1];
+    hci_event_hdr *header = (hci_event_hdr *)(packet + HCI_TYPE_LEN);
+    uint8_t *meta = (uint8_t *)(header + 1);
+    le_advertising_info *info = (le_advertising_info *)(meta + 2);
+    uint64_t next = UINT64_MAX;
+
+    if (sim_options.advertisers <= 0 || sim_options.advertising_us <= 0)
+        return next;
+
+    for (int i = 0; i < device_count; i++)
+    {
+        struct sim_device *device = &devices[i];
+
+        if (!device->scanning || !hci_test_bit(HCI_UP, &device->info.flags))
+            continue;
+
+        while (device->report_ns <= now)
+        {
+            uint32_t advertiser = device->reports % sim_options.advertisers;
+            uint32_t round = device->reports / sim_options.advertisers;
+
+            packet[0] = HCI_EVENT_PKT;
+            header->evt = EVT_LE_META_EVENT;
+            header->plen = sizeof(packet) - HCI_TYPE_LEN - HCI_EVENT_HDR_SIZE;
+            meta[0] = EVT_LE_ADVERTISING_REPORT;
+            meta[1] = 1;
+            info->evt_type = 0x00; // ADV_IND
+            info->bdaddr_type = LE_RANDOM_ADDRESS;
+            memset(&info->bdaddr, 0, sizeof(info->bdaddr));
+            info->bdaddr.b[0] = advertiser;
+            info->bdaddr.b[1] = advertiser >> 8;
+            info->bdaddr.b[5] = 0xc0;
+
+            // Flags, then manufacturer data carrying the round
+            info->length = 12;
+            memcpy(info->data, "\x02\x01\x06\x08\xff\x59\x00", 7);
+            info->data[7] = round / 8;
+            info->data[8] = round / 2048;
+            info->data[9] = advertiser;
+            info->data[10] = advertiser >> 8;
+            info->data[11] = 0;
+            info->data[12] = (uint8_t)(-40 - (int)(advertiser % 50)); // RSSI
+
+            for (int j = 0; j < SIM_LINKS; j++)
+            {
+                if (links[j].descriptor >= 0 && links[j].kind == LINK_DEVICE && links[j].device_id == i &&
+                    links[j].filtered && link_accepts(&links[j], EVT_LE_META_EVENT))
+                    link_send(&links[j], packet, sizeof(packet));
+            }
+
+            monitor(HCI_MONITOR_EVENT_PKT, i, packet + HCI_TYPE_LEN, sizeof(packet) - HCI_TYPE_LEN);
+            device->info.stat.evt_rx++;
+            device->info.stat.byte_rx += sizeof(packet);
+            device->reports++;
+            device->report_ns += (uint64_t)sim_options.advertising_us * 1000ULL;
+
+            // Don't catch up with a backlog, e.g. after a stall
+            if (device->report_ns + 1000000ULL < now)
+                device->report_ns = now;
+        }
+
+        if (device->report_ns < next)
+            next = device->report_ns;
+    }
+
+    return next;
+}
+
+/*
+ * Deliver queued packets and advertising reports once due, until the
+ * simulator stops.
+ */
+static void sim_loop(void)
+{
+    std::unique_lock<std::mutex> guard(sim_lock);
+
+    while (sim_running)
+    {
+        uint64_t now = hci_monotonic_ns();
+        uint64_t due = advertise(now);
+        int next = 0;
+
+        for (int i = 1; i < packet_count; i++)
+        {
+            if (packets[i].due_ns < packets[next].due_ns ||
+                (packets[i].due_ns == packets[next].due_ns && packets[i].sequence < packets[next].sequence))
+                next = i;
+        }
+
+        if (packet_count == 0 || packets[next].due_ns > now)
+        {
+            if (packet_count > 0 && packets[next].due_ns < due)
+                due = packets[next].due_ns;
+
+            if (due == UINT64_MAX)
+                sim_wakeup.wait(guard);
+            else
+                sim_wakeup.wait_for(guard, std::chrono::nanoseconds(due - now));
+            continue;
+        }
+
+        struct sim_link *link = link_find(packets[next].descriptor);
+
+        command_answered(packets[next].device_id, packets[next].data);
+        if (link && link->peer == packets[next].peer)
+            device_send(link, packets[next].data, packets[next].length);
+
+        packets[next] = packets[--packet_count];
+    }
+}
+
+/*
+ * Tell the events links about a device event.
+ * Params:
+ *     - event: HCI_DEV_* event.
+ *     - device_id: device ID.
+ */
+static void emit(int event, int device_id)
+{
+    uint8_t packet[HCI_TYPE_LEN + HCI_EVENT_HDR_SIZE + EVT_STACK_INTERNAL_SIZE + EVT_SI_DEVICE_SIZE];
+    hci_event_hdr *header = (hci_event_hdr *)(packet + HCI_TYPE_LEN);
+    evt_stack_internal *internal = (evt_stack_internal *)(header + 1);
+    evt_si_device *device = (evt_si_device *)internal->data;
+
+    packet[0] = HCI_EVENT_PKT;
+    header->evt = EVT_STACK_INTERNAL;
+    header->plen = EVT_STACK_INTERNAL_SIZE + EVT_SI_DEVICE_SIZE;
+    internal->type = htobs(EVT_SI_DEVICE);
+    device->event = htobs(event);
+    device->dev_id = htobs(device_id);
+
+    for (int i = 0; i < SIM_LINKS; i++)
+    {
+        if (links[i].descriptor >= 0 && links[i].kind == LINK_EVENTS)
+            link_send(&links[i], packet, sizeof(packet));
+    }
+}
+
+/*
+ * Reset a controller: a written address takes effect.
+ */
+static void controller_reset(struct sim_device *device)
+{
+    if (device->pending)
+        bacpy(&device->controller, &device->written);
+    device->pending = false;
+    device->scanning = false;
+}
+
+/*
+ * Build a Command Complete event.
+ * Params:
+ *     - packet: buffer of SIM_PACKET_SIZE bytes.
+ *     - ogf, ocf: opcode of the command.
+ *     - ret, rlen: return parameters.
+ * Return value: length of the packet.
+ */
+static int command_complete(uint8_t *packet, uint16_t ogf, uint16_t ocf, void const *ret, int rlen)
+{
+    hci_event_hdr *header = (hci_event_hdr *)(packet + HCI_TYPE_LEN);
+    evt_cmd_complete *event = (evt_cmd_complete *)(header + 1);
+
+    packet[0] = HCI_EVENT_PKT;
+    header->evt = EVT_CMD_COMPLETE;
+    header->plen = EVT_CMD_COMPLETE_SIZE + rlen;
+    event->ncmd = 1;
+    event->opcode = htobs(cmd_opcode_pack(ogf, ocf));
+    memcpy(event + 1, ret, rlen);
+
+    return HCI_TYPE_LEN + HCI_EVENT_HDR_SIZE + header->plen;
+}
+
+/*
+ * Answer a CSR BCCMD, echoed back as a GETRESP vendor event.
+ * Params:
+ *     - device: controller.
+ *     - params, plen: command parameters, 0xc2 then the BCCMD.
+ *     - packet: buffer of SIM_PACKET_SIZE bytes.
+ *     - delay_us: receives the time the command takes.
+ * Return value: length of the packet.
+ */
+static int csr_answer(struct sim_device *device, uint8_t const *params, uint8_t plen,
+                      uint8_t *packet, int *delay_us)
+{
+    hci_event_hdr *header = (hci_event_hdr *)(packet + HCI_TYPE_LEN);
+    uint8_t *data = (uint8_t *)(header + 1);
+    uint8_t const *bccmd = params + 1;
+    uint16_t varid = bccmd[6] | (bccmd[7] << 8);
+
+    if (varid == CSR_VARID_PS && plen >= 25)
+    {
+        device->written.b[0] = bccmd[18];
+        device->written.b[1] = bccmd[19];
+        device->written.b[2] = bccmd[16];
+        device->written.b[3] = bccmd[20];
+        device->written.b[4] = bccmd[22];
+        device->written.b[5] = bccmd[23];
+        device->pending = true;
+    }
+    else if (varid == CSR_VARID_WARM_RESET)
+    {
+        controller_reset(device);
+        *delay_us = sim_options.reset_us;
+    }
+
+    packet[0] = HCI_EVENT_PKT;
+    header->evt = EVT_VENDOR;
+    header->plen = plen;
+    memcpy(data, params, plen);
+    data[1] = 0x01; // GETRESP
+    data[2] = 0x00;
+
+    return HCI_TYPE_LEN + HCI_EVENT_HDR_SIZE + plen;
+}
+
+/*
+ * Answer a command like the controller would.
+ * Params:
+ *     - device: controller.
+ *     - ogf, ocf: opcode.
+ *     - params, plen: command parameters.
+ *     - packet: buffer of SIM_PACKET_SIZE bytes.
+ *     - delay_us: receives the time the command takes.
+ * Return value: length of the packet.
+ */
+static int answer(struct sim_device *device, uint16_t ogf, uint16_t ocf,
+                  uint8_t const *params, uint8_t plen, uint8_t *packet, int *delay_us)
+{
+    uint8_t status = 0x01; // Unknown HCI Command
+
+    *delay_us = sim_options.command_us;
+
+    if (ogf == OGF_HOST_CTL && ocf == OCF_RESET)
+    {
+        controller_reset(device);
+        *delay_us = sim_options.reset_us;
+        status = 0;
+    }
+    else if (ogf == OGF_INFO_PARAM && ocf == OCF_READ_BD_ADDR)
+    {
+        read_bd_addr_rp response;
+
+        response.status = 0;
+        bacpy(&response.bdaddr, &device->controller);
+        return command_complete(packet, ogf, ocf, &response, sizeof(response));
+    }
+    else if (ogf == OGF_INFO_PARAM && ocf == OCF_READ_LOCAL_VERSION)
+    {
+        read_local_version_rp response;
+
+        response.status = 0;
+        response.hci_ver = 6;
+        response.hci_rev = htobs(0x1000);
+        response.lmp_ver = 6;
+        response.manufacturer = htobs(device->manufacturer);
+        response.lmp_subver = htobs(0x2000);
+        return command_complete(packet, ogf, ocf, &response, sizeof(response));
+    }
+    else if (ogf == OGF_LE_CTL && ocf == OCF_LE_SET_SCAN_PARAMETERS)
+        status = device->scanning ? 0x0c : 0; // Command Disallowed while scanning
+    else if (ogf == OGF_LE_CTL && ocf == OCF_LE_SET_SCAN_ENABLE && plen >= LE_SET_SCAN_ENABLE_CP_SIZE)
+    {
+        if (params[0] && !device->scanning)
+        {
+            device->report_ns = hci_monotonic_ns() + (uint64_t)sim_options.advertising_us * 1000ULL;
+            sim_wakeup.notify_one();
+        }
+
+        device->scanning = params[0] != 0;
+        status = 0;
+    }
+    else if ((ogf == OGF_STATUS_PARAM && (ocf == OCF_READ_RSSI || ocf == OCF_READ_LINK_QUALITY)) ||
+             (ogf == OGF_HOST_CTL && ocf == OCF_READ_TRANSMIT_POWER_LEVEL))
+    {
+        read_rssi_rp response; // The three responses are laid out alike
+        uint16_t handle = plen >= 2 ? params[0] | params[1] << 8 : 0;
+
+        // Unknown Connection Identifier
+        response.status = handle >= 1 && handle <= sim_options.connections ? 0 : 0x02;
+        response.handle = htobs(handle);
+        if (ocf == OCF_READ_RSSI)
+            response.rssi = -40 - handle % 50;
+        else if (ocf == OCF_READ_LINK_QUALITY)
+            response.rssi = (int8_t)(255 - handle % 64);
+        else
+            response.rssi = 4;
+        return command_complete(packet, ogf, ocf, &response, sizeof(response));
+    }
+    else if (ogf == OGF_VENDOR_CMD)
+    {
+        if (device->manufacturer == 10 && ocf == 0 && plen >= 11 && params[0] == 0xc2)
+            return csr_answer(device, params, plen, packet, delay_us);
+
+        for (size_t i = 0; i < sizeof(sim_vendor) / sizeof(sim_vendor[0]); i++)
+        {
+            if (sim_vendor[i].compid != device->manufacturer || sim_vendor[i].ocf != ocf ||
+                plen < sim_vendor[i].offset + 6)
+                continue;
+
+            memcpy(&device->written, params + sim_vendor[i].offset, sizeof(device->written));
+            device->pending = true;
+            if (sim_vendor[i].immediate)
+                controller_reset(device);
+            status = 0;
+            break;
+        }
+    }
+
+    return command_complete(packet, ogf, ocf, &status, 1);
+}
+
+static int sim_open_control(struct hci_error *error)
+{
+    return link_open(-1, LINK_CONTROL, error);
+}
+
+static int sim_open_device(int device_id, struct hci_error *error)
+{
+    if (device_id < 0 || device_id >= device_count)
+    {
+        hci_set_error(error, ENODEV, "hci_open_dev");
+        return -1;
+    }
+
+    return link_open(device_id, LINK_DEVICE, error);
+}
+
+static int sim_open_events(struct hci_error *error)
+{
+    return link_open(-1, LINK_EVENTS, error);
+}
+
+static int sim_open_monitor(struct hci_error *error)
+{
+    return link_open(-1, LINK_MONITOR, error);
+}
+
+static int sim_set_filter(int descriptor, struct hci_filter const *filter)
+{
+    std::lock_guard<std::mutex> guard(sim_lock);
+    struct sim_link *link = link_find(descriptor);
+
+    if (link == NULL || link->kind != LINK_DEVICE)
+    {
+        errno = EBADF;
+        return -1;
+    }
+
+    link->filter = *filter;
+    link->filtered = true;
+    return 0;
+}
+
+/*
+ * Get a simulated device.
+ * Return value: the device, or NULL with errno set to ENODEV.
+ */
+static struct sim_device *get_device(int device_id)
+{
+    if (device_id < 0 || device_id >= device_count)
+    {
+        errno = ENODEV;
+        return NULL;
+    }
+
+    return &devices[device_id];
+}
+
+/*
+ * Answer a device ioctl like the kernel would. HCIDEVUP runs the kernel's
+ * HCI Reset, and reads the controller's address like hci_dev_open().
+ */
+static int sim_ioctl(int descriptor, unsigned long request, void *arg)
+{
+    int device_id = (int)(long)arg;
+    struct sim_device *device;
+
+    switch (request)
+    {
+    case HCIGETDEVLIST:
+    {
+        struct hci_dev_list_req *devices_list = (struct hci_dev_list_req *)arg;
+
+        sim_delay(sim_options.ioctl_us);
+
+        std::lock_guard<std::mutex> guard(sim_lock);
+
+        if (devices_list->dev_num > device_count)
+            devices_list->dev_num = device_count;
+
+        for (int i = 0; i < devices_list->dev_num; i++)
+        {
+            devices_list->dev_req[i].dev_id = i;
+            devices_list->dev_req[i].dev_opt = devices[i].info.flags;
+        }
+        return 0;
+    }
+
+    case HCIGETCONNLIST:
+    {
+        struct hci_conn_list_req *connections_list = (struct hci_conn_list_req *)arg;
+        int count = 0;
+
+        sim_delay(sim_options.ioctl_us);
+
+        std::lock_guard<std::mutex> guard(sim_lock);
+
+        if (!(device = get_device(connections_list->dev_id)))
+            return -1;
+
+        if (hci_test_bit(HCI_UP, &device->info.flags))
+            count = sim_options.connections < connections_list->conn_num ?
+                sim_options.connections : connections_list->conn_num;
+
+        for (int i = 0; i < count; i++)
+        {
+            struct hci_conn_info *connection = &connections_list->conn_info[i];
+
+            // 00:1B:DC:C0:<dev_id>:<handle>
+            memset(connection, 0, sizeof(*connection));
+            connection->handle = i + 1;
+            connection->type = ACL_LINK;
+            connection->out = i & 1;
+            connection->state = 1; // BT_CONNECTED
+            connection->bdaddr.b[0] = i + 1;
+            connection->bdaddr.b[1] = connections_list->dev_id;
+            connection->bdaddr.b[2] = 0xc0;
+            connection->bdaddr.b[3] = 0xdc;
+            connection->bdaddr.b[4] = 0x1b;
+        }
+
+        connections_list->conn_num = count;
+        return 0;
+    }
+
+    case HCIGETDEVINFO:
+    {
+        struct hci_dev_info *device_info = (struct hci_dev_info *)arg;
+
+        sim_delay(sim_options.ioctl_us);
+
+        std::lock_guard<std::mutex> guard(sim_lock);
+
+        if ((device = get_device(device_info->dev_id)) == NULL)
+            return -1;
+
+        *device_info = device->info;
+        return 0;
+    }
+
+    case HCIDEVUP:
+    {
+        if (get_device(device_id) == NULL)
+            return -1;
+
+        {
+            std::lock_guard<std::mutex> guard(sim_lock);
+
+            if (hci_test_bit(HCI_UP, &devices[device_id].info.flags))
+            {
+                errno = EALREADY;
+                return -1;
+            }
+        }
+
+        sim_delay(sim_options.up_us);
+
+        std::lock_guard<std::mutex> guard(sim_lock);
+
+        device = &devices[device_id];
+        controller_reset(device);
+        bacpy(&device->info.bdaddr, &device->controller);
+        hci_set_bit(HCI_UP, &device->info.flags);
+        hci_set_bit(HCI_RUNNING, &device->info.flags);
+        emit(HCI_DEV_UP, device_id);
+        return 0;
+    }
+
+    case HCIDEVDOWN:
+    {
+        sim_delay(sim_options.ioctl_us);
+
+        std::lock_guard<std::mutex> guard(sim_lock);
+
+        if ((device = get_device(device_id)) == NULL)
+            return -1;
+
+        if (hci_test_bit(HCI_UP, &device->info.flags))
+        {
+            hci_clear_bit(HCI_UP, &device->info.flags);
+            hci_clear_bit(HCI_RUNNING, &device->info.flags);
+            emit(HCI_DEV_DOWN, device_id);
+        }
+        return 0;
+    }
+
+    case HCIDEVRESET:
+    {
+        if (get_device(device_id) == NULL)
+            return -1;
+
+        sim_delay(sim_options.reset_us);
+
+        std::lock_guard<std::mutex> guard(sim_lock);
+
+        device = &devices[device_id];
+        if (!hci_test_bit(HCI_UP, &device->info.flags))
+        {
+            errno = ENETDOWN;
+            return -1;
+        }
+
+        controller_reset(device);
+        return 0;
+    }
+    }
+
+    errno = ENOTTY;
+    return -1;
+}
+
+/*
+ * Send a command to a simulated controller. The answer is written to the
+ * descriptor once the controller would have sent it.
+ */
+static int sim_send_command(int descriptor, uint16_t ogf, uint16_t ocf, uint8_t plen, void const *params)
+{
+    std::lock_guard<std::mutex> guard(sim_lock);
+    uint8_t packet[SIM_PACKET_SIZE];
+    struct sim_link *link = link_find(descriptor);
+    struct sim_device *device;
+    int length, delay_us;
+
+    if (link == NULL || link->kind != LINK_DEVICE)
+    {
+        errno = EBADF;
+        return -1;
+    }
+
+    device = &devices[link->device_id];
+
+    if (!hci_test_bit(HCI_UP, &device->info.flags))
+    {
+        errno = ENETDOWN;
+        return -1;
+    }
+
+    hci_command_hdr *command = (hci_command_hdr *)packet;
+
+    command->opcode = htobs(cmd_opcode_pack(ogf, ocf));
+    command->plen = plen;
+    memcpy(command + 1, params, plen);
+    monitor(HCI_MONITOR_COMMAND_PKT, link->device_id, packet, HCI_COMMAND_HDR_SIZE + plen);
+
+    length = answer(device, ogf, ocf, (uint8_t const *)params, plen, packet, &delay_us);
+
+    device->info.stat.cmd_tx++;
+    device->info.stat.evt_rx++;
+    device->info.stat.byte_tx += HCI_TYPE_LEN + HCI_COMMAND_HDR_SIZE + plen;
+    device->info.stat.byte_rx += length;
+    device->outstanding++;
+
+    // Commands are answered in order, after whatever the controller is busy with
+    uint64_t now = hci_monotonic_ns();
+
+    if (device->busy_ns < now)
+        device->busy_ns = now;
+    device->busy_ns += (uint64_t)delay_us * 1000ULL;
+
+    deliver(link, packet, length, device->busy_ns);
+
+    return 0;
+}
+
+static struct hci_backend const sim_backend =
+{
+    "sim",
+    sim_open_control,
+    sim_open_device,
+    sim_open_events,
+    sim_open_monitor,
+    sim_set_filter,
+    sim_ioctl,
+    sim_send_command
+};
+
+/*
+ * Replace the kernel by simulated controllers, up with distinct addresses.
+ * Starting again replaces the previous ones.
+ * Params:
+ *     - options: controllers and latencies.
+ *     - error: details about the failed step.
+ * Return values:
+ *     - EXIT_FAILURE: on failure.
+ *     - EXIT_SUCCESS: on success.
+ */
+int hci_sim_start(struct hci_sim_options const *options, struct hci_error *error)
+{
+    static uint8_t const features[8] = { 0xff, 0xff, 0x8f, 0xfe, 0xdb, 0xff, 0x5b, 0x87 };
+
+    if (options->count <= 0 || options->count > HCI_MAX_DEV)
+        return hci_set_error(error, EINVAL, "count");
+
+    hci_sim_stop();
+
+    {
+        std::lock_guard<std::mutex> guard(sim_lock);
+
+        sim_options = *options;
+        device_count = options->count;
+
+        for (int i = 0; i < device_count; i++)
+        {
+            struct sim_device *device = &devices[i];
+
+            memset(device, 0, sizeof(*device));
+            device->manufacturer = options->manufacturers[i];
+            device->info.dev_id = i;
+            snprintf(device->info.name, sizeof(device->info.name), "hci%d", i);
+            device->info.type = HCI_USB;
+            device->info.acl_mtu = 1021;
+            device->info.acl_pkts = 8;
+            device->info.sco_mtu = 64;
+            device->info.sco_pkts = 1;
+            memcpy(device->info.features, features, sizeof(features));
+            hci_set_bit(HCI_UP, &device->info.flags);
+            hci_set_bit(HCI_RUNNING, &device->info.flags);
+
+            // 00:1B:DC:F0:00:xx
+            device->controller.b[0] = i + 1;
+            device->controller.b[2] = 0xf0;
+            device->controller.b[3] = 0xdc;
+            device->controller.b[4] = 0x1b;
+            bacpy(&device->info.bdaddr, &device->controller);
+        }
+
+        for (int i = 0; i < SIM_LINKS; i++)
+        {
+            links[i].descriptor = -1;
+            links[i].peer = -1;
+        }
+
+        packet_count = 0;
+        sim_running = true;
+        sim_thread = std::thread(sim_loop);
+    }
+
+    hci_backend_set(&sim_backend);
+
+    return EXIT_SUCCESS;
+}
+
+/*
+ * Drop the answers a controller has yet to send: it was reset or replaced.
+ */
+static void forget_commands(struct sim_device *device)
+{
+    int device_id = (int)(device - devices);
+
+    for (int i = 0; i < packet_count; i++)
+    {
+        if (packets[i].device_id == device_id)
+            packets[i--] = packets[--packet_count];
+    }
+
+    device->outstanding = 0;
+    device->busy_ns = 0;
+}
+
+/*
+ * Make a controller report a Hardware Error: the commands it was running
+ * are never answered.
+ * Params:
+ *     - device_id: device ID.
+ *     - code: hardware code of the event.
+ *     - error: details about the failed step.
+ * Return values:
+ *     - EXIT_FAILURE: on failure.
+ *     - EXIT_SUCCESS: on success.
+ */
+int hci_sim_hardware_error(int device_id, uint8_t code, struct hci_error *error)
+{
+    std::lock_guard<std::mutex> guard(sim_lock);
+    uint8_t packet[HCI_TYPE_LEN + HCI_EVENT_HDR_SIZE + 1];
+    hci_event_hdr *header = (hci_event_hdr *)(packet + HCI_TYPE_LEN);
+    struct sim_device *device;
+
+    if (!sim_running || (device = get_device(device_id)) == NULL)
+        return hci_set_error(error, ENODEV, "device");
+
+    forget_commands(device);
+
+    packet[0] = HCI_EVENT_PKT;
+    header->evt = EVT_HARDWARE_ERROR;
+    header->plen = 1;
+    packet[HCI_TYPE_LEN + HCI_EVENT_HDR_SIZE] = code;
+
+    for (int i = 0; i < SIM_LINKS; i++)
+    {
+        if (links[i].descriptor >= 0 && links[i].kind == LINK_DEVICE && links[i].device_id == device_id)
+            link_send(&links[i], packet, sizeof(packet));
+    }
+
+    monitor(HCI_MONITOR_EVENT_PKT, device_id, packet + HCI_TYPE_LEN, sizeof(packet) - HCI_TYPE_LEN);
+
+    return EXIT_SUCCESS;
+}
+
+/*
+ * Unplug an adapter and plug another one in its place, from another
+ * manufacturer and with another address. Descriptors bound to the old one
+ * read end of file; the events links see it unregistered, then registered.
+ * Params:
+ *     - device_id: device ID.
+ *     - manufacturer: company ID of the new adapter.
+ *     - error: details about the failed step.
+ * Return values:
+ *     - EXIT_FAILURE: on failure.
+ *     - EXIT_SUCCESS: on success.
+ */
+int hci_sim_replug(int device_id, uint16_t manufacturer, struct hci_error *error)
+{
+    std::lock_guard<std::mutex> guard(sim_lock);
+    struct sim_device *device;
+
+    if (!sim_running || (device = get_device(device_id)) == NULL)
+        return hci_set_error(error, ENODEV, "device");
+
+    for (int i = 0; i < SIM_LINKS; i++)
+    {
+        if (links[i].descriptor >= 0 && links[i].kind == LINK_DEVICE && links[i].device_id == device_id)
+            link_drop(&links[i]);
+    }
+
+    emit(HCI_DEV_UNREG, device_id);
+
+    device->manufacturer = manufacturer;
+    device->generation++;
+    device->controller.b[1] = device->generation;
+    device->pending = false;
+    device->scanning = false;
+    forget_commands(device);
+    bacpy(&device->info.bdaddr, &device->controller);
+
+    emit(HCI_DEV_REG, device_id);
+
+    return EXIT_SUCCESS;
+}
+
+/*
+ * Go back to the kernel. Descriptors still held on simulated controllers
+ * read end of file.
+ */
+void hci_sim_stop(void)
+{
+    {
+        std::lock_guard<std::mutex> guard(sim_lock);
+
+        if (!sim_running)
+            return;
+    }
+
+    hci_backend_set(&hci_backend_kernel);
+
+    {
+        std::lock_guard<std::mutex> guard(sim_lock);
+
+        sim_running = false;
+        sim_wakeup.notify_one();
+    }
+
+    sim_thread.join();
+
+    std::lock_guard<std::mutex> guard(sim_lock);
+
+    for (int i = 0; i < SIM_LINKS; i++)
+    {
+        if (links[i].descriptor >= 0)
+            link_drop(&links[i]);
+    }
+
+    packet_count = 0;
+}
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "hci_core.hpp"
+
+/*
+ * Options of the simulated backend.
+ *     - manufacturers, count: one adapter per company ID, from hci0. The
+ *       vendor commands of companies 0, 10, 13, 15, 18, 48 and 57 are
+ *       answered like btim expects them to.
+ *     - command_us: delay before a command completes.
+ *     - reset_us: delay before a reset completes (HCI Reset, vendor reset,
+ *       HCIDEVRESET).
+ *     - up_us: time HCIDEVUP takes.
+ *     - ioctl_us: time every other ioctl takes.
+ *     - advertisers: LE advertisers around the adapters, 0 for none.
+ *     - advertising_us: delay between two advertising reports of a
+ *       scanning adapter.
+ *     - connections: ACL links of every adapter while it is up, with
+ *       handles 1 to connections.
+ *     - credits: commands a controller accepts before answering, 0 for 1.
+ *       Its answers grant what is left of them.
+ */
+struct hci_sim_options
+{
+    uint16_t const *manufacturers;
+    int count;
+    int command_us;
+    int reset_us;
+    int up_us;
+    int ioctl_us;
+    int advertisers;
+    int advertising_us;
+    int connections;
+    int credits;
+};
+
+int hci_sim_start(struct hci_sim_options const *options, struct hci_error *error);
+void hci_sim_stop(void);
+int hci_sim_hardware_error(int device_id, uint8_t code, struct hci_error *error);
+int hci_sim_replug(int device_id, uint16_t manufacturer, struct hci_error *error);
@@ -0,0 +1,642 @@
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <mutex>
+
+#include <bluetooth/bluetooth.h>
+#include <bluetooth/hci.h>
+#include <bluetooth/hci_lib.h>
+
+#include "hci_backend.hpp"
+#include "hci_core.hpp"
+#include "hci_bdaddr.hpp"
+#include "hci_caps.hpp"
+#include "hci_engine.hpp"
+#include "hci_events.hpp"
+#include "hci_pool.hpp"
+#include "hci_executor.hpp"
+#include "hci_wait.hpp"
+
+#define OCF_ERICSSON_WRITE_BD_ADDR     0x000d
+#define ERICSSON_WRITE_BD_ADDR_CP_SIZE 6
+
+#define OCF_TI_WRITE_BD_ADDR           0x0006
+#define TI_WRITE_BD_ADDR_CP_SIZE       6
+
+#define OCF_BCM_WRITE_BD_ADDR          0x0001
+#define BCM_WRITE_BD_ADDR_CP_SIZE      6
+
+#define OCF_ZEEVO_WRITE_BD_ADDR        0x0001
+#define ZEEVO_WRITE_BD_ADDR_CP_SIZE    6
+
+typedef struct {
+    bdaddr_t    bdaddr;
+} __attribute__ ((packed)) write_bd_addr_cp;
+
+/*
+ * Commands of a spoof, run in one go by the device's command engine: the
+ * vendor write, then the vendor reset.
+ */
+#define SPOOF_MAX_COMMANDS 4
+
+struct spoof_batch
+{
+    struct hci_command commands[SPOOF_MAX_COMMANDS];
+    uint8_t params[SPOOF_MAX_COMMANDS][HCI_MAX_EVENT_SIZE];
+    uint8_t responses[SPOOF_MAX_COMMANDS][HCI_MAX_EVENT_SIZE];
+    int count;
+};
+
+/*
+ * Add a command to a batch.
+ * Params:
+ *     - batch: batch to fill.
+ *     - ogf, ocf: opcode.
+ *     - params, plen: command parameters, copied.
+ *     - timeout_ms: give up this long after the command was sent.
+ * Return value: the command.
+ */
+static struct hci_command *batch_add(struct spoof_batch *batch, uint16_t ogf, uint16_t ocf,
+                                     void const *params, uint8_t plen, int timeout_ms)
+{
+    struct hci_command *command = &batch->commands[batch->count];
+
+    if (plen)
+        memcpy(batch->params[batch->count], params, plen);
+    hci_command_init(command, ogf, ocf, batch->params[batch->count], plen, timeout_ms);
+    command->response = batch->responses[batch->count];
+    command->rsize = sizeof(batch->responses[batch->count]);
+    batch->count++;
+
+    return command;
+}
+
+/*
+ * Check the status returned by a command.
+ * Params:
+ *     - command: completed command.
+ * Return value: 0, or EIO when the controller reported an error.
+ */
+static int check_status(struct hci_command const *command)
+{
+    return command->status ? EIO : 0;
+}
+
+/*
+ * Reset a device after a MAC address change on a generic device: the reset
+ * isn't waited for, reading the address back tells when the controller is
+ * usable again.
+ * Params:
+ *     - batch: batch to fill.
+ */
+static void generic_reset_device(struct spoof_batch *batch)
+{
+    struct hci_command *command;
+
+    batch_add(batch, OGF_HOST_CTL, OCF_RESET, NULL, 0, 10000)->flags |= HCI_COMMAND_NOWAIT;
+
+    // Waits out the reset: unlike other address reads, it can't be learned
+    command = batch_add(batch, OGF_INFO_PARAM, OCF_READ_BD_ADDR, NULL, 0, 10000);
+    command->flags |= HCI_COMMAND_UNPROFILED;
+    command->check = check_status;
+}
+
+/*
+ * A callback function to change a MAC address on generic devices.
+ * Params:
+ *     - batch: batch to fill.
+ *     - bdaddr: new mac address.
+ *     - opcode_command_field: Command opcode.
+ *     - command_length: Command size.
+ */
+static void generic_write_bd_addr(struct spoof_batch *batch, bdaddr_t const *bdaddr,
+                                  int opcode_command_field, int command_length)
+{
+    write_bd_addr_cp command_params;
+
+    memset(&command_params, 0, sizeof(command_params));
+    bacpy(&command_params.bdaddr, bdaddr);
+
+    batch_add(batch, OGF_VENDOR_CMD, opcode_command_field,
+              &command_params, command_length, 1000)->check = check_status;
+}
+
+
+#define OCF_ERICSSON_STORE	0x0022
+typedef struct {
+    uint8_t    user_id;
+    uint8_t    flash_length;
+    uint8_t    flash_data[253];
+} __attribute__ ((packed)) ericsson_store_in_flash_cp;
+#define ERICSSON_STORE_CP_SIZE 255
+
+/*
+ * A callback function to change a MAC address on Ericsson devices.
+ * Params:
+ *     - batch: batch to fill.
+ *     - flash_data: MAC address.
+ */
+static void ericsson_write(struct spoof_batch *batch, uint8_t const *flash_data)
+{
+    ericsson_store_in_flash_cp command_params;
+    uint8_t flash_length = 6;
+
+    memset(&command_params, 0, sizeof(command_params));
+    command_params.user_id      = 0xfe;	// user id
+    command_params.flash_length = flash_length;
+    if (flash_length > 0)
+        memcpy(command_params.flash_data, flash_data, flash_length);
+
+    batch_add(batch, OGF_VENDOR_CMD, OCF_ERICSSON_STORE,
+              &command_params, ERICSSON_STORE_CP_SIZE, 1000)->check = check_status;
+}
+
+/*
+ * Check the answer of a CSR BCCMD.
+ * Params:
+ *     - command: completed command.
+ * Return value: 0, EIO for an unexpected answer, ENXIO when the BCCMD
+ * failed.
+ */
+static int csr_check(struct hci_command const *command)
+{
+    if (command->rlen < 11 || command->response[0] != 0xc2)
+        return EIO;
+
+    if ((command->response[9] + (command->response[10] << 8)) != 0)
+        return ENXIO;
+
+    return 0;
+}
+
+/*
+ * A callback function to change a MAC address on CSR devices.
+ * Params:
+ *     - batch: batch to fill.
+ *     - bdaddr: new MAC address.
+ *     - opcode_command_field: not used (0).
+ *     - command_length: not used (0).
+ */
+static void csr_write_bd_addr(struct spoof_batch *batch, bdaddr_t const *bdaddr,
+                              int opcode_command_field, int command_length)
+{
+    unsigned char cmd[] =
+    {
+        0x02, 0x00, 0x0c, 0x00, 0x11, 0x47, 0x03, 0x70,
+        0x00, 0x00, 0x01, 0x00, 0x04, 0x00, 0x00, 0x00,
+        0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00
+    };
+
+    unsigned char command_params[sizeof(cmd) + 1];
+    struct hci_command *command;
+
+    cmd[16] = bdaddr->b[2];
+    cmd[17] = 0x00;
+    cmd[18] = bdaddr->b[0];
+    cmd[19] = bdaddr->b[1];
+    cmd[20] = bdaddr->b[3];
+    cmd[21] = 0x00;
+    cmd[22] = bdaddr->b[4];
+    cmd[23] = bdaddr->b[5];
+
+    command_params[0] = 0xc2;
+    memcpy(command_params + 1, cmd, sizeof(cmd));
+
+    command = batch_add(batch, OGF_VENDOR_CMD, 0x00, command_params, sizeof(command_params), 2000);
+    command->event = EVT_VENDOR;
+    command->check = csr_check;
+}
+
+/*
+ * Reset a CSR device after a MAC address change.
+ * Params:
+ *     - batch: batch to fill.
+ */
+static void csr_reset_device(struct spoof_batch *batch)
+{
+    unsigned char cmd[] =
+    {
+        0x02, 0x00, 0x09, 0x00,
+        0x00, 0x00, 0x01, 0x40, 0x00, 0x00,
+        0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00
+    };
+
+    unsigned char command_params[sizeof(cmd) + 1];
+
+    command_params[0] = 0xc2;
+    memcpy(command_params + 1, cmd, sizeof(cmd));
+
+    batch_add(batch, OGF_VENDOR_CMD, 0x00, command_params, sizeof(command_params), 2000)->event = EVT_VENDOR;
+}
+
+/*
+ * A callback function to change a MAC address on ST microelecronics devices.
+ * Params:
+ *     - batch: batch to fill.
+ *     - bdaddr: new MAC address.
+ *     - opcode_command_field: not used (0).
+ *     - command_length: not used (0).
+ */
+static void st_write_bd_addr(struct spoof_batch *batch, bdaddr_t const *bdaddr,
+                             int opcode_command_field, int command_length)
+{
+    ericsson_write(batch, (uint8_t const *)bdaddr);
+}
+
+/*
+ * Supported controllers.
+ *     - low_downtime: the controller uses a new address right away; when
+ *       reading it back shows it, the resets are skipped.
+ */
+static struct {
+    uint16_t compid;
+    void (*write_bd_addr)(struct spoof_batch *batch, bdaddr_t const *bdaddr, int opcode_command_field, int command_length);
+    void (*reset_device)(struct spoof_batch *batch);
+    int opcode_command_field;
+    int command_length;
+    bool low_downtime;
+} vendor[] = {
+    {0,  generic_write_bd_addr, NULL,                 OCF_ERICSSON_WRITE_BD_ADDR, ERICSSON_WRITE_BD_ADDR_CP_SIZE, false},
+    {10, csr_write_bd_addr,     csr_reset_device,     0,                          0,                              false},
+    {13, generic_write_bd_addr, NULL,                 OCF_TI_WRITE_BD_ADDR,       TI_WRITE_BD_ADDR_CP_SIZE,       false},
+    {15, generic_write_bd_addr, generic_reset_device, OCF_BCM_WRITE_BD_ADDR,      BCM_WRITE_BD_ADDR_CP_SIZE,      true },
+    {18, generic_write_bd_addr, NULL,                 OCF_ZEEVO_WRITE_BD_ADDR,    ZEEVO_WRITE_BD_ADDR_CP_SIZE,    false},
+    {48, st_write_bd_addr,      generic_reset_device, 0,                          0,                              false},
+    {57, generic_write_bd_addr, generic_reset_device, OCF_ERICSSON_WRITE_BD_ADDR, ERICSSON_WRITE_BD_ADDR_CP_SIZE, false},
+    {65535,    NULL,            NULL,                 0,                          0,                              false},
+};
+
+#define VENDOR_COUNT (sizeof(vendor) / sizeof(vendor[0]) - 1)
+
+static std::mutex downtime_lock;
+static struct hci_spoof_downtime downtimes[VENDOR_COUNT];
+
+/*
+ * Milliseconds between two hci_monotonic_ns() values.
+ */
+static double elapsed_ms(uint64_t from_ns, uint64_t to_ns)
+{
+    return to_ns > from_ns ? (to_ns - from_ns) / 1e6 : 0;
+}
+
+/*
+ * Account for a completed spoof.
+ * Params:
+ *     - timings: timings of the spoof.
+ */
+static void record_downtime(struct hci_spoof_timings const *timings)
+{
+    std::lock_guard<std::mutex> guard(downtime_lock);
+
+    for (size_t i = 0; i < VENDOR_COUNT; i++)
+    {
+        if (vendor[i].compid != timings->manufacturer)
+            continue;
+
+        downtimes[i].manufacturer = timings->manufacturer;
+        downtimes[i].spoofs++;
+        downtimes[i].resets_skipped += timings->resets_skipped;
+        downtimes[i].total_ms += timings->downtime;
+        downtimes[i].last_ms = timings->downtime;
+        if (timings->downtime > downtimes[i].max_ms)
+            downtimes[i].max_ms = timings->downtime;
+        return;
+    }
+}
+
+/*
+ * Get the capabilities of an adapter, probing it on a cache miss.
+ * Params:
+ *     - device_id: device ID.
+ *     - caps: receives the capabilities.
+ *     - error: details about the failed step.
+ * Return values:
+ *     - EXIT_FAILURE: on failure.
+ *     - EXIT_SUCCESS: on success.
+ */
+int hci_capabilities(int device_id, struct hci_capabilities *caps, struct hci_error *error)
+{
+    struct hci_engine engine;
+    struct hci_command command;
+    read_local_version_rp version;
+    int i;
+
+    // Drop capabilities of adapters plugged out meanwhile
+    hci_events_sync();
+
+    if (hci_caps_lookup(device_id, caps))
+        return EXIT_SUCCESS;
+
+    if (hci_engine_open(&engine, device_id, error) != EXIT_SUCCESS)
+    {
+        fprintf(stderr, "Can't open device hci%d: %s (%d)\n",
+            device_id, strerror(error->code), error->code);
+        return EXIT_FAILURE;
+    }
+
+    hci_command_init(&command, OGF_INFO_PARAM, OCF_READ_LOCAL_VERSION, NULL, 0, 1000);
+    command.response = (uint8_t *)&version;
+    command.rsize = sizeof(version);
+    command.check = check_status;
+
+    if (hci_engine_run(&engine, &command, 1) != EXIT_SUCCESS ||
+        command.rlen < (int)sizeof(version))
+    {
+        hci_set_error(error, command.result ? command.result : EIO, "hci_read_local_version");
+        fprintf(stderr, "Can't read version info for hci%d: %s (%d)\n",
+            device_id, strerror(error->code), error->code);
+        hci_engine_close(&engine, error->code);
+        return EXIT_FAILURE;
+    }
+
+    hci_engine_close(&engine, 0);
+
+    caps->manufacturer = btohs(version.manufacturer);
+    caps->hci_ver = version.hci_ver;
+    caps->hci_rev = btohs(version.hci_rev);
+    caps->lmp_ver = version.lmp_ver;
+    caps->lmp_subver = btohs(version.lmp_subver);
+    caps->vendor = -1;
+    caps->has_reset = false;
+
+    for (i = 0; vendor[i].compid != 65535; i++)
+    {
+        if (caps->manufacturer == vendor[i].compid)
+        {
+            caps->vendor = i;
+            caps->has_reset = vendor[i].reset_device != NULL;
+            break;
+        }
+    }
+
+    hci_caps_store(caps);
+
+    return EXIT_SUCCESS;
+}
+
+/*
+ * Spoof a MAC address. The vendor write runs first; in low downtime mode
+ * the address is read back in the same batch and the resets are skipped
+ * when the controller already uses it.
+ * Params:
+ *     - new_mac_address: MAC address which will be assigned to the device.
+ *     - timings: receives where the time went, may be NULL.
+ *     - error: details about the failed step.
+ * Return values:
+ *     - EXIT_FAILURE: on failure.
+ *     - EXIT_SUCCESS: on success.
+ *     - EIO: New MAC address wasn't written.
+ *     - ECANCELED: The device should be reset manually.
+ */
+int hci_spoof_mac(int device_id, char const *new_mac_address, struct hci_spoof_timings *timings,
+                  struct hci_error *error)
+{
+    struct hci_spoof_timings local_timings;
+    struct hci_capabilities caps;
+    struct hci_engine engine;
+    struct spoof_batch batch;
+    bdaddr_t bdaddr;
+    int i, verify = -1;
+    int status = ECANCELED; // Worst case by default: manual reset
+
+    if (timings == NULL)
+        timings = &local_timings;
+    memset(timings, 0, sizeof(*timings));
+
+    if (bachk(new_mac_address) < 0 || str2ba(new_mac_address, &bdaddr) < 0 ||
+        !bacmp(&bdaddr, BDADDR_ANY))
+        return hci_set_error(error, EINVAL, "str2ba");
+
+    if (hci_capabilities(device_id, &caps, error) != EXIT_SUCCESS)
+        return EXIT_FAILURE;
+
+    if (caps.vendor < 0)
+        return hci_set_error(error, ENOTSUP, "vendor");
+
+    timings->manufacturer = caps.manufacturer;
+
+    batch.count = 0;
+    vendor[caps.vendor].write_bd_addr(&batch, &bdaddr,
+        vendor[caps.vendor].opcode_command_field,
+        vendor[caps.vendor].command_length);
+
+    if (vendor[caps.vendor].low_downtime)
+    {
+        verify = batch.count;
+        batch_add(&batch, OGF_INFO_PARAM, OCF_READ_BD_ADDR, NULL, 0, 1000)->flags |= HCI_COMMAND_BARRIER;
+    }
+
+    if (hci_engine_open(&engine, device_id, error) != EXIT_SUCCESS)
+    {
+        fprintf(stderr, "Can't open device hci%d: %s (%d)\n",
+            device_id, strerror(error->code), error->code);
+        return EXIT_FAILURE;
+    }
+
+    engine.manufacturer = caps.manufacturer;
+    hci_engine_run(&engine, batch.commands, batch.count);
+
+    timings->write_ns = batch.commands[0].sent_ns;
+    timings->write = elapsed_ms(batch.commands[0].sent_ns, batch.commands[batch.count - 1].done_ns);
+
+    // The error comes from the command which failed, never from errno
+    for (i = 0; i < (verify < 0 ? batch.count : verify); i++)
+    {
+        if (batch.commands[i].result)
+        {
+            hci_set_error(error, batch.commands[i].result, "write_bd_addr");
+            fprintf(stderr, "Can't write new MAC address: %s (status 0x%02x)\n",
+                strerror(error->code), batch.commands[i].status);
+            hci_engine_close(&engine, error->code);
+            return EIO;
+        }
+    }
+
+    hci_bdaddr_invalidate(device_id);
+
+    // The controller already answers with the new address: resets are redundant
+    if (verify >= 0 && !batch.commands[verify].result &&
+        batch.commands[verify].rlen >= (int)sizeof(read_bd_addr_rp) &&
+        !bacmp(&((read_bd_addr_rp *)batch.commands[verify].response)->bdaddr, &bdaddr))
+    {
+        timings->resets_skipped = true;
+        hci_engine_close(&engine, 0);
+        return EXIT_SUCCESS;
+    }
+
+    if (caps.has_reset)
+    {
+        batch.count = 0;
+        vendor[caps.vendor].reset_device(&batch);
+
+        if (hci_engine_run(&engine, batch.commands, batch.count) != EXIT_SUCCESS)
+        {
+            timings->vendor_reset = elapsed_ms(batch.commands[0].sent_ns, hci_monotonic_ns());
+
+            // The device should be reset manually.
+            status = ECANCELED;
+            hci_set_error(error, ECANCELED, "reset_device");
+        }
+        else
+        {
+            uint64_t reset_ns = hci_monotonic_ns();
+
+            timings->vendor_reset = elapsed_ms(batch.commands[0].sent_ns, reset_ns);
+
+            // Reset the device
+            hci_backend_ioctl(engine.descriptor, HCIDEVRESET, (void *)(long)device_id);
+            hci_events_emit(HCI_DEVICE_RESET, device_id);
+            timings->kernel_reset = elapsed_ms(reset_ns, hci_monotonic_ns());
+            status = EXIT_SUCCESS;
+        }
+    }
+    else
+    {
+       // The device should be reset manually.
+       status = ECANCELED;
+       hci_set_error(error, ECANCELED, "reset_device");
+    }
+
+    hci_engine_close(&engine, 0);
+    return status;
+}
+
+/*
+ * Spoof a MAC address and wait until the device is up with it.
+ * Params:
+ *     - device_id: device ID.
+ *     - new_mac_address: MAC address which will be assigned to the device.
+ *     - timeout_ms: give up after this delay.
+ *     - timings: receives where the time went, may be NULL. Successful
+ *       spoofs are accounted in the vendor's downtime.
+ *     - error: details about the failed step.
+ * Return values:
+ *     - EXIT_FAILURE: on failure, ETIMEDOUT when the deadline passed,
+ *       ECANCELED when the device should be reset manually.
+ *     - EXIT_SUCCESS: the kernel reports the device up with the new address.
+ */
+int hci_spoof_mac_wait(int device_id, char const *new_mac_address, int timeout_ms,
+                       struct hci_spoof_timings *timings, struct hci_error *error)
+{
+    uint64_t deadline = hci_deadline(timeout_ms);
+    struct hci_spoof_timings local_timings;
+    struct hci_dev_info device_info;
+    uint64_t resets_ns;
+    bdaddr_t bdaddr;
+    bool cycled = false;
+    int events, status;
+    int result = EXIT_SUCCESS;
+
+    // Listen before acting, so no event is missed
+    if ((events = hci_events_open(error)) < 0)
+        return EXIT_FAILURE;
+
+    if (timings == NULL)
+        timings = &local_timings;
+
+    status = hci_spoof_mac(device_id, new_mac_address, timings, error);
+    resets_ns = hci_monotonic_ns();
+
+    if (status != EXIT_SUCCESS && status != ECANCELED)
+    {
+        close(events);
+        return EXIT_FAILURE;
+    }
+
+    str2ba(new_mac_address, &bdaddr);
+
+    for (;;)
+    {
+        char const *step = NULL;
+
+        if (hci_device_info(device_id, &device_info, error) != EXIT_SUCCESS)
+        {
+            // A vendor reset may re-enumerate the controller
+            if (error->code != ENODEV)
+            {
+                result = EXIT_FAILURE;
+                break;
+            }
+            step = "wait_register";
+        }
+        else if (hci_test_bit(HCI_INIT, &device_info.flags))
+        {
+            step = "wait_up";
+        }
+        else if (bacmp(&device_info.bdaddr, &bdaddr))
+        {
+            if (cycled)
+            {
+                // The controller kept its old address
+                if (status == ECANCELED)
+                {
+                    result = hci_set_error(error, ECANCELED, "reset_device");
+                    break;
+                }
+                step = "wait_bdaddr";
+            }
+            else
+            {
+                // The kernel only reads the address when opening the device
+                cycled = true;
+                if (hci_interface_up_down(device_id, false, error) != EXIT_SUCCESS ||
+                    hci_interface_up_down(device_id, true, error) != EXIT_SUCCESS)
+                {
+                    result = EXIT_FAILURE;
+                    break;
+                }
+                continue;
+            }
+        }
+        else if (!hci_test_bit(HCI_UP, &device_info.flags))
+        {
+            if (hci_interface_up_down(device_id, true, error) != EXIT_SUCCESS)
+            {
+                result = EXIT_FAILURE;
+                break;
+            }
+            continue;
+        }
+        else
+        {
+            uint64_t up_ns = hci_monotonic_ns();
+
+            timings->up = elapsed_ms(resets_ns, up_ns);
+            timings->downtime = elapsed_ms(timings->write_ns, up_ns);
+            record_downtime(timings);
+            break;
+        }
+
+        if (hci_wait_event(events, device_id, deadline, step, error) != EXIT_SUCCESS)
+        {
+            result = EXIT_FAILURE;
+            break;
+        }
+    }
+
+    close(events);
+    return result;
+}
+
+/*
+ * Get the downtime of the spoofs made so far.
+ * Params:
+ *     - stats: receives one entry per vendor spoofed at least once.
+ *     - max: number of entries of stats.
+ * Return value: number of entries filled.
+ */
+int hci_spoof_downtimes(struct hci_spoof_downtime *stats, int max)
+{
+    std::lock_guard<std::mutex> guard(downtime_lock);
+    int count = 0;
+
+    for (size_t i = 0; i < VENDOR_COUNT && count < max; i++)
+    {
+        if (downtimes[i].spoofs)
+            stats[count++] = downtimes[i];
+    }
+
+    return count;
+}
@@ -1,385 +1,275 @@
 #include <stdio.h>
 #include <string.h>
-#include <sys/ioctl.h>
 
 #include <bluetooth/bluetooth.h>
 #include <bluetooth/hci.h>
-#include <bluetooth/hci_lib.h>
 
 #include <nan.h>
 
-#define OCF_ERICSSON_WRITE_BD_ADDR     0x000d
-#define ERICSSON_WRITE_BD_ADDR_CP_SIZE 6
-
-#define OCF_TI_WRITE_BD_ADDR           0x0006
-#define TI_WRITE_BD_ADDR_CP_SIZE       6
-
-#define OCF_BCM_WRITE_BD_ADDR          0x0001
-#define BCM_WRITE_BD_ADDR_CP_SIZE      6
-
-#define OCF_ZEEVO_WRITE_BD_ADDR        0x0001
-#define ZEEVO_WRITE_BD_ADDR_CP_SIZE    6
-
-typedef struct {
-    bdaddr_t    bdaddr;
-} __attribute__ ((packed)) write_bd_addr_cp;
+#include "hci.hpp"
+#include "hci_core.hpp"
+#include "hci_caps.hpp"
+#include "hci_timeouts.hpp"
+#include "hci_queue.hpp"
 
 /*
- * Reset a device after a MAC address change on a generic device.
+ * A wrapper to spoof a MAC address.
  * Params:
- *     - descriptor: device's file descriptor.
+ *     - info: Contains arguments and a return value.
  */
-static int generic_reset_device(int descriptor)
+void HCI_spoof_mac(const Nan::FunctionCallbackInfo<v8::Value>& info)
 {
-    bdaddr_t bdaddr;
-    int status;
+    if(!info[0]->IsNumber() || !info[1]->IsString())
+    {
+        Nan::ThrowTypeError("1st argument should be a number and the 2nd one a string");
+        return;
+    }
 
-    status = hci_send_cmd(descriptor, 0x03, 0x0003, 0, NULL);
-    if (status < 0)
-        return status;
+    int device_id;
+    struct hci_error error;
+    v8::String::Utf8Value new_mac_address(info[1]);
+
+    if (!hci_device_sync_lock(info[0], &device_id))
+    {
+        info.GetReturnValue().Set(Nan::New(EXIT_FAILURE));
+        return;
+    }
+
+    v8::Local<v8::Number> status = Nan::New(hci_spoof_mac(device_id, *new_mac_address, NULL, &error));
+    hci_executor_unlock(device_id);
 
-    return hci_read_bd_addr(descriptor, &bdaddr, 10000);
+    info.GetReturnValue().Set(status);
 }
 
 /*
- * A callback function to change a MAC address on generic devices.
- * Params:
- *     - descriptor: device's file descriptor.
- *     - bdaddr: new mac address.
- *     - opcode_command_field: Command opcode.
- *     - command_length: Command size.
- * Return values:
- *     - EXIT_FAILURE: on failure.
- *     - EXIT_SUCCESS: on success.
+ * Spoof a MAC address on the device's executor lane.
  */
-static int generic_write_bd_addr(int descriptor, bdaddr_t *bdaddr, int opcode_command_field, int command_length)
+class SpoofMacWorker : public DeviceWorker
 {
-    struct hci_request request;
-    write_bd_addr_cp command_params;
-
-    memset(&command_params, 0, sizeof(command_params));
-    bacpy(&command_params.bdaddr, bdaddr);
-
-    memset(&request, 0, sizeof(request));
-    request.ogf    = OGF_VENDOR_CMD;
-    request.ocf    = opcode_command_field;
-    request.cparam = &command_params;
-    request.clen   = command_length;
-    request.rparam = NULL;
-    request.rlen   = 0;
-
-    if (hci_send_req(descriptor, &request, 1000) < 0)
-        return EXIT_FAILURE;
+public:
+    SpoofMacWorker(Nan::Callback *callback, int device_id, char const *new_mac_address, int timeout_ms)
+        : DeviceWorker(callback, "btim:spoof_mac", device_id), timeout_ms(timeout_ms)
+    {
+        strncpy(mac_address, new_mac_address, sizeof(mac_address) - 1);
+        mac_address[sizeof(mac_address) - 1] = '\0';
+    }
 
-    return EXIT_SUCCESS;
-}
+    void Execute()
+    {
+        if (hci_spoof_mac_wait(device_id, mac_address, timeout_ms, &timings, &error) != EXIT_SUCCESS)
+            SetErrorMessage(error.step);
+    }
 
+protected:
+    /*
+     * Return value: { id, queuedMs, elapsedMs, timings: { writeMs,
+     * vendorResetMs, kernelResetMs, upMs, downtimeMs, resetsSkipped } }.
+     */
+    v8::Local<v8::Object> Result()
+    {
+        v8::Local<v8::Object> obj = DeviceWorker::Result();
+        v8::Local<v8::Object> obj_timings = Nan::New<v8::Object>();
+
+        Nan::Set(obj_timings, Nan::New("writeMs").ToLocalChecked(), Nan::New(timings.write));
+        Nan::Set(obj_timings, Nan::New("vendorResetMs").ToLocalChecked(), Nan::New(timings.vendor_reset));
+        Nan::Set(obj_timings, Nan::New("kernelResetMs").ToLocalChecked(), Nan::New(timings.kernel_reset));
+        Nan::Set(obj_timings, Nan::New("upMs").ToLocalChecked(), Nan::New(timings.up));
+        Nan::Set(obj_timings, Nan::New("downtimeMs").ToLocalChecked(), Nan::New(timings.downtime));
+        Nan::Set(obj_timings, Nan::New("resetsSkipped").ToLocalChecked(), Nan::New(timings.resets_skipped));
+        Nan::Set(obj, Nan::New("timings").ToLocalChecked(), obj_timings);
+
+        return obj;
+    }
 
-#define OCF_ERICSSON_STORE	0x0022
-typedef struct {
-    uint8_t    user_id;
-    uint8_t    flash_length;
-    uint8_t    flash_data[253];
-} __attribute__ ((packed)) ericsson_store_in_flash_cp;
-#define ERICSSON_STORE_CP_SIZE 255
+private:
+    char mac_address[18];
+    int timeout_ms;
+    struct hci_spoof_timings timings;
+};
 
 /*
- * A callback function to change a MAC address on Ericsson devices.
+ * A wrapper to spoof a MAC address without blocking the event loop.
  * Params:
- *     - descriptor: device's descriptor.
- *     - flash_data: MAC address.
- * Return values:
- *     - EXIT_FAILURE: on failure.
- *     - EXIT_SUCCESS: on success.
+ *     - info: Contains a device ID, a MAC address, a timeout in milliseconds
+ *       and a callback(error, result).
  */
-static int ericsson_write(int descriptor, uint8_t *flash_data)
+void HCI_spoof_mac_async(const Nan::FunctionCallbackInfo<v8::Value>& info)
 {
-    struct hci_request request;
-    ericsson_store_in_flash_cp command_params;
-    uint8_t flash_length = 6;
-
-    memset(&command_params, 0, sizeof(command_params));
-    command_params.user_id      = 0xfe;	// user id
-    command_params.flash_length = flash_length;
-    if (flash_length > 0)
-        memcpy(command_params.flash_data, flash_data, flash_length);
-
-    memset(&request, 0, sizeof(request));
-    request.ogf    = OGF_VENDOR_CMD;
-    request.ocf    = OCF_ERICSSON_STORE;
-    request.cparam = &command_params;
-    request.clen   = ERICSSON_STORE_CP_SIZE;
-    request.rparam = NULL;
-    request.rlen   = 0;
-
-    if (hci_send_req(descriptor, &request, 1000) < 0)
-        return EXIT_FAILURE;
-
-    return EXIT_SUCCESS;
+    if (!info[0]->IsNumber() || !info[1]->IsString() || !info[2]->IsNumber() ||
+        !info[3]->IsFunction())
+    {
+        Nan::ThrowTypeError("Arguments should be a number, a string, a number and a callback");
+        return;
+    }
+
+    int device_id, timeout_ms;
+
+    if (!hci_device_id_arg(info[0], &device_id) || !hci_timeout_arg(info[2], &timeout_ms))
+        return;
+
+    Nan::Utf8String new_mac_address(info[1]);
+    Nan::Callback *callback = new Nan::Callback(info[3].As<v8::Function>());
+
+    hci_queue_worker(hci_instance_get(info), new SpoofMacWorker(callback, device_id, *new_mac_address, timeout_ms));
 }
 
 /*
- * A callback function to change a MAC address on CSR devices.
- * Params:
- *     - descriptor: device's descriptor.
- *     - bdaddr: new MAC address.
- *     - opcode_command_field: not used (0).
- *     - command_length: not used (0).
- * Return values:
- *     - EXIT_FAILURE: on failure.
- *     - EXIT_SUCCESS: on success.
+ * Get the capabilities of an adapter on the device's executor lane.
  */
-static int csr_write_bd_addr(int descriptor, bdaddr_t *bdaddr, int opcode_command_field, int command_length)
+class CapabilitiesWorker : public DeviceWorker
 {
-    unsigned char cmd[] =
-    {
-        0x02, 0x00, 0x0c, 0x00, 0x11, 0x47, 0x03, 0x70,
-        0x00, 0x00, 0x01, 0x00, 0x04, 0x00, 0x00, 0x00,
-        0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00
-    };
-
-    unsigned char command_params[254], returned_parameters[254];
-    struct hci_request request;
-
-    cmd[16] = bdaddr->b[2];
-    cmd[17] = 0x00;
-    cmd[18] = bdaddr->b[0];
-    cmd[19] = bdaddr->b[1];
-    cmd[20] = bdaddr->b[3];
-    cmd[21] = 0x00;
-    cmd[22] = bdaddr->b[4];
-    cmd[23] = bdaddr->b[5];
-
-    memset(&command_params, 0, sizeof(command_params));
-    command_params[0] = 0xc2;
-    memcpy(command_params + 1, cmd, sizeof(cmd));
-
-    memset(&request, 0, sizeof(request));
-    request.ogf    = OGF_VENDOR_CMD;
-    request.ocf    = 0x00;
-    request.event  = EVT_VENDOR;
-    request.cparam = command_params;
-    request.clen   = sizeof(cmd) + 1;
-    request.rparam = returned_parameters;
-    request.rlen   = sizeof(returned_parameters);
-
-    if (hci_send_req(descriptor, &request, 2000) < 0)
-        return EXIT_FAILURE;
-
-    if (returned_parameters[0] != 0xc2)
+public:
+    CapabilitiesWorker(Nan::Callback *callback, int device_id)
+        : DeviceWorker(callback, "btim:capabilities", device_id) {}
+
+    void Execute()
     {
-        errno = EIO;
-        return EXIT_FAILURE;
+        if (hci_capabilities(device_id, &caps, &error) != EXIT_SUCCESS)
+            SetErrorMessage(error.step);
     }
 
-    if ((returned_parameters[9] + (returned_parameters[10] << 8)) != 0)
+protected:
+    /*
+     * Return value: { id, bus, manufacturer, hciVersion, hciRevision,
+     * lmpVersion, lmpSubversion, supported, hasReset, queuedMs, elapsedMs }.
+     */
+    v8::Local<v8::Object> Result()
     {
-        errno = ENXIO;
-        return EXIT_FAILURE;
+        v8::Local<v8::Object> obj = DeviceWorker::Result();
+
+        Nan::Set(obj, Nan::New("bus").ToLocalChecked(), Nan::New(caps.bus).ToLocalChecked());
+        Nan::Set(obj, Nan::New("manufacturer").ToLocalChecked(), Nan::New(caps.manufacturer));
+        Nan::Set(obj, Nan::New("hciVersion").ToLocalChecked(), Nan::New(caps.hci_ver));
+        Nan::Set(obj, Nan::New("hciRevision").ToLocalChecked(), Nan::New(caps.hci_rev));
+        Nan::Set(obj, Nan::New("lmpVersion").ToLocalChecked(), Nan::New(caps.lmp_ver));
+        Nan::Set(obj, Nan::New("lmpSubversion").ToLocalChecked(), Nan::New(caps.lmp_subver));
+        Nan::Set(obj, Nan::New("supported").ToLocalChecked(), Nan::New(caps.vendor >= 0));
+        Nan::Set(obj, Nan::New("hasReset").ToLocalChecked(), Nan::New(caps.has_reset));
+
+        return obj;
     }
 
-    return EXIT_SUCCESS;
-}
+private:
+    struct hci_capabilities caps;
+};
 
 /*
- * Reset a CSR device after a MAC address change.
+ * Get the capabilities of an adapter without blocking the event loop.
  * Params:
- *     - descriptor: CSR device's file descriptor.
- * Return values:
- *     - EXIT_FAILURE: on failure.
- *     - EXIT_SUCCESS: on success.
+ *     - info: Contains a device ID and a callback(error, capabilities).
  */
-static int csr_reset_device(int descriptor)
+void HCI_capabilities_async(const Nan::FunctionCallbackInfo<v8::Value>& info)
 {
-    unsigned char cmd[] =
+    if (!info[0]->IsNumber() || !info[1]->IsFunction())
     {
-        0x02, 0x00, 0x09, 0x00,
-        0x00, 0x00, 0x01, 0x40, 0x00, 0x00,
-        0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00
-    };
-
-    unsigned char command_params[254], returned_parameters[254];
-    struct hci_request request;
-
-    memset(&command_params, 0, sizeof(command_params));
-    command_params[0] = 0xc2;
-    memcpy(command_params + 1, cmd, sizeof(cmd));
-
-    memset(&request, 0, sizeof(request));
-    request.ogf    = OGF_VENDOR_CMD;
-    request.ocf    = 0x00;
-    request.event  = EVT_VENDOR;
-    request.cparam = command_params;
-    request.clen   = sizeof(cmd) + 1;
-    request.rparam = returned_parameters;
-    request.rlen   = sizeof(returned_parameters);
-
-    if (hci_send_req(descriptor, &request, 2000) < 0)
-        return EXIT_FAILURE;
-
-    return EXIT_SUCCESS;
-}
+        Nan::ThrowTypeError("Arguments should be a number and a callback");
+        return;
+    }
 
-/*
- * A callback function to change a MAC address on ST microelecronics devices.
- * Params:
- *     - descriptor: device's descriptor.
- *     - bdaddr: new MAC address.
- *     - opcode_command_field: not used (0).
- *     - command_length: not used (0).
- */
-static int st_write_bd_addr(int descriptor, bdaddr_t *bdaddr, int opcode_command_field, int command_length)
-{
-    return ericsson_write(descriptor, (uint8_t *)bdaddr);
-}
+    int device_id;
 
-static struct {
-    uint16_t compid;
-    int (*write_bd_addr)(int descriptor, bdaddr_t *bdaddr, int opcode_command_field, int command_length);
-    int (*reset_device)(int descriptor);
-    int opcode_command_field;
-    int command_length;
-} vendor[] = {
-    {0,  generic_write_bd_addr, NULL,                 OCF_ERICSSON_WRITE_BD_ADDR, ERICSSON_WRITE_BD_ADDR_CP_SIZE},
-    {10, csr_write_bd_addr,     csr_reset_device,     0,                          0                             },
-    {13, generic_write_bd_addr, NULL,                 OCF_TI_WRITE_BD_ADDR,       TI_WRITE_BD_ADDR_CP_SIZE      },
-    {15, generic_write_bd_addr, generic_reset_device, OCF_BCM_WRITE_BD_ADDR,      BCM_WRITE_BD_ADDR_CP_SIZE     },
-    {18, generic_write_bd_addr, NULL,                 OCF_ZEEVO_WRITE_BD_ADDR,    ZEEVO_WRITE_BD_ADDR_CP_SIZE   },
-    {48, st_write_bd_addr,      generic_reset_device, 0,                          0                             },
-    {57, generic_write_bd_addr, generic_reset_device, OCF_ERICSSON_WRITE_BD_ADDR, ERICSSON_WRITE_BD_ADDR_CP_SIZE},
-    {65535,    NULL,            NULL,                 0,                          0                             },
-};
+    if (!hci_device_id_arg(info[0], &device_id))
+        return;
+
+    Nan::Callback *callback = new Nan::Callback(info[1].As<v8::Function>());
+
+    hci_queue_worker(hci_instance_get(info), new CapabilitiesWorker(callback, device_id));
+}
 
 /*
- * Spoof a MAC address.
+ * Set the timeout of a controller command, for all adapters or those of a
+ * manufacturer.
  * Params:
- *     - new_mac_address: MAC address which will be assigned to the device.
- * Return values:
- *     - EXIT_FAILURE: on failure.
- *     - EXIT_SUCCESS: on success.
- *     - EIO: New MAC address wasn't written.
- *     - ECANCELED: The device should be reset manually.
+ *     - info: Contains an opcode, a timeout in milliseconds (0 to go back
+ *       to the default) and an optional company ID.
  */
-int hci_spoof_mac(int device_id, char const *new_mac_address)
+void HCI_set_command_timeout(const Nan::FunctionCallbackInfo<v8::Value>& info)
 {
-    struct hci_dev_info device_info;
-    struct hci_version version;
-    bdaddr_t bdaddr;
-    char mac_address[18];
-    int i, descriptor;
-    int status = ECANCELED; // Worst case by default: manual reset
-
-    descriptor = hci_open_dev(device_id);
-    if (descriptor < 0)
+    if (!info[0]->IsUint32() || !info[1]->IsNumber() ||
+        !(info[2]->IsUndefined() || info[2]->IsUint32()))
     {
-        fprintf(stderr, "Can't open device hci%d: %s (%d)\n",
-            device_id, strerror(errno), errno);
-        return EXIT_FAILURE;
+        Nan::ThrowTypeError("Arguments should be an opcode, a timeout and an optional manufacturer");
+        return;
     }
 
-    if (hci_devinfo(device_id, &device_info) < 0)
-    {
-        fprintf(stderr, "Can't get device info for hci%d: %s (%d)\n",
-            device_id, strerror(errno), errno);
-        hci_close_dev(descriptor);
-        return EXIT_FAILURE;
-    }
+    uint32_t opcode = Nan::To<uint32_t>(info[0]).FromJust();
+    int timeout_ms = Nan::To<int32_t>(info[1]).FromJust();
+    int manufacturer = info[2]->IsUndefined() ? -1 : Nan::To<int32_t>(info[2]).FromJust();
 
-    if (hci_read_local_version(descriptor, &version, 1000) < 0)
+    if (opcode > 0xffff)
     {
-        fprintf(stderr, "Can't read version info for hci%d: %s (%d)\n",
-            device_id, strerror(errno), errno);
-        hci_close_dev(descriptor);
-        return EXIT_FAILURE;
+        Nan::ThrowRangeError("opcode should fit in 16 bits");
+        return;
     }
 
-    if (!bacmp(&device_info.bdaddr, BDADDR_ANY))
-    {
-        if (hci_read_bd_addr(descriptor, &bdaddr, 1000) < 0)
-        {
-            fprintf(stderr, "Can't read address for hci%d: %s (%d)\n",
-                device_id, strerror(errno), errno);
-            hci_close_dev(descriptor);
-            return EXIT_FAILURE;
-        }
-    }
-    else
+    hci_timeout_override(manufacturer, opcode, timeout_ms);
+}
+
+/*
+ * Get the command latencies learned on an adapter.
+ * Params:
+ *     - info: Contains a device ID and a return value:
+ *       [{ opcode, samples, p99Ms, timeoutMs }].
+ */
+void HCI_command_latency(const Nan::FunctionCallbackInfo<v8::Value>& info)
+{
+    struct hci_latency_profile profiles[8];
+    struct hci_capabilities caps;
+
+    if (!info[0]->IsNumber())
     {
-        bacpy(&bdaddr, &device_info.bdaddr);
+        Nan::ThrowTypeError("1st argument isn't a number");
+        return;
     }
 
-    ba2str(&bdaddr, mac_address);
+    int device_id;
 
-    str2ba(new_mac_address, &bdaddr);
+    if (!hci_device_id_arg(info[0], &device_id))
+        return;
 
-    if (!bacmp(&bdaddr, BDADDR_ANY))
-    {
-        hci_close_dev(descriptor);
-        return EXIT_FAILURE;
-    }
+    int manufacturer = hci_caps_lookup(device_id, &caps) ? caps.manufacturer : -1;
+    int count = hci_timeout_profiles(device_id, manufacturer, profiles, 8);
+    v8::Local<v8::Array> array = Nan::New<v8::Array>(count);
 
-    for (i = 0; vendor[i].compid != 65535; i++)
+    for (int i = 0; i < count; i++)
     {
-        if (version.manufacturer == vendor[i].compid)
-        {
-            ba2str(&bdaddr, mac_address);
-
-            if (vendor[i].write_bd_addr(descriptor, &bdaddr,
-                vendor[i].opcode_command_field,
-                vendor[i].command_length) < 0)
-            {
-                fprintf(stderr, "Can't write new MAC address\n");
-                hci_close_dev(descriptor);
-                return EIO;
-            }
-
-            if (vendor[i].reset_device)
-            {
-                if (vendor[i].reset_device(descriptor) < 0)
-                {
-                    // The device should be reset manually.
-                    status = ECANCELED;
-                }
-                else
-                {
-                    // Reset the device
-                    ioctl(descriptor, HCIDEVRESET, device_id);
-                    status = EXIT_SUCCESS;
-                }
-            }
-            else
-            {
-               // The device should be reset manually.
-               status = ECANCELED;
-            }
-
-            hci_close_dev(descriptor);
-            return status;
-        }
-    }
+        v8::Local<v8::Object> obj = Nan::New<v8::Object>();
 
-    hci_close_dev(descriptor);
+        Nan::Set(obj, Nan::New("opcode").ToLocalChecked(), Nan::New(profiles[i].opcode));
+        Nan::Set(obj, Nan::New("samples").ToLocalChecked(), Nan::New(profiles[i].samples));
+        Nan::Set(obj, Nan::New("p99Ms").ToLocalChecked(), Nan::New(profiles[i].p99_ms));
+        Nan::Set(obj, Nan::New("timeoutMs").ToLocalChecked(), Nan::New(profiles[i].timeout_ms));
+        Nan::Set(array, i, obj);
+    }
 
-    return EXIT_FAILURE;
+    info.GetReturnValue().Set(array);
 }
 
 /*
- * A wrapper to spoof a MAC address.
+ * Get the downtime of the spoofs made so far, per vendor.
  * Params:
- *     - info: Contains arguments and a return value.
+ *     - info: Contains a return value: [{ manufacturer, spoofs,
+ *       resetsSkipped, meanMs, maxMs, lastMs }].
  */
-void HCI_spoof_mac(const Nan::FunctionCallbackInfo<v8::Value>& info)
+void HCI_downtime(const Nan::FunctionCallbackInfo<v8::Value>& info)
 {
-    if(!info[0]->IsNumber() || !info[1]->IsString())
+    struct hci_spoof_downtime downtimes[16];
+    int count = hci_spoof_downtimes(downtimes, 16);
+    v8::Local<v8::Array> array = Nan::New<v8::Array>(count);
+
+    for (int i = 0; i < count; i++)
     {
-        Nan::ThrowTypeError("1st argument should be a number and the 2nd one a string");
-        return;
+        struct hci_spoof_downtime *downtime = &downtimes[i];
+        v8::Local<v8::Object> obj = Nan::New<v8::Object>();
+
+        Nan::Set(obj, Nan::New("manufacturer").ToLocalChecked(), Nan::New(downtime->manufacturer));
+        Nan::Set(obj, Nan::New("spoofs").ToLocalChecked(), Nan::New(downtime->spoofs));
+        Nan::Set(obj, Nan::New("resetsSkipped").ToLocalChecked(), Nan::New(downtime->resets_skipped));
+        Nan::Set(obj, Nan::New("meanMs").ToLocalChecked(), Nan::New(downtime->total_ms / downtime->spoofs));
+        Nan::Set(obj, Nan::New("maxMs").ToLocalChecked(), Nan::New(downtime->max_ms));
+        Nan::Set(obj, Nan::New("lastMs").ToLocalChecked(), Nan::New(downtime->last_ms));
+        Nan::Set(array, i, obj);
     }
 
-    int device_id = info[0]->NumberValue();
-    v8::String::Utf8Value new_mac_address(info[1]);
-
-    v8::Local<v8::Number> status = Nan::New(hci_spoof_mac(device_id, *new_mac_address));
-
-    info.GetReturnValue().Set(status);
+    info.GetReturnValue().Set(array);
 }
@@ -0,0 +1,299 @@
+#include <string.h>
+
+#include <mutex>
+
+#include <bluetooth/bluetooth.h>
+#include <bluetooth/hci.h>
+
+#include "hci_timeouts.hpp"
+
+/*
+ * A learned timeout is p99 times LATENCY_FACTOR, never below
+ * LATENCY_FLOOR_MS nor above the caller's default, once LATENCY_MIN_SAMPLES
+ * runs were measured.
+ */
+#define LATENCY_FACTOR      4
+#define LATENCY_FLOOR_MS    20
+#define LATENCY_MIN_SAMPLES 16
+
+#define LATENCY_BUCKETS  32
+#define LATENCY_OPCODES  8
+#define TIMEOUT_POLICIES 32
+
+/*
+ * Latencies of a command: bucket i counts runs of less than 2^i
+ * microseconds.
+ */
+struct latency_histogram
+{
+    uint16_t opcode;
+    uint32_t samples;
+    uint32_t buckets[LATENCY_BUCKETS];
+};
+
+/*
+ * Latencies measured on an adapter.
+ */
+struct latency_device
+{
+    int device_id;
+    struct latency_histogram commands[LATENCY_OPCODES];
+};
+
+/*
+ * A timeout set by the user.
+ *     - manufacturer: company ID it applies to, -1 for all.
+ *     - opcode: command it applies to.
+ */
+struct timeout_policy
+{
+    int manufacturer;
+    uint16_t opcode;
+    int timeout_ms;
+};
+
+static std::mutex timeouts_lock;
+static struct latency_device devices[HCI_MAX_DEV];
+static struct timeout_policy policies[TIMEOUT_POLICIES];
+static int policy_count;
+
+/*
+ * Find the histogram of a command on an adapter.
+ * Params:
+ *     - device_id: device ID.
+ *     - opcode: command opcode.
+ *     - create: take a free slot when missing.
+ * Return value: the histogram, NULL when missing or the table is full.
+ */
+static struct latency_histogram *get_histogram(int device_id, uint16_t opcode, bool create)
+{
+    struct latency_device *device = &devices[device_id % HCI_MAX_DEV];
+
+    if (device->device_id != device_id)
+    {
+        if (!create)
+            return NULL;
+        memset(device, 0, sizeof(*device));
+        device->device_id = device_id;
+    }
+
+    for (int i = 0; i < LATENCY_OPCODES; i++)
+    {
+        struct latency_histogram *histogram = &device->commands[i];
+
+        if (histogram->samples && histogram->opcode == opcode)
+            return histogram;
+
+        if (!histogram->samples && create)
+        {
+            histogram->opcode = opcode;
+            return histogram;
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Get the 99th percentile of a histogram.
+ * Return value: upper bound of the bucket holding it, in microseconds.
+ */
+static uint64_t p99_us(struct latency_histogram const *histogram)
+{
+    uint32_t rank = histogram->samples - histogram->samples / 100;
+    uint32_t seen = 0;
+    int i;
+
+    for (i = 0; i < LATENCY_BUCKETS - 1; i++)
+    {
+        seen += histogram->buckets[i];
+        if (seen >= rank)
+            break;
+    }
+
+    return 1ULL << i;
+}
+
+/*
+ * Timeout learned from a histogram.
+ * Return value: the timeout, 0 while still learning.
+ */
+static int learned_ms(struct latency_histogram const *histogram)
+{
+    uint64_t timeout_ms;
+
+    if (histogram == NULL || histogram->samples < LATENCY_MIN_SAMPLES)
+        return 0;
+
+    timeout_ms = (p99_us(histogram) * LATENCY_FACTOR + 999) / 1000;
+
+    return timeout_ms < LATENCY_FLOOR_MS ? LATENCY_FLOOR_MS : (int)timeout_ms;
+}
+
+/*
+ * Timeout set by the user for a command.
+ * Return value: the timeout, or 0 when none applies. A policy for the
+ * manufacturer wins over one for all manufacturers.
+ */
+static int policy_ms(int manufacturer, uint16_t opcode)
+{
+    int timeout_ms = 0;
+
+    for (int i = 0; i < policy_count; i++)
+    {
+        if (policies[i].opcode != opcode)
+            continue;
+
+        if (policies[i].manufacturer == manufacturer)
+            return policies[i].timeout_ms;
+
+        if (policies[i].manufacturer < 0)
+            timeout_ms = policies[i].timeout_ms;
+    }
+
+    return timeout_ms;
+}
+
+/*
+ * Get the timeout of a command: the user's policy as set, otherwise the
+ * caller's default lowered to what the adapter was measured to need.
+ * Params:
+ *     - device_id: device ID.
+ *     - manufacturer: company ID of the controller, -1 when unknown.
+ *     - opcode: command opcode.
+ *     - default_ms: timeout when no policy applies.
+ *     - learned: lower the default to the learned latencies; false for
+ *       commands whose latency differs from the usual runs, e.g. the first
+ *       one after a reset.
+ * Return value: the timeout in milliseconds.
+ */
+int hci_timeout_resolve(int device_id, int manufacturer, uint16_t opcode, int default_ms, bool learned)
+{
+    std::lock_guard<std::mutex> guard(timeouts_lock);
+    int timeout_ms = policy_ms(manufacturer, opcode);
+    int learned_timeout_ms;
+
+    if (timeout_ms)
+        return timeout_ms;
+
+    learned_timeout_ms = learned ? learned_ms(get_histogram(device_id, opcode, false)) : 0;
+
+    return learned_timeout_ms && learned_timeout_ms < default_ms ? learned_timeout_ms : default_ms;
+}
+
+/*
+ * Measure a successful run of a command.
+ * Params:
+ *     - device_id: device ID.
+ *     - opcode: command opcode.
+ *     - latency_ns: time from sending to completion.
+ */
+void hci_timeout_record(int device_id, uint16_t opcode, uint64_t latency_ns)
+{
+    std::lock_guard<std::mutex> guard(timeouts_lock);
+    struct latency_histogram *histogram = get_histogram(device_id, opcode, true);
+    uint64_t latency_us = latency_ns / 1000;
+    int bucket = 0;
+
+    if (histogram == NULL)
+        return;
+
+    while (bucket < LATENCY_BUCKETS - 1 && (1ULL << bucket) <= latency_us)
+        bucket++;
+
+    histogram->buckets[bucket]++;
+    histogram->samples++;
+}
+
+/*
+ * Set the timeout of a command.
+ * Params:
+ *     - manufacturer: company ID it applies to, -1 for all.
+ *     - opcode: command opcode.
+ *     - timeout_ms: timeout, 0 to remove the policy.
+ */
+void hci_timeout_override(int manufacturer, uint16_t opcode, int timeout_ms)
+{
+    std::lock_guard<std::mutex> guard(timeouts_lock);
+    int i;
+
+    for (i = 0; i < policy_count; i++)
+    {
+        if (policies[i].manufacturer == manufacturer && policies[i].opcode == opcode)
+            break;
+    }
+
+    if (timeout_ms <= 0)
+    {
+        if (i < policy_count)
+            policies[i] = policies[--policy_count];
+        return;
+    }
+
+    if (i == policy_count)
+    {
+        if (policy_count == TIMEOUT_POLICIES)
+            return;
+        policy_count++;
+    }
+
+    policies[i].manufacturer = manufacturer;
+    policies[i].opcode = opcode;
+    policies[i].timeout_ms = timeout_ms;
+}
+
+/*
+ * Get the learned latencies of an adapter.
+ * Params:
+ *     - device_id: device ID.
+ *     - manufacturer: company ID of the controller, -1 when unknown.
+ *     - profiles: receives one entry per command.
+ *     - max: number of entries of profiles.
+ * Return value: number of entries filled.
+ */
+int hci_timeout_profiles(int device_id, int manufacturer, struct hci_latency_profile *profiles, int max)
+{
+    std::lock_guard<std::mutex> guard(timeouts_lock);
+    struct latency_device *device = &devices[device_id % HCI_MAX_DEV];
+    int count = 0;
+
+    if (device->device_id != device_id)
+        return 0;
+
+    for (int i = 0; i < LATENCY_OPCODES && count < max; i++)
+    {
+        struct latency_histogram *histogram = &device->commands[i];
+
+        if (!histogram->samples)
+            continue;
+
+        profiles[count].opcode = histogram->opcode;
+        profiles[count].samples = histogram->samples;
+        profiles[count].p99_ms = p99_us(histogram) / 1e3;
+        profiles[count].timeout_ms = policy_ms(manufacturer, histogram->opcode);
+        if (!profiles[count].timeout_ms)
+            profiles[count].timeout_ms = learned_ms(histogram);
+        count++;
+    }
+
+    return count;
+}
+
+/*
+ * Forget the latencies of an adapter, e.g. when another one takes its ID.
+ * Params:
+ *     - device_id: device ID, -1 for all adapters.
+ */
+void hci_timeout_invalidate(int device_id)
+{
+    std::lock_guard<std::mutex> guard(timeouts_lock);
+
+    for (int i = 0; i < HCI_MAX_DEV; i++)
+    {
+        if (device_id < 0 || devices[i].device_id == device_id)
+        {
+            memset(&devices[i], 0, sizeof(devices[i]));
+            devices[i].device_id = -1;
+        }
+    }
+}
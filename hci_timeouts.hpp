@@ -0,0 +1,25 @@
+#pragma once
+
+#include <stdint.h>
+
+/*
+ * Learned latencies of a command on an adapter.
+ *     - samples: number of successful runs measured.
+ *     - p99_ms: 99th percentile, rounded up to a power of two microseconds.
+ *     - timeout_ms: timeout applied to the next run: the user's policy,
+ *       or the learned one (capped by the caller's default), 0 while the
+ *       profile is still learning.
+ */
+struct hci_latency_profile
+{
+    uint16_t opcode;
+    uint32_t samples;
+    double p99_ms;
+    int timeout_ms;
+};
+
+int hci_timeout_resolve(int device_id, int manufacturer, uint16_t opcode, int default_ms, bool learned);
+void hci_timeout_record(int device_id, uint16_t opcode, uint64_t latency_ns);
+void hci_timeout_override(int manufacturer, uint16_t opcode, int timeout_ms);
+int hci_timeout_profiles(int device_id, int manufacturer, struct hci_latency_profile *profiles, int max);
+void hci_timeout_invalidate(int device_id);
@@ -1,7 +1,6 @@
 #include <stdio.h>
+#include <errno.h>
 #include <unistd.h>
-#include <sys/socket.h>
-#include <sys/ioctl.h>
 
 #include <bluetooth/bluetooth.h>
 #include <bluetooth/hci.h>
@@ -9,41 +8,44 @@
 
 #include <nan.h>
 
+#include "hci.hpp"
+#include "hci_core.hpp"
+#include "hci_queue.hpp"
+
 /*
- * A helper function to bring HCI interafaces up or down.
+ * A wrapper to bring an interface up.
  * Params:
- *     - device_id: device ID.
- *     - status: true (up), false (down).
- * Return values:
- *     - EXIT_FAILURE: on failure.
- *     - EXIT_SUCCESS: on success.
+ *     - info: Contains arguments and a return value.
  */
-static int hci_interface_up_down(int device_id, bool status)
+void HCI_Up(const Nan::FunctionCallbackInfo<v8::Value>& info)
 {
-    int hci_socket;
-
-    if ((hci_socket = socket(AF_BLUETOOTH, SOCK_RAW, BTPROTO_HCI)) < 0)
+    if (!info[0]->IsNumber())
     {
-        perror("Can't open HCI socket.");
-        return EXIT_FAILURE;
+        Nan::ThrowTypeError("1st argument isn't a number");
+        return;
     }
 
-    if (status)
-        ioctl(hci_socket, HCIDEVUP, device_id);
-    else
-        ioctl(hci_socket, HCIDEVDOWN, device_id);
+    int device_id;
+    struct hci_error error;
 
-    close(hci_socket);
+    if (!hci_device_sync_lock(info[0], &device_id))
+    {
+        info.GetReturnValue().Set(Nan::New(EXIT_FAILURE));
+        return;
+    }
+
+    v8::Local<v8::Number> status = Nan::New(hci_interface_up_down(device_id, true, &error));
+    hci_executor_unlock(device_id);
 
-    return EXIT_SUCCESS;
+    info.GetReturnValue().Set(status);
 }
 
 /*
- * A wrapper to bring an interface up.
+ * A wrapper to bring an interface down.
  * Params:
  *     - info: Contains arguments and a return value.
  */
-void HCI_Up(const Nan::FunctionCallbackInfo<v8::Value>& info)
+void HCI_Down(const Nan::FunctionCallbackInfo<v8::Value>& info)
 {
     if (!info[0]->IsNumber())
     {
@@ -51,29 +53,83 @@ void HCI_Up(const Nan::FunctionCallbackInfo<v8::Value>& info)
         return;
     }
 
-    int device_id = info[0]->NumberValue();
+    int device_id;
+    struct hci_error error;
 
-    v8::Local<v8::Number> status = Nan::New(hci_interface_up_down(device_id, true));
+    if (!hci_device_sync_lock(info[0], &device_id))
+    {
+        info.GetReturnValue().Set(Nan::New(EXIT_FAILURE));
+        return;
+    }
+
+    v8::Local<v8::Number> status = Nan::New(hci_interface_up_down(device_id, false, &error));
+    hci_executor_unlock(device_id);
 
     info.GetReturnValue().Set(status);
 }
 
 /*
- * A wrapper to bring an interface down.
+ * Bring an interface up or down on the device's executor lane.
+ */
+class UpDownWorker : public DeviceWorker
+{
+public:
+    UpDownWorker(Nan::Callback *callback, int device_id, bool status, int timeout_ms)
+        : DeviceWorker(callback, "btim:updown", device_id),
+          status(status), timeout_ms(timeout_ms) {}
+
+    void Execute()
+    {
+        if (hci_interface_up_down_wait(device_id, status, timeout_ms, &error) != EXIT_SUCCESS)
+            SetErrorMessage(error.step);
+    }
+
+private:
+    bool status;
+    int timeout_ms;
+};
+
+/*
+ * Queue an UpDownWorker.
  * Params:
- *     - info: Contains arguments and a return value.
+ *     - info: Contains a device ID, a timeout in milliseconds and a
+ *       callback(error, result).
+ *     - status: true (up), false (down).
  */
-void HCI_Down(const Nan::FunctionCallbackInfo<v8::Value>& info)
+static void hci_up_down_async(const Nan::FunctionCallbackInfo<v8::Value>& info, bool status)
 {
-    if (!info[0]->IsNumber())
+    if (!info[0]->IsNumber() || !info[1]->IsNumber() || !info[2]->IsFunction())
     {
-        Nan::ThrowTypeError("1st argument isn't a number");
+        Nan::ThrowTypeError("Arguments should be a number, a number and a callback");
         return;
     }
 
-    int device_id = info[0]->NumberValue();
+    int device_id, timeout_ms;
+
+    if (!hci_device_id_arg(info[0], &device_id) || !hci_timeout_arg(info[1], &timeout_ms))
+        return;
 
-    v8::Local<v8::Number> status = Nan::New(hci_interface_up_down(device_id, false));
+    Nan::Callback *callback = new Nan::Callback(info[2].As<v8::Function>());
 
-    info.GetReturnValue().Set(status);
+    hci_queue_worker(hci_instance_get(info), new UpDownWorker(callback, device_id, status, timeout_ms));
+}
+
+/*
+ * A wrapper to bring an interface up without blocking the event loop.
+ * Params:
+ *     - info: Contains arguments and a return value.
+ */
+void HCI_Up_async(const Nan::FunctionCallbackInfo<v8::Value>& info)
+{
+    hci_up_down_async(info, true);
+}
+
+/*
+ * A wrapper to bring an interface down without blocking the event loop.
+ * Params:
+ *     - info: Contains arguments and a return value.
+ */
+void HCI_Down_async(const Nan::FunctionCallbackInfo<v8::Value>& info)
+{
+    hci_up_down_async(info, false);
 }
@@ -0,0 +1,124 @@
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+
+#include <bluetooth/bluetooth.h>
+#include <bluetooth/hci.h>
+#include <bluetooth/hci_lib.h>
+
+#include "hci_backend.hpp"
+#include "hci_events.hpp"
+#include "hci_executor.hpp"
+#include "hci_pool.hpp"
+#include "hci_wait.hpp"
+
+/*
+ * Compute a deadline.
+ * Params:
+ *     - timeout_ms: milliseconds from now.
+ * Return value: the deadline, comparable with hci_monotonic_ns().
+ */
+uint64_t hci_deadline(int timeout_ms)
+{
+    return hci_monotonic_ns() + (uint64_t)timeout_ms * 1000000ULL;
+}
+
+/*
+ * Wait for the next event about a device.
+ * Params:
+ *     - events: socket opened with hci_events_open().
+ *     - device_id: device ID.
+ *     - deadline: give up after this point.
+ *     - step: name of the step reported on timeout.
+ *     - error: details about the failed step.
+ * Return values:
+ *     - EXIT_FAILURE: on failure, ETIMEDOUT when the deadline passed.
+ *     - EXIT_SUCCESS: an event about the device was received.
+ */
+int hci_wait_event(int events, int device_id, uint64_t deadline, char const *step, struct hci_error *error)
+{
+    struct hci_device_event event;
+    struct pollfd descriptor;
+
+    descriptor.fd = events;
+    descriptor.events = POLLIN;
+
+    for (;;)
+    {
+        int result;
+
+        while ((result = hci_events_read(events, &event)) > 0)
+        {
+            if (event.device_id == device_id)
+                return EXIT_SUCCESS;
+        }
+
+        if (result < 0)
+            return hci_set_error(error, errno, "recv");
+
+        uint64_t now = hci_monotonic_ns();
+
+        if (now >= deadline)
+            return hci_set_error(error, ETIMEDOUT, step);
+
+        // Round up, not to spin during the last millisecond
+        result = poll(&descriptor, 1, (int)((deadline - now + 999999) / 1000000));
+
+        if (result < 0 && errno != EINTR)
+            return hci_set_error(error, errno, "poll");
+    }
+}
+
+/*
+ * Bring an interface up or down and wait until the kernel reports it.
+ * Params:
+ *     - device_id: device ID.
+ *     - status: true (up), false (down).
+ *     - timeout_ms: give up after this delay.
+ *     - error: details about the failed step.
+ * Return values:
+ *     - EXIT_FAILURE: on failure, ETIMEDOUT when the deadline passed.
+ *     - EXIT_SUCCESS: the device is in the requested state.
+ */
+int hci_interface_up_down_wait(int device_id, bool status, int timeout_ms, struct hci_error *error)
+{
+    uint64_t deadline = hci_deadline(timeout_ms);
+    struct hci_dev_info device_info;
+    int events;
+    int result = EXIT_SUCCESS;
+
+    // Listen before acting, so no event is missed
+    if ((events = hci_events_open(error)) < 0)
+        return EXIT_FAILURE;
+
+    if (hci_interface_up_down(device_id, status, error) != EXIT_SUCCESS)
+    {
+        close(events);
+        return EXIT_FAILURE;
+    }
+
+    for (;;)
+    {
+        if (hci_device_info(device_id, &device_info, error) != EXIT_SUCCESS)
+        {
+            result = EXIT_FAILURE;
+            break;
+        }
+
+        bool up = hci_test_bit(HCI_UP, &device_info.flags) &&
+                  !hci_test_bit(HCI_INIT, &device_info.flags);
+
+        if (up == status)
+            break;
+
+        if (hci_wait_event(events, device_id, deadline,
+                           status ? "wait_up" : "wait_down", error) != EXIT_SUCCESS)
+        {
+            result = EXIT_FAILURE;
+            break;
+        }
+    }
+
+    close(events);
+    return result;
+}
@@ -0,0 +1,8 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "hci_core.hpp"
+
+uint64_t hci_deadline(int timeout_ms);
+int hci_wait_event(int events, int device_id, uint64_t deadline, char const *step, struct hci_error *error);
@@ -0,0 +1,233 @@
+#include <unistd.h>
+
+#include <mutex>
+
+#include <nan.h>
+
+#include "hci.hpp"
+#include "hci_events.hpp"
+
+#define WATCH_MAX_PENDING 32
+
+/*
+ * A subscription to device events.
+ *     - instance: instance of the addon which subscribed.
+ *     - poll: watches the kernel's event socket.
+ *     - async: wakes up the loop for events emitted by btim itself.
+ *     - pending: events emitted by btim, waiting for the loop.
+ *     - handles: open libuv handles, the subscription is freed at 0.
+ */
+struct hci_watch
+{
+    struct hci_instance *instance;
+    bool active;
+    int descriptor;
+    uv_poll_t poll;
+    uv_async_t async;
+    Nan::Callback *callback;
+    Nan::AsyncResource *async_resource;
+    std::mutex lock;
+    struct hci_device_event pending[WATCH_MAX_PENDING];
+    int pending_count;
+    int handles;
+};
+
+/*
+ * Give an event to javascript.
+ * Params:
+ *     - watch: subscription.
+ *     - event: device event.
+ */
+static void watch_deliver(struct hci_watch *watch, struct hci_device_event const *event)
+{
+    Nan::HandleScope scope;
+    v8::Local<v8::Object> obj = Nan::New<v8::Object>();
+
+    Nan::Set(obj, Nan::New("type").ToLocalChecked(),
+             Nan::New(hci_device_event_name(event->type)).ToLocalChecked());
+    Nan::Set(obj, Nan::New("id").ToLocalChecked(), Nan::New(event->device_id));
+    Nan::Set(obj, Nan::New("timestamp").ToLocalChecked(), Nan::New(event->timestamp));
+
+    v8::Local<v8::Value> argv[] = { Nan::Null(), obj };
+
+    watch->callback->Call(2, argv, watch->async_resource);
+}
+
+/*
+ * Read the kernel's events. A failed socket stays readable: the
+ * subscription ends after reporting the error, rather than reporting it
+ * again on every loop iteration.
+ * Params:
+ *     - handle: the uv_poll_t handle.
+ *     - status: poll status.
+ *     - events: ready events.
+ */
+static void watch_readable(uv_poll_t *handle, int status, int events)
+{
+    struct hci_watch *watch = (struct hci_watch *)handle->data;
+    struct hci_device_event event;
+    int result = 0;
+
+    while (status == 0 && watch->active &&
+           (result = hci_events_read(watch->descriptor, &event)) > 0)
+        watch_deliver(watch, &event);
+
+    if (watch->active && (status < 0 || result < 0))
+    {
+        Nan::HandleScope scope;
+        struct hci_error error;
+
+        hci_set_error(&error, status < 0 ? -status : errno, "recv");
+
+        v8::Local<v8::Value> argv[] = { hci_error_to_js(-1, &error) };
+
+        watch->callback->Call(1, argv, watch->async_resource);
+
+        // Unless the callback already unsubscribed
+        if (watch->active)
+            hci_watch_cleanup(watch->instance);
+    }
+}
+
+/*
+ * Queue an event emitted by btim: called on the emitting thread.
+ * Params:
+ *     - event: device event.
+ *     - arg: subscription.
+ */
+static void watch_hook(struct hci_device_event const *event, void *arg)
+{
+    struct hci_watch *watch = (struct hci_watch *)arg;
+    std::lock_guard<std::mutex> guard(watch->lock);
+
+    // Drop events when javascript doesn't keep up
+    if (watch->pending_count < WATCH_MAX_PENDING)
+        watch->pending[watch->pending_count++] = *event;
+
+    uv_async_send(&watch->async);
+}
+
+/*
+ * Deliver the events emitted by btim.
+ * Params:
+ *     - handle: the uv_async_t handle.
+ */
+static void watch_emitted(uv_async_t *handle)
+{
+    struct hci_watch *watch = (struct hci_watch *)handle->data;
+    struct hci_device_event pending[WATCH_MAX_PENDING];
+    int count;
+
+    {
+        std::lock_guard<std::mutex> guard(watch->lock);
+
+        count = watch->pending_count;
+        memcpy(pending, watch->pending, count * sizeof(pending[0]));
+        watch->pending_count = 0;
+    }
+
+    for (int i = 0; i < count && watch->active; i++)
+        watch_deliver(watch, &pending[i]);
+}
+
+/*
+ * Free a subscription once its handles are closed.
+ * Params:
+ *     - handle: a closed handle.
+ */
+static void watch_closed(uv_handle_t *handle)
+{
+    struct hci_watch *watch = (struct hci_watch *)handle->data;
+
+    if (--watch->handles == 0)
+    {
+        delete watch->callback;
+        delete watch->async_resource;
+        delete watch;
+    }
+}
+
+/*
+ * Subscribe to device events.
+ * Params:
+ *     - info: Contains a callback(error, { type, id, timestamp }).
+ */
+void HCI_watch_start(const Nan::FunctionCallbackInfo<v8::Value>& info)
+{
+    struct hci_instance *instance = hci_instance_get(info);
+    struct hci_watch *watch;
+    struct hci_error error;
+    int descriptor;
+
+    if (!info[0]->IsFunction())
+    {
+        Nan::ThrowTypeError("1st argument should be a callback");
+        return;
+    }
+
+    if (instance->watch)
+    {
+        Nan::ThrowError("Already watching");
+        return;
+    }
+
+    if ((descriptor = hci_events_open(&error)) < 0)
+    {
+        v8::Isolate::GetCurrent()->ThrowException(hci_error_to_js(-1, &error));
+        return;
+    }
+
+    watch = new hci_watch();
+    watch->instance = instance;
+    watch->active = true;
+    watch->descriptor = descriptor;
+    watch->callback = new Nan::Callback(info[0].As<v8::Function>());
+    watch->async_resource = new Nan::AsyncResource("btim:watch");
+    watch->pending_count = 0;
+    watch->handles = 2;
+
+    uv_poll_init(Nan::GetCurrentEventLoop(), &watch->poll, descriptor);
+    watch->poll.data = watch;
+    uv_poll_start(&watch->poll, UV_READABLE, watch_readable);
+
+    uv_async_init(Nan::GetCurrentEventLoop(), &watch->async, watch_emitted);
+    watch->async.data = watch;
+
+    hci_events_subscribe(watch_hook, watch);
+
+    instance->watch = watch;
+}
+
+/*
+ * Unsubscribe an instance from device events.
+ * Params:
+ *     - instance: instance of the addon.
+ */
+void hci_watch_cleanup(struct hci_instance *instance)
+{
+    struct hci_watch *watch = instance->watch;
+
+    if (watch == NULL)
+        return;
+
+    instance->watch = NULL;
+    watch->active = false;
+
+    hci_events_unsubscribe(watch_hook, watch);
+
+    uv_poll_stop(&watch->poll);
+    close(watch->descriptor);
+
+    uv_close((uv_handle_t *)&watch->poll, watch_closed);
+    uv_close((uv_handle_t *)&watch->async, watch_closed);
+}
+
+/*
+ * Unsubscribe from device events.
+ * Params:
+ *     - info: Contains arguments and a return value.
+ */
+void HCI_watch_stop(const Nan::FunctionCallbackInfo<v8::Value>& info)
+{
+    hci_watch_cleanup(hci_instance_get(info));
+}
@@ -1,11 +1,48 @@
 'use strict';
 
+var EventEmitter = require('events').EventEmitter;
 var btim = require('./build/Release/btim');
+var raw = require('./raw');
 
-module.exports.list = function list() {
-  return btim.list();
+/*
+ * options: { ids: [interface_number...], fields: ['type', 'bus', 'address',
+ * 'acl_mtu', 'sco_mtu', 'status', 'rx', 'tx'] }. Both default to all.
+ */
+module.exports.list = function list(options) {
+  return btim.list(options);
 }
 
+module.exports.getInfo = function getInfo(interface_number, options) {
+  return btim.get_info(interface_number, options);
+}
+
+/*
+ * Devices added, changed (flags, address, MTU...) or removed since the
+ * enumeration of generation `since_generation`, plus counter deltas of the
+ * other ones. Unknown or expired generations (only the last few are kept)
+ * give every device in `added`, with `full` set.
+ */
+module.exports.listChanges = function listChanges(since_generation) {
+  return btim.list_changes(since_generation);
+}
+
+module.exports.listRaw = function listRaw(options) {
+  return btim.list_raw(options);
+}
+
+module.exports.RawList = raw.RawList;
+
+/*
+ * Connections of an adapter, as packed records decoded by ConnectionList.
+ * With `{ quality: true }`, the RSSI, link quality and TX power of every
+ * link are read too, pipelined in a few controller round trips.
+ */
+module.exports.connections = function connections(interface_number, options) {
+  return btim.connections(interface_number, options);
+}
+
+module.exports.ConnectionList = raw.ConnectionList;
+
 module.exports.spoof_mac = function spoof_mac(interface_number, mac_address) {
   return btim.spoof_mac(interface_number, mac_address);
 }
@@ -17,3 +54,421 @@ module.exports.up = function interface_up(interface_number) {
 module.exports.down = function interface_down(interface_number) {
   return btim.interface_down(interface_number);
 }
+
+/*
+ * Capabilities of an adapter, probed once and cached until it is plugged
+ * out: { id, bus, manufacturer, hciVersion, hciRevision, lmpVersion,
+ * lmpSubversion, supported, hasReset }. Returns a Promise.
+ */
+module.exports.capabilities = function capabilities(interface_number) {
+  return call_async(btim.capabilities_async, [interface_number]);
+}
+
+/*
+ * Controller command timeouts. Each command has a default timeout (e.g.
+ * 1000 ms for vendor address writes); once an adapter ran it enough times,
+ * the timeout drops to 4 times its measured p99. setCommandTimeout() sets
+ * the timeout of an opcode, learned latencies aside, for all adapters or
+ * those of a manufacturer (company ID); a timeout of 0 removes it.
+ */
+module.exports.setCommandTimeout = function setCommandTimeout(opcode, timeout_ms, manufacturer) {
+  return btim.set_command_timeout(opcode, timeout_ms, manufacturer);
+}
+
+module.exports.commandLatency = function commandLatency(interface_number) {
+  return btim.command_latency(interface_number);
+}
+
+/*
+ * Downtime of the spoofs made with promises.spoof_mac, per manufacturer:
+ * [{ manufacturer, spoofs, resetsSkipped, meanMs, maxMs, lastMs }].
+ */
+module.exports.downtime = function downtime() {
+  return btim.downtime();
+}
+
+/*
+ * Latencies of the device ioctls and controller commands run so far, per
+ * manufacturer (-1 when the adapter wasn't probed): { dropped,
+ * operations: [{ operation, opcode, manufacturer, count, errors, totalMs,
+ * p50Us, p99Us, buckets }] }. buckets[i] counts the operations of less
+ * than 2^i microseconds.
+ */
+module.exports.metrics = function metrics() {
+  return btim.metrics();
+}
+
+/*
+ * Adapter outbound work (connections, scans...) should go to: adapters up,
+ * running and matching `filter` ({ ids, bus, le }) are picked in proportion
+ * to their score, which drops with their connections, bytes sent per second
+ * and send errors and grows with their ACL buffers. Returns a dev_id, or
+ * throws an Error with code 'ENODEV' when none matches. adapterLoad() shows
+ * the scores: [{ id, usable, aclPkts, connections, txRate, errorRatio,
+ * score, picks }].
+ */
+module.exports.pickAdapter = function pickAdapter(options) {
+  return btim.pick_adapter(options && options.filter);
+}
+
+module.exports.adapterLoad = function adapterLoad() {
+  return btim.adapter_load();
+}
+
+/*
+ * Close the cached HCI sockets. Returns false when other threads have btim
+ * loaded and the sockets were left open.
+ */
+module.exports.close = function close() {
+  return btim.close();
+}
+
+/*
+ * Device events: "register", "unregister", "up", "down" and "reset", plus
+ * "event" for all of them. The native subscription runs while at least one
+ * of them has a listener. It ends on an "error"; the next listener added
+ * subscribes again.
+ */
+var events = new EventEmitter();
+var event_types = ['event', 'register', 'unregister', 'up', 'down', 'reset'];
+var watchers = 0;
+var watch_failed = false;
+
+function on_device_event(error, event) {
+  if (error) {
+    watch_failed = true;
+    if (events.listenerCount('error') > 0)
+      events.emit('error', error);
+    return;
+  }
+
+  events.emit(event.type, event);
+  events.emit('event', event);
+}
+
+events.on('newListener', function (type) {
+  if (event_types.indexOf(type) < 0 || (watchers++ > 0 && !watch_failed))
+    return;
+
+  try {
+    btim.watch_start(on_device_event);
+    watch_failed = false;
+  } catch (error) {
+    watchers--;
+    throw error;
+  }
+});
+
+events.on('removeListener', function (type) {
+  if (event_types.indexOf(type) >= 0 && --watchers === 0)
+    btim.watch_stop();
+});
+
+module.exports.events = events;
+
+module.exports.watch = function watch(callback) {
+  var watching = true;
+
+  events.on('event', callback);
+
+  return function unwatch() {
+    if (watching) {
+      watching = false;
+      events.removeListener('event', callback);
+    }
+  };
+}
+
+/*
+ * Promise based versions: the HCI work runs off the main thread and failures
+ * are rejected with an Error carrying `errno`, `code` and `step`. Commands
+ * to a device are serialized on its own native thread, different devices
+ * run in parallel.
+ */
+function call_async(fn, args) {
+  return new Promise(function (resolve, reject) {
+    fn.apply(btim, args.concat(function (error, result) {
+      if (error)
+        reject(error);
+      else
+        resolve(result);
+    }));
+  });
+}
+
+var DEFAULT_UPDOWN_TIMEOUT_MS = 5000;
+var DEFAULT_SPOOF_TIMEOUT_MS = 15000;
+
+function timeout_ms(options, default_timeout_ms) {
+  if (options && options.timeoutMs !== undefined)
+    return options.timeoutMs;
+  return default_timeout_ms;
+}
+
+/*
+ * up, down and spoof_mac resolve once the kernel reports the target state
+ * (for spoof_mac: the device up with the new address), and reject with
+ * code 'ETIMEDOUT' when options.timeoutMs passes first. spoof_mac also
+ * resolves with `timings`: { writeMs, vendorResetMs, kernelResetMs, upMs,
+ * downtimeMs, resetsSkipped }.
+ */
+module.exports.promises = {
+  list: function list(options) {
+    return call_async(btim.list_async, [options]);
+  },
+
+  getInfo: function getInfo(interface_number, options) {
+    return call_async(btim.get_info_async, [interface_number, options]);
+  },
+
+  listChanges: function listChanges(since_generation) {
+    return call_async(btim.list_changes_async, [since_generation]);
+  },
+
+  listRaw: function listRaw(options) {
+    return call_async(btim.list_raw_async, [options]);
+  },
+
+  connections: function connections(interface_number, options) {
+    return call_async(btim.connections_async, [interface_number, options]);
+  },
+
+  spoof_mac: function spoof_mac(interface_number, mac_address, options) {
+    return call_async(btim.spoof_mac_async, [interface_number, mac_address,
+      timeout_ms(options, DEFAULT_SPOOF_TIMEOUT_MS)]);
+  },
+
+  up: function interface_up(interface_number, options) {
+    return call_async(btim.interface_up_async, [interface_number,
+      timeout_ms(options, DEFAULT_UPDOWN_TIMEOUT_MS)]);
+  },
+
+  down: function interface_down(interface_number, options) {
+    return call_async(btim.interface_down_async, [interface_number,
+      timeout_ms(options, DEFAULT_UPDOWN_TIMEOUT_MS)]);
+  }
+};
+
+/*
+ * Turn the outcome of a per-device promise into a bulk result entry.
+ */
+function settle(promise, interface_number) {
+  return promise.then(function (result) {
+    return {
+      id: interface_number,
+      ok: true,
+      queuedMs: result.queuedMs,
+      elapsedMs: result.elapsedMs
+    };
+  }, function (error) {
+    return {
+      id: interface_number,
+      ok: false,
+      error: error,
+      queuedMs: error.queuedMs,
+      elapsedMs: error.elapsedMs
+    };
+  });
+}
+
+module.exports.promises.spoofMany = function spoofMany(devices, options) {
+  return Promise.all(devices.map(function (device) {
+    return settle(module.exports.promises.spoof_mac(device.id, device.mac, options), device.id);
+  }));
+}
+
+module.exports.promises.upMany = function upMany(interface_numbers, options) {
+  return Promise.all(interface_numbers.map(function (interface_number) {
+    return settle(module.exports.promises.up(interface_number, options), interface_number);
+  }));
+}
+
+module.exports.promises.downMany = function downMany(interface_numbers, options) {
+  return Promise.all(interface_numbers.map(function (interface_number) {
+    return settle(module.exports.promises.down(interface_number, options), interface_number);
+  }));
+}
+
+/*
+ * Counters sampler. A native thread samples every device each
+ * `intervalMs` into a ring of fixed layout records in a SharedArrayBuffer:
+ * a header of 32 bits words (version, capacity, record size, write, read,
+ * overruns, errors, reserved) followed by 56 bytes records (float64
+ * timestamp, uint32 dev_id, uint32 flags, ten uint32 counters).
+ */
+var SAMPLER_HEADER_SIZE = 32;
+var SAMPLER_RECORD_SIZE = 56;
+var SAMPLER_WRITE = 3;
+var SAMPLER_READ = 4;
+var SAMPLER_OVERRUNS = 5;
+var SAMPLER_ERRORS = 6;
+var SAMPLER_COUNTERS = ['bytes', 'acl', 'sco', 'events', 'errors'];
+
+function Sampler(options) {
+  var capacity = (options && options.capacity) || 4096;
+
+  this.intervalMs = (options && options.intervalMs) || 100;
+  this.buffer = new SharedArrayBuffer(SAMPLER_HEADER_SIZE + capacity * SAMPLER_RECORD_SIZE);
+  this.header = new Uint32Array(this.buffer, 0, SAMPLER_HEADER_SIZE / 4);
+  this.words = new Uint32Array(this.buffer);
+  this.floats = new Float64Array(this.buffer);
+  this.capacity = capacity;
+
+  // Reused for every record handed to drain() callbacks
+  this.record = { timestamp: 0, id: 0, flags: 0, rx: {}, tx: {} };
+  for (var i = 0; i < SAMPLER_COUNTERS.length; i++) {
+    this.record.rx[SAMPLER_COUNTERS[i]] = 0;
+    this.record.tx[SAMPLER_COUNTERS[i]] = 0;
+  }
+
+  this.native = new btim.StatsSampler(new Uint8Array(this.buffer), this.intervalMs);
+}
+
+/*
+ * Hand the records written since the last call to `callback(record)`. The
+ * record object is reused: copy what must outlive the callback.
+ * Returns the number of records read.
+ */
+Sampler.prototype.drain = function drain(callback) {
+  var write = Atomics.load(this.header, SAMPLER_WRITE);
+  var read = Atomics.load(this.header, SAMPLER_READ);
+  var record = this.record;
+  var count = (write - read) >>> 0;
+
+  for (var i = 0; i < count; i++) {
+    var offset = SAMPLER_HEADER_SIZE + ((read + i) % this.capacity) * SAMPLER_RECORD_SIZE;
+    var word = offset / 4;
+
+    record.timestamp = this.floats[offset / 8];
+    record.id = this.words[word + 2];
+    record.flags = this.words[word + 3];
+    record.rx.bytes = this.words[word + 4];
+    record.rx.acl = this.words[word + 5];
+    record.rx.sco = this.words[word + 6];
+    record.rx.events = this.words[word + 7];
+    record.rx.errors = this.words[word + 8];
+    record.tx.bytes = this.words[word + 9];
+    record.tx.acl = this.words[word + 10];
+    record.tx.sco = this.words[word + 11];
+    record.tx.events = this.words[word + 12];
+    record.tx.errors = this.words[word + 13];
+
+    callback(record);
+  }
+
+  Atomics.store(this.header, SAMPLER_READ, (read + count) >>> 0);
+  return count;
+}
+
+Object.defineProperty(Sampler.prototype, 'overruns', {
+  get: function () { return Atomics.load(this.header, SAMPLER_OVERRUNS); }
+});
+
+Object.defineProperty(Sampler.prototype, 'errors', {
+  get: function () { return Atomics.load(this.header, SAMPLER_ERRORS); }
+});
+
+Sampler.prototype.stop = function stop() {
+  this.native.stop();
+}
+
+module.exports.sampler = function sampler(options) {
+  return new Sampler(options);
+}
+
+/*
+ * Capture of the traffic of the devices into rotating btsnoop files, as
+ * read by `btmon -r` or Wireshark. Needs CAP_NET_RAW. `devices` lists the
+ * dev_ids captured, all by default; `maxBytes` is the size of a file before
+ * it is renamed `path.1`, `files` the number of files kept.
+ */
+module.exports.capture = function capture(options) {
+  var devices = options && options.devices;
+  var mask = 0xffffffff;
+
+  if (!options || typeof options.path !== 'string') {
+    throw new TypeError('options.path should be a string');
+  }
+
+  if (devices) {
+    mask = 0;
+    devices.forEach(function (id) {
+      if (id >= 0 && id < 32) {
+        mask |= 1 << id;
+      }
+    });
+  }
+
+  return new btim.HciCapture(options.path, options.maxBytes || 16 * 1024 * 1024, options.files || 4,
+                             mask >>> 0, options.ringBytes || 4 * 1024 * 1024);
+}
+
+/*
+ * LE scan. Advertising reports are parsed and merged on a native thread:
+ * reports of an advertiser with the same payload are counted instead of
+ * repeated. Every `intervalMs`, `callback(batch)` receives the merged
+ * reports: [{ id, address, addressType, type, rssi, count, timestamp,
+ * data }]. A batch holds at most `capacity` distinct reports, the others
+ * are counted as drops by stats().
+ */
+module.exports.scan = function scan(options, callback) {
+  var ids;
+
+  if (typeof options === 'function') {
+    callback = options;
+    options = {};
+  }
+
+  if (typeof callback !== 'function') {
+    throw new TypeError('callback should be a function');
+  }
+
+  ids = options.ids || btim.list({ fields: [] }).map(function (entry) {
+    return parseInt(Object.keys(entry)[0].slice(3), 10);
+  });
+
+  return new btim.HciScan(ids, options.intervalMs || 100, options.capacity || 1024,
+                          !!options.active, callback);
+}
+
+/*
+ * OpenMetrics exporter. A native thread samples the counters and flags of
+ * every adapter each `intervalMs` and renders monotonic totals, rates per
+ * second and error ratios into a fixed size buffer, so a scrape is a copy.
+ * With `port` (on 127.0.0.1) or `path` (a Unix socket), the thread also
+ * answers HTTP scrapes itself, without going through javascript.
+ */
+function Exporter(options) {
+  this.native = new btim.HciExporter(options.intervalMs || 1000, options.port || 0, options.path || '');
+  this.buffer = Buffer.alloc(this.native.textSize);
+}
+
+Exporter.contentType = 'application/openmetrics-text; version=1.0.0; charset=utf-8';
+
+/*
+ * Get the last rendered text, as a slice of a buffer reused by the next
+ * call: copy it to keep it.
+ */
+Exporter.prototype.render = function render() {
+  return this.buffer.slice(0, this.native.render(this.buffer));
+}
+
+Exporter.prototype.stats = function stats() {
+  return this.native.stats();
+}
+
+Exporter.prototype.stop = function stop() {
+  this.native.stop();
+}
+
+module.exports.exporter = function exporter(options) {
+  return new Exporter(options || {});
+}
+
+module.exports.Exporter = Exporter;
+
+/*
+ * Client of btimd, the daemon sharing the adapters between processes. Also
+ * available as require('btim/client'), which doesn't load the addon.
+ */
+module.exports.connect = require('./client');
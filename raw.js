@@ -0,0 +1,191 @@
+'use strict';
+
+/*
+ * Lazy decoders for the packed records of listRaw() and connections().
+ * Nothing is decoded until a field is read; see hci_raw.hpp for the layout.
+ */
+
+var MAGIC = 0x4d495442;
+var CONN_MAGIC = 0x43495442;
+var VERSION = 1;
+
+var LINK_TYPES = { 0: 'SCO', 1: 'ACL', 2: 'ESCO', 0x80: 'LE' };
+var CONN_RSSI = 0x01;
+var CONN_LINK_QUALITY = 0x02;
+var CONN_TX_POWER = 0x04;
+
+var DEVICE_FLAGS = ['UP', 'INIT', 'RUNNING', 'PSCAN', 'ISCAN', 'AUTH', 'ENCRYPT', 'INQUIRY', 'RAW'];
+
+function mac_address(view, offset) {
+  var parts = [];
+
+  for (var i = 5; i >= 0; i--) {
+    var byte = view.getUint8(offset + i).toString(16).toUpperCase();
+    parts.push(byte.length < 2 ? '0' + byte : byte);
+  }
+
+  return parts.join(':');
+}
+
+function RawDevice(view, offset) {
+  this.view = view;
+  this.offset = offset;
+}
+
+function u16(field) {
+  return { get: function () { return this.view.getUint16(this.offset + field, true); } };
+}
+
+function u32(field) {
+  return { get: function () { return this.view.getUint32(this.offset + field, true); } };
+}
+
+Object.defineProperties(RawDevice.prototype, {
+  id: u16(0),
+  type: { get: function () { return (this.view.getUint8(this.offset + 2) & 0x30) >> 4; } },
+  bus: { get: function () { return this.view.getUint8(this.offset + 2) & 0x0f; } },
+  name: {
+    get: function () {
+      var name = '';
+      for (var i = 0; i < 8; i++) {
+        var c = this.view.getUint8(this.offset + 4 + i);
+        if (c === 0)
+          break;
+        name += String.fromCharCode(c);
+      }
+      return name;
+    }
+  },
+  address: { get: function () { return mac_address(this.view, this.offset + 12); } },
+  flags: u32(20),
+  aclMtu: u16(24),
+  aclPackets: u16(26),
+  scoMtu: u16(28),
+  scoPackets: u16(30),
+  pktType: u32(32),
+  linkPolicy: u32(36),
+  linkMode: u32(40),
+  up: { get: function () { return (this.flags & 1) !== 0; } },
+  status: {
+    get: function () {
+      var flags = this.flags;
+      return DEVICE_FLAGS.filter(function (name, bit) { return flags & (1 << bit); });
+    }
+  },
+  rx: {
+    get: function () {
+      return {
+        bytes: this.view.getUint32(this.offset + 84, true),
+        acl: this.view.getUint32(this.offset + 72, true),
+        sco: this.view.getUint32(this.offset + 80, true),
+        events: this.view.getUint32(this.offset + 64, true),
+        errors: this.view.getUint32(this.offset + 52, true)
+      };
+    }
+  },
+  tx: {
+    get: function () {
+      return {
+        bytes: this.view.getUint32(this.offset + 88, true),
+        acl: this.view.getUint32(this.offset + 68, true),
+        sco: this.view.getUint32(this.offset + 76, true),
+        events: this.view.getUint32(this.offset + 60, true),
+        errors: this.view.getUint32(this.offset + 56, true)
+      };
+    }
+  }
+});
+
+/*
+ * A view over the buffer returned by listRaw().
+ */
+function RawList(buffer) {
+  var view = new DataView(buffer.buffer, buffer.byteOffset, buffer.byteLength);
+
+  if (view.getUint32(0, true) !== MAGIC)
+    throw new Error('Not a btim raw list');
+  if (view.getUint16(4, true) !== VERSION)
+    throw new Error('Unsupported raw list version ' + view.getUint16(4, true));
+
+  this.buffer = buffer;
+  this.view = view;
+  this.headerSize = view.getUint16(6, true);
+  this.recordSize = view.getUint16(8, true);
+  this.length = view.getUint16(10, true);
+}
+
+/*
+ * Get the device at `index`. Fields are decoded when read.
+ */
+RawList.prototype.get = function get(index) {
+  if (index < 0 || index >= this.length)
+    return undefined;
+  return new RawDevice(this.view, this.headerSize + index * this.recordSize);
+}
+
+RawList.prototype.forEach = function forEach(callback) {
+  for (var i = 0; i < this.length; i++)
+    callback(this.get(i), i);
+}
+
+function RawConnection(view, offset) {
+  this.view = view;
+  this.offset = offset;
+}
+
+/*
+ * A link quality value, undefined when it couldn't be read.
+ */
+function quality(field, bit, signed) {
+  return {
+    get: function () {
+      if (!(this.view.getUint8(this.offset + 16) & bit))
+        return undefined;
+      return signed ? this.view.getInt8(this.offset + field) : this.view.getUint8(this.offset + field);
+    }
+  };
+}
+
+Object.defineProperties(RawConnection.prototype, {
+  handle: u16(0),
+  type: { get: function () { return LINK_TYPES[this.view.getUint8(this.offset + 2)]; } },
+  out: { get: function () { return this.view.getUint8(this.offset + 3) !== 0; } },
+  address: { get: function () { return mac_address(this.view, this.offset + 4); } },
+  state: u16(10),
+  linkMode: u32(12),
+  rssi: quality(17, CONN_RSSI, true),
+  linkQuality: quality(18, CONN_LINK_QUALITY, false),
+  txPower: quality(19, CONN_TX_POWER, true)
+});
+
+/*
+ * A view over the buffer returned by connections().
+ */
+function ConnectionList(buffer) {
+  var view = new DataView(buffer.buffer, buffer.byteOffset, buffer.byteLength);
+
+  if (view.getUint32(0, true) !== CONN_MAGIC)
+    throw new Error('Not a btim connection list');
+  if (view.getUint16(4, true) !== VERSION)
+    throw new Error('Unsupported connection list version ' + view.getUint16(4, true));
+
+  this.buffer = buffer;
+  this.view = view;
+  this.headerSize = view.getUint16(6, true);
+  this.recordSize = view.getUint16(8, true);
+  this.length = view.getUint16(10, true);
+  this.id = view.getUint16(12, true);
+}
+
+ConnectionList.prototype.get = function get(index) {
+  if (index < 0 || index >= this.length)
+    return undefined;
+  return new RawConnection(this.view, this.headerSize + index * this.recordSize);
+}
+
+ConnectionList.prototype.forEach = RawList.prototype.forEach;
+
+module.exports.RawList = RawList;
+module.exports.RawDevice = RawDevice;
+module.exports.ConnectionList = ConnectionList;
+module.exports.RawConnection = RawConnection;
@@ -0,0 +1,366 @@
+/*
+ * Behavior of the native core against simulated controllers.
+ *
+ * Usage: btim_test
+ *
+ * Neither Bluetooth hardware nor privileges are needed. Every test starts
+ * the simulator afresh; the exit status is EXIT_FAILURE when one fails.
+ */
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <thread>
+
+#include <bluetooth/bluetooth.h>
+#include <bluetooth/hci.h>
+
+#include "../hci_backend.hpp"
+#include "../hci_bdaddr.hpp"
+#include "../hci_caps.hpp"
+#include "../hci_engine.hpp"
+#include "../hci_events.hpp"
+#include "../hci_executor.hpp"
+#include "../hci_pool.hpp"
+#include "../hci_sim.hpp"
+#include "../hci_timeouts.hpp"
+
+#define TEST_COMMANDS 16
+
+#define OPCODE_READ_LOCAL_VERSION cmd_opcode_pack(OGF_INFO_PARAM, OCF_READ_LOCAL_VERSION)
+#define OPCODE_READ_BD_ADDR       cmd_opcode_pack(OGF_INFO_PARAM, OCF_READ_BD_ADDR)
+
+/*
+ * Report why a test failed.
+ * Return value: EXIT_FAILURE.
+ */
+static int fail(char const *format, ...)
+{
+    va_list arguments;
+
+    va_start(arguments, format);
+    printf("    ");
+    vprintf(format, arguments);
+    printf("\n");
+    va_end(arguments);
+
+    return EXIT_FAILURE;
+}
+
+/*
+ * Start one simulated controller, with nothing cached about the previous
+ * ones.
+ * Params:
+ *     - manufacturer: company ID of the controller.
+ *     - command_us: delay before a command completes.
+ *     - credits: commands the controller accepts at once.
+ * Return values:
+ *     - EXIT_FAILURE: on failure.
+ *     - EXIT_SUCCESS: on success.
+ */
+static int start(uint16_t manufacturer, int command_us, int credits)
+{
+    static uint16_t manufacturers[1];
+    struct hci_sim_options options;
+    struct hci_error error;
+
+    memset(&options, 0, sizeof(options));
+    manufacturers[0] = manufacturer;
+    options.manufacturers = manufacturers;
+    options.count = 1;
+    options.command_us = command_us;
+    options.credits = credits;
+
+    if (hci_sim_start(&options, &error) != EXIT_SUCCESS)
+        return fail("can't start the simulator: %s (%s)", strerror(error.code), error.step);
+
+    // Descriptors of the previous controllers read end of file
+    hci_pool_close();
+    hci_events_close();
+    hci_events_sync();
+
+    return EXIT_SUCCESS;
+}
+
+/*
+ * Run count times a command on hci0.
+ * Params:
+ *     - commands: receives the commands run.
+ *     - count: number of commands.
+ *     - ocf: informational parameter read.
+ *     - flags: HCI_COMMAND_* flags.
+ *     - timeout_ms: default timeout.
+ *     - elapsed_ms: receives the duration of the run.
+ * Return value: result of hci_engine_run(), errno set on failure.
+ */
+static int run(struct hci_command *commands, int count, uint16_t ocf, int flags, int timeout_ms,
+               int *elapsed_ms)
+{
+    struct hci_engine engine;
+    struct hci_error error;
+    uint64_t start_ns;
+    int result, code;
+
+    if (hci_engine_open(&engine, 0, &error) != EXIT_SUCCESS)
+    {
+        errno = error.code;
+        return EXIT_FAILURE;
+    }
+
+    for (int i = 0; i < count; i++)
+    {
+        hci_command_init(&commands[i], OGF_INFO_PARAM, ocf, NULL, 0, timeout_ms);
+        commands[i].flags = flags;
+    }
+
+    start_ns = hci_monotonic_ns();
+    result = hci_engine_run(&engine, commands, count);
+    code = errno;
+    *elapsed_ms = (int)((hci_monotonic_ns() - start_ns) / 1000000ULL);
+
+    hci_engine_close(&engine, result == EXIT_SUCCESS ? 0 : code);
+
+    errno = code;
+    return result;
+}
+
+/*
+ * The engine keeps as many commands in flight as the controller grants
+ * (Num_HCI_Command_Packets), never more: counted on the monitor, from the
+ * commands sent and the Command Complete events.
+ */
+static int test_credits(void)
+{
+    static int const credits[] = { 1, 2, 4 };
+
+    for (size_t i = 0; i < sizeof(credits) / sizeof(credits[0]); i++)
+    {
+        struct hci_command commands[TEST_COMMANDS];
+        struct hci_error error;
+        uint8_t frame[sizeof(struct hci_monitor_header) + HCI_MAX_EVENT_SIZE];
+        int descriptor, elapsed_ms;
+        int in_flight = 0, most = 0;
+        ssize_t length;
+
+        if (start(0, 2000, credits[i]) != EXIT_SUCCESS)
+            return EXIT_FAILURE;
+
+        if ((descriptor = hci_backend_get()->open_monitor(&error)) < 0)
+            return fail("can't open the monitor: %s", strerror(error.code));
+
+        if (run(commands, TEST_COMMANDS, OCF_READ_LOCAL_VERSION, 0, 1000, &elapsed_ms) != EXIT_SUCCESS)
+        {
+            close(descriptor);
+            return fail("%d credits: %s", credits[i], strerror(errno));
+        }
+
+        while ((length = recv(descriptor, frame, sizeof(frame), MSG_DONTWAIT)) > 0)
+        {
+            struct hci_monitor_header const *header = (struct hci_monitor_header const *)frame;
+            uint8_t const *packet = (uint8_t const *)(header + 1);
+
+            if (btohs(header->opcode) == HCI_MONITOR_COMMAND_PKT)
+                in_flight++;
+            else if (btohs(header->opcode) == HCI_MONITOR_EVENT_PKT && packet[0] == EVT_CMD_COMPLETE)
+                in_flight--;
+
+            if (in_flight > most)
+                most = in_flight;
+        }
+
+        close(descriptor);
+
+        if (most != credits[i] || in_flight != 0)
+            return fail("%d credits: %d commands in flight at most, %d unanswered", credits[i], most, in_flight);
+    }
+
+    return EXIT_SUCCESS;
+}
+
+/*
+ * A Hardware Error fails the command in flight with the controller's code,
+ * and cancels the queued ones, without waiting for their timeouts.
+ */
+static int test_hardware_error(void)
+{
+    struct hci_command commands[3];
+    int result, code, elapsed_ms;
+
+    if (start(0, 200000, 1) != EXIT_SUCCESS)
+        return EXIT_FAILURE;
+
+    std::thread wedge([] {
+        struct hci_error error;
+
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        hci_sim_hardware_error(0, 0x42, &error);
+    });
+
+    result = run(commands, 3, OCF_READ_LOCAL_VERSION, 0, 5000, &elapsed_ms);
+    code = errno;
+    wedge.join();
+
+    if (result == EXIT_SUCCESS || code != EIO)
+        return fail("run: %s, expected %s", result == EXIT_SUCCESS ? "success" : strerror(code), strerror(EIO));
+
+    if (commands[0].result != EIO || commands[0].status != 0x42)
+        return fail("command in flight: %s, status 0x%02x", strerror(commands[0].result), commands[0].status);
+
+    if (commands[1].result != ECANCELED || commands[2].result != ECANCELED)
+        return fail("queued commands: %s, %s", strerror(commands[1].result), strerror(commands[2].result));
+
+    if (elapsed_ms >= 150)
+        return fail("failed after %d ms", elapsed_ms);
+
+    return EXIT_SUCCESS;
+}
+
+/*
+ * Learned timeouts: p99 times 4, never below 20 ms, only ever lowering the
+ * caller's default; policies win outright, and unprofiled commands keep
+ * the default.
+ */
+static int test_learned_timeouts(void)
+{
+    struct hci_command command;
+    int result, elapsed_ms;
+
+    if (start(0, 100000, 1) != EXIT_SUCCESS)
+        return EXIT_FAILURE;
+
+    // Learned on a controller answering within 100 us
+    for (int i = 0; i < TEST_COMMANDS; i++)
+        hci_timeout_record(0, OPCODE_READ_LOCAL_VERSION, 100000);
+
+    if ((result = hci_timeout_resolve(0, -1, OPCODE_READ_LOCAL_VERSION, 5000, true)) != 20)
+        return fail("fast controller: %d ms, expected the 20 ms floor", result);
+
+    if ((result = hci_timeout_resolve(0, -1, OPCODE_READ_LOCAL_VERSION, 5000, false)) != 5000)
+        return fail("unprofiled: %d ms, expected the default", result);
+
+    // Learned on a controller answering within 2 s
+    for (int i = 0; i < TEST_COMMANDS; i++)
+        hci_timeout_record(0, OPCODE_READ_BD_ADDR, 2000000000ULL);
+
+    if ((result = hci_timeout_resolve(0, -1, OPCODE_READ_BD_ADDR, 1000, true)) != 1000)
+        return fail("slow controller: %d ms, expected the default", result);
+
+    hci_timeout_override(-1, OPCODE_READ_BD_ADDR, 3000);
+    result = hci_timeout_resolve(0, 0, OPCODE_READ_BD_ADDR, 1000, true);
+    hci_timeout_override(-1, OPCODE_READ_BD_ADDR, 0);
+
+    if (result != 3000)
+        return fail("policy: %d ms, expected 3000", result);
+
+    // The controller now takes 100 ms: the learned timeout gives up first
+    if (run(&command, 1, OCF_READ_LOCAL_VERSION, 0, 5000, &elapsed_ms) == EXIT_SUCCESS ||
+        command.result != ETIMEDOUT || command.timeout_ms != 20)
+        return fail("run: %s after %d ms, timeout %d ms", strerror(command.result), elapsed_ms, command.timeout_ms);
+
+    if (elapsed_ms >= 100)
+        return fail("timed out after %d ms", elapsed_ms);
+
+    if (run(&command, 1, OCF_READ_BD_ADDR, HCI_COMMAND_UNPROFILED, 5000, &elapsed_ms) != EXIT_SUCCESS)
+        return fail("unprofiled run: %s", strerror(command.result));
+
+    return EXIT_SUCCESS;
+}
+
+/*
+ * An adapter plugged in place of another one, with the same device ID, is
+ * probed again: its capabilities, learned latencies and address aren't the
+ * previous adapter's.
+ */
+static int test_replug(void)
+{
+    struct hci_command commands[TEST_COMMANDS];
+    struct hci_latency_profile profiles[8];
+    struct hci_capabilities caps;
+    struct hci_error error;
+    bdaddr_t bdaddr;
+    int count, elapsed_ms;
+
+    if (start(0, 100, 1) != EXIT_SUCCESS)
+        return EXIT_FAILURE;
+
+    if (hci_capabilities(0, &caps, &error) != EXIT_SUCCESS || caps.manufacturer != 0)
+        return fail("capabilities: %s, manufacturer %d", strerror(error.code), caps.manufacturer);
+
+    if (run(commands, TEST_COMMANDS, OCF_READ_BD_ADDR, 0, 1000, &elapsed_ms) != EXIT_SUCCESS)
+        return fail("run: %s", strerror(errno));
+
+    count = hci_timeout_profiles(0, -1, profiles, 8);
+    while (count > 0 && (profiles[count - 1].opcode != OPCODE_READ_BD_ADDR || profiles[count - 1].timeout_ms == 0))
+        count--;
+
+    if (count == 0)
+        return fail("the latencies weren't learned");
+
+    hci_bdaddr_request(0);
+    if (!hci_bdaddr_resolve(0, &bdaddr, hci_monotonic_ns() + 1000000000ULL) || bdaddr.b[1] != 0)
+        return fail("address of the first adapter");
+
+    if (hci_sim_replug(0, 10, &error) != EXIT_SUCCESS)
+        return fail("replug: %s", strerror(error.code));
+
+    hci_events_sync();
+
+    if (hci_caps_lookup(0, &caps))
+        return fail("the capabilities are still cached");
+
+    if (hci_timeout_profiles(0, -1, profiles, 8) != 0)
+        return fail("the latencies are still learned");
+
+    if (hci_capabilities(0, &caps, &error) != EXIT_SUCCESS || caps.manufacturer != 10)
+        return fail("capabilities: %s, manufacturer %d", strerror(error.code), caps.manufacturer);
+
+    hci_bdaddr_request(0);
+    if (!hci_bdaddr_resolve(0, &bdaddr, hci_monotonic_ns() + 1000000000ULL) || bdaddr.b[1] != 1)
+        return fail("address of the second adapter");
+
+    return EXIT_SUCCESS;
+}
+
+/*
+ * A test.
+ *     - run: returns EXIT_SUCCESS when it passes.
+ */
+struct test
+{
+    char const *name;
+    int (*run)(void);
+};
+
+static struct test const tests[] =
+{
+    { "credits",          test_credits },
+    { "hardware_error",   test_hardware_error },
+    { "learned_timeouts", test_learned_timeouts },
+    { "replug",           test_replug },
+};
+
+int main(int argc, char **argv)
+{
+    int failed = 0;
+
+    for (size_t i = 0; i < sizeof(tests) / sizeof(tests[0]); i++)
+    {
+        int result = tests[i].run();
+
+        printf("%-18s %s\n", tests[i].name, result == EXIT_SUCCESS ? "ok" : "FAIL");
+        if (result != EXIT_SUCCESS)
+            failed++;
+    }
+
+    hci_sim_stop();
+
+    printf("\n%d/%zu passed\n", (int)(sizeof(tests) / sizeof(tests[0])) - failed,
+           sizeof(tests) / sizeof(tests[0]));
+
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}